@@ -0,0 +1,84 @@
+// Microbenchmark for the AT response parser on the receive path: serial
+// input as the module sends it for received packets, fed in chunks the
+// size of a serial read and parsed into responses.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at.h"
+#include "hex.h"
+#include "harness.h"
+
+#define CHUNK 64        // Bytes per read, about what a USB serial adapter hands over
+
+typedef struct {
+    char* stream;               // Responses for BENCH_MIX_LEN packets, back to back
+    size_t* offsets;            // Start of the responses of each packet
+    at_parser parser;
+} at_input;
+
+// Renders the responses to a received packet, and to a transmission now
+// and then since both arrive on the same line
+static size_t render(char* out, const unsigned char* data, size_t len, size_t i) {
+    char hex[2 * AT_MAX_PAYLOAD + 1];
+    hex[hex_encode(hex, data, len)] = '\0';
+    int n = sprintf(out, "+TEST: LEN:%zu, RSSI:%d, SNR:%d\r\n+TEST: RX \"%s\"\r\n",
+                    len, -40 - (int) (i % 80), 10 - (int) (i % 25), hex);
+    if (i % 4 == 0) { n += sprintf(out + n, "+TEST: TX DONE\r\n"); }
+    return n;
+}
+
+// Feeds the responses of one packet and parses them
+static void op_parse(void* arg, size_t i) {
+    at_input* in = (at_input*) arg;
+    size_t k = i % BENCH_MIX_LEN;
+    const char* p = in->stream + in->offsets[k];
+    size_t left = in->offsets[k + 1] - in->offsets[k];
+    unsigned char data[AT_MAX_PAYLOAD];
+    at_response res = { .data = data };
+    unsigned long got = 0;
+    while (left > 0) {
+        size_t n = left < CHUNK ? left : CHUNK;
+        at_feed(&in->parser, p, n);
+        p += n;
+        left -= n;
+        while (at_next(&in->parser, &res)) { got += res.kind + res.len; }
+    }
+    bench_sink(got);
+}
+
+int main(int argc, char** argv) {
+    if (bench_init(argc, argv) != 0) { return EXIT_FAILURE; }
+    static size_t lens[BENCH_MIX_LEN];
+    static at_input in;
+    bench_mix(lens, AT_MAX_PAYLOAD);
+    in.stream = malloc(BENCH_MIX_LEN * (2 * AT_MAX_PAYLOAD + 96));
+    in.offsets = malloc((BENCH_MIX_LEN + 1) * sizeof(size_t));
+    if (in.stream == NULL || in.offsets == NULL) { return EXIT_FAILURE; }
+    unsigned char data[AT_MAX_PAYLOAD];
+    for (int i = 0; i < AT_MAX_PAYLOAD; ++i) { data[i] = rand(); }
+
+    // Full packets only
+    size_t len = 0;
+    for (int i = 0; i < BENCH_MIX_LEN; ++i) {
+        in.offsets[i] = len;
+        len += render(in.stream + len, data, AT_MAX_PAYLOAD, i);
+    }
+    in.offsets[BENCH_MIX_LEN] = len;
+    at_init(&in.parser);
+    bench_run("at/parse/255", op_parse, &in, (double) len / BENCH_MIX_LEN);
+
+    // Packet lengths seen on a link
+    len = 0;
+    for (int i = 0; i < BENCH_MIX_LEN; ++i) {
+        in.offsets[i] = len;
+        len += render(in.stream + len, data, lens[i], i);
+    }
+    in.offsets[BENCH_MIX_LEN] = len;
+    at_init(&in.parser);
+    bench_run("at/parse/mix", op_parse, &in, (double) len / BENCH_MIX_LEN);
+
+    free(in.stream);
+    free(in.offsets);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+// Microbenchmark for the cryptographic path: sealing packets (compression,
+// header and ChaCha20-Poly1305) and opening them again on a device backed by
+// a pseudo-terminal that stands in for the module, the AEAD primitives on
+// their own, the password based key derivation done at startup with and
+// without the key cache, and the X25519 work of the session handshake.
+#define _DEFAULT_SOURCE     // cfmakeraw
+#define _XOPEN_SOURCE 600   // posix_openpt
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "wioe.h"
+#include "keycache.h"
+#include "harness.h"
+
+#define PWHASH_SAMPLES 5    // Key derivations timed, each takes a good fraction of a second
+
+typedef struct {
+    wioe* tx;
+    wioe* rx;
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    unsigned char text[BENCH_MIX_LEN][WIOE_MAX_PLAINTEXT];  // Chat like plaintexts
+    size_t lens[BENCH_MIX_LEN];
+    int mixed;
+} crypto_input;
+
+static size_t input_len(const crypto_input* in, size_t i) {
+    return in->mixed ? in->lens[i % BENCH_MIX_LEN] : WIOE_MAX_PLAINTEXT;
+}
+
+// Opens a device on a pseudo-terminal whose answers to the setup commands
+// are already waiting, no module needed
+static wioe* fake_device(wioe_params* params) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) { return NULL; }
+    char* path = ptsname(master);
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    struct termios tty;
+    if (slave < 0 || tcgetattr(slave, &tty) != 0) { return NULL; }
+    cfmakeraw(&tty);
+    tcsetattr(slave, TCSANOW, &tty);
+    static const char answers[] = "+MODE: TEST\r\n+TEST: RFCFG F:915000000\r\n";
+    if (write(master, answers, sizeof(answers) - 1) < 0) { return NULL; }
+    wioe* device = wioe_init(params, path);
+    close(slave);
+    // The master stays open for the commands the device writes
+    return wioe_is_valid(device) ? device : NULL;
+}
+
+static void op_seal(void* arg, size_t i) {
+    crypto_input* in = (crypto_input*) arg;
+    unsigned char pkt[WIOE_MAX_PAYLOAD];
+    bench_sink(wioe_seal(in->tx, pkt, sizeof(pkt), in->text[i % BENCH_MIX_LEN],
+                         input_len(in, i), in->key));
+}
+
+// Opening needs a fresh packet every time, replays are rejected before
+// decryption
+static void op_roundtrip(void* arg, size_t i) {
+    crypto_input* in = (crypto_input*) arg;
+    unsigned char pkt[WIOE_MAX_PAYLOAD];
+    unsigned char out[WIOE_MAX_PLAINTEXT];
+    ssize_t len = wioe_seal(in->tx, pkt, sizeof(pkt), in->text[i % BENCH_MIX_LEN],
+                            input_len(in, i), in->key);
+    bench_sink(wioe_open(in->rx, out, sizeof(out), pkt, len, in->key));
+}
+
+static void op_encrypt(void* arg, size_t i) {
+    crypto_input* in = (crypto_input*) arg;
+    unsigned char pkt[WIOE_MAX_PAYLOAD];
+    unsigned char nonce[crypto_aead_chacha20poly1305_NPUBBYTES] = { (unsigned char) i };
+    unsigned long long len;
+    crypto_aead_chacha20poly1305_encrypt(pkt, &len, in->text[i % BENCH_MIX_LEN],
+                                         input_len(in, i), nonce, 2, NULL, nonce, in->key);
+    bench_sink(len ^ pkt[0]);
+}
+
+static void op_decrypt(void* arg, size_t i) {
+    crypto_input* in = (crypto_input*) arg;
+    static unsigned char pkt[BENCH_MIX_LEN][WIOE_MAX_PAYLOAD];
+    static unsigned long long pkt_len[BENCH_MIX_LEN];
+    static int sealed = -1;
+    unsigned char nonce[crypto_aead_chacha20poly1305_NPUBBYTES] = { 0 };
+    if (sealed != in->mixed) {
+        // Encrypted once per input set, decryption is stateless
+        for (int k = 0; k < BENCH_MIX_LEN; ++k) {
+            crypto_aead_chacha20poly1305_encrypt(pkt[k], &pkt_len[k], in->text[k],
+                                                 input_len(in, k), NULL, 0, NULL, nonce, in->key);
+        }
+        sealed = in->mixed;
+    }
+    unsigned char out[WIOE_MAX_PAYLOAD];
+    unsigned long long len;
+    size_t k = i % BENCH_MIX_LEN;
+    int r = crypto_aead_chacha20poly1305_decrypt(out, &len, NULL, pkt[k], pkt_len[k],
+                                                 NULL, 0, nonce, in->key);
+    bench_sink(r ^ len);
+}
+
+static void op_pwhash(void* arg, size_t i) {
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    unsigned char salt[crypto_pwhash_SALTBYTES] = { 0 };
+    const char* password = "correct horse battery staple";
+    crypto_pwhash(key, sizeof key, password, strlen(password), salt,
+                  crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE,
+                  crypto_pwhash_ALG_DEFAULT);
+    bench_sink(key[0]);
+}
+
+// Startup with the key cache filled by a previous run
+static void op_keycache(void* arg, size_t i) {
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    keycache_derive(key, "correct horse battery staple", (const char*) arg);
+    bench_sink(key[0]);
+}
+
+// Both ends' share of a session key agreement: key pair and shared secret
+static void op_x25519(void* arg, size_t i) {
+    unsigned char secret[crypto_scalarmult_SCALARBYTES], pub[crypto_scalarmult_BYTES];
+    unsigned char shared[crypto_scalarmult_BYTES];
+    randombytes_buf(secret, sizeof(secret));
+    crypto_scalarmult_base(pub, secret);
+    bench_sink(crypto_scalarmult(shared, secret, (const unsigned char*) arg) ^ shared[0] ^ pub[0]);
+}
+
+int main(int argc, char** argv) {
+    if (bench_init(argc, argv) != 0) { return EXIT_FAILURE; }
+    static crypto_input in;
+    wioe_params params = {
+        .frequency = 915, .spreading_factor = 7, .bandwidth = 500, .tx_preamble = 12,
+        .rx_preamble = 12, .power = 14, .crc = 1,
+    };
+    in.tx = fake_device(&params);
+    in.rx = fake_device(&params);
+    if (in.tx == NULL || in.rx == NULL) {
+        perror("Failed to open a pseudo-terminal");
+        return EXIT_FAILURE;
+    }
+    randombytes_buf(in.key, sizeof(in.key));
+    double mix = bench_mix(in.lens, WIOE_MAX_PLAINTEXT);
+    // English text so compression sees what it would on a link
+    static const char words[] = "the message was sent to you and it is on the way now ";
+    for (int k = 0; k < BENCH_MIX_LEN; ++k) {
+        for (size_t j = 0; j < WIOE_MAX_PLAINTEXT; ++j) {
+            in.text[k][j] = words[(j + k * 7) % (sizeof(words) - 1)];
+        }
+    }
+
+    const char* suffix[] = { "max", "mix" };
+    for (in.mixed = 0; in.mixed < 2; ++in.mixed) {
+        double bytes = in.mixed ? mix : WIOE_MAX_PLAINTEXT;
+        char name[64];
+        snprintf(name, sizeof(name), "crypto/seal/%s", suffix[in.mixed]);
+        bench_run(name, op_seal, &in, bytes);
+        snprintf(name, sizeof(name), "crypto/seal+open/%s", suffix[in.mixed]);
+        bench_run(name, op_roundtrip, &in, bytes);
+        snprintf(name, sizeof(name), "crypto/aead_enc/%s", suffix[in.mixed]);
+        bench_run(name, op_encrypt, &in, bytes);
+        snprintf(name, sizeof(name), "crypto/aead_dec/%s", suffix[in.mixed]);
+        bench_run(name, op_decrypt, &in, bytes);
+    }
+    bench_run_slow("crypto/pwhash", op_pwhash, &in, PWHASH_SAMPLES);
+    char cache[64];
+    snprintf(cache, sizeof(cache), "/tmp/wio-bench-key.%d", (int) getpid());
+    bench_run("crypto/keycache", op_keycache, cache, 0);
+    unlink(cache);
+    unsigned char peer[crypto_scalarmult_BYTES];
+    unsigned char peer_secret[crypto_scalarmult_SCALARBYTES];
+    randombytes_buf(peer_secret, sizeof(peer_secret));
+    crypto_scalarmult_base(peer, peer_secret);
+    bench_run("crypto/x25519", op_x25519, peer, 0);
+    wioe_destroy(in.tx);
+    wioe_destroy(in.rx);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+// Microbenchmark for the Reed-Solomon erasure code behind forward error
+// correction: one parity fragment of a message, and rebuilding a message
+// with one or several of its data fragments lost.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rs.h"
+#include "harness.h"
+
+#define SYMBOL 220      // Fragment payload of a full LoRa packet
+#define MAX_K 16
+
+typedef struct {
+    unsigned char data[MAX_K * SYMBOL];
+    unsigned char parity[MAX_K * SYMBOL];
+    unsigned char work[MAX_K * SYMBOL];
+    uint8_t rows[MAX_K];
+    unsigned k;
+    unsigned lost;          // Data fragments rebuilt from parity
+} fec_input;
+
+static void op_encode(void* arg, size_t i) {
+    fec_input* in = (fec_input*) arg;
+    unsigned char out[SYMBOL];
+    rs_encode(in->data, in->k, SYMBOL, i % 4, out);
+    bench_sink(out[i % SYMBOL]);
+}
+
+static void op_decode(void* arg, size_t i) {
+    fec_input* in = (fec_input*) arg;
+    uint8_t have[MAX_K];
+    // The first fragments are lost, their contents do not matter
+    for (unsigned j = 0; j < in->k; ++j) { have[j] = j >= in->lost; }
+    bench_sink(rs_decode(in->work, have, in->k, SYMBOL, in->parity, in->rows, in->lost)
+               ^ in->work[i % SYMBOL]);
+}
+
+// Checks that every pattern of up to four lost data fragments is rebuilt
+static int check(fec_input* in) {
+    for (unsigned k = 1; k <= MAX_K; ++k) {
+        for (unsigned row = 0; row < 4; ++row) {
+            rs_encode(in->data, k, SYMBOL, row, in->parity + row * SYMBOL);
+            in->rows[row] = row;
+        }
+        for (int round = 0; round < 200; ++round) {
+            uint8_t have[MAX_K];
+            unsigned lost = 0;
+            memcpy(in->work, in->data, k * SYMBOL);
+            for (unsigned j = 0; j < k; ++j) {
+                have[j] = lost == 4 || rand() % 3 != 0;
+                if (!have[j]) {
+                    memset(in->work + j * SYMBOL, 0, SYMBOL);
+                    lost++;
+                }
+            }
+            if (rs_decode(in->work, have, k, SYMBOL, in->parity, in->rows, lost) != 0
+                || memcmp(in->work, in->data, k * SYMBOL) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (bench_init(argc, argv) != 0) { return EXIT_FAILURE; }
+    static fec_input in;
+    for (size_t i = 0; i < sizeof(in.data); ++i) { in.data[i] = rand(); }
+    if (check(&in) != 0) {
+        puts("rs FAILED correctness check");
+        return EXIT_FAILURE;
+    }
+    const unsigned ks[] = { 2, 8 };
+    for (size_t n = 0; n < sizeof(ks) / sizeof(ks[0]); ++n) {
+        char name[64];
+        in.k = ks[n];
+        snprintf(name, sizeof(name), "fec/encode/k%u", in.k);
+        bench_run(name, op_encode, &in, (double) in.k * SYMBOL);
+        for (unsigned row = 0; row < in.k; ++row) {
+            rs_encode(in.data, in.k, SYMBOL, row, in.parity + row * SYMBOL);
+            in.rows[row] = row;
+        }
+        memcpy(in.work, in.data, in.k * SYMBOL);
+        const unsigned losses[] = { 1, 2 };
+        for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); ++l) {
+            in.lost = losses[l];
+            snprintf(name, sizeof(name), "fec/decode/k%u/lost%u", in.k, in.lost);
+            bench_run(name, op_decode, &in, (double) in.k * SYMBOL);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+// Microbenchmark for the hex codec and TXLRPKT framing on the send and
+// receive paths, comparing the libc formatting the driver used to do with
+// the table driven and vector implementations in hex.c.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hex.h"
+#include "harness.h"
+
+#define PAYLOAD 255     // Largest LoRa packet
+
+typedef struct {
+    unsigned char data[PAYLOAD];
+    char hex[2 * PAYLOAD + 1];
+    size_t lens[BENCH_MIX_LEN];
+    int mixed;              // Lengths from bench_mix instead of PAYLOAD
+} hex_input;
+
+static size_t input_len(const hex_input* in, size_t i) {
+    return in->mixed ? in->lens[i % BENCH_MIX_LEN] : PAYLOAD;
+}
+
+// What wioe_send_bytes did before: sprintf per byte, snprintf, then strlen
+static size_t frame_libc(char* cmd, const unsigned char* data, size_t len) {
+    char hex_data[2 * PAYLOAD + 1];
+    hex_data[0] = '\0';
+    for (size_t i = 0; i < len; ++i)
+        sprintf(&hex_data[2 * i], "%02hhX", data[i]);
+    snprintf(cmd, 600, "AT+TEST=TXLRPKT,\"%s\"\n", hex_data);
+    return strlen(cmd) + 1;
+}
+
+// What wioe does now: one pass into a reusable buffer
+static size_t frame_codec(char* cmd, const unsigned char* data, size_t len) {
+    static const char prefix[] = "AT+TEST=TXLRPKT,\"";
+    char* p = cmd;
+    memcpy(p, prefix, sizeof(prefix) - 1);
+    p += sizeof(prefix) - 1;
+    p += hex_encode(p, data, len);
+    *p++ = '"';
+    *p++ = '\n';
+    return p - cmd;
+}
+
+// What wioe_handle_packet did before: sscanf per byte
+static size_t decode_libc(unsigned char* out, const char* hex, size_t len) {
+    size_t count = 0;
+    while (count < len && sscanf(hex, "%2hhx", &out[count]) == 1) {
+        hex += 2;
+        count++;
+    }
+    return count;
+}
+
+static void op_frame_libc(void* arg, size_t i) {
+    hex_input* in = (hex_input*) arg;
+    char cmd[600];
+    bench_sink(frame_libc(cmd, in->data, input_len(in, i)) ^ cmd[i % 16]);
+}
+
+static void op_frame(void* arg, size_t i) {
+    hex_input* in = (hex_input*) arg;
+    char cmd[600];
+    bench_sink(frame_codec(cmd, in->data, input_len(in, i)) ^ cmd[i % 16]);
+}
+
+static void op_decode_libc(void* arg, size_t i) {
+    hex_input* in = (hex_input*) arg;
+    unsigned char out[PAYLOAD];
+    size_t len = input_len(in, i);
+    bench_sink(decode_libc(out, in->hex, len) ^ out[i % len]);
+}
+
+static void op_decode(void* arg, size_t i) {
+    hex_input* in = (hex_input*) arg;
+    unsigned char out[PAYLOAD];
+    size_t len = input_len(in, i);
+    bench_sink(hex_decode(out, in->hex, len) ^ out[i % len]);
+}
+
+// Checks an implementation against the libc reference, including bad input
+static int check(void) {
+    unsigned char data[PAYLOAD], out[PAYLOAD];
+    char hex[2 * PAYLOAD + 1];
+    for (int round = 0; round < 1000; ++round) {
+        size_t len = rand() % (PAYLOAD + 1);
+        for (size_t i = 0; i < len; ++i) { data[i] = rand(); }
+        hex[hex_encode(hex, data, len)] = '\0';
+        for (size_t i = 0; i < len; ++i) {
+            char ref[3];
+            sprintf(ref, "%02hhX", data[i]);
+            if (memcmp(ref, &hex[2 * i], 2) != 0) { return -1; }
+        }
+        // Lower case must decode too
+        for (size_t i = 0; i < 2 * len; i += 3) {
+            if (hex[i] >= 'A') { hex[i] += 'a' - 'A'; }
+        }
+        if (hex_decode(out, hex, len) != len || memcmp(out, data, len) != 0) { return -1; }
+        // Decoding stops at the first bad pair
+        if (len > 0) {
+            size_t bad = rand() % len;
+            hex[2 * bad + rand() % 2] = "g\"/:@G`\x80"[rand() % 8];
+            if (hex_decode(out, hex, len) != bad) { return -1; }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (bench_init(argc, argv) != 0) { return EXIT_FAILURE; }
+    static hex_input in;
+    for (int i = 0; i < PAYLOAD; ++i) { in.data[i] = rand(); }
+    in.hex[hex_encode(in.hex, in.data, PAYLOAD)] = '\0';
+    double mix = bench_mix(in.lens, PAYLOAD);
+
+    // Per byte formatting is slow enough that the full packet tells enough
+    bench_run("hex/frame/libc", op_frame_libc, &in, PAYLOAD);
+    bench_run("hex/decode/libc", op_decode_libc, &in, PAYLOAD);
+    const hex_impl impls[] = { HEX_SCALAR, HEX_SSE2, HEX_AVX2 };
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (hex_use(impls[i]) != 0) { continue; }
+        if (check() != 0) {
+            printf("%s FAILED correctness check\n", hex_name());
+            return EXIT_FAILURE;
+        }
+        char name[64];
+        in.mixed = 0;
+        snprintf(name, sizeof(name), "hex/frame/%s/255", hex_name());
+        bench_run(name, op_frame, &in, PAYLOAD);
+        snprintf(name, sizeof(name), "hex/decode/%s/255", hex_name());
+        bench_run(name, op_decode, &in, PAYLOAD);
+        in.mixed = 1;
+        snprintf(name, sizeof(name), "hex/frame/%s/mix", hex_name());
+        bench_run(name, op_frame, &in, mix);
+        snprintf(name, sizeof(name), "hex/decode/%s/mix", hex_name());
+        bench_run(name, op_decode, &in, mix);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+// Microbenchmark for the message log: appending a chat sized message, which
+// the receive path pays for each message, and searches over a log of
+// LOG_MESSAGES messages by sequence number, time and text.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msglog.h"
+#include "harness.h"
+
+#define LOG_MESSAGES 200000     // About six segments
+#define MESSAGE 64
+
+typedef struct {
+    msglog* log;
+    const char* dir;
+    msglog_query q;
+} log_input;
+
+static int visit_count(const msglog_entry* e, void* arg) {
+    bench_sink(e->seq);
+    return 0;
+}
+
+static void op_append(void* arg, size_t i) {
+    log_input* in = (log_input*) arg;
+    char msg[MESSAGE];
+    memset(msg, 'a' + i % 26, sizeof(msg));
+    bench_sink(msglog_append(in->log, i & 1, 1 + i % 3, msg, sizeof(msg)));
+}
+
+static void op_search(void* arg, size_t i) {
+    log_input* in = (log_input*) arg;
+    bench_sink(msglog_search(in->dir, &in->q, visit_count, NULL) ^ (long) i);
+}
+
+int main(int argc, char** argv) {
+    if (bench_init(argc, argv) != 0) { return EXIT_FAILURE; }
+    static char dir[] = "/tmp/wio-bench-log-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("Failed to create a log directory");
+        return EXIT_FAILURE;
+    }
+    log_input in = { .dir = dir, .log = msglog_open(dir) };
+    if (in.log == NULL) {
+        perror("Failed to open the log");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < LOG_MESSAGES; ++i) { op_append(&in, i); }
+    bench_run("msglog/append", op_append, &in, MESSAGE);
+    // Searches see what was appended, wherever the committer is
+    in.q = (msglog_query) { .peer = -1, .sent = -1, .seq_from = LOG_MESSAGES / 2, .seq_to = LOG_MESSAGES / 2 + 9 };
+    bench_run("msglog/seq_range_10", op_search, &in, 0);
+    in.q = (msglog_query) { .peer = -1, .sent = 1, .limit = 10, .newest_first = 1 };
+    bench_run("msglog/latest_10_sent", op_search, &in, 0);
+    in.q = (msglog_query) { .peer = -1, .sent = -1, .since_ms = (int64_t) time(NULL) * 1000 + 3600000 };
+    bench_run("msglog/time_none", op_search, &in, 0);
+    in.q = (msglog_query) { .peer = -1, .sent = -1, .text = "zzzz" };
+    bench_run_slow("msglog/text_scan", op_search, &in, 5);
+    msglog_close(in.log);
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) { return EXIT_FAILURE; }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+// Microbenchmark for the serial path of one AT command: writing it, waking
+// up for the response and reading it, with each serial backend. By default
+// a thread answers on a pseudo-terminal in place of the module, which
+// measures the host side only. With WIO_BENCH_DEVICE set to the port of a
+// module, the commands go to it and the adapter's latency is included,
+// which is where ASYNC_LOW_LATENCY shows.
+#define _DEFAULT_SOURCE     // cfmakeraw
+#define _XOPEN_SOURCE 600   // posix_openpt
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "ser.h"
+#include "harness.h"
+
+#define ROUND_TRIPS 200     // Commands per sample on a module, each takes milliseconds
+
+typedef struct {
+    int fd;
+    const char* cmd;        // Command and the start of its response
+    const char* answer;
+} serial_input;
+
+// Answers every command line like the module does to AT+TEST=RXLRPKT
+static void* responder(void* arg) {
+    int master = *(int*) arg;
+    static const char answer[] = "+TEST: RXLRPKT\r\n";
+    char buf[256];
+    ssize_t n;
+    while ((n = read(master, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            if (buf[i] == '\n' && write(master, answer, sizeof(answer) - 1) < 0) { return NULL; }
+        }
+    }
+    return NULL;
+}
+
+// Opens a pseudo-terminal answered by a thread, returning the path of its slave side
+static const char* fake_module(void) {
+    static int master;
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) { return NULL; }
+    struct termios tty;
+    if (tcgetattr(master, &tty) != 0) { return NULL; }
+    cfmakeraw(&tty);
+    tcsetattr(master, TCSANOW, &tty);
+    // A slave kept open spares the responder the hangup between backends
+    if (open(ptsname(master), O_RDWR | O_NOCTTY) < 0) { return NULL; }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, responder, &master) != 0) { return NULL; }
+    pthread_detach(thread);
+    return ptsname(master);
+}
+
+// Sends the command and waits for the line starting with the answer
+static int round_trip(serial_input* in) {
+    if (write_serial(in->fd, in->cmd, strlen(in->cmd)) < 0) { return -1; }
+    char line[128];
+    size_t len = 0;
+    for (;;) {
+        if (wait_serial(in->fd, 1000, -1) != 1) { return -1; }
+        char c;
+        while (read(in->fd, &c, 1) == 1) {
+            if (c != '\n') {
+                if (len < sizeof(line) - 1) { line[len++] = c; }
+                continue;
+            }
+            line[len] = '\0';
+            if (strncmp(line, in->answer, strlen(in->answer)) == 0) { return 0; }
+            len = 0;
+        }
+    }
+}
+
+static void op_round_trip(void* arg, size_t i) {
+    bench_sink(round_trip((serial_input*) arg) ^ (int) i);
+}
+
+static void op_round_trips(void* arg, size_t i) {
+    int r = 0;
+    for (int n = 0; n < ROUND_TRIPS; ++n) { r |= round_trip((serial_input*) arg); }
+    bench_sink(r ^ (int) i);
+}
+
+int main(int argc, char** argv) {
+    if (bench_init(argc, argv) != 0) { return EXIT_FAILURE; }
+    const char* device = getenv("WIO_BENCH_DEVICE");
+    const char* path = device != NULL ? device : fake_module();
+    if (path == NULL) {
+        perror("Failed to open a pseudo-terminal");
+        return EXIT_FAILURE;
+    }
+    static char port[SER_MAX_PATH];
+    snprintf(port, sizeof(port), "%s", path);
+    serial_input in = {
+        .cmd = device != NULL ? "AT\r\n" : "AT+TEST=RXLRPKT\r\n",
+        .answer = device != NULL ? "+AT: OK" : "+TEST: RXLRPKT",
+    };
+    const ser_impl impls[] = { SER_POSIX, SER_LINUX };
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (ser_use(impls[i]) != 0) { continue; }
+        in.fd = open_serial(port, 0);
+        if (in.fd < 0) { return EXIT_FAILURE; }
+        fcntl(in.fd, F_SETFL, fcntl(in.fd, F_GETFL) | O_NONBLOCK);
+        char name[64];
+        if (device != NULL) {
+            // Times are per ROUND_TRIPS commands
+            snprintf(name, sizeof(name), "serial/%s/module/x%d", ser_name(), ROUND_TRIPS);
+            bench_run_slow(name, op_round_trips, &in, 10);
+        } else {
+            snprintf(name, sizeof(name), "serial/%s/pty", ser_name());
+            bench_run(name, op_round_trip, &in, 0);
+        }
+        close(in.fd);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#include "harness.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int json = 0;
+static int samples = BENCH_SAMPLES;
+static long warmup_ms = BENCH_WARMUP_MS;
+static const char* filter = NULL;
+static int header = 0;
+static volatile unsigned long sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int bench_init(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "jn:w:f:")) != -1) {
+        if (opt == 'j') {
+            json = 1;
+        } else if (opt == 'n') {
+            samples = atoi(optarg);
+        } else if (opt == 'w') {
+            warmup_ms = atol(optarg);
+        } else if (opt == 'f') {
+            filter = optarg;
+        } else {
+            samples = 0;
+        }
+    }
+    if (samples < 1) {
+        fprintf(stderr, "usage: %s [-j] [-n samples] [-w warmup_ms] [-f filter]\n", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+static int by_value(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted values
+static double percentile(const double* v, int n, double p) {
+    int i = (int) (p / 100 * n + 0.5) - 1;
+    return v[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+// Prints the report of per call times in nanoseconds
+static void report(const char* name, double* ns, int n, size_t batch, double bytes) {
+    qsort(ns, n, sizeof(*ns), by_value);
+    double p50 = percentile(ns, n, 50);
+    double p90 = percentile(ns, n, 90);
+    double p99 = percentile(ns, n, 99);
+    // Bytes per nanosecond is GB/s, reported in MB/s
+    double mbps = bytes > 0 ? bytes / p50 * 1000 : 0;
+    if (json) {
+        printf("{\"name\":\"%s\",\"samples\":%d,\"batch\":%zu,\"min_ns\":%.1f,\"p50_ns\":%.1f,"
+               "\"p90_ns\":%.1f,\"p99_ns\":%.1f,\"max_ns\":%.1f,\"mb_per_s\":%.1f}\n",
+               name, n, batch, ns[0], p50, p90, p99, ns[n - 1], mbps);
+        return;
+    }
+    if (!header) {
+        printf("%-24s %12s %12s %12s %12s %10s\n", "benchmark", "min ns", "p50 ns", "p90 ns",
+               "p99 ns", "MB/s");
+        header = 1;
+    }
+    printf("%-24s %12.1f %12.1f %12.1f %12.1f", name, ns[0], p50, p90, p99);
+    if (bytes > 0) {
+        printf(" %10.1f\n", mbps);
+    } else {
+        printf(" %10s\n", "-");
+    }
+}
+
+static int skipped(const char* name) {
+    return filter != NULL && strstr(name, filter) == NULL;
+}
+
+void bench_run(const char* name, bench_fn fn, void* arg, double bytes) {
+    if (skipped(name)) { return; }
+    // Warm caches and branch predictors while sizing the batch so that one
+    // sample takes about BENCH_SAMPLE_NS
+    size_t i = 0;
+    size_t calls = 0;
+    double start = now_ns();
+    double elapsed;
+    do {
+        fn(arg, i++);
+        calls++;
+        elapsed = now_ns() - start;
+    } while (elapsed < warmup_ms * 1e6 || calls < 16);
+    size_t batch = (size_t) (BENCH_SAMPLE_NS / (elapsed / calls)) + 1;
+    double* ns = malloc(samples * sizeof(*ns));
+    if (ns == NULL) { return; }
+    for (int s = 0; s < samples; ++s) {
+        start = now_ns();
+        for (size_t b = 0; b < batch; ++b) { fn(arg, i++); }
+        ns[s] = (now_ns() - start) / batch;
+    }
+    report(name, ns, samples, batch, bytes);
+    free(ns);
+}
+
+void bench_run_slow(const char* name, bench_fn fn, void* arg, int count) {
+    if (skipped(name)) { return; }
+    fn(arg, 0);
+    double* ns = malloc(count * sizeof(*ns));
+    if (ns == NULL) { return; }
+    for (int s = 0; s < count; ++s) {
+        double start = now_ns();
+        fn(arg, s + 1);
+        ns[s] = now_ns() - start;
+    }
+    report(name, ns, count, 1, 0);
+    free(ns);
+}
+
+double bench_mix(size_t* lens, size_t max) {
+    unsigned x = 12345;     // Fixed seed, every run sees the same lengths
+    double total = 0;
+    for (int i = 0; i < BENCH_MIX_LEN; ++i) {
+        x = x * 1103515245u + 12345u;
+        unsigned kind = (x >> 16) % 100;
+        x = x * 1103515245u + 12345u;
+        unsigned r = x >> 16;
+        size_t len;
+        if (kind < 40) {
+            len = 8 + r % 17;
+        } else if (kind < 75) {
+            len = 24 + r % 97;
+        } else {
+            len = max;
+        }
+        lens[i] = len < max ? len : max;
+        total += lens[i];
+    }
+    return total / BENCH_MIX_LEN;
+}
+
+void bench_sink(unsigned long v) {
+    sink ^= v;
+}
@@ -0,0 +1,64 @@
+#ifndef HARNESS_H_
+#define HARNESS_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+
+// Minimal benchmark harness shared by the bench_* programs. Each benchmark
+// runs an operation in batches: first for the warmup time, then for a
+// number of timed samples. The time per operation of every sample goes into
+// the report (min, median, p90, p99), so noise shows up as spread instead
+// of skewing a single average.
+//
+// Every program accepts the same options:
+//   -j          one JSON object per benchmark instead of a table
+//   -n samples  timed samples (default 50)
+//   -w ms       warmup time (default 100)
+//   -f filter   only run benchmarks whose name contains filter
+
+#define BENCH_SAMPLES 50
+#define BENCH_WARMUP_MS 100
+#define BENCH_SAMPLE_NS 2000000   // Target length of one sample, sets the batch size
+#define BENCH_MIX_LEN 1024        // Payload lengths drawn for the realistic mix
+
+// Operation under test, i is the index of the call (e.g., to pick an input)
+typedef void (*bench_fn)(void* arg, size_t i);
+
+// Parses the common options.
+//
+// @param argc Argument count from main.
+// @param argv Arguments from main.
+// @return 0 on success, or -1 after printing the usage.
+int bench_init(int argc, char** argv);
+
+// Times an operation and prints its report, unless filtered out.
+//
+// @param name Name of the benchmark (e.g., "seal/mix").
+// @param fn The operation.
+// @param arg Additional parameter passed to fn.
+// @param bytes Bytes processed per call on average, 0 to omit throughput.
+void bench_run(const char* name, bench_fn fn, void* arg, double bytes);
+
+// Like bench_run for slow operations (e.g., key derivation): a fixed number
+// of single calls, with no batching.
+//
+// @param name Name of the benchmark.
+// @param fn The operation.
+// @param arg Additional parameter passed to fn.
+// @param samples Number of calls, after one warmup call.
+void bench_run_slow(const char* name, bench_fn fn, void* arg, int samples);
+
+// Fills lengths drawn from the traffic seen on a link: ARQ acknowledgements
+// and control frames (8-24 bytes, 40%), chat messages (24-120 bytes, 35%)
+// and full fragments of long messages (max, 25%). Repeatable across runs.
+//
+// @param lens Receives BENCH_MIX_LEN lengths.
+// @param max Largest length (e.g., the largest payload).
+// @return The average length.
+double bench_mix(size_t* lens, size_t max);
+
+// Prevents the compiler from optimizing a result away.
+//
+// @param v Any value computed by the operation.
+void bench_sink(unsigned long v);
+
+#endif  // HARNESS_H_
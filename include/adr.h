@@ -0,0 +1,117 @@
+#ifndef ADR_H_
+#define ADR_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+#include "arq.h"      // Control frame ops
+
+// Adaptive data rate: picks the fastest spreading factor and bandwidth whose
+// SNR margin over the demodulation floor stays above a target, and agrees on
+// it with the peer before switching, since both ends must use the same
+// settings. Control frames carry [op][token][rate index]:
+//
+//   PROPOSE    a node whose received SNR supports another rate asks for it
+//   ACCEPT     the peer answers with the slower of the proposal and what its
+//              own SNR supports, then switches once the ACCEPT left the air
+//   PROBE      sent by the proposer after switching, answered by PROBE_ACK
+//
+// A node that hears nothing from the peer within a few frame times after
+// switching goes back to the previous rate, and a link silent for
+// ADR_HOME_MS returns to the configured rate, where both ends meet again.
+#define ADR_FRAME 3             // Length of a control frame
+
+#define ADR_SAMPLES 8           // SNR readings averaged
+#define ADR_MIN_SAMPLES 4       // Readings needed before deciding
+#define ADR_HOLD_MS 5000        // Minimum time between changes
+#define ADR_MAX_HOLD_MS 60000   // Hold after repeated failures
+#define ADR_HOME_MS 60000       // Silence after which the configured rate is restored
+
+// Callback sending a control frame, whose outcome is reported with adr_sent.
+//
+// @param frame The frame.
+// @param len Length of the frame.
+// @param arg The pointer given to adr_init.
+// @return 0 on success, or -1 if it could not be queued.
+typedef int (*adr_send_cb)(const unsigned char* frame, size_t len, void* arg);
+
+// Callback switching the radio to a new rate.
+//
+// @param sf Spreading factor.
+// @param bw Bandwidth in kHz.
+// @param arg The pointer given to adr_init.
+typedef void (*adr_apply_cb)(unsigned sf, unsigned bw, void* arg);
+
+// Controller for the link with a single peer
+typedef struct {
+    int rate;                   // Index of the current rate, fastest first
+    int home;                   // Index of the configured rate
+    int prev;                   // Rate before the last switch
+    int target;                 // Rate being negotiated
+    int state;
+    uint8_t token;              // Matches an ACCEPT with its PROPOSE
+    long deadline;
+    long hold_until;
+    long hold_ms;
+    long last_heard;
+    int snr[ADR_SAMPLES];
+    int samples;
+    int sample_pos;
+    int margin_db;
+    unsigned preamble;          // Used for the time on air of timeouts
+    int crc;
+    int queued;                 // Control frames sent and not yet reported
+    int switch_after;           // Reports to wait for before switching, 0 if none
+    adr_send_cb send;
+    adr_apply_cb apply;
+    void* arg;
+    unsigned long changes;      // Switches that were confirmed
+    unsigned long reverts;      // Switches undone because the peer went silent
+    unsigned long fallbacks;    // Returns to the configured rate
+} adr;
+
+// Initializes a controller at the configured rate.
+//
+// @param a The controller.
+// @param sf Configured spreading factor.
+// @param bw Configured bandwidth in kHz.
+// @param preamble Preamble length, for timeouts.
+// @param crc Non-zero if the payload CRC is on, for timeouts.
+// @param margin_db SNR margin over the floor required for a rate.
+// @param send Callback sending control frames.
+// @param apply Callback switching the radio.
+// @param arg Additional parameter passed to the callbacks.
+// @return 0 on success, or -1 if the configured rate is unknown.
+int adr_init(adr* a, unsigned sf, unsigned bw, unsigned preamble, int crc, int margin_db,
+             adr_send_cb send, adr_apply_cb apply, void* arg);
+
+// Records the SNR of an authenticated packet from the peer.
+//
+// @param a The controller.
+// @param snr SNR reported by the module in dB.
+// @param now_ms Current monotonic time in milliseconds.
+void adr_sample(adr* a, int snr, long now_ms);
+
+// Handles a control frame from the peer.
+//
+// @param a The controller.
+// @param frame The frame.
+// @param len Length of the frame.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the frame is malformed.
+int adr_recv(adr* a, const unsigned char* frame, size_t len, long now_ms);
+
+// Reports the outcome of the oldest control frame sent.
+//
+// @param a The controller.
+// @param status 0 if the frame left the air, or -1 on error.
+// @param now_ms Current monotonic time in milliseconds.
+void adr_sent(adr* a, int status, long now_ms);
+
+// Runs timeouts and proposes a new rate when the SNR calls for it.
+//
+// @param a The controller.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Milliseconds until the next deadline, or -1 if none is running.
+long adr_poll(adr* a, long now_ms);
+
+#endif  // ADR_H_
@@ -0,0 +1,29 @@
+#ifndef AIRTIME_H_
+#define AIRTIME_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+
+// Constants for the LoRa modem as configured by AT+TEST=RFCFG
+#define AIRTIME_CR 1        // Coding rate 4/(4+CR), the Wio-E5 uses 4/5 in test mode
+#define AIRTIME_LDRO_US 16000 // Symbol time above which low data rate optimize is on
+
+// Computes the duration of a single LoRa symbol.
+//
+// @param sf Spreading factor (7-12).
+// @param bw_khz Bandwidth in kHz (125, 250 or 500).
+// @return Symbol time in microseconds.
+uint32_t airtime_symbol_us(unsigned sf, unsigned bw_khz);
+
+// Computes the time a LoRa packet occupies the air using the formula from
+// Semtech AN1200.13 (explicit header, coding rate 4/5).
+//
+// @param sf Spreading factor (7-12).
+// @param bw_khz Bandwidth in kHz (125, 250 or 500).
+// @param preamble Number of programmed preamble symbols.
+// @param crc Non-zero if the payload CRC is enabled.
+// @param len Payload length in bytes.
+// @return Time on air in microseconds, or 0 on invalid parameters.
+uint32_t airtime_us(unsigned sf, unsigned bw_khz, unsigned preamble, int crc, size_t len);
+
+#endif  // AIRTIME_H_
@@ -0,0 +1,190 @@
+#ifndef ARQ_H_
+#define ARQ_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+
+// Every frame starts with a type byte, data frames follow it with an 8 bit
+// sequence number. The sender transmits a burst of up to window frames and
+// sets ARQ_POLL on the last one, the receiver answers a poll with an ACK
+// holding its next expected sequence number and a bitmap of the frames it
+// already buffered past it. Only the frames missing from the ACK are sent
+// again, so a loss costs one frame rather than the whole window.
+//
+// While a poll waits for its ACK, the sender goes on sending new frames up
+// to the window, and the next poll covers them. Each poll carries an id the
+// ACK echoes, so a late or repeated ACK of an earlier poll still acknowledges
+// frames but is not taken for the answer to the current one.
+//
+//   RAW  [type]                 unreliable frame, delivered as is
+//   DATA [type|POLL|id][seq]    reliable frame
+//   ACK  [type|id][expect][bitmap]
+//                               bitmap bit i acknowledges expect + 1 + i,
+//                               trailing zero bytes are left out
+//   REQ  [type|POLL|id][base]   poll without data, also tells the receiver
+//                               which frames the sender gave up on
+//   CTRL [type][op][...]        link control, sent outside the ARQ and
+//                               rejected by arq_recv
+#define ARQ_RAW 0
+#define ARQ_DATA 1
+#define ARQ_ACK 2
+#define ARQ_REQ 3
+#define ARQ_CTRL 4
+#define ARQ_TYPE_MASK 0x0f
+#define ARQ_POLL 0x80
+#define ARQ_POLL_ID 0x70        // Id of a poll, echoed by its ACK
+#define ARQ_POLL_SHIFT 4
+
+// Ops of control frames, the byte after the type. Every module using control
+// frames takes its ops from this list, so none of them overlap.
+#define ADR_PROPOSE 1           // Rate negotiation (adr.h)
+#define ADR_ACCEPT 2
+#define ADR_PROBE 3
+#define ADR_PROBE_ACK 4
+#define HS_HELLO 5              // Session key agreement (handshake.h)
+#define HS_REPLY 6
+#define HS_CONFIRM 7
+#define HS_DONE 8
+#define LOSS_REPORT 9           // Loss measured at the receiver: [op][level]
+
+#define ARQ_HEADER 2            // Header of a data frame
+#define ARQ_MAX_WINDOW 16       // Frames in flight, well below the send queue length
+#define ARQ_MAX_FRAME 255       // Largest frame, header included
+#define ARQ_ONAIR 64            // Frames handed to the radio and not yet sent
+
+// Callback pulling the next frame to send.
+//
+// @param buf Buffer receiving the frame payload.
+// @param len Size of the buffer.
+// @param arg The pointer given to arq_init.
+// @return Length of the payload, or 0 if there is nothing to send.
+typedef size_t (*arq_source)(unsigned char* buf, size_t len, void* arg);
+
+// Callback handing a frame to the radio, whose outcome must be reported
+// with arq_sent in the order frames were handed over.
+//
+// @param frame The frame.
+// @param len Length of the frame.
+// @param arg The pointer given to arq_init.
+// @return 0 on success, or -1 if the radio cannot take it now.
+typedef int (*arq_emit)(const unsigned char* frame, size_t len, void* arg);
+
+// Callback receiving payloads in order, valid only during the call.
+//
+// @param data The payload.
+// @param len Length of the payload.
+// @param arg The pointer given to arq_init.
+typedef void (*arq_deliver)(const unsigned char* data, size_t len, void* arg);
+
+// Structure to hold a frame in the send window
+typedef struct {
+    int state;
+    uint8_t poll;               // Id of the poll covering it once sent
+    size_t len;
+    unsigned char frame[ARQ_MAX_FRAME];
+} arq_slot;
+
+// Structure to hold a frame waiting for in order delivery
+typedef struct {
+    size_t len;
+    unsigned char data[ARQ_MAX_FRAME];
+} arq_buf;
+
+// Counters for the link
+typedef struct {
+    unsigned long sent;         // Data frames sent for the first time
+    unsigned long resent;       // Data frames sent again
+    unsigned long acked;        // Data frames acknowledged
+    unsigned long failed;       // Data frames given up on
+    unsigned long delivered;    // Data frames delivered in order
+    unsigned long duplicates;   // Data frames received twice
+} arq_stats;
+
+// Reliable link with a single peer
+typedef struct {
+    int reliable;               // 0 sends RAW frames only
+    unsigned window;
+    size_t mtu;
+    long rto_ms;                // Time allowed for the ACK after a poll left the air
+    int max_retries;
+    arq_source source;
+    arq_emit emit;
+    arq_deliver deliver;
+    void* arg;
+    // Sender
+    uint8_t base;               // Oldest unacknowledged sequence number
+    uint8_t next;               // Next new sequence number
+    arq_slot tx[ARQ_MAX_WINDOW];
+    int polling;                // Waiting for the ACK to a poll
+    uint8_t poll_id;            // Id of the last poll
+    int poll_armed;             // The poll left the air, deadline is running
+    long poll_deadline;
+    int retries;
+    int16_t onair[ARQ_ONAIR];   // Sequence numbers handed to the radio, -1 for control
+    uint8_t onair_poll[ARQ_ONAIR];
+    int onair_head;
+    int onair_count;
+    // Receiver
+    uint8_t expect;             // Next sequence number to deliver
+    uint32_t have;              // Bit i set if expect + i is buffered
+    int ack_pending;            // A poll was received, ACK after a short delay
+    uint8_t ack_id;             // Id of the poll answered
+    long ack_deadline;
+    arq_buf rx[ARQ_MAX_WINDOW];
+    arq_stats stats;
+} arq;
+
+// Initializes a link.
+//
+// @param a The link.
+// @param reliable Non-zero to retransmit lost frames, 0 for fire and forget.
+// @param window Frames sent per burst (1 to ARQ_MAX_WINDOW).
+// @param mtu Largest frame, header included (at most ARQ_MAX_FRAME).
+// @param rto_ms Time to wait for an ACK after a poll left the air, doubled
+//               on every retry (see arq_rto_ms).
+// @param source Callback pulling frames to send.
+// @param emit Callback handing frames to the radio.
+// @param deliver Callback receiving payloads.
+// @param arg Additional parameter passed to the callbacks.
+// @return 0 on success, or -1 on invalid parameters.
+int arq_init(arq* a, int reliable, unsigned window, size_t mtu, long rto_ms,
+             arq_source source, arq_emit emit, arq_deliver deliver, void* arg);
+
+// Computes a retransmission timeout from the time on air of the frames
+// exchanged: the peer may finish sending one full frame before its ACK.
+//
+// @param frame_ms Time on air of a full frame.
+// @param ack_ms Time on air of an ACK.
+// @return Timeout in milliseconds.
+long arq_rto_ms(long frame_ms, long ack_ms);
+
+// Pulls frames from the source and hands them to the radio while the window
+// allows it.
+//
+// @param a The link.
+void arq_pump(arq* a);
+
+// Reports the outcome of the oldest frame handed to the radio.
+//
+// @param a The link.
+// @param status 0 if the frame left the air, or -1 on error.
+// @param now_ms Current monotonic time in milliseconds.
+void arq_sent(arq* a, int status, long now_ms);
+
+// Handles a received frame.
+//
+// @param a The link.
+// @param frame The frame.
+// @param len Length of the frame.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the frame is malformed.
+int arq_recv(arq* a, const unsigned char* frame, size_t len, long now_ms);
+
+// Handles expired ACK and retransmission timers.
+//
+// @param a The link.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Milliseconds until the next deadline, or -1 if none is running.
+long arq_poll(arq* a, long now_ms);
+
+#endif  // ARQ_H_
@@ -0,0 +1,82 @@
+#ifndef AT_H_
+#define AT_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+
+// Constants for the AT response parser
+#define AT_RING_LEN 4096    // Serial input buffered per device (power of two)
+#define AT_LINE_LEN 600     // Longest response line (a 255 byte RX packet is 523)
+#define AT_MAX_PAYLOAD 255  // Largest packet carried by +TEST: RX
+
+// Kinds of complete responses produced by at_next
+typedef enum {
+    AT_RX = 1,      // +TEST: RX "<hex>" (with LEN/RSSI/SNR of the preceding line)
+    AT_TX_DONE,     // +TEST: TX DONE
+    AT_TXLRPKT,     // +TEST: TXLRPKT "<hex>", echo of a transmission
+    AT_RXLRPKT,     // +TEST: RXLRPKT, receive mode entered
+    AT_RFCFG,       // +TEST: RFCFG ..., configuration accepted
+    AT_MODE,        // +MODE: ..., mode changed
+    AT_OK,          // Any other +CMD: response
+    AT_ERROR        // +CMD: ERROR(<code>)
+} at_kind;
+
+// Structure to hold one complete response. The caller points data at a
+// buffer of AT_MAX_PAYLOAD bytes before at_next, so a received packet is
+// decoded straight to where it is used.
+typedef struct {
+    at_kind kind;                       // What the module reported
+    int code;                           // Error code for AT_ERROR
+    int rssi;                           // Received signal strength for AT_RX in dBm
+    int snr;                            // Signal to noise ratio for AT_RX in dB
+    size_t len;                         // Length of data for AT_RX
+    unsigned char* data;                // Receives the decoded packet for AT_RX
+} at_response;
+
+// Structure holding the parser state, embedded in each device
+typedef struct {
+    char ring[AT_RING_LEN]; // Raw serial input
+    size_t head;            // Free running write index
+    size_t tail;            // Free running index of the first unparsed byte
+    size_t scan;            // Bytes after tail known not to end a line
+    int have_len;           // A +TEST: LEN line is waiting for its RX line
+    int rssi;
+    int snr;
+} at_parser;
+
+// Resets a parser, discarding buffered input.
+//
+// @param p The parser.
+void at_init(at_parser* p);
+
+// Gets contiguous free space in the ring so serial input can be read
+// straight into it, followed by at_commit.
+//
+// @param p The parser.
+// @param dst Set to the start of the free space.
+// @return Number of bytes that may be written at dst (0 if the ring is full).
+size_t at_space(at_parser* p, char** dst);
+
+// Marks bytes written into the space returned by at_space as received.
+//
+// @param p The parser.
+// @param len Number of bytes written.
+void at_commit(at_parser* p, size_t len);
+
+// Copies serial input into the ring.
+//
+// @param p The parser.
+// @param data The received bytes.
+// @param len Number of received bytes.
+// @return Number of bytes accepted (less than len if the ring is full).
+size_t at_feed(at_parser* p, const char* data, size_t len);
+
+// Extracts the next complete response. A response is complete as soon as
+// its terminating line ending has been received. Lines are parsed where
+// they sit in the ring unless they wrap around its end.
+//
+// @param p The parser.
+// @param res Filled in with the response, res->data must be set.
+// @return 1 if res was filled, or 0 if more input is needed.
+int at_next(at_parser* p, at_response* res);
+
+#endif  // AT_H_
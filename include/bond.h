@@ -0,0 +1,200 @@
+#ifndef BOND_H_
+#define BOND_H_
+
+#include <stddef.h>     // Standard definitions (e.g., size_t)
+#include <stdint.h>     // Fixed width integer types
+#include "wioe.h"
+#include "reactor.h"
+#include "txq.h"
+
+// Several modules, each on its own channel, used as one link. Frames are
+// striped over the radios and numbered so the receiver can put them back
+// in order. Both ends must bond the same number of radios: radio i talks
+// to the peer's radio i.
+#define BOND_MAX_RADIOS 8
+#define BOND_SPACING_MHZ 1.0        // Channel spacing, wider than the widest bandwidth
+#define BOND_HEADER 1               // Sequence number, only sent with more than one radio
+#define BOND_WINDOW 32              // Frames held back while an earlier one is missing
+#define BOND_ORDER (BOND_MAX_RADIOS * TXQ_LEN)  // Sends awaiting their outcome
+#define BOND_TURNAROUND_MS 30       // Quiet time after a packet so its sender can listen again
+
+// Callback receiving decrypted frames, in order of sending where possible
+//
+// @param data The frame.
+// @param len Length of the frame.
+// @param rssi Signal strength in dBm.
+// @param snr Signal to noise ratio in dB.
+// @param arg The pointer given to bond_init.
+typedef void (*bond_deliver)(const unsigned char* data, size_t len, int rssi, int snr, void* arg);
+
+// Callback reporting the outcome of a send. Outcomes are reported in the
+// order the sends were made, whichever radio finishes first.
+//
+// @param status 0 once the frame left the air, or -1 on error.
+// @param arg The pointer given to bond_send.
+typedef void (*bond_done)(int status, void* arg);
+
+// Callback reporting a problem with one of the radios
+//
+// @param radio Index of the radio.
+// @param what Description of the problem.
+// @param fatal Non-zero if the radio can no longer be used.
+// @param arg The pointer given to bond_init.
+typedef void (*bond_error)(int radio, const char* what, int fatal, void* arg);
+
+struct bond;
+
+// One module of the link
+typedef struct {
+    struct bond* owner;
+    int index;
+    wioe* device;
+    wioe_params params;         // Configuration, frequency included
+    int update_pending;         // params changed, applied once the radio is idle
+    int updating;               // Waiting for the module to confirm them
+    int tx_timer;               // Running while waiting for TX DONE or the confirmation
+    int guard_timer;            // Running while a transmission waits for the turnaround or duty cycle
+    long quiet_until;           // No transmission before, see BOND_TURNAROUND_MS
+    uint32_t backlog_us;        // Time on air of the frames queued on this radio
+    unsigned long frames;       // Frames sent through this radio
+} bond_radio;
+
+// A send awaiting its outcome
+typedef struct {
+    bond_radio* radio;
+    uint32_t airtime_us;
+    int done;
+    int status;
+    bond_done cb;
+    void* arg;
+} bond_pending;
+
+// A frame received ahead of a missing one
+typedef struct {
+    frame* f;                   // Decrypted in place, sequence number pulled
+    int rssi;
+    int snr;
+} bond_held;
+
+// Counters for the receiving side
+typedef struct {
+    unsigned long reordered;    // Frames held until an earlier one arrived
+    unsigned long skipped;      // Sequence numbers given up on
+    unsigned long late;         // Frames arriving after they were given up on
+} bond_stats;
+
+// Link over one or more radios
+typedef struct bond {
+    reactor* loop;
+    bond_radio radios[BOND_MAX_RADIOS];
+    int count;
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];      // From the passphrase
+    unsigned char session_key[crypto_aead_chacha20poly1305_KEYBYTES]; // From the last handshake
+    int rx_keyed;               // Packets sealed with session_key are accepted
+    int tx_keyed;               // Sends are sealed with session_key
+    bond_deliver deliver;
+    bond_error error;
+    void* arg;
+    long hold_ms;               // Time a gap may hold back later frames
+    // Sender
+    uint8_t next_seq;
+    bond_pending order[BOND_ORDER];
+    int order_head;
+    int order_count;
+    // Receiver
+    int started;
+    uint8_t expect;             // Next sequence number to deliver
+    uint32_t have;              // Bit i set if expect + i is held
+    int hold_timer;
+    int hold_armed;
+    bond_held held[BOND_WINDOW];
+    bond_stats stats;
+    frame_pool pool;            // Received packets, from the hex decoder to delivery
+} bond;
+
+// Opens the radios and starts listening. Radio i uses the frequency of
+// params plus i * BOND_SPACING_MHZ.
+//
+// @param b The link.
+// @param loop The event loop driving the radios.
+// @param paths Serial ports of the modules.
+// @param count Number of modules (1 to BOND_MAX_RADIOS).
+// @param params Configuration of the first radio.
+// @param key The encryption key of len crypto_aead_chacha20poly1305_KEYBYTES.
+// @param deliver Callback receiving frames.
+// @param error Callback reporting problems.
+// @param arg Additional parameter passed to the callbacks.
+// @return 0 on success, or -1 on error.
+int bond_init(bond* b, reactor* loop, char** paths, int count, const wioe_params* params,
+              const unsigned char* key, bond_deliver deliver, bond_error error, void* arg);
+
+// Largest frame accepted by bond_send.
+//
+// @param b The link.
+// @return The size in bytes.
+size_t bond_mtu(const bond* b);
+
+// Encrypts a frame and queues it on the radio expected to get it on the
+// air first, counting what is already queued on each.
+//
+// @param b The link.
+// @param data The frame.
+// @param len Length of the frame (at most bond_mtu).
+// @param done Callback for the outcome, may be NULL.
+// @param arg Additional parameter passed to the callback.
+// @return 0 on success, or -1 if the frame is too long or all queues are full.
+int bond_send(bond* b, const unsigned char* data, size_t len, bond_done done, void* arg);
+
+// Like bond_send, sealed with the passphrase key even when a session key
+// is in use, for the handshake agreeing on the next one.
+//
+// @param b The link.
+// @param data The frame.
+// @param len Length of the frame (at most bond_mtu).
+// @param done Callback for the outcome, may be NULL.
+// @param arg Additional parameter passed to the callback.
+// @return 0 on success, or -1 if the frame is too long or all queues are full.
+int bond_send_passphrase(bond* b, const unsigned char* data, size_t len, bond_done done,
+                         void* arg);
+
+// Installs a session key agreed by a handshake, replacing the previous one.
+// Packets sealed with it are accepted from now on, and sends use it too once
+// both ends are known to have it.
+//
+// @param b The link.
+// @param key The key of len crypto_aead_chacha20poly1305_KEYBYTES.
+// @param send Non-zero to seal sends with it.
+void bond_rekey(bond* b, const unsigned char* key, int send);
+
+// Changes the data rate of all radios, each one switching once it is idle.
+//
+// @param b The link.
+// @param sf Spreading factor.
+// @param bw Bandwidth in kHz.
+void bond_update(bond* b, unsigned sf, unsigned bw);
+
+// Gets one of the modules.
+//
+// @param b The link.
+// @param i Index of the radio.
+// @return The device.
+wioe* bond_device(bond* b, int i);
+
+// Sums the compression counters of all radios.
+//
+// @param b The link.
+// @param stats Receives the counters.
+void bond_get_compress_stats(bond* b, wioe_compress_stats* stats);
+
+// Sums the receive counters of all radios.
+//
+// @param b The link.
+// @param stats Receives the counters.
+void bond_get_link_stats(bond* b, wioe_link_stats* stats);
+
+// Closes all radios.
+//
+// @param b The link.
+void bond_destroy(bond* b);
+
+#endif  // BOND_H_
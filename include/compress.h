@@ -0,0 +1,33 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>     // Standard definitions (e.g., size_t)
+#include <sys/types.h>  // ssize_t
+
+// Compression for short chat messages with a static codebook shared by both
+// ends. Each output byte is either the code of a common English fragment
+// (e.g., " the ", "ing ") or an escape followed by literal bytes, so even a
+// 10 byte message can shrink and nothing has to be sent ahead of the data.
+#define COMPRESS_LITERAL 0xFE   // One literal byte follows
+#define COMPRESS_RUN 0xFF       // A count (minus one) and that many literals follow
+
+// Compresses data if that makes it shorter.
+//
+// @param out Buffer receiving the compressed data.
+// @param out_len Size of out.
+// @param in The data.
+// @param len Length of the data.
+// @return Length of the compressed data, or 0 if it is not shorter than the
+//         input or does not fit in out.
+size_t compress_bytes(unsigned char* out, size_t out_len, const unsigned char* in, size_t len);
+
+// Restores data produced by compress_bytes.
+//
+// @param out Buffer receiving the data.
+// @param out_len Size of out.
+// @param in The compressed data.
+// @param len Length of the compressed data.
+// @return Length of the data, or -1 if it is malformed or does not fit in out.
+ssize_t decompress_bytes(unsigned char* out, size_t out_len, const unsigned char* in, size_t len);
+
+#endif  // COMPRESS_H_
@@ -0,0 +1,46 @@
+#ifndef DUTY_H_
+#define DUTY_H_
+
+#include <stdint.h>   // Fixed width integer types
+
+// Token bucket limiting the share of time a radio spends on the air, as
+// required in some bands (e.g., 1% in most of the EU 868 MHz band). Tokens
+// are microseconds of airtime: they accumulate at ratio per microsecond up
+// to a full window's allowance, and a transmission takes its time on air.
+typedef struct {
+    double ratio;               // Share of the time on air allowed, 0 if unlimited
+    double capacity_us;         // Airtime allowed in one window
+    double tokens_us;           // Airtime available now
+    uint64_t last_us;           // When tokens were last added
+    uint64_t held_us;           // When the waiting transmission was first held back, 0 if none
+    unsigned long delays;       // Transmissions that had to wait
+    uint64_t delay_us;          // Time they waited in total
+} duty;
+
+// Initializes a full bucket.
+//
+// @param d The bucket.
+// @param ratio Share of the time on air allowed (e.g., 0.01), 0 or 1 and
+//              above for no limit.
+// @param window_ms Period over which the ratio is measured, which bounds
+//                  the longest burst.
+// @param now_us Current monotonic time in microseconds.
+void duty_init(duty* d, double ratio, uint32_t window_ms, uint64_t now_us);
+
+// Gets how long a transmission must wait. One longer than a whole window's
+// allowance may go once the bucket is full.
+//
+// @param d The bucket.
+// @param airtime_us Time on air of the transmission.
+// @param now_us Current monotonic time in microseconds.
+// @return Microseconds to wait, 0 if it may start now.
+uint64_t duty_wait_us(duty* d, uint32_t airtime_us, uint64_t now_us);
+
+// Records a transmission that starts now.
+//
+// @param d The bucket.
+// @param airtime_us Time on air of the transmission.
+// @param now_us Current monotonic time in microseconds.
+void duty_take(duty* d, uint32_t airtime_us, uint64_t now_us);
+
+#endif  // DUTY_H_
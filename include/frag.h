@@ -0,0 +1,202 @@
+#ifndef FRAG_H_
+#define FRAG_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+
+// Every frame starts with a 3 byte header: message id, fragment index and
+// index of the last fragment. All fragments but the last carry exactly
+// mtu - FRAG_HEADER bytes, so the receiver can place them in any order.
+//
+// With coalescing on, messages that fit in a frame may share one: the index
+// is FRAG_BATCH, followed by the number of messages less one (below
+// FRAG_CODED, which tells it from the last fragment of a 256 fragment
+// message and from coded fragments), and each message follows as a length
+// byte and its data.
+//
+// With forward error correction on, a message is cut into k data fragments
+// followed by parity fragments of a Reed-Solomon code, any k of which rebuild
+// it, so that lost frames cost no retransmission round trip. Coded fragments
+// have a longer header: the message id, FRAG_BATCH, FRAG_CODED, the fragment
+// index (below k for data), k less one and the message length (16 bits,
+// little endian). Parity fragments carry a full symbol of mtu -
+// FRAG_CODED_HEADER bytes, the last data fragment only what remains of the
+// message.
+#define FRAG_HEADER 3
+#define FRAG_BATCH 0xff       // Fragment index of a frame holding several messages
+#define FRAG_CODED 0xfe       // Follows FRAG_BATCH in a coded fragment
+#define FRAG_CODED_HEADER 7
+#define FRAG_FEC_AUTO -1      // Parity sized from the measured loss
+#define FRAG_FEC_FAILURE 0.01 // Chance of losing a coded message the auto mode aims at
+#define FRAG_MAX_COUNT 256    // Fragments per message
+#define FRAG_TX_DEPTH 32      // Messages waiting to be fragmented
+#define FRAG_RX_SLOTS 8       // Messages reassembled at the same time
+
+// Structure to hold a message waiting to be fragmented
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    uint8_t id;
+    unsigned next;      // Next fragment to hand out
+    unsigned count;     // Number of fragments
+    long queued_ms;     // When it was pushed
+    unsigned k;         // Data fragments of a coded message, 0 if not coded
+} frag_msg;
+
+// Sender side: splits queued messages into frames
+typedef struct {
+    size_t mtu;                         // Largest frame, header included
+    uint8_t next_id;
+    frag_msg queue[FRAG_TX_DEPTH];
+    int head;
+    int count;
+    long hold_ms;                       // Latency budget of coalescing, 0 if off
+    unsigned long batches;              // Frames holding several messages
+    unsigned long batched;              // Messages sent in them
+    int fec;                            // Parity percent, FRAG_FEC_AUTO, or 0 if off
+    double loss;                        // Frame loss rate the auto mode plans for
+    unsigned long coded;                // Messages sent with parity
+    unsigned long parity;               // Parity fragments sent
+} frag_tx;
+
+// Callback receiving a reassembled message, valid only during the call
+//
+// @param msg The message.
+// @param len Length of the message.
+// @param arg The pointer given to frag_rx_init.
+typedef void (*frag_deliver)(const unsigned char* msg, size_t len, void* arg);
+
+// Structure to hold a message being reassembled
+typedef struct {
+    int used;
+    uint8_t id;
+    unsigned count;                     // Fragments, or data fragments if coded
+    unsigned received;
+    uint32_t have[FRAG_MAX_COUNT / 32]; // Bitmap of received fragments
+    size_t len;                         // Known once the last fragment arrived
+    long first_ms;                      // Arrival of the first fragment
+    unsigned char* data;
+    int coded;
+    unsigned parities;                  // Parity symbols received, after the data
+    uint8_t rows[FRAG_MAX_COUNT];       // Parity row of each of them
+} frag_slot;
+
+// Receiver side: reassembles frames that may arrive out of order
+typedef struct {
+    size_t mtu;
+    long timeout_ms;
+    frag_slot slots[FRAG_RX_SLOTS];
+    frag_deliver deliver;
+    void* arg;
+    unsigned long completed;            // Messages delivered
+    unsigned long expired;              // Messages dropped incomplete
+    unsigned long rebuilt;              // Coded messages completed from parity
+    uint32_t done[FRAG_RX_SLOTS];       // Recently completed coded messages
+    int done_next;
+} frag_rx;
+
+// Computes the largest message that can be fragmented.
+//
+// @param mtu Largest frame, header included.
+// @return Maximum message length in bytes.
+size_t frag_max_message(size_t mtu);
+
+// Initializes the sender side.
+//
+// @param tx The sender.
+// @param mtu Largest frame to produce, header included (must match the receiver).
+// @return 0 on success, or -1 if the mtu cannot hold any data.
+int frag_tx_init(frag_tx* tx, size_t mtu);
+
+// Turns on coalescing: messages that fit in a frame are held for up to
+// hold_ms so that those queued meanwhile go out in the same frame, which
+// saves the preamble, header, tag and TX DONE round trip of each. A frame
+// goes out as soon as the next message would not fit. The receiver always
+// understands coalesced frames.
+//
+// @param tx The sender.
+// @param hold_ms Latency budget per message, 0 to send each in its own frame.
+void frag_tx_coalesce(frag_tx* tx, long hold_ms);
+
+// Turns on forward error correction: each message gets parity fragments
+// sent right after its data. Meant for links without retransmission, where
+// it saves the round trips of lost fragments at the cost of airtime. The
+// receiver always understands coded fragments.
+//
+// @param tx The sender.
+// @param percent Parity fragments per 100 data fragments (at least one),
+//        FRAG_FEC_AUTO for as many as frag_tx_loss calls for, or 0 for none.
+void frag_tx_fec(frag_tx* tx, int percent);
+
+// Reports the frame loss rate of the link, which sizes the parity in
+// FRAG_FEC_AUTO mode: the fewest parity fragments that lose a message with
+// a chance of at most FRAG_FEC_FAILURE.
+//
+// @param tx The sender.
+// @param loss Fraction of frames lost, from 0 to 1.
+void frag_tx_loss(frag_tx* tx, double loss);
+
+// Copies a message into the sender queue.
+//
+// @param tx The sender.
+// @param msg The message.
+// @param len Length of the message (at most frag_max_message).
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if it is too long or the queue is full.
+int frag_tx_push(frag_tx* tx, const unsigned char* msg, size_t len, long now_ms);
+
+// Builds the next frame: the next fragment of the oldest queued message, or
+// several whole messages when coalescing.
+//
+// @param tx The sender.
+// @param frame Buffer of at least mtu bytes.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Length of the frame, or 0 if nothing is queued or the queued
+//         messages are held for coalescing.
+size_t frag_tx_next(frag_tx* tx, unsigned char* frame, long now_ms);
+
+// Gets the time until held messages are due, when frag_tx_next has to be
+// called again even if nothing else happens.
+//
+// @param tx The sender.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Milliseconds until the oldest held message is due, or -1 if none is held.
+long frag_tx_wait(const frag_tx* tx, long now_ms);
+
+// Frees the messages still queued.
+//
+// @param tx The sender.
+void frag_tx_free(frag_tx* tx);
+
+// Initializes the receiver side.
+//
+// @param rx The receiver.
+// @param mtu Largest frame the sender produces, header included.
+// @param timeout_ms Time after its first fragment a message is given up on.
+// @param deliver Callback receiving complete messages.
+// @param arg Additional parameter passed to the callback.
+void frag_rx_init(frag_rx* rx, size_t mtu, long timeout_ms, frag_deliver deliver, void* arg);
+
+// Adds a received frame, delivering its message once complete.
+//
+// @param rx The receiver.
+// @param frame The frame.
+// @param len Length of the frame.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 1 if a message was delivered, 0 if more fragments are needed,
+//         or -1 if the frame is malformed.
+int frag_rx_push(frag_rx* rx, const unsigned char* frame, size_t len, long now_ms);
+
+// Drops messages whose fragments stopped arriving.
+//
+// @param rx The receiver.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Number of messages dropped.
+int frag_rx_expire(frag_rx* rx, long now_ms);
+
+// Frees messages being reassembled.
+//
+// @param rx The receiver.
+void frag_rx_free(frag_rx* rx);
+
+#endif  // FRAG_H_
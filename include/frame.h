@@ -0,0 +1,86 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+
+// Packet buffers taken from a fixed pool. The content sits in the middle of
+// the buffer so that every layer can strip its header (frame_pull), add one
+// in front (frame_push) or append a tag (frame_put) without moving the
+// payload: a received packet is decoded from hex into a frame, decrypted in
+// place and handed up the stack by pointer. Whoever holds a frame owns it and
+// gives it back with frame_release.
+#define FRAME_HEADROOM 32       // Room for the headers of all layers
+#define FRAME_TAILROOM 32       // Room for authentication tags
+#define FRAME_PAYLOAD 255       // Largest packet on the air
+#define FRAME_SIZE (FRAME_HEADROOM + FRAME_PAYLOAD + FRAME_TAILROOM)
+#define FRAME_POOL 64           // Frames per pool
+
+struct frame_pool;
+
+// One packet buffer
+typedef struct frame {
+    unsigned char* data;        // Start of the content
+    size_t len;                 // Length of the content
+    struct frame_pool* pool;    // Pool to return to, NULL for a frame on the stack
+    struct frame* next;         // Free list link, or for the owner's use
+    unsigned char buf[FRAME_SIZE];
+} frame;
+
+// Preallocated frames. Not thread safe: a pool belongs to the thread running
+// the radios.
+typedef struct frame_pool {
+    frame frames[FRAME_POOL];
+    frame* free;
+    int available;
+    unsigned long exhausted;    // Allocations that failed
+} frame_pool;
+
+// Initializes a pool with all frames free.
+//
+// @param pool The pool.
+void frame_pool_init(frame_pool* pool);
+
+// Takes a frame from a pool, empty with the full headroom before it.
+//
+// @param pool The pool.
+// @return The frame, or NULL if all are in use.
+frame* frame_alloc(frame_pool* pool);
+
+// Prepares a frame that is not from a pool (e.g., on the stack).
+//
+// @param f The frame.
+void frame_init(frame* f);
+
+// Gives a frame back to its pool. Does nothing for frames not from a pool.
+//
+// @param f The frame, may be NULL.
+void frame_release(frame* f);
+
+// Grows the content at the front, for a header.
+//
+// @param f The frame.
+// @param n Bytes to add.
+// @return The new start of the content, or NULL if the headroom is too small.
+unsigned char* frame_push(frame* f, size_t n);
+
+// Removes bytes from the front of the content, e.g. a parsed header.
+//
+// @param f The frame.
+// @param n Bytes to remove (at most the length).
+// @return The new start of the content, or NULL if n is too large.
+unsigned char* frame_pull(frame* f, size_t n);
+
+// Grows the content at the end.
+//
+// @param f The frame.
+// @param n Bytes to add.
+// @return Where the added bytes go, or NULL if the room is too small.
+unsigned char* frame_put(frame* f, size_t n);
+
+// Gets the room left after the content.
+//
+// @param f The frame.
+// @return The number of bytes frame_put may add.
+size_t frame_tailroom(const frame* f);
+
+#endif  // FRAME_H_
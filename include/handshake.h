@@ -0,0 +1,107 @@
+#ifndef HANDSHAKE_H_
+#define HANDSHAKE_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <sodium.h>   // X25519 and BLAKE2b
+#include "arq.h"      // Control frame ops
+
+// Session key agreement: both ends exchange ephemeral X25519 public keys in
+// control frames sealed with the passphrase key, which authenticates them,
+// and hash the shared secret with the passphrase key and both public keys
+// into a key used for this session only. Control frames carry [op][...]:
+//
+//   HELLO      sent by a node starting up: [op][public key]
+//   REPLY      the peer's ephemeral public key and a tag proving it derived
+//              the key: [op][public key][tag]
+//   CONFIRM    the initiator's tag, after which the responder seals with the
+//              new key: [op][tag]
+//   DONE       sealed with the new key, after which the initiator does too
+//
+// HELLO and CONFIRM are sent again until answered, and answered again when
+// repeated. When both ends start at once, the HELLO with the lower public
+// key wins.
+#define HS_TAG 16               // Length of a key confirmation tag
+#define HS_FRAME (1 + crypto_scalarmult_BYTES + HS_TAG)  // Longest control frame
+#define HS_MAX_RETRY_MS 30000   // Longest wait before sending again
+
+// Callback sending a control frame.
+//
+// @param frame The frame.
+// @param len Length of the frame.
+// @param passphrase Non-zero if it must be sealed with the passphrase key
+//                   rather than the session key.
+// @param arg The pointer given to hs_init.
+// @return 0 on success, or -1 if it could not be queued.
+typedef int (*hs_send_cb)(const unsigned char* frame, size_t len, int passphrase, void* arg);
+
+// Callback installing an agreed key, see bond_rekey.
+//
+// @param key The key of len crypto_aead_chacha20poly1305_KEYBYTES.
+// @param send Non-zero once the peer is known to have it and sends may use it.
+// @param arg The pointer given to hs_init.
+typedef void (*hs_key_cb)(const unsigned char* key, int send, void* arg);
+
+// Handshake state for the link with a single peer
+typedef struct {
+    int state;
+    unsigned char psk[crypto_generichash_KEYBYTES];     // Passphrase key
+    unsigned char secret[crypto_scalarmult_SCALARBYTES]; // Own ephemeral key
+    unsigned char pub[crypto_scalarmult_BYTES];
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES]; // Agreed or being agreed
+    // Responder side, kept to answer repeats of the same HELLO
+    int answered;
+    unsigned char peer_pub[crypto_scalarmult_BYTES];
+    unsigned char reply[HS_FRAME];
+    unsigned char confirm[HS_TAG];  // Expected from the initiator
+    long deadline;
+    long retry_ms;
+    long backoff_ms;
+    hs_send_cb send;
+    hs_key_cb keyed;
+    void* arg;
+    unsigned long sessions;     // Keys agreed
+    unsigned long rejected;     // Frames with a wrong tag or public key
+} hs;
+
+// Initializes the handshake state, idle until hs_start.
+//
+// @param h The handshake.
+// @param psk The passphrase key of len crypto_generichash_KEYBYTES.
+// @param retry_ms Wait before sending a HELLO or CONFIRM again, doubled up
+//                 to HS_MAX_RETRY_MS while unanswered.
+// @param send Callback sending control frames.
+// @param keyed Callback installing agreed keys.
+// @param arg Additional parameter passed to the callbacks.
+void hs_init(hs* h, const unsigned char* psk, long retry_ms, hs_send_cb send, hs_key_cb keyed,
+             void* arg);
+
+// Starts agreeing on a new key with a fresh ephemeral key pair.
+//
+// @param h The handshake.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the HELLO could not be queued (it is sent
+//         again by hs_poll).
+int hs_start(hs* h, long now_ms);
+
+// Handles a control frame from the peer.
+//
+// @param h The handshake.
+// @param frame The frame.
+// @param len Length of the frame.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the frame is malformed or unexpected.
+int hs_recv(hs* h, const unsigned char* frame, size_t len, long now_ms);
+
+// Sends a HELLO or CONFIRM again once unanswered for too long.
+//
+// @param h The handshake.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Milliseconds until the next deadline, or -1 if none is running.
+long hs_poll(hs* h, long now_ms);
+
+// Wipes the keys held.
+//
+// @param h The handshake.
+void hs_clear(hs* h);
+
+#endif  // HANDSHAKE_H_
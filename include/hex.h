@@ -0,0 +1,41 @@
+#ifndef HEX_H_
+#define HEX_H_
+
+#include <stddef.h>     // Standard definitions (e.g., size_t)
+
+// Implementations of the codec, fastest supported one is used by default
+typedef enum {
+    HEX_SCALAR = 0,   // Table driven, portable
+    HEX_SSE2,         // 16 bytes per step (x86-64 baseline)
+    HEX_AVX2          // 32 bytes per step, picked at runtime when the CPU has it
+} hex_impl;
+
+// Encodes bytes as upper case hex, two characters per byte. No NUL is written.
+//
+// @param out Buffer of at least 2 * len characters.
+// @param in Bytes to encode.
+// @param len Number of bytes.
+// @return Number of characters written (2 * len).
+size_t hex_encode(char* out, const unsigned char* in, size_t len);
+
+// Decodes hex characters (either case) into bytes, stopping at the first
+// pair that is not valid hex.
+//
+// @param out Buffer of at least len bytes.
+// @param in Characters to decode, 2 * len of them are read at most.
+// @param len Maximum number of bytes to decode.
+// @return Number of bytes decoded.
+size_t hex_decode(unsigned char* out, const char* in, size_t len);
+
+// Forces an implementation, mainly for benchmarking.
+//
+// @param impl The implementation to use.
+// @return 0 on success, or -1 if the CPU does not support it.
+int hex_use(hex_impl impl);
+
+// Gets the name of the implementation in use (e.g., "avx2").
+//
+// @return A static string.
+const char* hex_name(void);
+
+#endif  // HEX_H_
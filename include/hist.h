@@ -0,0 +1,59 @@
+#ifndef HIST_H_
+#define HIST_H_
+
+#include <stdint.h>     // Fixed width integer types
+#include <stdatomic.h>  // C11 atomics, values may be recorded from any thread
+
+// Log-linear buckets in the style of HdrHistogram: values below
+// HIST_SUB are exact, above that every power of two is split into
+// HIST_SUB buckets, so any value is known to within 1 / HIST_SUB (6%).
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)   // Covers all 32-bit values
+
+// Distribution of a 32-bit quantity (e.g., a latency in microseconds)
+typedef struct {
+    atomic_ulong buckets[HIST_BUCKETS];
+    atomic_ulong count;
+    atomic_ullong sum;
+    atomic_uint min;
+    atomic_uint max;
+} hist;
+
+// Summary of a histogram, see hist_summary
+typedef struct {
+    unsigned long count;
+    uint32_t min;
+    uint32_t max;
+    double mean;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t p999;
+} hist_stats;
+
+// Initializes an empty histogram.
+//
+// @param h The histogram.
+void hist_init(hist* h);
+
+// Records a value. Thread safe and lock-free.
+//
+// @param h The histogram.
+// @param v The value.
+void hist_record(hist* h, uint32_t v);
+
+// Computes a percentile from the buckets.
+//
+// @param h The histogram.
+// @param p The percentile (0 to 100).
+// @return The middle of the bucket holding the percentile, or 0 if empty.
+uint32_t hist_percentile(const hist* h, double p);
+
+// Summarizes a histogram. Values recorded meanwhile may be partly counted.
+//
+// @param h The histogram.
+// @param s Receives the summary.
+void hist_summary(const hist* h, hist_stats* s);
+
+#endif  // HIST_H_
@@ -0,0 +1,128 @@
+#ifndef HUB_H_
+#define HUB_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include "reactor.h"  // Event loop the clients are served from
+
+// Local clients of a headless client (daemon mode) sharing its radio
+// through a UNIX stream socket. Requests and replies are lines of text:
+//
+//   SEND text     queues text for the peer, answered "OK" or "ERR reason"
+//   SUB / UNSUB   starts / stops "MSG text" lines for messages received
+//   STATS         answered "STATS json", the statistics of the radios
+//
+// Each client has its own queue, and the queues are drained into the link
+// by deficit round robin over bytes, so a client sending long or many
+// messages does not delay the others by more than its share. The link sees
+// one sender, its coalescing packs messages of several clients in a frame.
+// Requests are answered in order: a client not reading its replies is not
+// read from until they have room again, and MSG lines that find no room are
+// dropped.
+#define HUB_CLIENTS 64            // Clients connected at the same time
+#define HUB_CLIENT_QUEUE 64       // Messages a client may have waiting
+#define HUB_LINE_MAX 4096         // Longest request line
+#define HUB_OUT_MAX (64 << 10)    // Replies and messages buffered for a slow client
+#define HUB_QUANTUM 256           // Bytes a client may send per round
+
+// Callback queuing a message of a client for the peer.
+//
+// @param msg The message.
+// @param len Length of the message.
+// @param arg The pointer given to hub_open.
+// @return 0 on success, or -1 if the link has no room now (the message
+//         waits for the next hub_pump).
+typedef int (*hub_send_cb)(const unsigned char* msg, size_t len, void* arg);
+
+// Callback rendering the statistics for STATS.
+//
+// @param out Buffer for a single line of text.
+// @param size The size of out.
+// @param arg The pointer given to hub_open.
+// @return Length of the text, or -1 on error.
+typedef long (*hub_stats_cb)(char* out, size_t size, void* arg);
+
+// A queued message
+typedef struct {
+    unsigned char* data;
+    size_t len;
+} hub_msg;
+
+// A connected client
+typedef struct {
+    int fd;                             // -1 if the slot is free
+    int subscribed;
+    int reading;                        // Watched for EPOLLIN, while answers have room
+    int writing;                        // Watched for EPOLLOUT
+    char in[HUB_LINE_MAX];              // Partial request line
+    size_t in_len;
+    char* out;                          // Replies not written yet
+    size_t out_len;
+    hub_msg queue[HUB_CLIENT_QUEUE];
+    int head;
+    int count;
+    size_t deficit;                     // Bytes it may still send this round
+} hub_client;
+
+// Statistics
+typedef struct {
+    unsigned long accepted;             // Connections
+    unsigned long requests;
+    unsigned long sent;                 // Messages queued for the peer
+    unsigned long delivered;            // Messages written to subscribers
+    unsigned long dropped;              // To subscribers too slow to keep up
+} hub_stats;
+
+// The socket and its clients
+typedef struct {
+    reactor* loop;
+    int fd;
+    char path[108];                     // Socket path, removed on close
+    hub_send_cb send;
+    hub_stats_cb stats_cb;
+    void* arg;
+    hub_client clients[HUB_CLIENTS];
+    int turn;                           // Client whose round it is
+    int turn_started;                   // Its quantum was added
+    int queued;                         // Messages in all queues
+    hub_stats stats;
+} hub;
+
+// Listens on a UNIX socket, serving clients from the event loop.
+//
+// @param h The hub.
+// @param loop The event loop.
+// @param path Path of the socket. A stale socket left by a crash is
+//        replaced, one with a live daemon behind it is not.
+// @param send Callback queuing messages for the peer.
+// @param stats Callback rendering statistics.
+// @param arg Additional parameter passed to the callbacks.
+// @return 0 on success, or -1 on error (errno is EADDRINUSE if another
+//         daemon serves the path).
+int hub_open(hub* h, reactor* loop, const char* path, hub_send_cb send, hub_stats_cb stats,
+             void* arg);
+
+// Moves queued messages to the link, fairly between clients, until it has
+// no room.
+//
+// @param h The hub.
+void hub_pump(hub* h);
+
+// Tells whether messages wait for room on the link.
+//
+// @param h The hub.
+// @return Non-zero if hub_pump has work.
+int hub_pending(const hub* h);
+
+// Passes a message received from the peer to the subscribed clients.
+//
+// @param h The hub.
+// @param msg The message.
+// @param len Length of the message.
+void hub_deliver(hub* h, const unsigned char* msg, size_t len);
+
+// Disconnects all clients and removes the socket.
+//
+// @param h The hub.
+void hub_close(hub* h);
+
+#endif  // HUB_H_
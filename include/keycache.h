@@ -0,0 +1,35 @@
+#ifndef KEYCACHE_H_
+#define KEYCACHE_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+
+// Cache of the key derived from the passphrase, so that only the first start
+// pays for crypto_pwhash (tens of milliseconds and 64 MiB of memory). The
+// file holds the key itself, readable by its owner only, along with a
+// BLAKE2b tag of the passphrase keyed with it that tells whether it was
+// derived from the passphrase given. It is as sensitive as the passphrase:
+// files that anyone else can read or write, or that are not owned by the
+// user, are ignored and replaced.
+#define KEYCACHE_FILE "wio/key"     // Under $XDG_CACHE_HOME, or ~/.cache
+
+// Gets the default location of the cache.
+//
+// @param out Buffer receiving the path.
+// @param len Size of out.
+// @return 0 on success, or -1 if neither $XDG_CACHE_HOME nor $HOME is set
+//         or the path does not fit.
+int keycache_default_path(char* out, size_t len);
+
+// Derives the key from a passphrase like crypto_pwhash with the INTERACTIVE
+// limits and an all zero salt (the salt must match the peers'), reading it
+// from the cache when it holds the key of the same passphrase and storing
+// it there otherwise.
+//
+// @param key Buffer receiving the key of len crypto_aead_chacha20poly1305_KEYBYTES.
+// @param password The passphrase.
+// @param path The cache file, NULL or empty for none.
+// @return 0 on success, or -1 if the derivation ran out of memory. Errors
+//         reading or writing the cache only cost the derivation.
+int keycache_derive(unsigned char* key, const char* password, const char* path);
+
+#endif  // KEYCACHE_H_
@@ -0,0 +1,163 @@
+#ifndef MESH_H_
+#define MESH_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+
+// Addressed multi-hop networking. Every frame starts with
+//
+//   [type << 4 | ttl] [source] [destination] [from] [next hop] [id, LE16]
+//
+// where source and id identify the frame across all hops, from is the node
+// that transmitted this copy and next hop the only node meant to act on it
+// (MESH_BROADCAST for anyone). Nodes announce themselves and the nodes they
+// reach in HELLO frames heard by their neighbors only, as [node][hops][via]
+// entries so a neighbor skips routes leading back through itself; everything a node
+// hears also teaches it the way back to the source. Frames for a known
+// destination are forwarded hop by hop, others are flooded: each node
+// repeats a frame once after a random delay, unless it heard enough copies
+// meanwhile. Frames already seen are recognized with a pair of rotating
+// bloom filters.
+#define MESH_DATA 1
+#define MESH_HELLO 2
+#define MESH_HEADER 7
+#define MESH_ENTRY 3                // Route announced in a HELLO
+#define MESH_BROADCAST 0xff         // Destination or next hop meaning every node
+#define MESH_TTL 7                  // Hops a data frame may travel
+#define MESH_MAX_HOPS 15            // Routes this long are unreachable
+
+#define MESH_ROUTES 32              // Destinations remembered
+#define MESH_HELLO_MS 30000         // Interval between HELLO frames
+#define MESH_ROUTE_TIMEOUT_MS (3 * MESH_HELLO_MS + 5000)   // Routes not refreshed expire
+#define MESH_BLOOM_BITS 4096        // Bits per filter
+#define MESH_BLOOM_HASHES 3
+#define MESH_BLOOM_ROTATE 128       // Frames recorded before the older filter is cleared
+#define MESH_PENDING 8              // Flooded frames waiting to be repeated
+#define MESH_JITTER_MS 300          // Longest delay before repeating a flooded frame
+#define MESH_REDUNDANT 2            // Copies heard while waiting that cancel a repeat
+#define MESH_MAX_FRAME 255
+
+// Callback transmitting a frame.
+//
+// @param frame The frame.
+// @param len Length of the frame.
+// @param local 1 if the frame carries data given to mesh_send, 0 for
+//              frames the mesh sends on its own (HELLO, forwarding).
+// @param arg The pointer given to mesh_init.
+// @return 0 on success, or -1 if it could not be queued.
+typedef int (*mesh_send_cb)(const unsigned char* frame, size_t len, int local, void* arg);
+
+// Callback receiving data addressed to this node or to every node.
+//
+// @param src Address of the node that sent it.
+// @param data The data.
+// @param len Length of the data.
+// @param arg The pointer given to mesh_init.
+typedef void (*mesh_deliver_cb)(uint8_t src, const unsigned char* data, size_t len, void* arg);
+
+// Way to a destination
+typedef struct {
+    uint8_t dest;
+    uint8_t via;                // Neighbor to hand frames to
+    uint8_t hops;
+    long seen_ms;               // Last time the route was confirmed
+} mesh_route;
+
+// Flooded frame waiting for its repeat
+typedef struct {
+    int used;
+    long due_ms;
+    int heard;                  // Copies heard from other nodes meanwhile
+    uint8_t src;
+    uint16_t id;
+    size_t len;
+    unsigned char frame[MESH_MAX_FRAME];
+} mesh_pending;
+
+// Counters for the mesh
+typedef struct {
+    unsigned long sent;         // Frames originated
+    unsigned long delivered;    // Frames delivered to this node
+    unsigned long forwarded;    // Frames passed on to a next hop
+    unsigned long flooded;      // Flooded frames repeated
+    unsigned long suppressed;   // Repeats cancelled because enough copies were heard
+    unsigned long duplicates;   // Frames dropped as already seen
+    unsigned long ignored;      // Frames meant for another next hop
+    unsigned long dropped;      // Frames out of hops or without room to wait
+} mesh_stats;
+
+// A node of the mesh
+typedef struct {
+    uint8_t addr;
+    uint16_t next_id;
+    size_t mtu;                 // Largest frame, header included
+    mesh_route routes[MESH_ROUTES];
+    int route_count;
+    uint8_t bloom[2][MESH_BLOOM_BITS / 8];
+    int bloom_cur;              // Filter receiving new frames, the other one is older
+    int bloom_count;            // Frames recorded in the current filter
+    mesh_pending pending[MESH_PENDING];
+    long next_hello;            // -1 until the first mesh_poll
+    unsigned rand_state;
+    mesh_send_cb send;
+    mesh_deliver_cb deliver;
+    void* arg;
+    mesh_stats stats;
+} mesh;
+
+// Initializes a node, the first HELLO goes out within a second of the
+// first mesh_poll.
+//
+// @param m The node.
+// @param addr Address of the node (1 to 254).
+// @param mtu Largest frame the radio carries, header included.
+// @param seed Random seed for frame ids and delays, so that a restarted node
+//             does not reuse ids its neighbors still remember.
+// @param send Callback transmitting frames.
+// @param deliver Callback receiving data.
+// @param arg Additional parameter passed to the callbacks.
+// @return 0 on success, or -1 on invalid parameters.
+int mesh_init(mesh* m, uint8_t addr, size_t mtu, unsigned seed, mesh_send_cb send,
+              mesh_deliver_cb deliver, void* arg);
+
+// Largest data accepted by mesh_send.
+//
+// @param m The node.
+// @return The size in bytes.
+size_t mesh_mtu(const mesh* m);
+
+// Sends data to a node, through the known route or by flooding.
+//
+// @param m The node.
+// @param dst Address of the destination, or MESH_BROADCAST.
+// @param data The data.
+// @param len Length of the data (at most mesh_mtu).
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if too long or it could not be queued.
+int mesh_send(mesh* m, uint8_t dst, const unsigned char* data, size_t len, long now_ms);
+
+// Handles a received frame: learns routes, delivers, forwards or floods.
+//
+// @param m The node.
+// @param frame The frame.
+// @param len Length of the frame.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the frame is malformed.
+int mesh_recv(mesh* m, const unsigned char* frame, size_t len, long now_ms);
+
+// Sends HELLO frames and repeats flooded frames when due.
+//
+// @param m The node.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Milliseconds until the next deadline.
+long mesh_poll(mesh* m, long now_ms);
+
+// Gets the length of the route to a node.
+//
+// @param m The node.
+// @param dst Address of the destination.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Number of hops, or -1 if no route is known.
+int mesh_hops(const mesh* m, uint8_t dst, long now_ms);
+
+#endif  // MESH_H_
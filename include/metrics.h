@@ -0,0 +1,46 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include "wioe.h"     // wioe_stats
+
+#define METRICS_MAX 8192    // Longest text produced by metrics_render
+
+// Text formats for the device statistics
+typedef enum {
+    METRICS_PROMETHEUS = 0,   // Prometheus text exposition format
+    METRICS_JSON
+} metrics_format;
+
+// Picks the format for a target: JSON if it ends with ".json", Prometheus
+// text otherwise.
+//
+// @param target A file path, or "unix:" followed by a socket path.
+// @return The format.
+metrics_format metrics_format_of(const char* target);
+
+// Renders device statistics as text. The radios of a bonded link are told
+// apart by a radio label in Prometheus text, and in JSON the object of each
+// is an element of a "radios" array.
+//
+// @param out Buffer for the text, METRICS_MAX bytes per radio are always
+//        enough.
+// @param len The size of out.
+// @param stats The statistics of each radio.
+// @param count Number of radios (at least 1).
+// @param format The format.
+// @return Length of the text (without the NUL), or -1 if out is too small.
+ssize_t metrics_render(char* out, size_t len, const wioe_stats* stats, int count,
+                       metrics_format format);
+
+// Publishes rendered statistics. A file is replaced atomically so readers
+// never see half of it; "unix:path" sends one datagram to a UNIX socket
+// and drops it if nobody listens.
+//
+// @param target A file path, or "unix:" followed by a socket path.
+// @param text The text.
+// @param len Length of the text.
+// @return 0 on success, or -1 on error.
+int metrics_publish(const char* target, const char* text, size_t len);
+
+#endif  // METRICS_H_
@@ -0,0 +1,101 @@
+#ifndef MSGLOG_H_
+#define MSGLOG_H_
+
+#include <stddef.h>     // Standard definitions (e.g., size_t)
+#include <stdint.h>     // Fixed width integer types
+
+// Persistent log of the messages sent and received. Messages are appended
+// to segment files of a fixed size mapped into memory, so logging one costs
+// a copy and a checksum; a thread syncs what was appended to disk every
+// MSGLOG_COMMIT_MS (group commit). Each record carries a checksum and a
+// sequence number, so a record torn by a crash ends the log on the next
+// open instead of corrupting it.
+//
+// The start of each segment holds a sparse index with one entry per
+// MSGLOG_BLOCK bytes of records: the first sequence number, the time span
+// and the peers of the records starting there. Searches skip blocks and
+// segments by their index and only read the records that may match.
+#define MSGLOG_DIR "wio/log"            // Under $XDG_DATA_HOME, or ~/.local/share
+#define MSGLOG_SEGMENT (4 << 20)        // Size of a segment file
+#define MSGLOG_BLOCK 8192               // Bytes of records per index entry
+#define MSGLOG_COMMIT_MS 200            // Longest time an appended message stays unsynced
+#define MSGLOG_MAX_MSG 65535            // Longer messages are truncated
+
+// One logged message
+typedef struct {
+    uint64_t seq;                   // Consecutive over the whole log, from 1
+    int64_t time_ms;                // Wall clock time, milliseconds since the epoch
+    uint8_t peer;                   // Node at the other end (0 without a mesh)
+    int sent;                       // 1 if sent, 0 if received
+    const unsigned char* data;      // Valid during the visit only
+    size_t len;
+} msglog_entry;
+
+// What to look for, zero for no bound
+typedef struct {
+    uint64_t seq_from;              // Sequence numbers, inclusive
+    uint64_t seq_to;
+    int64_t since_ms;               // Wall clock times, inclusive
+    int64_t until_ms;
+    int peer;                       // Peer address, or -1 for any
+    int sent;                       // 1 for sent, 0 for received, -1 for both
+    const char* text;               // Substring of the message, NULL for any
+    size_t limit;                   // Most messages visited
+    int newest_first;               // Visit the latest messages first
+} msglog_query;
+
+// Called for each message matching a search.
+//
+// @param entry The message.
+// @param arg The pointer given to msglog_search.
+// @return 0 to continue, anything else to stop the search.
+typedef int (*msglog_visit)(const msglog_entry* entry, void* arg);
+
+typedef struct msglog msglog;
+
+// Gets the default location of the log.
+//
+// @param out Buffer receiving the path.
+// @param len Size of out.
+// @return 0 on success, or -1 if neither $XDG_DATA_HOME nor $HOME is set
+//         or the path does not fit.
+int msglog_default_path(char* out, size_t len);
+
+// Opens the log for appending, creating the directory if needed, and
+// recovers the end of the last segment. A last segment that is not one
+// (e.g., of the wrong size) is renamed with a .bad suffix, and the log goes
+// on with sequence numbers it could not have held. Only one process may
+// append at a time.
+//
+// @param dir Directory of the segment files.
+// @return The log, or NULL on error (errno is EWOULDBLOCK if another process
+//         has it open, or why the last segment could not be read).
+msglog* msglog_open(const char* dir);
+
+// Appends a message. It is readable by searches at once and on disk within
+// MSGLOG_COMMIT_MS. Not thread safe: appends come from one thread.
+//
+// @param log The log.
+// @param sent 1 if the message was sent, 0 if received.
+// @param peer Node at the other end.
+// @param data The message.
+// @param len Length of the message.
+// @return Its sequence number, or 0 on error (e.g., disk full).
+uint64_t msglog_append(msglog* log, int sent, uint8_t peer, const void* data, size_t len);
+
+// Syncs everything appended so far and closes the log.
+//
+// @param log The log, may be NULL.
+void msglog_close(msglog* log);
+
+// Visits the messages matching a query, oldest first unless asked
+// otherwise. Works while another process appends to the log.
+//
+// @param dir Directory of the segment files.
+// @param q The query.
+// @param visit Called for each match.
+// @param arg Passed to visit.
+// @return Number of messages visited, or -1 if the directory cannot be read.
+long msglog_search(const char* dir, const msglog_query* q, msglog_visit visit, void* arg);
+
+#endif  // MSGLOG_H_
@@ -0,0 +1,89 @@
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <stdint.h>       // Fixed width integer types
+#include <sys/epoll.h>    // Event flags for watched descriptors (e.g., EPOLLIN)
+
+// Opaque reactor struct used to represent a single threaded event loop
+typedef struct reactor reactor;
+
+// Callback invoked from reactor_run when a watched descriptor becomes ready.
+//
+// @param r The reactor dispatching the event.
+// @param fd The descriptor that is ready.
+// @param events The epoll events that fired (e.g., EPOLLIN).
+// @param arg The pointer given when the descriptor was added.
+typedef void (*reactor_cb)(reactor* r, int fd, uint32_t events, void* arg);
+
+// Creates an epoll based event loop.
+//
+// @return Pointer to the reactor, or NULL on error.
+reactor* reactor_create(void);
+
+// Watches a descriptor, calling cb from reactor_run whenever it is ready.
+//
+// @param r The reactor.
+// @param fd The descriptor to watch.
+// @param events The epoll events of interest (e.g., EPOLLIN).
+// @param cb Callback invoked when the descriptor is ready.
+// @param arg Additional parameter passed to the callback.
+// @return 0 on success, or -1 on error.
+int reactor_add(reactor* r, int fd, uint32_t events, reactor_cb cb, void* arg);
+
+// Stops watching a descriptor. Safe to call from within a callback.
+//
+// @param r The reactor.
+// @param fd The descriptor to remove (it is not closed).
+// @return 0 on success, or -1 on error.
+int reactor_remove(reactor* r, int fd);
+
+// Creates a timer that calls cb from reactor_run when it expires.
+//
+// @param r The reactor.
+// @param cb Callback invoked on expiry.
+// @param arg Additional parameter passed to the callback.
+// @return Timer descriptor to use with reactor_timer_set, or -1 on error.
+int reactor_timer(reactor* r, reactor_cb cb, void* arg);
+
+// Arms or disarms a timer created by reactor_timer.
+//
+// @param r The reactor.
+// @param timer_fd The timer returned by reactor_timer.
+// @param ms Milliseconds until expiry, 0 disarms the timer.
+// @param periodic Non-zero to fire every ms milliseconds until disarmed.
+// @return 0 on success, or -1 on error.
+int reactor_timer_set(reactor* r, int timer_fd, unsigned ms, int periodic);
+
+// Creates an eventfd that calls cb from reactor_run once reactor_notify has
+// been called on it (possibly from another thread). Notifications are merged.
+//
+// @param r The reactor.
+// @param cb Callback invoked after a notification.
+// @param arg Additional parameter passed to the callback.
+// @return Event descriptor to use with reactor_notify, or -1 on error.
+int reactor_event(reactor* r, reactor_cb cb, void* arg);
+
+// Wakes the reactor and schedules the callback of an event descriptor.
+// Thread and async signal safe.
+//
+// @param event_fd The descriptor returned by reactor_event.
+void reactor_notify(int event_fd);
+
+// Dispatches events until reactor_stop is called.
+//
+// @param r The reactor.
+// @return 0 on success, or -1 on error.
+int reactor_run(reactor* r);
+
+// Makes reactor_run return after the current dispatch. Thread safe.
+//
+// @param r The reactor.
+void reactor_stop(reactor* r);
+
+// Closes all timers and events created by the reactor and frees it.
+// Descriptors added with reactor_add are left open.
+//
+// @param r The reactor.
+void reactor_destroy(reactor* r);
+
+#endif  // REACTOR_H_
@@ -0,0 +1,92 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>   // Fixed width integer types
+
+#define REPLAY_WINDOW 64    // Sequence numbers below the highest still accepted
+#define REPLAY_ID_BYTES 8   // Bytes of a session id told apart, ids are random
+#define REPLAY_HISTORY 1024 // Sessions no longer tracked that are remembered
+
+// Sliding window over the sequence numbers received from one sender
+typedef struct {
+    int started;
+    uint32_t top;               // Highest sequence number accepted
+    uint64_t bitmap;            // Bit i set if top - i was accepted
+    unsigned long received;     // Packets accepted
+    unsigned long lost;         // Sequence numbers skipped and not (yet) received
+    unsigned long reordered;    // Packets accepted below the highest
+    unsigned long replayed;     // Packets rejected as duplicates or too old
+} replay_window;
+
+// Initializes an empty window.
+//
+// @param w The window.
+void replay_init(replay_window* w);
+
+// Checks a sequence number without recording it.
+//
+// @param w The window.
+// @param seq The sequence number.
+// @return 1 if it was not seen before, or 0 if it is a replay or too old.
+int replay_check(const replay_window* w, uint32_t seq);
+
+// Records an authenticated sequence number and updates the statistics.
+//
+// @param w The window.
+// @param seq The sequence number, accepted by replay_check.
+void replay_update(replay_window* w, uint32_t seq);
+
+// A session that is no longer tracked and the highest sequence number it
+// had accepted
+typedef struct {
+    unsigned char id[REPLAY_ID_BYTES];
+    uint32_t top;
+} replay_retired;
+
+// Sessions that stopped being tracked, because newer ones took their place
+// or the receiver restarted. A session heard again resumes above what it
+// accepted before instead of with an empty window, which would take its old
+// packets again. The oldest are forgotten after REPLAY_HISTORY others.
+typedef struct {
+    replay_retired entries[REPLAY_HISTORY];
+    int next;                   // Entry replaced next
+    int count;
+} replay_history;
+
+// Initializes an empty history.
+//
+// @param h The history.
+void replay_history_init(replay_history* h);
+
+// Remembers a session that is no longer tracked.
+//
+// @param h The history.
+// @param id The session id, at least REPLAY_ID_BYTES long.
+// @param w Its window.
+void replay_retire(replay_history* h, const unsigned char* id, const replay_window* w);
+
+// Initializes the window of a session starting to be tracked: empty if it
+// was never heard, otherwise rejecting everything up to the highest
+// sequence number it accepted.
+//
+// @param h The history.
+// @param id The session id, at least REPLAY_ID_BYTES long.
+// @param w The window.
+void replay_recall(const replay_history* h, const unsigned char* id, replay_window* w);
+
+// Writes a history to a file readable by its owner only, replacing it
+// atomically.
+//
+// @param h The history.
+// @param path The file.
+// @return 0 on success, or -1 on error.
+int replay_history_save(const replay_history* h, const char* path);
+
+// Reads a history written by replay_history_save.
+//
+// @param h The history, left empty if the file is missing or damaged.
+// @param path The file.
+// @return 0 on success, or -1 on error.
+int replay_history_load(replay_history* h, const char* path);
+
+#endif  // REPLAY_H_
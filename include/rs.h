@@ -0,0 +1,37 @@
+#ifndef RS_H_
+#define RS_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+
+// Systematic Reed-Solomon erasure code over GF(2^8): k data symbols of equal
+// length are sent as they are, followed by parity symbols, each a linear
+// combination of the data with coefficients from a Cauchy matrix. Any k of
+// the symbols rebuild the data, whichever were lost.
+#define RS_MAX_SYMBOLS 255      // Data and parity symbols of one block
+
+// Computes one parity symbol.
+//
+// @param data The k data symbols of len bytes, back to back.
+// @param k Number of data symbols.
+// @param len Length of a symbol.
+// @param row Index of the parity symbol (k + row at most RS_MAX_SYMBOLS).
+// @param out Buffer receiving the len bytes of the parity symbol.
+void rs_encode(const unsigned char* data, unsigned k, size_t len, unsigned row,
+               unsigned char* out);
+
+// Rebuilds missing data symbols from parity symbols.
+//
+// @param data The k data symbols back to back, missing ones rebuilt in place.
+// @param have Non-zero for each data symbol that was received.
+// @param k Number of data symbols.
+// @param len Length of a symbol.
+// @param parity Received parity symbols back to back.
+// @param rows Row of each parity symbol, as given to rs_encode.
+// @param count Number of parity symbols.
+// @return 0 on success, or -1 if fewer than k symbols are known in total or
+//         memory ran out.
+int rs_decode(unsigned char* data, const uint8_t* have, unsigned k, size_t len,
+              const unsigned char* parity, const uint8_t* rows, unsigned count);
+
+#endif  // RS_H_
@@ -7,38 +7,65 @@
 #include <unistd.h>   // UNIX standard functions (e.g., read, write)
 #include <fcntl.h>    // File control options (e.g., open)
 #include <termios.h>  // Terminal I/O interfaces (e.g., setting baud rate)
-#include <sys/select.h> // Functions for I/O multiplexing (e.g., select)
+#include <poll.h>     // Functions for I/O multiplexing (e.g., poll)
 #include <pthread.h>  // POSIX threads (e.g., thread creation and synchronization)
 
-// Constants for timeouts
-#define INIT_TIMEOUT 1      // Initial read timeout in seconds
-#define NORM_TIMEOUT 5000   // Normal read timeout in nanoseconds
+#define SERIAL_BAUD 230400  // Default line speed of the module, 8N1
+#define SER_BY_ID "/dev/serial/by-id"   // Stable names of USB serial adapters (udev)
+#define SER_MAX_PATH 256
+#define SER_PROBE_MS 300    // Wait for the answer to AT from a port autodetected
+
+// Ways of configuring the port, the best supported one is used by default
+typedef enum {
+    SER_POSIX = 0,    // termios, standard baud rates only
+    SER_LINUX         // termios2 with any baud rate, ASYNC_LOW_LATENCY, byte wise wakeups
+} ser_impl;
 
 // Opens a serial port for communication.
 //
 // @param serial_port Path to the serial port device (e.g., "/dev/ttyS0").
+// @param baud Line speed, 0 for SERIAL_BAUD. Module and host must agree
+//             (see AT+UART=BR).
 // @return File descriptor for the opened serial port, or -1 on error.
-int open_serial(char* serial_port);
+int open_serial(char* serial_port, unsigned baud);
 
-// Reads data from the serial port.
+// Writes all of a buffer to the serial port, waiting whenever its output
+// queue is full (the port may be non-blocking).
 //
 // @param serial_fd File descriptor for the serial port.
-// @param ms Timeout for read operation in milliseconds.
-// @param buf Buffer to store the read data.
-// @param len Length of the buffer.
-// @return Number of bytes read, or -1 on error.
-ssize_t read_serial(int serial_fd, size_t ms, unsigned char* buf, size_t len);
-
-// Reads data from the serial port that takes trigger to prematurely end read
-// that is thread safe.
+// @param buf Data to write.
+// @param len Length of the data.
+// @return Number of bytes written, or -1 on error.
+ssize_t write_serial(int serial_fd, const void* buf, size_t len);
+
+// Waits until the serial port has data to read, without reading it.
 //
 // @param serial_fd File descriptor for the serial port.
-// @param ms Timeout for read operation in milliseconds.
-// @param buf Buffer to store the read data.
-// @param len Length of the buffer.
-// @param trigger_fd File descriptor of pipe used to cancel read
-// @return Number of bytes read, or -1 on error.
-ssize_t read_serial_trigger(int serial_fd, size_t ms, unsigned char* buf, size_t len, 
-                            int trigger_fd);
+// @param ms Timeout in milliseconds, or -1 to wait forever.
+// @param trigger_fd File descriptor of pipe used to cancel the wait, or -1
+//                   for none. A cancel consumes one byte from the pipe.
+// @return 1 if data is ready, 0 on timeout or cancel, or -1 on error.
+int wait_serial(int serial_fd, int ms, int trigger_fd);
+
+// Finds the modules plugged in, by the USB serial adapters of the Wio-E5
+// boards listed in SER_BY_ID. Each is sent AT and kept only if a module
+// answers within SER_PROBE_MS.
+//
+// @param paths Receives up to max paths, sorted so that the order is stable.
+// @param max Size of paths.
+// @param baud Line speed of the modules, 0 for SERIAL_BAUD.
+// @return Number of paths found.
+int ser_autodetect(char paths[][SER_MAX_PATH], int max, unsigned baud);
+
+// Forces a backend for the ports opened afterwards, mainly for benchmarking.
+//
+// @param impl The backend to use.
+// @return 0 on success, or -1 if the system does not support it.
+int ser_use(ser_impl impl);
+
+// Gets the name of the backend in use (e.g., "linux").
+//
+// @return A static string.
+const char* ser_name(void);
 
 #endif  // SER_H_
@@ -0,0 +1,19 @@
+#ifndef SER_LINUX_H_
+#define SER_LINUX_H_
+
+// Linux serial backend used by ser.c. It lives in its own file because the
+// termios2 interface (asm/termbits.h) cannot be included together with the
+// termios.h that ser.h pulls in.
+
+// Configures an open port: raw 8N1 at any baud rate (BOTHER), a wakeup for
+// every byte (VMIN 1, VTIME 0), and ASYNC_LOW_LATENCY where the driver
+// supports it, which has USB serial adapters pass on each byte at once
+// instead of after their latency timer (16 ms on FTDI chips).
+//
+// @param fd File descriptor of the port.
+// @param baud Line speed in bits per second.
+// @return 1 if low latency mode is on, 0 if the driver does not offer it,
+//         or -1 on error.
+int ser_linux_configure(int fd, unsigned baud);
+
+#endif  // SER_LINUX_H_
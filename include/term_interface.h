@@ -13,6 +13,15 @@
 // Constants for terminal interface
 #define MAX_HISTORY_SIZE 10       // Maximum number of command history entries
 #define MAX_COMMAND_LENGTH 512    // Maximum length of a command
+#define TERM_SCROLLBACK 1000      // Printed lines kept to repaint the screen (Ctrl-L)
+#define TERM_QUEUE_LEN 256        // Lines printed from another thread waiting to be drawn
+#define TERM_FRAME_MS 16          // Shortest time between screen updates
+
+// The screen has one owner: the thread handling the keystrokes. It gathers
+// everything that changed since the last update (printed lines, edits of the
+// command line) into one write, at most once every TERM_FRAME_MS, and only
+// redraws the part of the command line that changed. Lines printed from any
+// other thread go through a lock-free single producer queue.
 
 // Opaque term struct used to represent term interface object
 typedef struct term term;
@@ -38,12 +47,58 @@ term* term_interface_async(int (*callback)(char*, void*),
                            int (*cleanup)(void*),
                            void* ptr);
 
-// Prints a string to the terminal interface.
+// Initializes the terminal interface without starting a thread. Keystrokes
+// are handled by calling term_input whenever stdin is readable (e.g., from
+// an event loop), so the callback runs on the caller's thread.
+//
+// @param callback Function pointer to a callback that will be invoked with
+//                 with a null terminated string.
+// @param ptr Additional parameter passed to the callback function.
+// @return Pointer to a `term` structure representing the terminal interface,
+//         or NULL on error.
+term* term_interface_attach(int (*callback)(char*, void*),
+                            int (*cleanup)(void*),
+                            void* ptr);
+
+// Processes the keystrokes available on stdin without blocking. Only valid
+// for a terminal interface created with term_interface_attach.
+//
+// @param info Pointer to a `term` structure representing the terminal interface.
+// @return 0 to keep going, 1 once the user has quit, or -1 on error.
+int term_input(term* info);
+
+// Prints a string to the terminal interface, above the command line. It is
+// copied and drawn with the next screen update. Safe to call from the owner
+// thread and from one other thread; lines that do not fit in the queue are
+// dropped.
 //
 // @param info Pointer to a `term` structure representing the terminal interface.
 // @param str String to be printed.
 void term_print(term* info, char* str);
 
+// Adds a command to the history recalled with the arrow keys, as if it had
+// been entered (e.g., from an earlier run). Owner thread only.
+//
+// @param info Pointer to a `term` structure representing the terminal interface.
+// @param command The command.
+void term_history_add(term* info, const char* command);
+
+// Gets a file descriptor that becomes readable when the screen needs an
+// update, for an event loop driving a terminal interface created with
+// term_interface_attach. term_flush clears it.
+//
+// @param info Pointer to a `term` structure representing the terminal interface.
+// @return The file descriptor.
+int term_wake_fd(term* info);
+
+// Updates the screen if anything changed and a frame is due. Owner thread
+// only (the one calling term_input).
+//
+// @param info Pointer to a `term` structure representing the terminal interface.
+// @return Milliseconds until the next update is due, or -1 if the screen is
+//         up to date.
+long term_flush(term* info);
+
 // Waits for the terminal interface to finish its operations and joins the thread.
 // Also cleans up memory used by the term object. The term object cannot be reused.
 //
@@ -0,0 +1,87 @@
+#ifndef TXQ_H_
+#define TXQ_H_
+
+#include <stddef.h>     // Standard definitions (e.g., size_t)
+#include <stdint.h>     // Fixed width integer types
+#include <stdatomic.h>  // C11 atomics for the lock-free indices
+
+// Constants for the send queue
+#define TXQ_LEN 32          // Number of queued packets (power of two)
+#define TXQ_PAYLOAD 255     // Largest packet a slot holds
+
+// Callback reporting the outcome of a queued packet.
+//
+// @param status 0 if the packet left the air, or -1 on error.
+// @param arg The pointer given when the packet was queued.
+typedef void (*txq_done)(int status, void* arg);
+
+// One queued packet, owned by the consumer between txq_peek and txq_release
+typedef struct {
+    atomic_size_t seq;                  // Slot sequence number (see txq.c)
+    size_t len;
+    txq_done done;
+    void* arg;
+    uint64_t stamp;                     // Given by the producer, e.g. when it was queued
+    unsigned char data[TXQ_PAYLOAD];
+} txq_cell;
+
+// Bounded lock-free queue with many producers and a single consumer
+typedef struct {
+    txq_cell cells[TXQ_LEN];
+    _Alignas(64) atomic_size_t enqueue_pos; // Shared by producers
+    _Alignas(64) size_t dequeue_pos;        // Owned by the consumer
+} txq;
+
+// Initializes an empty queue.
+//
+// @param q The queue.
+void txq_init(txq* q);
+
+// Claims a slot for a packet, e.g. to make sure of room before producing
+// it. Thread safe and never blocks. The consumer waits at the slot until it
+// is filled with txq_commit, which must follow right away.
+//
+// @param q The queue.
+// @return The slot, or NULL if the queue is full.
+txq_cell* txq_reserve(txq* q);
+
+// Fills a slot claimed with txq_reserve and hands it to the consumer.
+//
+// @param cell The slot.
+// @param data The packet.
+// @param len Length of the packet (at most TXQ_PAYLOAD), or 0 to give the
+//            slot back (the consumer skips it).
+// @param done Callback for the outcome, may be NULL.
+// @param arg Additional parameter passed to the callback.
+// @param stamp Kept with the packet for the consumer.
+// @return 0 on success, or -1 if the packet is too long (the slot is then
+//         given back).
+int txq_commit(txq_cell* cell, const unsigned char* data, size_t len, txq_done done, void* arg,
+               uint64_t stamp);
+
+// Copies a packet into the queue. Thread safe and never blocks.
+//
+// @param q The queue.
+// @param data The packet.
+// @param len Length of the packet (at most TXQ_PAYLOAD).
+// @param done Callback for the outcome, may be NULL.
+// @param arg Additional parameter passed to the callback.
+// @param stamp Kept with the packet for the consumer.
+// @return 0 on success, or -1 if the queue is full or the packet too long.
+int txq_push(txq* q, const unsigned char* data, size_t len, txq_done done, void* arg,
+             uint64_t stamp);
+
+// Gets the oldest packet without removing it. Consumer only.
+//
+// @param q The queue.
+// @return The packet, or NULL if the queue is empty.
+txq_cell* txq_peek(txq* q);
+
+// Reports the outcome of the packet returned by txq_peek and frees its slot.
+// Consumer only.
+//
+// @param q The queue.
+// @param status Passed to the packet's callback.
+void txq_release(txq* q, int status);
+
+#endif  // TXQ_H_
@@ -2,6 +2,9 @@
 #define WIOE_H_
 
 #include "ser.h"  // Include serial communication functions
+#include "hist.h" // Latency histograms
+#include "frame.h" // Packet buffers with room for headers
+#include "txq.h"   // Send queue slots
 #include <sodium.h>
 
 // Forward declaration of wioe structure
@@ -18,8 +21,129 @@ typedef struct {
     unsigned char crc;               // CRC enable/disable flag
     unsigned char inverted_iq;       // IQ inversion flag
     unsigned char public_lorawan;    // Public LoRaWAN flag
+    unsigned baud;                   // Serial line speed, 0 for SERIAL_BAUD
 } wioe_params;
 
+// Largest payload accepted by AT+TEST=TXLRPKT in bytes
+#define WIOE_MAX_PAYLOAD 255
+
+// Encrypted packets start with a header authenticated along with the data:
+// a byte with the format version (top 3 bits) and flags, the sender's
+// session id if WIOE_FLAG_SESSION is set, and the packet's sequence number
+// as a varint. Each session seals with its own key, a hash of the shared key
+// and its random 128 bit id, so the sequence number alone is the nonce and
+// is never reused even by many nodes sharing the passphrase. The session id
+// goes out with the first packets of a session and then every
+// WIOE_ANNOUNCE_EVERY packets.
+#define WIOE_VERSION 2
+#define WIOE_FLAG_COMPRESSED 0x01   // The plaintext was shrunk by compress_bytes
+#define WIOE_FLAG_SESSION 0x02      // The session id follows the first byte
+#define WIOE_FLAG_EPHEMERAL 0x04    // Sealed with a key agreed by handshake.h, not the passphrase key
+#define WIOE_SESSION_BYTES 16
+#define WIOE_SEQ_BYTES 3            // Longest varint, a new session starts before more are needed
+#define WIOE_MAX_HEADER (1 + WIOE_SESSION_BYTES + WIOE_SEQ_BYTES)
+#define WIOE_ANNOUNCE 8             // Packets at the start of a session carrying its id
+#define WIOE_ANNOUNCE_EVERY 32
+#define WIOE_PEERS 4                // Sender sessions tracked by default, see wioe_set_peers
+#define WIOE_MAX_PEERS 256          // At least one per node of a mesh (mesh.h)
+
+// Largest plaintext that fits in one encrypted packet
+#define WIOE_MAX_PLAINTEXT (WIOE_MAX_PAYLOAD - WIOE_MAX_HEADER - crypto_aead_chacha20poly1305_ABYTES)
+
+// Structure to hold what compression saved on encrypted sends
+typedef struct {
+    unsigned long packets;          // Encrypted packets sent
+    unsigned long compressed;       // Packets sent compressed
+    unsigned long bytes_in;         // Plaintext bytes
+    unsigned long bytes_out;        // Plaintext bytes after compression
+    unsigned long airtime_saved_us; // Time on air saved with the current parameters
+} wioe_compress_stats;
+
+// Structure to hold what the sequence numbers of received packets revealed
+typedef struct {
+    unsigned long received;     // Packets accepted
+    unsigned long lost;         // Sequence numbers never received
+    unsigned long reordered;    // Packets received after a later one
+    unsigned long replayed;     // Packets rejected as already received
+    unsigned long rejected;     // Packets failing authentication
+} wioe_link_stats;
+
+// Structure to hold what was seen of a signal measure (RSSI or SNR)
+typedef struct {
+    unsigned long count;    // Packets measured
+    int min;
+    int max;
+    int last;
+    double mean;
+} wioe_signal_stats;
+
+// Structure to hold everything the device measured. Latencies are in
+// microseconds.
+typedef struct {
+    unsigned long tx_packets;       // Packets that left the air
+    unsigned long tx_bytes;
+    unsigned long tx_errors;        // Sends rejected by the module or never confirmed
+    unsigned long rx_packets;       // Packets received, authentic or not
+    unsigned long rx_bytes;
+    unsigned long timeouts;         // Commands left without a response
+    unsigned long cancelled;        // Reads cancelled with wioe_cancel_recieve
+    unsigned long decrypt_failures; // Packets failing authentication or decompression
+    wioe_signal_stats rssi;         // In dBm
+    wioe_signal_stats snr;          // In dB
+    hist_stats at_rtt;              // Command written to its echo
+    hist_stats tx_time;             // TXLRPKT written to TX DONE
+    hist_stats send_latency;        // Send queued to TX DONE, queueing included
+    hist_stats airtime;             // Predicted time on air of the same packets as tx_time
+    unsigned long airtime_us;       // Predicted time on air of all packets sent
+    unsigned long tx_time_us;       // Measured TXLRPKT to TX DONE of all packets sent
+    unsigned long duty_delays;      // Sends held back by the duty cycle
+    unsigned long duty_delay_us;    // Time they were held back
+    wioe_compress_stats compress;
+    wioe_link_stats link;
+} wioe_stats;
+
+// Events reported by wioe_poll for event driven use of the device
+typedef enum {
+    WIOE_EV_RX = 1,   // A packet was received
+    WIOE_EV_TX_DONE,  // The transmission started by wioe_tx_start left the air
+    WIOE_EV_UPDATED,  // The configuration given to wioe_update_start took effect
+    WIOE_EV_ERROR     // The module rejected the last command
+} wioe_event_type;
+
+// Structure to hold an event produced by wioe_poll
+typedef struct {
+    wioe_event_type type;                 // What happened
+    size_t len;                           // Length of data for WIOE_EV_RX
+    int rssi;                             // Signal strength in dBm for WIOE_EV_RX
+    int snr;                              // Signal to noise ratio in dB for WIOE_EV_RX
+    unsigned char data[WIOE_MAX_PAYLOAD]; // Received packet for WIOE_EV_RX
+} wioe_event;
+
+// Callback reporting the outcome of a send queued with wioe_send_async,
+// called from the thread running wioe_send_pump and wioe_poll
+//
+// @param status 0 once the packet left the air, or -1 on error
+// @param arg The pointer given when the send was queued
+typedef void (*wioe_send_cb)(int status, void* arg);
+
+// Callback receiving packets in persistent receive mode, called from the
+// thread running wioe_poll
+//
+// @param data The received packet
+// @param len Length of the packet
+// @param rssi Signal strength in dBm
+// @param snr Signal to noise ratio in dB
+// @param arg The pointer given to wioe_rx_persistent
+typedef void (*wioe_rx_cb)(const unsigned char* data, size_t len, int rssi, int snr, void* arg);
+
+// Callback receiving packets decoded into frames, see wioe_rx_frames
+//
+// @param f The received packet, now owned by the callback
+// @param rssi Signal strength in dBm
+// @param snr Signal to noise ratio in dB
+// @param arg The pointer given to wioe_rx_frames
+typedef void (*wioe_rx_frame_cb)(frame* f, int rssi, int snr, void* arg);
+
 // Constants for LoRa communication parameters
 enum {
     MAXFREQ = 928,   // Maximum frequency in MHz
@@ -55,6 +179,16 @@ wioe* wioe_init(wioe_params* params, char* serial_port);
 // @return 0 on success, or a non-zero value on error.
 int wioe_update(wioe* device, wioe_params* params);
 
+// Starts updating the configuration without waiting for the module to
+// accept it, which is reported by wioe_poll as WIOE_EV_UPDATED (or
+// WIOE_EV_ERROR). Transmissions wait until then, see wioe_tx_busy.
+//
+// @param device The initialized wioe device
+// @param params The new configuration
+// @return 0 on success, or a non-zero value on invalid params, while
+//         transmitting, or on error.
+int wioe_update_start(wioe* device, const wioe_params* params);
+
 // Sends data through the Wio-E5 device
 //
 // @param device The initialized wioe device
@@ -94,6 +228,295 @@ int wioe_recieve_encrypted(wioe* device, unsigned char* buf, size_t len, const u
 // @param device The initialized wioe device
 void wioe_cancel_recieve(wioe* device);
 
+// Compresses data when that makes it shorter, then encrypts it with
+// ChaCha20-Poly1305 into a packet ready for sending, using the next
+// sequence number of the device's session
+//
+// @param device The initialized wioe device
+// @param out Buffer receiving header, ciphertext and tag
+// @param out_len The size of out
+// @param data The data to be encrypted
+// @param len Len in bytes of the data to be encrypted
+// @param key The encryption key being used of len crypto_aead_chacha20poly1305_KEYBYTES
+// @return the length of the packet, or -1 if it does not fit in out
+ssize_t wioe_seal(wioe* device, unsigned char* out, size_t out_len, const unsigned char* data,
+                  size_t len, const unsigned char* key);
+
+// Seals the data held by a frame in place: the header is pushed into its
+// headroom and the tag appended, and the data is compressed and encrypted
+// where it is. Needs WIOE_MAX_HEADER bytes of headroom and
+// crypto_aead_chacha20poly1305_ABYTES of tailroom.
+//
+// @param device The initialized wioe device
+// @param f The frame, holding the packet on success
+// @param key The encryption key being used of len crypto_aead_chacha20poly1305_KEYBYTES
+// @param ephemeral Non-zero if key was agreed by a handshake, see WIOE_FLAG_EPHEMERAL
+// @return the length of the packet, or -1 if the data is too long
+ssize_t wioe_seal_frame(wioe* device, frame* f, const unsigned char* key, int ephemeral);
+
+// Opens a packet held by a frame in place like wioe_open: header and tag
+// are stripped and the plaintext is left where the ciphertext was
+//
+// @param device The initialized wioe device
+// @param f The frame, holding the plaintext on success
+// @param key The passphrase key of len crypto_aead_chacha20poly1305_KEYBYTES
+// @param ephemeral_key The key for packets with WIOE_FLAG_EPHEMERAL, NULL to reject them
+// @return the length of the plaintext, or -1 if the packet is forged, replayed
+//         or malformed
+ssize_t wioe_open_frame(wioe* device, frame* f, const unsigned char* key,
+                        const unsigned char* ephemeral_key);
+
+// Decrypts and authenticates a packet produced by wioe_seal, rejecting
+// replays and decompressing it if needed
+//
+// @param device The initialized wioe device
+// @param out Buffer receiving the plaintext
+// @param out_len The size of out
+// @param pkt The received packet
+// @param len Len in bytes of the received packet
+// @param key The encryption key being used of len crypto_aead_chacha20poly1305_KEYBYTES
+// @return the length of the plaintext, or -1 if the packet is forged, replayed
+//         or does not fit
+ssize_t wioe_open(wioe* device, unsigned char* out, size_t out_len, const unsigned char* pkt,
+                  size_t len, const unsigned char* key);
+
+// Gets the signal of the last packet received
+//
+// @param device The initialized wioe device
+// @param rssi Receives the signal strength in dBm
+// @param snr Receives the signal to noise ratio in dB
+// @return 0 on success, or -1 if nothing was received yet
+int wioe_last_signal(wioe* device, int* rssi, int* snr);
+
+// Gets what compression saved on the packets sent with wioe_send_encrypted
+// and wioe_send_encrypted_async
+//
+// @param device The initialized wioe device
+// @param stats Receives the counters
+void wioe_get_compress_stats(wioe* device, wioe_compress_stats* stats);
+
+// Gets loss, reordering and replay counters over all tracked senders
+//
+// @param device The initialized wioe device
+// @param stats Receives the counters
+void wioe_get_link_stats(wioe* device, wioe_link_stats* stats);
+
+// Sets how many sender sessions get their own replay window. When more
+// send, the least recently heard is evicted and remembered by replay_history,
+// so its old packets stay rejected but new ones are accepted only once it
+// announces its session again. A mesh, where every node is heard directly or
+// forwarded, needs a session per node and senders announcing on every packet.
+//
+// @param device The initialized wioe device
+// @param count Sessions tracked, 1 to WIOE_MAX_PEERS
+// @param announce_all Non-zero to send the session id with every packet
+//                     instead of every WIOE_ANNOUNCE_EVERY packets
+// @return 0 on success, or -1 if count is out of range.
+int wioe_set_peers(wioe* device, int count, int announce_all);
+
+// Saves the sessions heard to a file, so that after a restart
+// wioe_load_sessions keeps their packets from being accepted again
+//
+// @param device The initialized wioe device
+// @param path The file
+// @return 0 on success, or -1 on error.
+int wioe_save_sessions(wioe* device, const char* path);
+
+// Reads the sessions saved by wioe_save_sessions. Call before receiving.
+//
+// @param device The initialized wioe device
+// @param path The file
+// @return 0 on success, or -1 if the file is missing or damaged.
+int wioe_load_sessions(wioe* device, const char* path);
+
+// Gets all counters and a summary of the latency histograms. Counters and
+// histograms may be read from any thread, signal and link statistics are
+// updated by the receiving thread.
+//
+// @param device The initialized wioe device
+// @param stats Receives the statistics
+void wioe_get_stats(wioe* device, wioe_stats* stats);
+
+// Event driven interface: instead of blocking, the caller watches wioe_fd for
+// input (e.g., with a reactor) and calls wioe_poll until it returns 0. These
+// must not be mixed with the blocking send and recieve functions.
+
+// Gets the file descriptor of the serial port to watch for input
+//
+// @param device The initialized wioe device
+// @return the serial file descriptor
+int wioe_fd(wioe* device);
+
+// Gets the read end of the pipe written by wioe_cancel_recieve so that a
+// cancel can be watched for alongside the serial port
+//
+// @param device The initialized wioe device
+// @return the cancel file descriptor
+int wioe_cancel_fd(wioe* device);
+
+// Consumes pending cancel requests made with wioe_cancel_recieve
+//
+// @param device The initialized wioe device
+// @return 1 if a cancel was pending, 0 otherwise
+int wioe_cancel_clear(wioe* device);
+
+// Puts the module in receive mode without waiting for its response. Does
+// nothing if it is already listening.
+//
+// @param device The initialized wioe device
+// @return 0 on success, or a non-zero value on error.
+int wioe_rx_start(wioe* device);
+
+// Keeps the module in receive mode: it only leaves for transmissions and
+// re-enters as soon as the last queued one is done (or the configuration
+// changed), without waiting for the caller. Packets go to cb as wioe_poll
+// parses them instead of being returned as WIOE_EV_RX events.
+//
+// @param device The initialized wioe device
+// @param on Non-zero to enable, 0 to go back to explicit wioe_rx_start calls
+// @param cb Callback receiving packets, or NULL to keep WIOE_EV_RX events
+// @param arg Additional parameter passed to the callback
+// @return 0 on success, or a non-zero value on error.
+int wioe_rx_persistent(wioe* device, int on, wioe_rx_cb cb, void* arg);
+
+// Like wioe_rx_persistent, with each packet decoded from the serial input
+// straight into a frame taken from a pool and handed over to cb. Packets
+// arriving while the pool is empty are dropped.
+//
+// @param device The initialized wioe device
+// @param pool Pool the frames come from, used by the thread running wioe_poll
+// @param cb Callback receiving the frames
+// @param arg Additional parameter passed to the callback
+// @return 0 on success, or a non-zero value on error.
+int wioe_rx_frames(wioe* device, frame_pool* pool, wioe_rx_frame_cb cb, void* arg);
+
+// Starts sending data without waiting for it to leave the air, which is
+// reported by wioe_poll as WIOE_EV_TX_DONE. Leaves receive mode.
+//
+// @param device The initialized wioe device
+// @param data The data to be sent
+// @param len Len in bytes of the data to be sent
+// @return 0 on success, or a non-zero value on error.
+int wioe_tx_start(wioe* device, const unsigned char* data, size_t len);
+
+// Queues data for sending and returns immediately. The send happens once the
+// thread that owns the radio runs wioe_send_pump. Thread safe and lock-free.
+//
+// @param device The initialized wioe device
+// @param data The data to be sent
+// @param len Len in bytes of the data to be sent
+// @param done Callback for the outcome of the send, may be NULL
+// @param arg Additional parameter passed to the callback
+// @return 0 on success, or a non-zero value if the queue is full.
+int wioe_send_async(wioe* device, const unsigned char* data, size_t len,
+                    wioe_send_cb done, void* arg);
+
+// Claims room in the send queue for one packet. Sealing uses up a sequence
+// number the receiver counts as lost if the packet never leaves, so a
+// packet is sealed once it is sure to be queued. The slot must be filled
+// with wioe_send_commit right away, sends queued after it wait until then.
+//
+// @param device The initialized wioe device
+// @return The slot, or NULL if the queue is full.
+txq_cell* wioe_send_reserve(wioe* device);
+
+// Queues a packet into a slot claimed with wioe_send_reserve, like
+// wioe_send_async
+//
+// @param device The initialized wioe device
+// @param slot The slot
+// @param data The data to be sent
+// @param len Len in bytes of the data to be sent, or 0 to give the slot back
+// @param done Callback for the outcome of the send, may be NULL
+// @param arg Additional parameter passed to the callback
+// @return 0 on success, or a non-zero value if nothing was queued.
+int wioe_send_commit(wioe* device, txq_cell* slot, const unsigned char* data, size_t len,
+                     wioe_send_cb done, void* arg);
+
+// Encrypts data on the calling thread and queues it like wioe_send_async
+//
+// @param device The initialized wioe device
+// @param data The data to be sent
+// @param len Len in bytes of the data to be sent
+// @param key The encryption key being used of len crypto_aead_chacha20poly1305_KEYBYTES
+// @param done Callback for the outcome of the send, may be NULL
+// @param arg Additional parameter passed to the callback
+// @return 0 on success, or a non-zero value on error.
+int wioe_send_encrypted_async(wioe* device, const char* data, size_t len,
+                              const unsigned char* key, wioe_send_cb done, void* arg);
+
+// Gets an eventfd that becomes readable whenever a send is queued, so the
+// thread that owns the radio knows to call wioe_send_pump
+//
+// @param device The initialized wioe device
+// @return the event file descriptor
+int wioe_send_fd(wioe* device);
+
+// Starts the next queued send if the radio is not already transmitting
+// and the duty cycle allows it. Must only be called by the thread that
+// owns the radio.
+//
+// @param device The initialized wioe device
+// @return 1 if a transmission is in progress, 0 if the queue is empty or
+//         the next send must wait (see wioe_tx_wait_ms), or -1 on error
+int wioe_send_pump(wioe* device);
+
+// Checks whether a transmission started by wioe_tx_start, or a configuration
+// change started by wioe_update_start, is in progress
+//
+// @param device The initialized wioe device
+// @return 1 if busy, 0 otherwise
+int wioe_tx_busy(wioe* device);
+
+// Gets the time a transmission may take before WIOE_EV_TX_DONE: its
+// predicted time on air plus the time for the command and the response to
+// cross the serial line and be processed. For a configuration change only
+// the latter counts.
+//
+// @param device The initialized wioe device
+// @return the timeout in milliseconds for the last transmission or
+//         configuration change started
+long wioe_tx_timeout_ms(wioe* device);
+
+// Predicts the time a packet occupies the air with the current parameters
+//
+// @param device The initialized wioe device
+// @param len Len in bytes of the packet
+// @return the time on air in microseconds
+uint32_t wioe_airtime_us(wioe* device, size_t len);
+
+// Limits the share of time the radio spends transmitting. Sends queued with
+// wioe_send_async wait in the queue and wioe_send_bytes sleeps until the
+// budget allows them.
+//
+// @param device The initialized wioe device
+// @param ratio Share of the time on air allowed (e.g., 0.01 for 1%), 0 for
+//              no limit
+// @param window_ms Period over which the ratio is measured, which bounds
+//                  the longest burst
+void wioe_set_duty_cycle(wioe* device, double ratio, uint32_t window_ms);
+
+// Gets how long the next queued send must wait for the duty cycle
+//
+// @param device The initialized wioe device
+// @return milliseconds to wait, 0 if nothing waits for the duty cycle
+long wioe_tx_wait_ms(wioe* device);
+
+// Abandons a transmission whose WIOE_EV_TX_DONE never arrived, failing
+// its queued send if it came from wioe_send_pump, or a configuration change
+// never confirmed, keeping the previous configuration
+//
+// @param device The initialized wioe device
+void wioe_tx_abort(wioe* device);
+
+// Processes serial input without blocking
+//
+// @param device The initialized wioe device
+// @param ev Filled in with the next event
+// @return 1 if ev was filled, 0 if no complete event is available yet,
+//         or -1 on a serial error
+int wioe_poll(wioe* device, wioe_event* ev);
+
 // Checks if the Wio-E5 device is valid and properly initialized
 //
 // @return 0 if invalid, 1 if valid
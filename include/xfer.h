@@ -0,0 +1,167 @@
+#ifndef XFER_H_
+#define XFER_H_
+
+#include <stddef.h>   // Standard definitions (e.g., size_t)
+#include <stdint.h>   // Fixed width integer types
+#include <sodium.h>   // BLAKE2b and SipHash
+
+// File transfer over the link: a file is split into chunks sent as
+// messages, next to chat messages (which are printable text, so the first
+// byte XFER_MAGIC tells them apart). Messages carry [XFER_MAGIC][op][...],
+// numbers little endian:
+//
+//   OFFER      [hash 32][size 8][chunk size 2][name], the hash being the
+//              BLAKE2b-256 of the whole file
+//   CHUNK      [tag 4][flags 1][mac 8][index 4][data], the tag being the
+//              start of the file hash and the mac a SipHash of the index
+//              and data keyed with the file hash
+//   STATUS     [tag 4][flags 1][base 4][bitmap], the chunks the receiver
+//              has from the first one it misses, XFER_WINDOW of them, or
+//              that it has the whole file (XFER_DONE), takes no files
+//              (XFER_REFUSED) or needs the offer again (XFER_UNKNOWN)
+//
+// The receiver answers an OFFER with a STATUS, and the sender sends the
+// chunks missing from its window, the last one flagged. The receiver sends
+// the next STATUS when that one arrives or when chunks stop coming for
+// XFER_IDLE_MS; the sender offers again when no STATUS came for a while.
+// The receiver keeps the chunks in name.part and its bitmap in name.xfer,
+// so an interrupted transfer, even by a restart of either side, resumes
+// with the chunks missing. Once all are there, the file is checked against
+// the hash before being renamed to name. One file is sent and one received
+// at a time.
+#define XFER_MAGIC 0x01
+#define XFER_OFFER 1
+#define XFER_CHUNK 2
+#define XFER_STATUS 3
+#define XFER_LAST 0x01              // CHUNK flag: the last one sent of the window
+#define XFER_DONE 0x01              // STATUS flags
+#define XFER_REFUSED 0x02
+#define XFER_UNKNOWN 0x04           // Chunks came for a file not offered (e.g., after a restart)
+#define XFER_HASH 32
+#define XFER_TAG 4
+#define XFER_MAC 8
+#define XFER_CHUNK_HEADER (2 + XFER_TAG + 1 + XFER_MAC + 4)
+#define XFER_WINDOW 256             // Chunks acknowledged by a STATUS
+#define XFER_STATUS_LEN (2 + XFER_TAG + 1 + 4 + XFER_WINDOW / 8)
+#define XFER_MAX_NAME 64
+#define XFER_MAX_SIZE (64L << 20)   // Largest file accepted
+#define XFER_IDLE_MS 2000           // Silence after which the receiver reports
+#define XFER_RETRY_MS 4000          // Silence after which the sender offers again
+#define XFER_SAVE_CHUNKS 8          // Chunks between saves of the bitmap
+#define XFER_TRIES 8                // Offers without an answer before giving up
+#define XFER_PROGRESS_MS 5000       // Between progress reports
+
+// Callback queuing a message for the peer.
+//
+// @param msg The message.
+// @param len Length of the message.
+// @param arg The pointer given to xfer_init.
+// @return 0 on success, or -1 if there is no room now (it is tried again
+//         from xfer_poll).
+typedef int (*xfer_send_cb)(const unsigned char* msg, size_t len, void* arg);
+
+// Callback reporting progress and outcomes as a line of text.
+//
+// @param text The line.
+// @param arg The pointer given to xfer_init.
+typedef void (*xfer_note_cb)(const char* text, void* arg);
+
+// Transfer state for the link with a single peer
+typedef struct {
+    xfer_send_cb send;
+    xfer_note_cb note;
+    void* arg;
+    size_t chunk;                       // Chunk size of the files sent
+    double link_rate;                   // Bytes per second the link carries at best
+    const char* dir;                    // Where received files go, NULL to refuse them
+    // Sending
+    int sending;
+    char name[XFER_MAX_NAME + 1];
+    const unsigned char* map;           // The file, mapped
+    uint64_t size;
+    uint32_t count;                     // Chunks
+    unsigned char hash[XFER_HASH];
+    uint32_t base;                      // Window of the last STATUS
+    uint8_t need[XFER_WINDOW / 8];      // Chunks of the window still to send
+    uint32_t next;                      // Next chunk of the window to consider
+    uint32_t last;                      // Last chunk of the window to send
+    uint32_t acked;                     // Chunks the receiver has, at least
+    long started_ms;
+    long deadline;                      // Offer again if no STATUS by then
+    int tries;
+    int offered;                        // An offer is waiting for its STATUS
+    long progress_ms;
+    long round_ms;                      // When the last STATUS came
+    size_t round_bytes;                 // Bytes queued since the last STATUS
+    uint32_t round_chunks;              // Chunks queued since the last STATUS
+    // Receiving
+    int receiving;
+    char rx_name[XFER_MAX_NAME + 1];
+    int part_fd;                        // Chunks received so far
+    int state_fd;                       // Bitmap of them
+    unsigned char rx_hash[XFER_HASH];
+    uint64_t rx_size;
+    uint32_t rx_chunk;
+    uint32_t rx_count;
+    uint32_t rx_have;                   // Chunks in the bitmap
+    uint8_t* bitmap;
+    long rx_started_ms;
+    long last_chunk_ms;
+    int unreported;                     // Chunks since the last STATUS
+    long unknown_ms;                    // Last XFER_UNKNOWN sent
+    unsigned char done_hash[XFER_HASH]; // Last file completed, for repeated offers
+    // Statistics
+    unsigned long files_sent;
+    unsigned long files_received;
+    unsigned long chunks_sent;
+    unsigned long chunks_rejected;      // Failed their mac
+} xfer;
+
+// Initializes the transfer state.
+//
+// @param x The transfer state.
+// @param max_msg Longest message to send, a chunk and its header.
+// @param dir Directory receiving files, NULL to refuse them.
+// @param send Callback queuing messages.
+// @param note Callback reporting progress.
+// @param arg Additional parameter passed to the callbacks.
+void xfer_init(xfer* x, size_t max_msg, const char* dir, xfer_send_cb send, xfer_note_cb note,
+               void* arg);
+
+// Sets the rate of the link for the goodput reports.
+//
+// @param x The transfer state.
+// @param bytes_per_s Payload the link carries when sending back to back.
+void xfer_rate(xfer* x, double bytes_per_s);
+
+// Starts sending a file, replacing any file being sent.
+//
+// @param x The transfer state.
+// @param path The file.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the file cannot be read or is too large.
+int xfer_start(xfer* x, const char* path, long now_ms);
+
+// Handles a message starting with XFER_MAGIC.
+//
+// @param x The transfer state.
+// @param msg The message.
+// @param len Length of the message.
+// @param now_ms Current monotonic time in milliseconds.
+// @return 0 on success, or -1 if the message is malformed or unexpected.
+int xfer_recv(xfer* x, const unsigned char* msg, size_t len, long now_ms);
+
+// Queues what can be sent and runs the timers.
+//
+// @param x The transfer state.
+// @param now_ms Current monotonic time in milliseconds.
+// @return Milliseconds until the next deadline, or -1 if nothing is running.
+//         Chunks that found no room are tried again at the next call.
+long xfer_poll(xfer* x, long now_ms);
+
+// Stops both directions, keeping what was received for a later resume.
+//
+// @param x The transfer state.
+void xfer_free(xfer* x);
+
+#endif  // XFER_H_
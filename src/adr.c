@@ -0,0 +1,187 @@
+#include "adr.h"
+#include "airtime.h"
+#include <string.h>
+
+// States of the negotiation
+enum { ADR_IDLE, ADR_PROPOSED, ADR_ACCEPTING, ADR_VERIFY };
+
+// Structure to hold a spreading factor and bandwidth pair
+typedef struct {
+    unsigned char sf;
+    unsigned short bw;
+} adr_rate;
+
+// Rates from fastest to slowest, which is also from least to most sensitive
+static const adr_rate rates[] = {
+    { 7, 500 }, { 8, 500 }, { 7, 250 }, { 9, 500 }, { 8, 250 }, { 7, 125 },
+    { 10, 500 }, { 9, 250 }, { 8, 125 }, { 11, 500 }, { 10, 250 }, { 9, 125 },
+    { 12, 500 }, { 11, 250 }, { 10, 125 }, { 12, 250 }, { 11, 125 }, { 12, 125 },
+};
+
+#define RATES ((int) (sizeof(rates) / sizeof(rates[0])))
+
+// Lowest SNR the SX126x demodulates per spreading factor, in tenths of dB
+static const int snr_floor[] = { -75, -100, -125, -150, -175, -200 };
+
+// Noise grows 3 dB each time the bandwidth doubles
+static int bw_step(unsigned bw) {
+    return bw == 500 ? 2 : bw == 250 ? 1 : 0;
+}
+
+// SNR margin at a rate, in tenths of dB, from the SNR measured at the current rate
+static int margin(const adr* a, int snr10, int r) {
+    int gain = 30 * (bw_step(rates[a->rate].bw) - bw_step(rates[r].bw));
+    return snr10 + gain - snr_floor[rates[r].sf - 7];
+}
+
+// Time allowed for a few full frames at the slower of two rates
+static long timeout_ms(const adr* a, int r1, int r2) {
+    const adr_rate* r = &rates[r1 > r2 ? r1 : r2];
+    return 4L * airtime_us(r->sf, r->bw, a->preamble, a->crc, 255) / 1000 + 500;
+}
+
+// Fastest rate the measured SNR supports, or the current one if unsure
+static int choose(const adr* a) {
+    if (a->samples < ADR_MIN_SAMPLES) { return a->rate; }
+    int n = a->samples < ADR_SAMPLES ? a->samples : ADR_SAMPLES;
+    int sum = 0;
+    for (int i = 0; i < n; ++i) { sum += a->snr[i]; }
+    int snr10 = sum * 10 / n;
+    for (int r = 0; r < RATES; ++r) {
+        // Going faster needs some extra margin so the link does not flap
+        int need = 10 * a->margin_db + (r < a->rate ? 30 : 0);
+        if (margin(a, snr10, r) >= need) { return r; }
+    }
+    return RATES - 1;
+}
+
+static int send_op(adr* a, int op, int rate) {
+    unsigned char frame[ADR_FRAME] = { (unsigned char) op, a->token, (unsigned char) rate };
+    if (a->send(frame, sizeof(frame), a->arg) != 0) { return -1; }
+    a->queued++;
+    return 0;
+}
+
+// Switches the radio, readings taken at the old rate no longer apply
+static void switch_to(adr* a, int rate) {
+    a->prev = a->rate;
+    a->rate = rate;
+    a->samples = 0;
+    a->sample_pos = 0;
+    a->apply(rates[rate].sf, rates[rate].bw, a->arg);
+}
+
+int adr_init(adr* a, unsigned sf, unsigned bw, unsigned preamble, int crc, int margin_db,
+             adr_send_cb send, adr_apply_cb apply, void* arg) {
+    memset(a, 0, sizeof(*a));
+    a->home = -1;
+    for (int r = 0; r < RATES; ++r) {
+        if (rates[r].sf == sf && rates[r].bw == bw) { a->home = r; }
+    }
+    if (a->home < 0) { return -1; }
+    a->rate = a->prev = a->home;
+    a->hold_ms = ADR_HOLD_MS;
+    a->margin_db = margin_db;
+    a->preamble = preamble;
+    a->crc = crc;
+    a->send = send;
+    a->apply = apply;
+    a->arg = arg;
+    return 0;
+}
+
+void adr_sample(adr* a, int snr, long now_ms) {
+    a->snr[a->sample_pos] = snr;
+    a->sample_pos = (a->sample_pos + 1) % ADR_SAMPLES;
+    a->samples++;
+    a->last_heard = now_ms;
+    // Hearing the peer at the new rate confirms the switch
+    if (a->state == ADR_VERIFY) {
+        a->state = ADR_IDLE;
+        a->changes++;
+        a->hold_ms = ADR_HOLD_MS;
+        a->hold_until = now_ms + a->hold_ms;
+    }
+}
+
+int adr_recv(adr* a, const unsigned char* frame, size_t len, long now_ms) {
+    if (len < ADR_FRAME || frame[2] >= RATES) { return -1; }
+    int op = frame[0];
+    uint8_t token = frame[1];
+    int rate = frame[2];
+    if (op == ADR_PROPOSE) {
+        // Settle on the slower of both views of the link, a proposal of our
+        // own crossing this one is dropped
+        int own = choose(a);
+        int agreed = rate > own ? rate : own;
+        a->token = token;
+        a->state = ADR_IDLE;
+        a->hold_until = now_ms + a->hold_ms;
+        if (send_op(a, ADR_ACCEPT, agreed) != 0 || agreed == a->rate) { return 0; }
+        a->target = agreed;
+        a->state = ADR_ACCEPTING;
+        a->switch_after = a->queued;
+    } else if (op == ADR_ACCEPT && a->state == ADR_PROPOSED && token == a->token) {
+        a->hold_until = now_ms + a->hold_ms;
+        if (rate == a->rate) {
+            a->state = ADR_IDLE;
+            return 0;
+        }
+        switch_to(a, rate);
+        a->state = ADR_VERIFY;
+        a->deadline = now_ms + timeout_ms(a, a->rate, a->prev);
+        send_op(a, ADR_PROBE, rate);
+    } else if (op == ADR_PROBE) {
+        send_op(a, ADR_PROBE_ACK, a->rate);
+    }
+    return 0;
+}
+
+void adr_sent(adr* a, int status, long now_ms) {
+    if (a->queued > 0) { a->queued--; }
+    if (a->switch_after == 0 || --a->switch_after > 0) { return; }
+    // The ACCEPT left the air, the peer switches when it hears it
+    if (a->state == ADR_ACCEPTING && status == 0) {
+        switch_to(a, a->target);
+        a->state = ADR_VERIFY;
+        a->deadline = now_ms + timeout_ms(a, a->rate, a->prev);
+    } else if (a->state == ADR_ACCEPTING) {
+        a->state = ADR_IDLE;
+    }
+}
+
+long adr_poll(adr* a, long now_ms) {
+    if ((a->state == ADR_PROPOSED || a->state == ADR_VERIFY) && now_ms >= a->deadline) {
+        if (a->state == ADR_VERIFY) {
+            // Nothing heard at the new rate, go back where the peer was
+            switch_to(a, a->prev);
+            a->reverts++;
+            a->hold_ms = a->hold_ms * 2 > ADR_MAX_HOLD_MS ? ADR_MAX_HOLD_MS : a->hold_ms * 2;
+        }
+        a->state = ADR_IDLE;
+        a->hold_until = now_ms + a->hold_ms;
+    }
+    if (a->state == ADR_IDLE && a->rate != a->home && now_ms - a->last_heard >= ADR_HOME_MS) {
+        switch_to(a, a->home);
+        a->fallbacks++;
+        a->last_heard = now_ms;
+    }
+    if (a->state == ADR_IDLE && now_ms >= a->hold_until) {
+        int best = choose(a);
+        if (best != a->rate) {
+            a->token++;
+            if (send_op(a, ADR_PROPOSE, best) == 0) {
+                a->target = best;
+                a->state = ADR_PROPOSED;
+                a->deadline = now_ms + timeout_ms(a, a->rate, best);
+            }
+        }
+    }
+    long next = -1;
+    if (a->state == ADR_PROPOSED || a->state == ADR_VERIFY) { next = a->deadline - now_ms; }
+    if (a->state == ADR_IDLE && a->rate != a->home) {
+        long home = a->last_heard + ADR_HOME_MS - now_ms;
+        if (next < 0 || home < next) { next = home; }
+    }
+    return next;
+}
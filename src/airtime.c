@@ -0,0 +1,20 @@
+#include "airtime.h"
+
+uint32_t airtime_symbol_us(unsigned sf, unsigned bw_khz) {
+    if (sf < 6 || sf > 12 || bw_khz == 0) { return 0; }
+    return (uint32_t) (((uint64_t) 1000 << sf) / bw_khz);
+}
+
+uint32_t airtime_us(unsigned sf, unsigned bw_khz, unsigned preamble, int crc, size_t len) {
+    uint32_t tsym = airtime_symbol_us(sf, bw_khz);
+    if (tsym == 0 || len > 255) { return 0; }
+    int de = tsym > AIRTIME_LDRO_US ? 1 : 0;
+    // Preamble is the programmed length plus 4.25 symbols of sync word
+    uint64_t preamble_x4 = (uint64_t) (4 * preamble + 17) * tsym;
+    // Payload symbols: 8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH) / 4(SF - 2DE)) * (CR + 4), 0)
+    long num = 8 * (long) len - 4 * (long) sf + 28 + (crc ? 16 : 0);
+    long den = 4 * ((long) sf - 2 * de);
+    long blocks = num > 0 ? (num + den - 1) / den : 0;
+    uint64_t symbols = 8 + (uint64_t) blocks * (AIRTIME_CR + 4);
+    return (uint32_t) (preamble_x4 / 4 + symbols * tsym);
+}
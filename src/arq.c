@@ -0,0 +1,303 @@
+#include "arq.h"
+#include <string.h>
+
+#define ARQ_TURNAROUND_MS 100   // Serial transfer of a TXLRPKT command and the RX line
+#define ARQ_MAX_BACKOFF 4       // Retries after which the timeout stops doubling
+#define ARQ_ACK_DELAY_MS 30     // Gives the sender time to switch back to receive
+
+// States of a slot in the send window
+enum { SLOT_FREE, SLOT_READY, SLOT_QUEUED, SLOT_SENT, SLOT_ACKED };
+
+int arq_init(arq* a, int reliable, unsigned window, size_t mtu, long rto_ms,
+             arq_source source, arq_emit emit, arq_deliver deliver, void* arg) {
+    if (window < 1 || window > ARQ_MAX_WINDOW || mtu <= ARQ_HEADER || mtu > ARQ_MAX_FRAME) {
+        return -1;
+    }
+    memset(a, 0, sizeof(*a));
+    a->reliable = reliable;
+    a->window = window;
+    a->mtu = mtu;
+    a->rto_ms = rto_ms;
+    a->max_retries = 8;
+    a->source = source;
+    a->emit = emit;
+    a->deliver = deliver;
+    a->arg = arg;
+    return 0;
+}
+
+long arq_rto_ms(long frame_ms, long ack_ms) {
+    return 2 * frame_ms + ack_ms + ARQ_TURNAROUND_MS;
+}
+
+// Hands a frame to the radio and remembers it until arq_sent
+static int emit(arq* a, const unsigned char* frame, size_t len, int seq, int poll) {
+    if (a->onair_count == ARQ_ONAIR || a->emit(frame, len, a->arg) != 0) { return -1; }
+    int i = (a->onair_head + a->onair_count) % ARQ_ONAIR;
+    a->onair[i] = (int16_t) seq;
+    a->onair_poll[i] = (uint8_t) poll;
+    a->onair_count++;
+    return 0;
+}
+
+static void send_ack(arq* a) {
+    unsigned char frame[2 + sizeof(uint32_t)];
+    uint32_t bitmap = a->have >> 1;     // Bit 0 is expect itself, never set
+    size_t len = 2;
+    frame[0] = ARQ_ACK | a->ack_id << ARQ_POLL_SHIFT;
+    frame[1] = a->expect;
+    while (bitmap != 0) {
+        frame[len++] = (unsigned char) bitmap;
+        bitmap >>= 8;
+    }
+    emit(a, frame, len, -1, 0);  // A lost ACK is asked for again
+}
+
+static int send_req(arq* a, int poll) {
+    unsigned char type = ARQ_REQ | (poll ? ARQ_POLL | a->poll_id << ARQ_POLL_SHIFT : 0);
+    unsigned char frame[2] = { type, a->base };
+    return emit(a, frame, sizeof(frame), -1, poll);
+}
+
+// Id of the poll following the current one, wrapping within ARQ_POLL_ID
+static uint8_t next_poll_id(const arq* a) {
+    return (a->poll_id + 1) & (ARQ_POLL_ID >> ARQ_POLL_SHIFT);
+}
+
+void arq_pump(arq* a) {
+    if (!a->reliable) {
+        unsigned char frame[ARQ_MAX_FRAME];
+        while (a->onair_count < (int) a->window) {
+            size_t n = a->source(frame + ARQ_HEADER, a->mtu - ARQ_HEADER, a->arg);
+            if (n == 0) { break; }
+            // Same offset as data frames so both modes share one MTU
+            frame[ARQ_HEADER - 1] = ARQ_RAW;
+            if (emit(a, frame + ARQ_HEADER - 1, n + 1, -1, 0) != 0) { break; }
+            a->stats.sent++;
+        }
+        return;
+    }
+    while ((uint8_t) (a->next - a->base) < a->window) {
+        arq_slot* slot = &a->tx[a->next % ARQ_MAX_WINDOW];
+        size_t n = a->source(slot->frame + ARQ_HEADER, a->mtu - ARQ_HEADER, a->arg);
+        if (n == 0) { break; }
+        slot->frame[1] = a->next++;
+        slot->len = n + ARQ_HEADER;
+        slot->state = SLOT_READY;
+        a->stats.sent++;
+    }
+    // Send everything ready, asking for an ACK with the last frame unless a
+    // poll is outstanding already, then the next one covers these frames
+    uint8_t id = next_poll_id(a);
+    int last = -1;
+    int unpolled = 0;
+    for (uint8_t s = a->base; s != a->next; ++s) {
+        int state = a->tx[s % ARQ_MAX_WINDOW].state;
+        if (state == SLOT_READY) { last = s; }
+        if (state == SLOT_QUEUED || state == SLOT_SENT) { unpolled = 1; }
+    }
+    if (a->polling) { last = -1; }
+    for (uint8_t s = a->base; s != a->next; ++s) {
+        arq_slot* slot = &a->tx[s % ARQ_MAX_WINDOW];
+        if (slot->state != SLOT_READY) { continue; }
+        int poll = s == last;
+        slot->frame[0] = ARQ_DATA | (poll ? ARQ_POLL | id << ARQ_POLL_SHIFT : 0);
+        if (emit(a, slot->frame, slot->len, s, poll) != 0) { return; }  // Resumed by arq_sent
+        slot->state = SLOT_QUEUED;
+        slot->poll = id;
+        if (poll) {
+            a->polling = 1;
+            a->poll_armed = 0;
+            a->poll_id = id;
+        }
+    }
+    // Frames sent while the last poll was outstanding and not acknowledged
+    // by its ACK need a poll of their own
+    if (!a->polling && unpolled) {
+        a->poll_id = id;
+        if (send_req(a, 1) == 0) {
+            a->polling = 1;
+            a->poll_armed = 0;
+        }
+    }
+}
+
+void arq_sent(arq* a, int status, long now_ms) {
+    if (a->onair_count == 0) { return; }
+    int seq = a->onair[a->onair_head];
+    int poll = a->onair_poll[a->onair_head];
+    a->onair_head = (a->onair_head + 1) % ARQ_ONAIR;
+    a->onair_count--;
+    if (seq >= 0) {
+        arq_slot* slot = &a->tx[seq % ARQ_MAX_WINDOW];
+        if (slot->state == SLOT_QUEUED) { slot->state = status == 0 ? SLOT_SENT : SLOT_READY; }
+    }
+    // The ACK timer runs from the end of the poll
+    if (poll && a->polling) {
+        int shift = a->retries < ARQ_MAX_BACKOFF ? a->retries : ARQ_MAX_BACKOFF;
+        a->poll_armed = 1;
+        a->poll_deadline = now_ms + (status == 0 ? a->rto_ms << shift : 0);
+    }
+}
+
+// Delivers buffered frames that became in order
+static void deliver_buffered(arq* a) {
+    while (a->have & 1) {
+        arq_buf* buf = &a->rx[a->expect % ARQ_MAX_WINDOW];
+        a->deliver(buf->data, buf->len, a->arg);
+        a->stats.delivered++;
+        a->have >>= 1;
+        a->expect++;
+    }
+}
+
+static void recv_data(arq* a, uint8_t seq, const unsigned char* data, size_t len) {
+    uint8_t d = seq - a->expect;
+    if (d == 0) {
+        a->deliver(data, len, a->arg);
+        a->stats.delivered++;
+        a->have >>= 1;
+        a->expect++;
+        deliver_buffered(a);
+    } else if (d < ARQ_MAX_WINDOW) {
+        if (a->have & (1u << d)) {
+            a->stats.duplicates++;
+            return;
+        }
+        arq_buf* buf = &a->rx[seq % ARQ_MAX_WINDOW];
+        memcpy(buf->data, data, len);
+        buf->len = len;
+        a->have |= 1u << d;
+    } else if (d >= 128) {
+        a->stats.duplicates++;  // Already delivered, its ACK was lost
+    }
+}
+
+// Skips frames the sender gave up on, or starts over if the sender restarted
+static void resync(arq* a, uint8_t base) {
+    uint8_t d = base - a->expect;
+    if (d == 0) { return; }
+    if (d < 128) {
+        while (a->expect != base) {
+            if (a->have & 1) {
+                arq_buf* buf = &a->rx[a->expect % ARQ_MAX_WINDOW];
+                a->deliver(buf->data, buf->len, a->arg);
+                a->stats.delivered++;
+            }
+            a->have >>= 1;
+            a->expect++;
+        }
+        deliver_buffered(a);
+    } else if ((uint8_t) (a->expect - base) > ARQ_MAX_WINDOW) {
+        a->expect = base;
+        a->have = 0;
+    }
+}
+
+static void recv_ack(arq* a, uint8_t id, uint8_t expect, const unsigned char* bitmap, size_t len) {
+    uint8_t inflight = a->next - a->base;
+    uint8_t d = expect - a->base;
+    if (d > inflight) { return; }  // Stale
+    // Everything before expect arrived
+    for (; a->base != expect; ++a->base) {
+        arq_slot* slot = &a->tx[a->base % ARQ_MAX_WINDOW];
+        if (slot->state != SLOT_ACKED) { a->stats.acked++; }
+        slot->state = SLOT_FREE;
+    }
+    // So did the frames in the bitmap
+    for (size_t i = 0; i < len * 8; ++i) {
+        if (!(bitmap[i / 8] & (1u << (i % 8)))) { continue; }
+        uint8_t s = expect + 1 + i;
+        if ((uint8_t) (s - a->base) >= (uint8_t) (a->next - a->base)) { break; }
+        arq_slot* slot = &a->tx[s % ARQ_MAX_WINDOW];
+        if (slot->state != SLOT_ACKED) {
+            slot->state = SLOT_ACKED;
+            a->stats.acked++;
+        }
+    }
+    while (a->base != a->next && a->tx[a->base % ARQ_MAX_WINDOW].state == SLOT_ACKED) {
+        a->tx[a->base++ % ARQ_MAX_WINDOW].state = SLOT_FREE;
+    }
+    if (!a->polling || id != a->poll_id) { return; }
+    // The ACK answers the poll that ended the burst, any frame of the burst
+    // it does not cover was lost. Frames sent after the poll may still be on
+    // their way.
+    a->polling = 0;
+    a->poll_armed = 0;
+    a->retries = 0;
+    for (uint8_t s = a->base; s != a->next; ++s) {
+        arq_slot* slot = &a->tx[s % ARQ_MAX_WINDOW];
+        if (slot->state == SLOT_SENT && slot->poll == id) {
+            slot->state = SLOT_READY;
+            a->stats.resent++;
+        }
+    }
+}
+
+int arq_recv(arq* a, const unsigned char* frame, size_t len, long now_ms) {
+    if (len < 1) { return -1; }
+    int type = frame[0] & ARQ_TYPE_MASK;
+    int poll = frame[0] & ARQ_POLL;
+    if (type == ARQ_RAW) {
+        a->deliver(frame + 1, len - 1, a->arg);
+        return 0;
+    }
+    if (len < 2 || (type != ARQ_ACK && len > a->mtu)) { return -1; }
+    switch (type) {
+        case ARQ_DATA:
+            recv_data(a, frame[1], frame + ARQ_HEADER, len - ARQ_HEADER);
+            break;
+        case ARQ_REQ:
+            resync(a, frame[1]);
+            break;
+        case ARQ_ACK:
+            recv_ack(a, (frame[0] & ARQ_POLL_ID) >> ARQ_POLL_SHIFT, frame[1], frame + 2,
+                     len - 2 < sizeof(uint32_t) ? len - 2 : sizeof(uint32_t));
+            return 0;
+        default:
+            return -1;
+    }
+    if (poll) { a->ack_id = (frame[0] & ARQ_POLL_ID) >> ARQ_POLL_SHIFT; }
+    if (poll && !a->ack_pending) {
+        a->ack_pending = 1;
+        a->ack_deadline = now_ms + ARQ_ACK_DELAY_MS;
+    }
+    return 0;
+}
+
+// Handles an expired ACK timer
+static void poll_expired(arq* a, long now_ms) {
+    a->poll_armed = 0;
+    if (++a->retries > a->max_retries) {
+        // Give up on the window, the REQ tells the receiver to skip it
+        for (uint8_t s = a->base; s != a->next; ++s) {
+            arq_slot* slot = &a->tx[s % ARQ_MAX_WINDOW];
+            if (slot->state != SLOT_ACKED) { a->stats.failed++; }
+            slot->state = SLOT_FREE;
+        }
+        a->base = a->next;
+        a->polling = 0;
+        a->retries = 0;
+        send_req(a, 0);
+        return;
+    }
+    // Ask for the ACK again, cheaper than resending the burst
+    if (send_req(a, 1) != 0) {
+        a->poll_armed = 1;
+        a->poll_deadline = now_ms + a->rto_ms;
+    }
+}
+
+long arq_poll(arq* a, long now_ms) {
+    if (a->ack_pending && now_ms >= a->ack_deadline) {
+        a->ack_pending = 0;
+        send_ack(a);
+    }
+    if (a->polling && a->poll_armed && now_ms >= a->poll_deadline) { poll_expired(a, now_ms); }
+    long next = -1;
+    if (a->ack_pending) { next = a->ack_deadline - now_ms; }
+    if (a->polling && a->poll_armed && (next < 0 || a->poll_deadline - now_ms < next)) {
+        next = a->poll_deadline - now_ms;
+    }
+    return next;
+}
@@ -0,0 +1,148 @@
+#include "at.h"
+#include "hex.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_MASK (AT_RING_LEN - 1)
+
+// Checks whether a line starts with a given prefix
+static int starts_with(const char* line, const char* prefix) {
+    return strncmp(line, prefix, strlen(prefix)) == 0;
+}
+
+// Decodes the quoted hex payload of an RX line
+static size_t decode_hex(const char* hex, unsigned char* out, size_t len) {
+    const char* quote = strchr(hex, '"');
+    size_t pairs = (quote != NULL ? (size_t) (quote - hex) : strlen(hex)) / 2;
+    return hex_decode(out, hex, pairs < len ? pairs : len);
+}
+
+// Parses "+TEST: LEN:<n>, RSSI:<n>, SNR:<n>"
+static int parse_len(at_parser* p, const char* line) {
+    const char* rssi = strstr(line, "RSSI:");
+    const char* snr = strstr(line, "SNR:");
+    if (rssi == NULL || snr == NULL) { return 0; }
+    p->rssi = (int) strtol(rssi + 5, NULL, 10);
+    p->snr = (int) strtol(snr + 4, NULL, 10);
+    p->have_len = 1;
+    return 0;
+}
+
+// Classifies one line, returning 1 if it is a response worth reporting
+static int at_classify(at_parser* p, const char* line, at_response* res) {
+    const char* err = strstr(line, "ERROR");
+    if (err != NULL) {
+        res->kind = AT_ERROR;
+        res->code = err[5] == '(' ? (int) strtol(err + 6, NULL, 10) : -1;
+        return 1;
+    }
+    if (starts_with(line, "+TEST: LEN:")) {
+        return parse_len(p, line);
+    }
+    if (starts_with(line, "+TEST: RX \"")) {
+        res->kind = AT_RX;
+        res->len = decode_hex(line + 11, res->data, AT_MAX_PAYLOAD);
+        res->rssi = p->have_len ? p->rssi : 0;
+        res->snr = p->have_len ? p->snr : 0;
+        p->have_len = 0;
+        return 1;
+    }
+    if (strcmp(line, "+TEST: TX DONE") == 0) {
+        res->kind = AT_TX_DONE;
+    } else if (starts_with(line, "+TEST: TXLRPKT")) {
+        res->kind = AT_TXLRPKT;
+    } else if (starts_with(line, "+TEST: RXLRPKT")) {
+        res->kind = AT_RXLRPKT;
+    } else if (starts_with(line, "+TEST: RFCFG")) {
+        res->kind = AT_RFCFG;
+    } else if (starts_with(line, "+MODE:")) {
+        res->kind = AT_MODE;
+    } else if (line[0] == '+') {
+        res->kind = AT_OK;
+    } else {
+        return 0;  // Noise or an echoed command
+    }
+    return 1;
+}
+
+void at_init(at_parser* p) {
+    p->head = p->tail = p->scan = 0;
+    p->have_len = 0;
+}
+
+size_t at_space(at_parser* p, char** dst) {
+    size_t used = p->head - p->tail;
+    size_t start = p->head & RING_MASK;
+    size_t contiguous = AT_RING_LEN - start;
+    size_t space = AT_RING_LEN - used;
+    *dst = &p->ring[start];
+    return space < contiguous ? space : contiguous;
+}
+
+void at_commit(at_parser* p, size_t len) {
+    p->head += len;
+}
+
+size_t at_feed(at_parser* p, const char* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        char* dst;
+        size_t n = at_space(p, &dst);
+        if (n == 0) { break; }
+        if (n > len - done) { n = len - done; }
+        memcpy(dst, data + done, n);
+        at_commit(p, n);
+        done += n;
+    }
+    return done;
+}
+
+int at_next(at_parser* p, at_response* res) {
+    for (;;) {
+        // Skip line endings and the NUL bytes commands are sent with
+        while (p->tail != p->head) {
+            char c = p->ring[p->tail & RING_MASK];
+            if (c != '\r' && c != '\n' && c != '\0') { break; }
+            p->tail++;
+            p->scan = 0;
+        }
+        // Look for the end of the line, only scanning new input
+        size_t end = p->tail + p->scan;
+        while (end != p->head) {
+            char c = p->ring[end & RING_MASK];
+            if (c == '\r' || c == '\n') { break; }
+            end++;
+        }
+        if (end == p->head) {
+            p->scan = end - p->tail;
+            // A full ring without a line ending is garbage, drop it
+            if (p->scan == AT_RING_LEN) {
+                p->tail = p->head;
+                p->scan = 0;
+            }
+            return 0;
+        }
+        // Lines too long for any response are dropped
+        size_t start = p->tail & RING_MASK;
+        size_t n = end - p->tail;
+        int overflow = n >= AT_LINE_LEN;
+        char copy[AT_LINE_LEN];
+        char* line = &p->ring[start];
+        if (!overflow && (start + n > AT_RING_LEN || memchr(line, '\0', n) != NULL)) {
+            // Wrapped or with NUL bytes inside, copy the line out of the ring
+            size_t k = 0;
+            for (size_t i = p->tail; i != end; ++i) {
+                char c = p->ring[i & RING_MASK];
+                if (c != '\0') { copy[k++] = c; }
+            }
+            copy[k] = '\0';
+            line = copy;
+        } else {
+            // Parsed in place, the line ending is consumed anyway
+            p->ring[end & RING_MASK] = '\0';
+        }
+        p->tail = end + 1;
+        p->scan = 0;
+        if (!overflow && at_classify(p, line, res)) { return 1; }
+    }
+}
@@ -0,0 +1,365 @@
+#include "bond.h"
+#include "airtime.h"
+#include <string.h>
+#include <time.h>
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static uint32_t radio_airtime(const bond_radio* r, size_t len) {
+    const wioe_params* p = &r->params;
+    return airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc, len);
+}
+
+// Derives the hold time from the time on air of the current rate
+static void bond_timing(bond* b) {
+    long frame_ms = radio_airtime(&b->radios[0], WIOE_MAX_PAYLOAD) / 1000;
+    // A frame may still be on the air of another radio when a later one,
+    // shorter or queued behind less, already arrived
+    b->hold_ms = frame_ms + BOND_TURNAROUND_MS;
+}
+
+// Sender
+
+// Starts the next transmission of a radio, or goes back to listening until
+// the duty cycle allows it. A new data rate is applied between transmissions,
+// sending resumes once the module confirmed it.
+static void radio_next(bond_radio* r) {
+    bond* b = r->owner;
+    if (wioe_tx_busy(r->device)) { return; }
+    if (r->update_pending) {
+        r->update_pending = 0;
+        if (wioe_update_start(r->device, &r->params) == 0) {
+            r->updating = 1;
+            reactor_timer_set(b->loop, r->tx_timer, wioe_tx_timeout_ms(r->device), 0);
+            return;
+        }
+        b->error(r->index, "Error changing data rate", 0, b->arg);
+    }
+    // Replies wait until the peer is back in receive mode, the radio still
+    // listens since it just received
+    long quiet = r->quiet_until - now_ms();
+    if (quiet > 0) {
+        reactor_timer_set(b->loop, r->guard_timer, quiet, 0);
+        return;
+    }
+    int s = wioe_send_pump(r->device);
+    if (s > 0) {
+        reactor_timer_set(b->loop, r->tx_timer, wioe_tx_timeout_ms(r->device), 0);
+    } else if (s < 0 || wioe_rx_start(r->device) != 0) {
+        b->error(r->index, "Error recieving message", 1, b->arg);
+    } else {
+        long wait = wioe_tx_wait_ms(r->device);
+        if (wait > 0) { reactor_timer_set(b->loop, r->guard_timer, wait, 0); }
+    }
+}
+
+// Records the outcome of a send and reports those that are next in order
+static void radio_sent(int status, void* arg) {
+    bond_pending* p = (bond_pending*) arg;
+    bond* b = p->radio->owner;
+    p->radio->backlog_us -= p->airtime_us;
+    p->done = 1;
+    p->status = status;
+    while (b->order_count > 0 && b->order[b->order_head].done) {
+        bond_pending head = b->order[b->order_head];
+        b->order_head = (b->order_head + 1) % BOND_ORDER;
+        b->order_count--;
+        // The callback may send again, the slot is already free
+        if (head.cb != NULL) { head.cb(head.status, head.arg); }
+    }
+}
+
+size_t bond_mtu(const bond* b) {
+    return WIOE_MAX_PLAINTEXT - (b->count > 1 ? BOND_HEADER : 0);
+}
+
+// Seals a frame with the session key if ephemeral is set, the passphrase key otherwise
+static int bond_seal_send(bond* b, const unsigned char* data, size_t len, int ephemeral,
+                          bond_done done, void* arg) {
+    if (len > bond_mtu(b) || b->order_count == BOND_ORDER) { return -1; }
+    const unsigned char* key = ephemeral ? b->session_key : b->key;
+    // Radios are tried by the time the frame would leave their air
+    int tried = 0;
+    while (tried < b->count) {
+        bond_radio* r = NULL;
+        for (int i = 0; i < b->count; ++i) {
+            if (!(tried & (1 << i))
+                && (r == NULL || b->radios[i].backlog_us < r->backlog_us)) {
+                r = &b->radios[i];
+            }
+        }
+        tried |= 1 << r->index;
+        // Room is claimed before sealing, which uses up a sequence number of
+        // the radio: a frame sealed but never sent would count as lost
+        txq_cell* slot = wioe_send_reserve(r->device);
+        if (slot == NULL) { continue; }
+        // Sealed in place, with the sequence number pushed in front
+        frame f;
+        frame_init(&f);
+        memcpy(frame_put(&f, len), data, len);
+        if (b->count > 1) { *frame_push(&f, BOND_HEADER) = b->next_seq; }
+        ssize_t pkt_len = wioe_seal_frame(r->device, &f, key, ephemeral);
+        if (pkt_len < 0) {
+            wioe_send_commit(r->device, slot, NULL, 0, NULL, NULL);
+            return -1;
+        }
+        int i = (b->order_head + b->order_count) % BOND_ORDER;
+        bond_pending* p = &b->order[i];
+        p->radio = r;
+        p->airtime_us = radio_airtime(r, pkt_len);
+        p->done = 0;
+        p->cb = done;
+        p->arg = arg;
+        if (wioe_send_commit(r->device, slot, f.data, pkt_len, radio_sent, p) != 0) { return -1; }
+        b->order_count++;
+        b->next_seq++;
+        r->backlog_us += p->airtime_us;
+        r->frames++;
+        return 0;
+    }
+    return -1;
+}
+
+int bond_send(bond* b, const unsigned char* data, size_t len, bond_done done, void* arg) {
+    return bond_seal_send(b, data, len, b->tx_keyed, done, arg);
+}
+
+int bond_send_passphrase(bond* b, const unsigned char* data, size_t len, bond_done done,
+                         void* arg) {
+    return bond_seal_send(b, data, len, 0, done, arg);
+}
+
+void bond_rekey(bond* b, const unsigned char* key, int send) {
+    // Frames already queued were sealed with the previous key
+    memcpy(b->session_key, key, sizeof(b->session_key));
+    b->rx_keyed = 1;
+    b->tx_keyed = send != 0;
+}
+
+void bond_update(bond* b, unsigned sf, unsigned bw) {
+    for (int i = 0; i < b->count; ++i) {
+        bond_radio* r = &b->radios[i];
+        r->params.spreading_factor = sf;
+        r->params.bandwidth = bw;
+        r->update_pending = 1;
+    }
+    bond_timing(b);
+    for (int i = 0; i < b->count; ++i) { radio_next(&b->radios[i]); }
+}
+
+// Receiver
+
+// Delivers the held frames that are now in order and keeps the timer
+// running while frames remain held behind a gap
+static void rx_release(bond* b) {
+    while (b->have & 1) {
+        bond_held* h = &b->held[b->expect % BOND_WINDOW];
+        b->have >>= 1;
+        b->expect++;
+        b->deliver(h->f->data, h->f->len, h->rssi, h->snr, b->arg);
+        frame_release(h->f);
+        h->f = NULL;
+    }
+    if (b->have == 0 && b->hold_armed) {
+        b->hold_armed = 0;
+        reactor_timer_set(b->loop, b->hold_timer, 0, 0);
+    } else if (b->have != 0 && !b->hold_armed) {
+        b->hold_armed = 1;
+        reactor_timer_set(b->loop, b->hold_timer, b->hold_ms, 0);
+    }
+}
+
+// Gives up on the oldest missing frame
+static void rx_skip(bond* b) {
+    if (b->have & 1) {
+        bond_held* h = &b->held[b->expect % BOND_WINDOW];
+        b->deliver(h->f->data, h->f->len, h->rssi, h->snr, b->arg);
+        frame_release(h->f);
+        h->f = NULL;
+    } else {
+        b->stats.skipped++;
+    }
+    b->have >>= 1;
+    b->expect++;
+}
+
+// Takes ownership of the frame, keeping it while it is held
+static void rx_reorder(bond* b, frame* f, int rssi, int snr) {
+    uint8_t seq = f->data[0];
+    frame_pull(f, BOND_HEADER);
+    if (!b->started) {
+        b->started = 1;
+        b->expect = seq;
+    }
+    uint8_t d = seq - b->expect;
+    if (d >= 128) {
+        // Behind: given up on already, or a duplicate the layers above drop
+        b->stats.late++;
+        b->deliver(f->data, f->len, rssi, snr, b->arg);
+        frame_release(f);
+        return;
+    }
+    // Too far ahead, the frames missing before it are not coming
+    while (d >= BOND_WINDOW) {
+        rx_skip(b);
+        d--;
+    }
+    if (b->have & (1u << d)) {
+        frame_release(f);
+        return;
+    }
+    if (d == 0) {
+        b->have >>= 1;
+        b->expect++;
+        b->deliver(f->data, f->len, rssi, snr, b->arg);
+        frame_release(f);
+    } else {
+        bond_held* h = &b->held[seq % BOND_WINDOW];
+        h->f = f;
+        h->rssi = rssi;
+        h->snr = snr;
+        b->have |= 1u << d;
+        b->stats.reordered++;
+    }
+    rx_release(b);
+}
+
+// Packets arrive decoded into frames from the pool and are decrypted where
+// they are, the frame then travels up until delivered
+static void on_packet(frame* f, int rssi, int snr, void* arg) {
+    bond_radio* r = (bond_radio*) arg;
+    bond* b = r->owner;
+    r->quiet_until = now_ms() + BOND_TURNAROUND_MS;
+    ssize_t bytes = wioe_open_frame(r->device, f, b->key, b->rx_keyed ? b->session_key : NULL);
+    if (b->count > 1 && bytes > BOND_HEADER) {
+        rx_reorder(b, f, rssi, snr);
+        return;
+    }
+    if (b->count == 1 && bytes > 0) { b->deliver(f->data, f->len, rssi, snr, b->arg); }
+    frame_release(f);
+}
+
+// Event loop callbacks
+
+// Ends a data rate change, reporting it if it failed (the radio then keeps
+// the previous rate)
+static void radio_updated(bond_radio* r, int ok) {
+    if (!r->updating) { return; }
+    r->updating = 0;
+    if (!ok) { r->owner->error(r->index, "Error changing data rate", 0, r->owner->arg); }
+}
+
+static void on_serial(reactor* loop, int fd, uint32_t events, void* arg) {
+    bond_radio* r = (bond_radio*) arg;
+    wioe_event ev;
+    int s;
+    // Packets go to on_packet while this parses the serial input
+    while ((s = wioe_poll(r->device, &ev)) > 0) {
+        if (ev.type == WIOE_EV_TX_DONE || ev.type == WIOE_EV_UPDATED
+            || ev.type == WIOE_EV_ERROR) {
+            radio_updated(r, ev.type == WIOE_EV_UPDATED);
+            reactor_timer_set(loop, r->tx_timer, 0, 0);
+            radio_next(r);
+        }
+    }
+    if (s < 0) { r->owner->error(r->index, "Error recieving message", 1, r->owner->arg); }
+}
+
+static void on_tx_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    bond_radio* r = (bond_radio*) arg;
+    radio_updated(r, 0);
+    wioe_tx_abort(r->device);
+    radio_next(r);
+}
+
+static void on_wake(reactor* loop, int fd, uint32_t events, void* arg) {
+    bond_radio* r = (bond_radio*) arg;
+    if (!wioe_tx_busy(r->device)) { radio_next(r); }
+}
+
+static void on_hold(reactor* loop, int fd, uint32_t events, void* arg) {
+    bond* b = (bond*) arg;
+    b->hold_armed = 0;
+    if (b->have == 0) { return; }
+    while (!(b->have & 1)) { rx_skip(b); }
+    rx_release(b);
+}
+
+int bond_init(bond* b, reactor* loop, char** paths, int count, const wioe_params* params,
+              const unsigned char* key, bond_deliver deliver, bond_error error, void* arg) {
+    if (count < 1 || count > BOND_MAX_RADIOS
+        || params->frequency + (count - 1) * BOND_SPACING_MHZ > MAXFREQ) { return -1; }
+    memset(b, 0, sizeof(*b));
+    b->loop = loop;
+    b->deliver = deliver;
+    b->error = error;
+    b->arg = arg;
+    memcpy(b->key, key, sizeof(b->key));
+    frame_pool_init(&b->pool);
+    b->hold_timer = reactor_timer(loop, on_hold, b);
+    if (b->hold_timer < 0) { return -1; }
+    for (int i = 0; i < count; ++i) {
+        bond_radio* r = &b->radios[i];
+        r->owner = b;
+        r->index = i;
+        r->params = *params;
+        r->params.frequency += i * BOND_SPACING_MHZ;
+        r->device = wioe_init(&r->params, paths[i]);
+        if (r->device == NULL) { return -1; }
+        b->count++;
+        if (!wioe_is_valid(r->device)) { return -1; }
+        r->tx_timer = reactor_timer(loop, on_tx_timeout, r);
+        r->guard_timer = reactor_timer(loop, on_wake, r);
+        if (r->tx_timer < 0 || r->guard_timer < 0
+            || reactor_add(loop, wioe_fd(r->device), EPOLLIN, on_serial, r) != 0
+            || reactor_add(loop, wioe_send_fd(r->device), EPOLLIN, on_wake, r) != 0
+            || wioe_rx_frames(r->device, &b->pool, on_packet, r) != 0) { return -1; }
+    }
+    bond_timing(b);
+    return 0;
+}
+
+wioe* bond_device(bond* b, int i) {
+    return b->radios[i].device;
+}
+
+void bond_get_compress_stats(bond* b, wioe_compress_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < b->count; ++i) {
+        wioe_compress_stats s;
+        wioe_get_compress_stats(b->radios[i].device, &s);
+        stats->packets += s.packets;
+        stats->compressed += s.compressed;
+        stats->bytes_in += s.bytes_in;
+        stats->bytes_out += s.bytes_out;
+        stats->airtime_saved_us += s.airtime_saved_us;
+    }
+}
+
+void bond_get_link_stats(bond* b, wioe_link_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < b->count; ++i) {
+        wioe_link_stats s;
+        wioe_get_link_stats(b->radios[i].device, &s);
+        stats->received += s.received;
+        stats->lost += s.lost;
+        stats->reordered += s.reordered;
+        stats->replayed += s.replayed;
+        stats->rejected += s.rejected;
+    }
+}
+
+void bond_destroy(bond* b) {
+    for (int i = 0; i < BOND_WINDOW; ++i) {
+        frame_release(b->held[i].f);
+        b->held[i].f = NULL;
+    }
+    sodium_memzero(b->key, sizeof(b->key));
+    sodium_memzero(b->session_key, sizeof(b->session_key));
+    for (int i = 0; i < b->count; ++i) { wioe_destroy(b->radios[i].device); }
+    b->count = 0;
+}
@@ -0,0 +1,143 @@
+#include "compress.h"
+#include <pthread.h>
+#include <string.h>
+
+// Codebook, index is the code. Single characters avoid the cost of an
+// escape, longer entries are fragments frequent in typed English.
+static const char* const codebook[] = {
+    "\0", " ", "e", "t", "a", "o", "i", "n", "s", "r", "h", "l", "d", "c", "u", "m", "f", "p",
+    "g", "w", "y", "b", "v", "k", ".", ",", "?", "!", "'", "-", ":", "I", "A", "T", "S", "W",
+    "H", "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", " the ", "the ", " the", "The ",
+    " and ", "and ", " to ", " of ", " a ", " is ", " in ", " it ", " you ", "you", " i ",
+    "I ", "I'm ", " for ", " that ", " on ", " with ", " this ", " are ", " be ", " have ",
+    " not ", " at ", " we ", " can ", " do ", " what ", " so ", " if ", " my ", " me ",
+    " just ", " will ", " was ", " but ", " all ", " your ", " there ", " here ", " now ",
+    " how ", " get ", " ok", "ok ", "hello", "hi ", "yes", "no ", "thanks", " please",
+    " about ", " know ", " like ", " think ", " time ", " good ", " see ", " go ", " out ",
+    " up ", " one ", " some ", "message", " send", " from ", " when ", " where ", " back",
+    " again", " today", " tomorrow", " later", " sure", " right", " want", " need", " going",
+    " don't ", " can't ", " it's ", "ing ", "ing", "tion", "ion ", "ed ", "er ", "es ", "s ",
+    "e ", "t ", "d ", "y ", "n ", "r ", "o ", "l ", "th", "he", "in", "er", "an", "re", "on",
+    "at", "en", "nd", "ti", "es", "or", "te", "of", "ed", "is", "it", "al", "ar", "st", "to",
+    "nt", "ng", "se", "ha", "as", "ou", "io", "le", "ve", "co", "me", "de", "hi", "ri", "ro",
+    "ic", "ne", "ea", "ra", "ce", "li", "ch", "ll", "be", "ma", "si", "om", "ur", "ent", "her",
+    "for", "tha", "ter", "ould", "ight", "ver", "ome", "ave", "ear", "ust", "ess", "est",
+    "all", "ore", "ate", "ally", "ake", "ame", "ook", "ee", ". ", ", ", "? ", "! ", "'s ",
+    "n't ", "'m ", "'re ", "'ll ", "...", "  ", "wh", "ay", "ow", "wa", "ly", "ut", "ge", "pe",
+    "ki", "ad", "lo", "ho", "no", "so", "ac", "el", "il", "ol", "un", "us", "ay ", "ers", "ry",
+    "ck",
+};
+
+#define CODES (sizeof(codebook) / sizeof(codebook[0]))
+
+_Static_assert(CODES <= COMPRESS_LITERAL, "codebook overlaps the escapes");
+
+// Codes of the entries starting with each byte, longest first
+static unsigned char by_first[256][CODES];
+static unsigned char by_first_count[256];
+static unsigned char code_len[CODES];
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+static void build_index(void) {
+    for (size_t i = 0; i < CODES; ++i) {
+        // "\0" has length 1 even though strlen sees none
+        code_len[i] = codebook[i][0] == '\0' ? 1 : strlen(codebook[i]);
+    }
+    for (size_t len = 16; len > 0; --len) {
+        for (size_t i = 0; i < CODES; ++i) {
+            if (code_len[i] != len) { continue; }
+            unsigned char first = (unsigned char) codebook[i][0];
+            by_first[first][by_first_count[first]++] = (unsigned char) i;
+        }
+    }
+}
+
+// Finds the longest entry at the start of in
+static int longest_match(const unsigned char* in, size_t len) {
+    const unsigned char* codes = by_first[in[0]];
+    for (int i = 0; i < by_first_count[in[0]]; ++i) {
+        unsigned char c = codes[i];
+        if (code_len[c] <= len && memcmp(in, codebook[c], code_len[c]) == 0) { return c; }
+    }
+    return -1;
+}
+
+// Appends pending literals as a single escape or a run
+static size_t flush_literals(unsigned char* out, size_t pos, size_t out_len,
+                             const unsigned char* lit, size_t n) {
+    while (n > 0) {
+        size_t chunk = n > 256 ? 256 : n;
+        size_t need = chunk == 1 ? 2 : chunk + 2;
+        if (pos + need > out_len) { return 0; }
+        if (chunk == 1) {
+            out[pos++] = COMPRESS_LITERAL;
+        } else {
+            out[pos++] = COMPRESS_RUN;
+            out[pos++] = (unsigned char) (chunk - 1);
+        }
+        memcpy(out + pos, lit, chunk);
+        pos += chunk;
+        lit += chunk;
+        n -= chunk;
+    }
+    return pos;
+}
+
+size_t compress_bytes(unsigned char* out, size_t out_len, const unsigned char* in, size_t len) {
+    pthread_once(&index_once, build_index);
+    if (len == 0) { return 0; }
+    // Only worth it if strictly shorter
+    if (out_len >= len) { out_len = len - 1; }
+    size_t pos = 0;
+    size_t lit = 0;     // Start of pending literals
+    size_t i = 0;
+    while (i < len) {
+        int c = longest_match(in + i, len - i);
+        if (c < 0) {
+            i++;
+            continue;
+        }
+        if (lit < i && (pos = flush_literals(out, pos, out_len, in + lit, i - lit)) == 0) {
+            return 0;
+        }
+        if (pos == out_len) { return 0; }
+        out[pos++] = (unsigned char) c;
+        i += code_len[c];
+        lit = i;
+    }
+    if (lit < i && (pos = flush_literals(out, pos, out_len, in + lit, i - lit)) == 0) { return 0; }
+    return pos;
+}
+
+ssize_t decompress_bytes(unsigned char* out, size_t out_len, const unsigned char* in, size_t len) {
+    pthread_once(&index_once, build_index);
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < len) {
+        unsigned char c = in[i++];
+        const unsigned char* src;
+        size_t n;
+        if (c == COMPRESS_LITERAL) {
+            n = 1;
+        } else if (c == COMPRESS_RUN) {
+            if (i == len) { return -1; }
+            n = (size_t) in[i++] + 1;
+        } else if (c < CODES) {
+            n = 0;
+        } else {
+            return -1;
+        }
+        if (n > 0) {
+            if (n > len - i) { return -1; }
+            src = in + i;
+            i += n;
+        } else {
+            src = (const unsigned char*) codebook[c];
+            n = code_len[c];
+        }
+        if (n > out_len - pos) { return -1; }
+        memcpy(out + pos, src, n);
+        pos += n;
+    }
+    return pos;
+}
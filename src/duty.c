@@ -0,0 +1,41 @@
+#include "duty.h"
+
+void duty_init(duty* d, double ratio, uint32_t window_ms, uint64_t now_us) {
+    d->ratio = ratio > 0 && ratio < 1 ? ratio : 0;
+    d->capacity_us = d->ratio * window_ms * 1000.0;
+    d->tokens_us = d->capacity_us;
+    d->last_us = now_us;
+    d->held_us = 0;
+    d->delays = 0;
+    d->delay_us = 0;
+}
+
+static void duty_refill(duty* d, uint64_t now_us) {
+    if (now_us <= d->last_us) { return; }
+    d->tokens_us += (now_us - d->last_us) * d->ratio;
+    if (d->tokens_us > d->capacity_us) { d->tokens_us = d->capacity_us; }
+    d->last_us = now_us;
+}
+
+uint64_t duty_wait_us(duty* d, uint32_t airtime_us, uint64_t now_us) {
+    if (d->ratio == 0) { return 0; }
+    duty_refill(d, now_us);
+    double need = airtime_us < d->capacity_us ? airtime_us : d->capacity_us;
+    if (d->tokens_us >= need) { return 0; }
+    if (d->held_us == 0) { d->held_us = now_us; }
+    // Rounded up so that waiting this long is always enough
+    return (uint64_t) ((need - d->tokens_us) / d->ratio) + 1;
+}
+
+void duty_take(duty* d, uint32_t airtime_us, uint64_t now_us) {
+    if (d->ratio == 0) { return; }
+    duty_refill(d, now_us);
+    // May go below zero after an oversized transmission, which then
+    // delays the next ones accordingly
+    d->tokens_us -= airtime_us;
+    if (d->held_us != 0) {
+        d->delays++;
+        d->delay_us += now_us - d->held_us;
+        d->held_us = 0;
+    }
+}
@@ -0,0 +1,367 @@
+#include "frag.h"
+#include "rs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+size_t frag_max_message(size_t mtu) {
+    return mtu > FRAG_HEADER ? (mtu - FRAG_HEADER) * FRAG_MAX_COUNT : 0;
+}
+
+// Sender
+
+int frag_tx_init(frag_tx* tx, size_t mtu) {
+    if (mtu <= FRAG_HEADER) { return -1; }
+    memset(tx, 0, sizeof(*tx));
+    tx->mtu = mtu;
+    return 0;
+}
+
+void frag_tx_coalesce(frag_tx* tx, long hold_ms) {
+    tx->hold_ms = hold_ms > 0 ? hold_ms : 0;
+}
+
+void frag_tx_fec(frag_tx* tx, int percent) {
+    tx->fec = percent > 0 || percent == FRAG_FEC_AUTO ? percent : 0;
+}
+
+void frag_tx_loss(frag_tx* tx, double loss) {
+    // Past half the frames lost, parity costs more than it is worth
+    tx->loss = loss < 0 ? 0 : loss > 0.5 ? 0.5 : loss;
+}
+
+// Chance that more than m of n frames are lost
+static double tail(unsigned n, unsigned m, double p) {
+    double pmf = 1;
+    for (unsigned i = 0; i < n; ++i) { pmf *= 1 - p; }
+    double cdf = 0;
+    for (unsigned i = 0; i <= m; ++i) {
+        cdf += pmf;
+        pmf *= (double) (n - i) / (i + 1) * p / (1 - p);
+    }
+    return 1 - cdf;
+}
+
+// Number of parity fragments for a message of k data fragments
+static unsigned parity_for(const frag_tx* tx, unsigned k) {
+    unsigned most = RS_MAX_SYMBOLS - k;
+    if (tx->fec > 0) {
+        unsigned m = (k * (unsigned) tx->fec + 99) / 100;
+        return m < most ? m : most;
+    }
+    if (tx->fec != FRAG_FEC_AUTO || tx->loss <= 0) { return 0; }
+    unsigned m = 0;
+    while (m < most && tail(k + m, m, tx->loss) > FRAG_FEC_FAILURE) { m++; }
+    return m;
+}
+
+int frag_tx_push(frag_tx* tx, const unsigned char* msg, size_t len, long now_ms) {
+    size_t payload = tx->mtu - FRAG_HEADER;
+    if (len == 0 || len > frag_max_message(tx->mtu) || tx->count == FRAG_TX_DEPTH) { return -1; }
+    frag_msg* m = &tx->queue[(tx->head + tx->count) % FRAG_TX_DEPTH];
+    size_t symbol = tx->mtu > FRAG_CODED_HEADER ? tx->mtu - FRAG_CODED_HEADER : 0;
+    unsigned k = symbol > 0 ? (len + symbol - 1) / symbol : 0;
+    unsigned parity = tx->fec != 0 && len <= 0xffff && k < RS_MAX_SYMBOLS ? parity_for(tx, k) : 0;
+    // Coded messages are padded to whole symbols for the encoder
+    size_t size = parity > 0 ? k * symbol : len;
+    m->data = malloc(size);
+    if (m->data == NULL) { return -1; }
+    memcpy(m->data, msg, len);
+    memset(m->data + len, 0, size - len);
+    m->len = len;
+    m->id = tx->next_id++;
+    m->next = 0;
+    m->k = parity > 0 ? k : 0;
+    m->count = parity > 0 ? k + parity : (len + payload - 1) / payload;
+    m->queued_ms = now_ms;
+    tx->count++;
+    if (parity > 0) { tx->coded++; }
+    return 0;
+}
+
+// Removes the oldest message from the queue
+static void pop(frag_tx* tx) {
+    free(tx->queue[tx->head].data);
+    tx->queue[tx->head].data = NULL;
+    tx->head = (tx->head + 1) % FRAG_TX_DEPTH;
+    tx->count--;
+}
+
+// Whether a queued message can share a frame with others
+static int whole(const frag_msg* m) {
+    return m->count == 1 && m->next == 0 && m->k == 0;
+}
+
+// Packs the oldest messages into one frame when more than one fits
+//
+// @return Length of the frame, 0 to send the oldest message alone, or -1 to
+//         hold the messages for more to arrive
+static ssize_t coalesce(frag_tx* tx, unsigned char* frame, long now_ms) {
+    frag_msg* m = &tx->queue[tx->head];
+    if (!whole(m)) { return 0; }
+    size_t len = FRAG_HEADER;
+    int n = 0;
+    int full = 0;
+    for (; n < tx->count; ++n) {
+        frag_msg* next = &tx->queue[(tx->head + n) % FRAG_TX_DEPTH];
+        if (!whole(next) || len + 1 + next->len > tx->mtu) {
+            full = 1;
+            break;
+        }
+        len += 1 + next->len;
+    }
+    if (!full && now_ms - m->queued_ms < tx->hold_ms) { return -1; }
+    if (n < 2) { return 0; }
+    frame[0] = m->id;
+    frame[1] = FRAG_BATCH;
+    frame[2] = (uint8_t) (n - 1);
+    len = FRAG_HEADER;
+    for (int i = 0; i < n; ++i) {
+        m = &tx->queue[tx->head];
+        frame[len++] = (uint8_t) m->len;
+        memcpy(frame + len, m->data, m->len);
+        len += m->len;
+        pop(tx);
+    }
+    tx->batches++;
+    tx->batched += n;
+    return len;
+}
+
+// Builds the next fragment of a coded message: its data symbols, then parity
+static size_t next_coded(frag_tx* tx, frag_msg* m, unsigned char* frame) {
+    size_t symbol = tx->mtu - FRAG_CODED_HEADER;
+    size_t n = symbol;
+    frame[0] = m->id;
+    frame[1] = FRAG_BATCH;
+    frame[2] = FRAG_CODED;
+    frame[3] = (uint8_t) m->next;
+    frame[4] = (uint8_t) (m->k - 1);
+    frame[5] = (uint8_t) m->len;
+    frame[6] = (uint8_t) (m->len >> 8);
+    if (m->next < m->k) {
+        size_t offset = m->next * symbol;
+        n = m->len - offset < symbol ? m->len - offset : symbol;
+        memcpy(frame + FRAG_CODED_HEADER, m->data + offset, n);
+    } else {
+        rs_encode(m->data, m->k, symbol, m->next - m->k, frame + FRAG_CODED_HEADER);
+        tx->parity++;
+    }
+    if (++m->next == m->count) { pop(tx); }
+    return FRAG_CODED_HEADER + n;
+}
+
+size_t frag_tx_next(frag_tx* tx, unsigned char* frame, long now_ms) {
+    if (tx->count == 0) { return 0; }
+    if (tx->hold_ms > 0) {
+        ssize_t len = coalesce(tx, frame, now_ms);
+        if (len != 0) { return len > 0 ? (size_t) len : 0; }
+    }
+    size_t payload = tx->mtu - FRAG_HEADER;
+    frag_msg* m = &tx->queue[tx->head];
+    if (m->k > 0) { return next_coded(tx, m, frame); }
+    size_t offset = m->next * payload;
+    size_t n = m->len - offset < payload ? m->len - offset : payload;
+    frame[0] = m->id;
+    frame[1] = (uint8_t) m->next;
+    frame[2] = (uint8_t) (m->count - 1);
+    memcpy(frame + FRAG_HEADER, m->data + offset, n);
+    // Move on to the next message once the last fragment is out
+    if (++m->next == m->count) { pop(tx); }
+    return FRAG_HEADER + n;
+}
+
+long frag_tx_wait(const frag_tx* tx, long now_ms) {
+    if (tx->hold_ms == 0 || tx->count == 0 || !whole(&tx->queue[tx->head])) { return -1; }
+    long ms = tx->queue[tx->head].queued_ms + tx->hold_ms - now_ms;
+    return ms > 0 ? ms : -1;
+}
+
+void frag_tx_free(frag_tx* tx) {
+    while (tx->count > 0) { pop(tx); }
+}
+
+// Receiver
+
+static void slot_clear(frag_slot* slot) {
+    free(slot->data);
+    memset(slot, 0, sizeof(*slot));
+}
+
+void frag_rx_init(frag_rx* rx, size_t mtu, long timeout_ms, frag_deliver deliver, void* arg) {
+    memset(rx, 0, sizeof(*rx));
+    rx->mtu = mtu;
+    rx->timeout_ms = timeout_ms;
+    rx->deliver = deliver;
+    rx->arg = arg;
+}
+
+// Finds the slot of a message, starting a new one (evicting the oldest) if
+// needed. Coded messages give their length, which is part of their shape.
+static frag_slot* slot_for(frag_rx* rx, uint8_t id, unsigned count, size_t coded_len,
+                           long now_ms) {
+    frag_slot* oldest = NULL;
+    frag_slot* free_slot = NULL;
+    for (int i = 0; i < FRAG_RX_SLOTS; ++i) {
+        frag_slot* slot = &rx->slots[i];
+        if (!slot->used) {
+            if (free_slot == NULL) { free_slot = slot; }
+        } else if (slot->id == id) {
+            if (slot->count == count && slot->coded == (coded_len > 0)
+                && (coded_len == 0 || slot->len == coded_len)) {
+                return slot;
+            }
+            // Same id but a different shape: the id wrapped, start over
+            slot_clear(slot);
+            free_slot = slot;
+            break;
+        } else if (oldest == NULL || slot->first_ms < oldest->first_ms) {
+            oldest = slot;
+        }
+    }
+    if (free_slot == NULL) {
+        slot_clear(oldest);
+        rx->expired++;
+        free_slot = oldest;
+    }
+    // Coded messages keep up to count parity symbols after the data
+    size_t size = coded_len > 0 ? 2 * count * (rx->mtu - FRAG_CODED_HEADER)
+                                : count * (rx->mtu - FRAG_HEADER);
+    free_slot->data = malloc(size);
+    if (free_slot->data == NULL) { return NULL; }
+    free_slot->used = 1;
+    free_slot->id = id;
+    free_slot->count = count;
+    free_slot->first_ms = now_ms;
+    free_slot->coded = coded_len > 0;
+    free_slot->len = coded_len;
+    return free_slot;
+}
+
+// Delivers the messages of a coalesced frame once all their lengths add up
+static int unbatch(frag_rx* rx, const unsigned char* frame, size_t len) {
+    unsigned count = frame[2] + 1u;
+    size_t pos = FRAG_HEADER;
+    for (unsigned i = 0; i < count; ++i) {
+        if (pos >= len || frame[pos] == 0 || pos + 1 + frame[pos] > len) { return -1; }
+        pos += 1 + frame[pos];
+    }
+    if (pos != len) { return -1; }
+    for (pos = FRAG_HEADER; pos < len; pos += 1 + frame[pos]) {
+        rx->deliver(frame + pos + 1, frame[pos], rx->arg);
+        rx->completed++;
+    }
+    return 1;
+}
+
+// Rebuilds a coded message from k of its symbols and delivers it
+static int decode(frag_rx* rx, frag_slot* slot) {
+    size_t symbol = rx->mtu - FRAG_CODED_HEADER;
+    uint8_t have[RS_MAX_SYMBOLS];
+    for (unsigned i = 0; i < slot->count; ++i) { have[i] = (slot->have[i / 32] >> (i % 32)) & 1; }
+    int missing = slot->received - slot->parities < slot->count;
+    unsigned char* parity = slot->data + slot->count * symbol;
+    int r = rs_decode(slot->data, have, slot->count, symbol, parity, slot->rows, slot->parities);
+    if (r == 0) {
+        rx->deliver(slot->data, slot->len, rx->arg);
+        rx->completed++;
+        if (missing) { rx->rebuilt++; }
+    }
+    // Late fragments of the message are recognized and dropped
+    rx->done[rx->done_next] = slot->id | (slot->count - 1) << 8 | (uint32_t) slot->len << 16;
+    rx->done_next = (rx->done_next + 1) % FRAG_RX_SLOTS;
+    slot_clear(slot);
+    return r == 0 ? 1 : -1;
+}
+
+// Adds a coded fragment, delivering its message once k symbols are in
+static int push_coded(frag_rx* rx, const unsigned char* frame, size_t len, long now_ms) {
+    size_t symbol = rx->mtu - FRAG_CODED_HEADER;
+    if (len <= FRAG_CODED_HEADER || rx->mtu <= FRAG_CODED_HEADER) { return -1; }
+    unsigned index = frame[3];
+    unsigned k = frame[4] + 1u;
+    size_t msg_len = frame[5] | (size_t) frame[6] << 8;
+    size_t n = len - FRAG_CODED_HEADER;
+    if (msg_len == 0 || msg_len > k * symbol || msg_len <= (k - 1) * symbol
+        || index >= RS_MAX_SYMBOLS || k >= RS_MAX_SYMBOLS) {
+        return -1;
+    }
+    // Data symbols are cut short at the end of the message, parity never is
+    size_t expected = index < k ? (msg_len - index * symbol < symbol ? msg_len - index * symbol
+                                                                     : symbol)
+                                : symbol;
+    if (n != expected) { return -1; }
+    uint32_t key = frame[0] | (uint32_t) frame[4] << 8 | (uint32_t) msg_len << 16;
+    for (int i = 0; i < FRAG_RX_SLOTS; ++i) {
+        if (rx->done[i] == key) { return 0; }
+    }
+    frag_rx_expire(rx, now_ms);
+    frag_slot* slot = slot_for(rx, frame[0], k, msg_len, now_ms);
+    if (slot == NULL) { return -1; }
+    uint32_t bit = 1u << (index % 32);
+    if (slot->have[index / 32] & bit) { return 0; }  // Duplicate
+    if (index < k) {
+        memcpy(slot->data + index * symbol, frame + FRAG_CODED_HEADER, n);
+        memset(slot->data + index * symbol + n, 0, symbol - n);
+    } else {
+        // Only k symbols are ever needed, so there is room for any parity
+        memcpy(slot->data + (k + slot->parities) * symbol, frame + FRAG_CODED_HEADER, n);
+        slot->rows[slot->parities++] = (uint8_t) (index - k);
+    }
+    slot->have[index / 32] |= bit;
+    if (++slot->received < k) { return 0; }
+    return decode(rx, slot);
+}
+
+int frag_rx_push(frag_rx* rx, const unsigned char* frame, size_t len, long now_ms) {
+    size_t payload = rx->mtu - FRAG_HEADER;
+    if (len <= FRAG_HEADER || len > rx->mtu) { return -1; }
+    if (frame[1] == FRAG_BATCH && frame[2] == FRAG_CODED) {
+        return push_coded(rx, frame, len, now_ms);
+    } else if (frame[1] == FRAG_BATCH && frame[2] != FRAG_BATCH) {
+        return unbatch(rx, frame, len);
+    }
+    uint8_t id = frame[0];
+    unsigned index = frame[1];
+    unsigned count = frame[2] + 1u;
+    size_t n = len - FRAG_HEADER;
+    if (index >= count || (index + 1 < count && n != payload)) { return -1; }
+    // Messages that fit in one frame skip reassembly
+    if (count == 1) {
+        rx->deliver(frame + FRAG_HEADER, n, rx->arg);
+        rx->completed++;
+        return 1;
+    }
+    frag_rx_expire(rx, now_ms);
+    frag_slot* slot = slot_for(rx, id, count, 0, now_ms);
+    if (slot == NULL) { return -1; }
+    uint32_t bit = 1u << (index % 32);
+    if (slot->have[index / 32] & bit) { return 0; }  // Duplicate
+    slot->have[index / 32] |= bit;
+    memcpy(slot->data + index * payload, frame + FRAG_HEADER, n);
+    if (index + 1 == count) { slot->len = index * payload + n; }
+    if (++slot->received < count) { return 0; }
+    rx->deliver(slot->data, slot->len, rx->arg);
+    rx->completed++;
+    slot_clear(slot);
+    return 1;
+}
+
+int frag_rx_expire(frag_rx* rx, long now_ms) {
+    int dropped = 0;
+    for (int i = 0; i < FRAG_RX_SLOTS; ++i) {
+        frag_slot* slot = &rx->slots[i];
+        if (slot->used && now_ms - slot->first_ms > rx->timeout_ms) {
+            slot_clear(slot);
+            rx->expired++;
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+void frag_rx_free(frag_rx* rx) {
+    for (int i = 0; i < FRAG_RX_SLOTS; ++i) {
+        if (rx->slots[i].used) { slot_clear(&rx->slots[i]); }
+    }
+}
@@ -0,0 +1,66 @@
+#include "frame.h"
+
+void frame_pool_init(frame_pool* pool) {
+    pool->free = NULL;
+    for (int i = FRAME_POOL - 1; i >= 0; --i) {
+        frame* f = &pool->frames[i];
+        f->pool = pool;
+        f->next = pool->free;
+        pool->free = f;
+    }
+    pool->available = FRAME_POOL;
+    pool->exhausted = 0;
+}
+
+frame* frame_alloc(frame_pool* pool) {
+    frame* f = pool->free;
+    if (f == NULL) {
+        pool->exhausted++;
+        return NULL;
+    }
+    pool->free = f->next;
+    pool->available--;
+    f->next = NULL;
+    f->data = f->buf + FRAME_HEADROOM;
+    f->len = 0;
+    return f;
+}
+
+void frame_init(frame* f) {
+    f->pool = NULL;
+    f->next = NULL;
+    f->data = f->buf + FRAME_HEADROOM;
+    f->len = 0;
+}
+
+void frame_release(frame* f) {
+    if (f == NULL || f->pool == NULL) { return; }
+    f->next = f->pool->free;
+    f->pool->free = f;
+    f->pool->available++;
+}
+
+unsigned char* frame_push(frame* f, size_t n) {
+    if ((size_t) (f->data - f->buf) < n) { return NULL; }
+    f->data -= n;
+    f->len += n;
+    return f->data;
+}
+
+unsigned char* frame_pull(frame* f, size_t n) {
+    if (n > f->len) { return NULL; }
+    f->data += n;
+    f->len -= n;
+    return f->data;
+}
+
+unsigned char* frame_put(frame* f, size_t n) {
+    if (frame_tailroom(f) < n) { return NULL; }
+    unsigned char* tail = f->data + f->len;
+    f->len += n;
+    return tail;
+}
+
+size_t frame_tailroom(const frame* f) {
+    return (size_t) (f->buf + FRAME_SIZE - (f->data + f->len));
+}
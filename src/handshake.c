@@ -0,0 +1,188 @@
+#include "handshake.h"
+#include <string.h>
+
+// Progress of a handshake this end started
+enum { HS_IDLE, HS_WAIT_REPLY, HS_WAIT_DONE, HS_KEYED };
+
+// Progress of a handshake the peer started
+enum { HS_UNANSWERED, HS_REPLIED, HS_CONFIRMED };
+
+static const char label_key[] = "wio session key";
+static const char label_reply[] = "wio reply";
+static const char label_confirm[] = "wio confirm";
+
+// Hashes the shared secret and both public keys into the session key,
+// keyed with the passphrase key so that only the two ends can derive it
+static void derive(hs* h, const unsigned char* shared, const unsigned char* initiator,
+                   const unsigned char* responder) {
+    crypto_generichash_state st;
+    crypto_generichash_init(&st, h->psk, sizeof(h->psk), sizeof(h->key));
+    crypto_generichash_update(&st, (const unsigned char*) label_key, sizeof(label_key));
+    crypto_generichash_update(&st, shared, crypto_scalarmult_BYTES);
+    crypto_generichash_update(&st, initiator, crypto_scalarmult_BYTES);
+    crypto_generichash_update(&st, responder, crypto_scalarmult_BYTES);
+    crypto_generichash_final(&st, h->key, sizeof(h->key));
+    sodium_memzero(&st, sizeof(st));
+}
+
+// Tag showing the peer that this end derived the same key
+static void tag(const hs* h, const char* label, size_t len, unsigned char* out) {
+    crypto_generichash(out, HS_TAG, (const unsigned char*) label, len, h->key, sizeof(h->key));
+}
+
+static void new_keypair(hs* h) {
+    randombytes_buf(h->secret, sizeof(h->secret));
+    crypto_scalarmult_base(h->pub, h->secret);
+}
+
+static int send_hello(hs* h) {
+    unsigned char frame[1 + crypto_scalarmult_BYTES] = { HS_HELLO };
+    memcpy(frame + 1, h->pub, sizeof(h->pub));
+    return h->send(frame, sizeof(frame), 1, h->arg);
+}
+
+static int send_confirm(hs* h) {
+    unsigned char frame[1 + HS_TAG] = { HS_CONFIRM };
+    memcpy(frame + 1, h->confirm, HS_TAG);
+    return h->send(frame, sizeof(frame), 1, h->arg);
+}
+
+static int send_done(hs* h) {
+    unsigned char frame[1] = { HS_DONE };
+    return h->send(frame, sizeof(frame), 0, h->arg);
+}
+
+void hs_init(hs* h, const unsigned char* psk, long retry_ms, hs_send_cb send, hs_key_cb keyed,
+             void* arg) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->psk, psk, sizeof(h->psk));
+    h->retry_ms = retry_ms;
+    h->send = send;
+    h->keyed = keyed;
+    h->arg = arg;
+}
+
+// Sends again after half to all of the backoff, so that two ends that
+// started together do not keep colliding
+static void rearm(hs* h, long now_ms) {
+    h->deadline = now_ms + h->backoff_ms / 2 + randombytes_uniform(h->backoff_ms / 2 + 1);
+}
+
+// Waits for an answer, sending again after the current backoff
+static void wait_for(hs* h, int state, long now_ms) {
+    h->state = state;
+    h->backoff_ms = h->retry_ms;
+    rearm(h, now_ms);
+}
+
+int hs_start(hs* h, long now_ms) {
+    new_keypair(h);
+    wait_for(h, HS_WAIT_REPLY, now_ms);
+    return send_hello(h);
+}
+
+// Answers a HELLO with a new key pair, or the same REPLY if it is repeated
+static int on_hello(hs* h, const unsigned char* peer_pub) {
+    if (h->answered != HS_UNANSWERED && memcmp(h->peer_pub, peer_pub, sizeof(h->peer_pub)) == 0) {
+        return h->send(h->reply, sizeof(h->reply), 1, h->arg);
+    }
+    // Both ends started at once: the lower public key stays the initiator
+    if (h->state == HS_WAIT_REPLY && memcmp(h->pub, peer_pub, sizeof(h->pub)) <= 0) { return 0; }
+    new_keypair(h);
+    unsigned char shared[crypto_scalarmult_BYTES];
+    if (crypto_scalarmult(shared, h->secret, peer_pub) != 0) {
+        h->rejected++;
+        return -1;
+    }
+    derive(h, shared, peer_pub, h->pub);
+    sodium_memzero(shared, sizeof(shared));
+    sodium_memzero(h->secret, sizeof(h->secret));
+    h->state = HS_IDLE;
+    h->answered = HS_REPLIED;
+    memcpy(h->peer_pub, peer_pub, sizeof(h->peer_pub));
+    h->reply[0] = HS_REPLY;
+    memcpy(h->reply + 1, h->pub, sizeof(h->pub));
+    tag(h, label_reply, sizeof(label_reply), h->reply + 1 + sizeof(h->pub));
+    tag(h, label_confirm, sizeof(label_confirm), h->confirm);
+    return h->send(h->reply, sizeof(h->reply), 1, h->arg);
+}
+
+// Checks the responder's tag, then accepts the new key and confirms it
+static int on_reply(hs* h, const unsigned char* peer_pub, const unsigned char* peer_tag,
+                    long now_ms) {
+    if (h->state != HS_WAIT_REPLY) { return 0; }  // Repeated, already confirmed
+    unsigned char shared[crypto_scalarmult_BYTES];
+    if (crypto_scalarmult(shared, h->secret, peer_pub) != 0) {
+        h->rejected++;
+        return -1;
+    }
+    derive(h, shared, h->pub, peer_pub);
+    sodium_memzero(shared, sizeof(shared));
+    unsigned char expected[HS_TAG];
+    tag(h, label_reply, sizeof(label_reply), expected);
+    if (sodium_memcmp(expected, peer_tag, HS_TAG) != 0) {
+        // Answers another HELLO (e.g., one of a previous run)
+        h->rejected++;
+        return -1;
+    }
+    sodium_memzero(h->secret, sizeof(h->secret));
+    h->answered = HS_UNANSWERED;
+    // The peer may seal with the key as soon as it has the CONFIRM
+    h->keyed(h->key, 0, h->arg);
+    tag(h, label_confirm, sizeof(label_confirm), h->confirm);
+    wait_for(h, HS_WAIT_DONE, now_ms);
+    return send_confirm(h);
+}
+
+// Switches to the key the initiator confirmed
+static int on_confirm(hs* h, const unsigned char* peer_tag) {
+    if (h->answered == HS_UNANSWERED || sodium_memcmp(h->confirm, peer_tag, HS_TAG) != 0) {
+        h->rejected++;
+        return -1;
+    }
+    if (h->answered == HS_REPLIED) {
+        h->answered = HS_CONFIRMED;
+        h->sessions++;
+        h->keyed(h->key, 1, h->arg);
+    }
+    return send_done(h);
+}
+
+int hs_recv(hs* h, const unsigned char* frame, size_t len, long now_ms) {
+    if (len == 1 + crypto_scalarmult_BYTES && frame[0] == HS_HELLO) {
+        return on_hello(h, frame + 1);
+    } else if (len == 1 + crypto_scalarmult_BYTES + HS_TAG && frame[0] == HS_REPLY) {
+        return on_reply(h, frame + 1, frame + 1 + crypto_scalarmult_BYTES, now_ms);
+    } else if (len == 1 + HS_TAG && frame[0] == HS_CONFIRM) {
+        return on_confirm(h, frame + 1);
+    } else if (len == 1 && frame[0] == HS_DONE) {
+        if (h->state != HS_WAIT_DONE) { return 0; }
+        h->state = HS_KEYED;
+        h->sessions++;
+        h->keyed(h->key, 1, h->arg);
+        return 0;
+    }
+    return -1;
+}
+
+long hs_poll(hs* h, long now_ms) {
+    if (h->state != HS_WAIT_REPLY && h->state != HS_WAIT_DONE) { return -1; }
+    if (now_ms >= h->deadline) {
+        // A frame that could not be queued is simply sent at the next deadline
+        if (h->state == HS_WAIT_REPLY) {
+            send_hello(h);
+        } else {
+            send_confirm(h);
+        }
+        h->backoff_ms = h->backoff_ms * 2 > HS_MAX_RETRY_MS ? HS_MAX_RETRY_MS : h->backoff_ms * 2;
+        rearm(h, now_ms);
+    }
+    return h->deadline - now_ms;
+}
+
+void hs_clear(hs* h) {
+    sodium_memzero(h->psk, sizeof(h->psk));
+    sodium_memzero(h->secret, sizeof(h->secret));
+    sodium_memzero(h->key, sizeof(h->key));
+    sodium_memzero(h->confirm, sizeof(h->confirm));
+}
@@ -0,0 +1,220 @@
+#include "hex.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_X86 1
+#endif
+
+// Scalar implementation
+
+static const char digits[] = "0123456789ABCDEF";
+
+// Two output characters per byte value, built on first use
+static uint16_t enc_table[256];
+// Nibble value per character, 0xFF for non hex characters
+static uint8_t dec_table[256];
+
+static void hex_tables(void) {
+    for (int i = 0; i < 256; ++i) {
+        char pair[2] = { digits[i >> 4], digits[i & 0xF] };
+        memcpy(&enc_table[i], pair, 2);
+        dec_table[i] = 0xFF;
+    }
+    for (int i = 0; i < 10; ++i) { dec_table['0' + i] = i; }
+    for (int i = 0; i < 6; ++i) { dec_table['A' + i] = dec_table['a' + i] = 10 + i; }
+}
+
+static size_t encode_scalar(char* out, const unsigned char* in, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        memcpy(&out[2 * i], &enc_table[in[i]], 2);
+    }
+    return 2 * len;
+}
+
+static size_t decode_scalar(unsigned char* out, const char* in, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t hi = dec_table[(unsigned char) in[2 * i]];
+        uint8_t lo = dec_table[(unsigned char) in[2 * i + 1]];
+        if ((hi | lo) & 0xF0) { return i; }
+        out[i] = (unsigned char) (hi << 4 | lo);
+    }
+    return len;
+}
+
+#ifdef HEX_X86
+
+// SSE2 implementation
+
+// Turns nibbles (0-15) into '0'-'9' and 'A'-'F'
+static inline __m128i nibble_ascii_sse2(__m128i n) {
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+
+// Turns hex characters into nibbles, setting *valid to a 16 bit mask of valid lanes
+static inline __m128i ascii_nibble_sse2(__m128i c, int* valid) {
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                     _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    *valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+    __m128i digit = _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+    __m128i alpha = _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+    return _mm_or_si128(digit, alpha);
+}
+
+static size_t encode_sse2(char* out, const unsigned char* in, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) &in[i]);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0xF));
+        __m128i lo = _mm_and_si128(x, _mm_set1_epi8(0xF));
+        hi = nibble_ascii_sse2(hi);
+        lo = nibble_ascii_sse2(lo);
+        _mm_storeu_si128((__m128i*) &out[2 * i], _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*) &out[2 * i + 16], _mm_unpackhi_epi8(hi, lo));
+    }
+    return 2 * i + encode_scalar(out + 2 * i, in + i, len - i);
+}
+
+// Packs 16 nibbles (high, low, high, low, ...) into 8 bytes in each 16 bit lane
+static inline __m128i pack_nibbles_sse2(__m128i n) {
+    __m128i hi = _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00FF)), 4);
+    __m128i lo = _mm_srli_epi16(n, 8);
+    return _mm_or_si128(hi, lo);
+}
+
+static size_t decode_sse2(unsigned char* out, const char* in, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        int valid0, valid1;
+        __m128i a = ascii_nibble_sse2(_mm_loadu_si128((const __m128i*) &in[2 * i]), &valid0);
+        __m128i b = ascii_nibble_sse2(_mm_loadu_si128((const __m128i*) &in[2 * i + 16]), &valid1);
+        if ((valid0 & valid1) != 0xFFFF) { break; }  // Let the scalar path find where it stops
+        _mm_storeu_si128((__m128i*) &out[i],
+                         _mm_packus_epi16(pack_nibbles_sse2(a), pack_nibbles_sse2(b)));
+    }
+    return i + decode_scalar(out + i, in + 2 * i, len - i);
+}
+
+// AVX2 implementation
+
+__attribute__((target("avx2")))
+static inline __m256i nibble_ascii_avx2(__m256i n) {
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8(7));
+    return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letter);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ascii_nibble_avx2(__m256i c, unsigned* valid) {
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    *valid = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha));
+    __m256i digit = _mm256_and_si256(is_digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0')));
+    __m256i alpha = _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)));
+    return _mm256_or_si256(digit, alpha);
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(char* out, const unsigned char* in, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) &in[i]);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi8(0xF));
+        __m256i lo = _mm256_and_si256(x, _mm256_set1_epi8(0xF));
+        hi = nibble_ascii_avx2(hi);
+        lo = nibble_ascii_avx2(lo);
+        // Unpack works within 128 bit lanes, put the halves back in order
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*) &out[2 * i], _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*) &out[2 * i + 32], _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    // Leave the upper halves clean so the legacy SSE tail avoids transition stalls
+    _mm256_zeroupper();
+    return 2 * i + encode_sse2(out + 2 * i, in + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(unsigned char* out, const char* in, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned valid0, valid1;
+        __m256i a = ascii_nibble_avx2(_mm256_loadu_si256((const __m256i*) &in[2 * i]), &valid0);
+        __m256i b = ascii_nibble_avx2(_mm256_loadu_si256((const __m256i*) &in[2 * i + 32]), &valid1);
+        if ((valid0 & valid1) != 0xFFFFFFFFu) { break; }
+        __m256i pa = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x00FF)), 4),
+                                     _mm256_srli_epi16(a, 8));
+        __m256i pb = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(b, _mm256_set1_epi16(0x00FF)), 4),
+                                     _mm256_srli_epi16(b, 8));
+        // Pack works within 128 bit lanes, put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pa, pb), 0xD8);
+        _mm256_storeu_si256((__m256i*) &out[i], packed);
+    }
+    _mm256_zeroupper();
+    return i + decode_sse2(out + i, in + 2 * i, len - i);
+}
+
+#endif  // HEX_X86
+
+// Dispatch
+
+static hex_impl impl = HEX_SCALAR;
+static size_t (*encode_fn)(char*, const unsigned char*, size_t) = NULL;
+static size_t (*decode_fn)(unsigned char*, const char*, size_t) = NULL;
+
+int hex_use(hex_impl which) {
+    static pthread_once_t built = PTHREAD_ONCE_INIT;
+    pthread_once(&built, hex_tables);
+    switch (which) {
+        case HEX_SCALAR:
+            encode_fn = encode_scalar;
+            decode_fn = decode_scalar;
+            break;
+#ifdef HEX_X86
+        case HEX_SSE2:
+            encode_fn = encode_sse2;
+            decode_fn = decode_sse2;
+            break;
+        case HEX_AVX2:
+            if (!__builtin_cpu_supports("avx2")) { return -1; }
+            encode_fn = encode_avx2;
+            decode_fn = decode_avx2;
+            break;
+#endif
+        default:
+            return -1;
+    }
+    impl = which;
+    return 0;
+}
+
+static pthread_once_t selected = PTHREAD_ONCE_INIT;
+
+// Picks the fastest implementation the CPU supports
+static void hex_select(void) {
+    if (hex_use(HEX_AVX2) != 0 && hex_use(HEX_SSE2) != 0) { hex_use(HEX_SCALAR); }
+}
+
+size_t hex_encode(char* out, const unsigned char* in, size_t len) {
+    pthread_once(&selected, hex_select);
+    return encode_fn(out, in, len);
+}
+
+size_t hex_decode(unsigned char* out, const char* in, size_t len) {
+    pthread_once(&selected, hex_select);
+    return decode_fn(out, in, len);
+}
+
+const char* hex_name(void) {
+    static const char* names[] = { "scalar", "sse2", "avx2" };
+    pthread_once(&selected, hex_select);
+    return names[impl];
+}
@@ -0,0 +1,71 @@
+#include "hist.h"
+
+// Bucket holding v
+static unsigned bucket_of(uint32_t v) {
+    if (v < HIST_SUB) { return v; }
+    unsigned e = 31 - __builtin_clz(v);     // Highest set bit, at least HIST_SUB_BITS
+    unsigned shift = e - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) - HIST_SUB);
+}
+
+// Middle of the values falling in bucket i
+static uint32_t bucket_mid(unsigned i) {
+    if (i < HIST_SUB) { return i; }
+    unsigned shift = i / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + i % HIST_SUB) << shift;
+    return (uint32_t) (low + ((1ULL << shift) >> 1));
+}
+
+void hist_init(hist* h) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) { atomic_init(&h->buckets[i], 0); }
+    atomic_init(&h->count, 0);
+    atomic_init(&h->sum, 0);
+    atomic_init(&h->min, UINT32_MAX);
+    atomic_init(&h->max, 0);
+}
+
+void hist_record(hist* h, uint32_t v) {
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+    uint32_t cur = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (v < cur && !atomic_compare_exchange_weak(&h->min, &cur, v)) { }
+    cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (v > cur && !atomic_compare_exchange_weak(&h->max, &cur, v)) { }
+    // Counted last so readers never see more values than buckets hold
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+uint32_t hist_percentile(const hist* h, double p) {
+    unsigned long count = atomic_load_explicit(&h->count, memory_order_acquire);
+    if (count == 0) { return 0; }
+    unsigned long rank = (unsigned long) (p / 100.0 * count + 0.5);
+    if (rank < 1) { rank = 1; }
+    if (rank > count) { rank = count; }
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            // The bucket's middle may lie outside what was actually recorded
+            uint32_t v = bucket_mid(i);
+            uint32_t min = atomic_load_explicit(&h->min, memory_order_relaxed);
+            uint32_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            return v < min ? min : v > max ? max : v;
+        }
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void hist_summary(const hist* h, hist_stats* s) {
+    s->count = atomic_load_explicit(&h->count, memory_order_acquire);
+    if (s->count == 0) {
+        *s = (hist_stats) { 0 };
+        return;
+    }
+    s->min = atomic_load_explicit(&h->min, memory_order_relaxed);
+    s->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    s->mean = (double) atomic_load_explicit(&h->sum, memory_order_relaxed) / s->count;
+    s->p50 = hist_percentile(h, 50);
+    s->p90 = hist_percentile(h, 90);
+    s->p99 = hist_percentile(h, 99);
+    s->p999 = hist_percentile(h, 99.9);
+}
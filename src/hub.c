@@ -0,0 +1,324 @@
+#define _GNU_SOURCE         // accept4
+#include "hub.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STATS_MAX (32 << 10) // Longest STATS line, a few radios bonded
+#define REPLY_MAX (STATS_MAX + 8)   // Longest answer to a request
+
+static void on_accept(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_client(reactor* loop, int fd, uint32_t events, void* arg);
+
+int hub_open(hub* h, reactor* loop, const char* path, hub_send_cb send, hub_stats_cb stats,
+             void* arg) {
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < HUB_CLIENTS; ++i) { h->clients[i].fd = -1; }
+    h->loop = loop;
+    h->send = send;
+    h->stats_cb = stats;
+    h->arg = arg;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    snprintf(h->path, sizeof(h->path), "%s", path);
+    h->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (h->fd < 0) { return -1; }
+    if (bind(h->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 && errno == EADDRINUSE) {
+        // Left by a daemon that crashed, unless one still answers on it
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+        if (probe >= 0) { close(probe); }
+        if (!live) { unlink(path); }
+        errno = EADDRINUSE;
+        if (live || bind(h->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            close(h->fd);
+            return -1;
+        }
+    }
+    if (listen(h->fd, SOMAXCONN) != 0 || reactor_add(loop, h->fd, EPOLLIN, on_accept, h) != 0) {
+        close(h->fd);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+static hub_client* find_client(hub* h, int fd) {
+    for (int i = 0; i < HUB_CLIENTS; ++i) {
+        if (h->clients[i].fd == fd) { return &h->clients[i]; }
+    }
+    return NULL;
+}
+
+static void drop_client(hub* h, hub_client* c) {
+    reactor_remove(h->loop, c->fd);
+    close(c->fd);
+    while (c->count > 0) {
+        free(c->queue[c->head].data);
+        c->head = (c->head + 1) % HUB_CLIENT_QUEUE;
+        c->count--;
+        h->queued--;
+    }
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    if (&h->clients[h->turn] == c) { h->turn_started = 0; }
+}
+
+// Tells whether the answer to any request fits in what a client has waiting
+static int has_room(const hub_client* c) {
+    return c->out_len + REPLY_MAX <= HUB_OUT_MAX;
+}
+
+// Watches a client for requests only while their answers have room, and for
+// room to write only while replies are waiting. A client reading slowly is
+// thus held back instead of losing answers.
+static int watch(hub* h, hub_client* c) {
+    int reading = has_room(c);
+    int writing = c->out_len > 0;
+    if (c->reading == reading && c->writing == writing) { return 0; }
+    c->reading = reading;
+    c->writing = writing;
+    reactor_remove(h->loop, c->fd);
+    return reactor_add(h->loop, c->fd, (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0),
+                       on_client, h);
+}
+
+// Writes what the socket takes of the buffered replies
+static int flush(hub* h, hub_client* c) {
+    size_t done = 0;
+    while (done < c->out_len) {
+        ssize_t r = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) { continue; }
+        if (r < 0 && errno == EAGAIN) { break; }
+        if (r < 0) { return -1; }
+        done += r;
+    }
+    memmove(c->out, c->out + done, c->out_len - done);
+    c->out_len -= done;
+    return watch(h, c);
+}
+
+// Queues a line for a client, failing if it has more than HUB_OUT_MAX
+// waiting already
+static int reply(hub* h, hub_client* c, const char* head, const char* text, size_t len) {
+    size_t head_len = strlen(head);
+    size_t total = head_len + len + 1;
+    if (c->out_len + total > HUB_OUT_MAX) { return -1; }
+    if (c->out == NULL) {
+        c->out = malloc(HUB_OUT_MAX);
+        if (c->out == NULL) { return -1; }
+    }
+    memcpy(c->out + c->out_len, head, head_len);
+    memcpy(c->out + c->out_len + head_len, text, len);
+    c->out[c->out_len + total - 1] = '\n';
+    c->out_len += total;
+    return 0;
+}
+
+static void on_accept(reactor* loop, int fd, uint32_t events, void* arg) {
+    hub* h = (hub*) arg;
+    for (;;) {
+        int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) { return; }
+        hub_client* c = find_client(h, -1);
+        if (c == NULL || reactor_add(loop, cfd, EPOLLIN, on_client, h) != 0) {
+            send(cfd, "ERR busy\n", 9, MSG_NOSIGNAL);
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        c->reading = 1;
+        h->stats.accepted++;
+    }
+}
+
+// Queues a message of a client, sent with the trailing NUL of chat messages
+static const char* queue_message(hub* h, hub_client* c, const char* text, size_t len) {
+    if (len == 0) { return "empty message"; }
+    for (size_t i = 0; i < len; ++i) {
+        if ((unsigned char) text[i] < 32) { return "control character in message"; }
+    }
+    if (c->count == HUB_CLIENT_QUEUE) { return "queue full"; }
+    hub_msg* m = &c->queue[(c->head + c->count) % HUB_CLIENT_QUEUE];
+    m->data = malloc(len + 1);
+    if (m->data == NULL) { return "out of memory"; }
+    memcpy(m->data, text, len);
+    m->data[len] = '\0';
+    m->len = len + 1;
+    c->count++;
+    h->queued++;
+    return NULL;
+}
+
+// Answers a request, which has room for its answer
+//
+// @return 0 on success, or -1 if the answer could not be queued
+static int handle(hub* h, hub_client* c, char* line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r') { len--; }
+    h->stats.requests++;
+    if (len >= 5 && memcmp(line, "SEND ", 5) == 0) {
+        const char* error = queue_message(h, c, line + 5, len - 5);
+        if (error != NULL) { return reply(h, c, "ERR ", error, strlen(error)); }
+        if (reply(h, c, "OK", "", 0) != 0) { return -1; }
+        hub_pump(h);
+        return 0;
+    } else if (len == 3 && memcmp(line, "SUB", 3) == 0) {
+        c->subscribed = 1;
+        return reply(h, c, "OK", "", 0);
+    } else if (len == 5 && memcmp(line, "UNSUB", 5) == 0) {
+        c->subscribed = 0;
+        return reply(h, c, "OK", "", 0);
+    } else if (len == 5 && memcmp(line, "STATS", 5) == 0) {
+        char text[STATS_MAX];
+        long n = h->stats_cb(text, sizeof(text), h->arg);
+        while (n > 0 && text[n - 1] == '\n') { n--; }
+        if (n < 0) { return reply(h, c, "ERR ", "no statistics", 13); }
+        return reply(h, c, "STATS ", text, n);
+    }
+    return reply(h, c, "ERR ", "unknown request", 15);
+}
+
+// Answers the complete request lines buffered, as long as the answers have
+// room; the others wait for the client to read what it has
+//
+// @return 0 on success, or -1 if the client must be dropped
+static int serve(hub* h, hub_client* c) {
+    char* start = c->in;
+    char* end;
+    while (has_room(c) && (end = memchr(start, '\n', c->in + c->in_len - start)) != NULL) {
+        if (handle(h, c, start, end - start) != 0) { return -1; }
+        start = end + 1;
+    }
+    c->in_len -= start - c->in;
+    memmove(c->in, start, c->in_len);
+    return 0;
+}
+
+static void on_client(reactor* loop, int fd, uint32_t events, void* arg) {
+    hub* h = (hub*) arg;
+    hub_client* c = find_client(h, fd);
+    if (c == NULL) { return; }
+    if ((events & EPOLLOUT) && flush(h, c) != 0) {
+        drop_client(h, c);
+        return;
+    }
+    // Requests held back while the client was not reading its answers
+    if (serve(h, c) != 0) {
+        drop_client(h, c);
+        return;
+    }
+    // Every complete line is a request, read while the answers have room
+    while ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && has_room(c)) {
+        if (c->in_len == sizeof(c->in)) {
+            reply(h, c, "ERR ", "line too long", 13);
+            flush(h, c);
+            drop_client(h, c);
+            return;
+        }
+        ssize_t r = read(fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (r < 0 && errno == EINTR) { continue; }
+        if (r < 0 && errno == EAGAIN) { break; }
+        if (r <= 0) {
+            drop_client(h, c);
+            return;
+        }
+        c->in_len += r;
+        if (serve(h, c) != 0) {
+            drop_client(h, c);
+            return;
+        }
+    }
+    for (;;) {
+        if (flush(h, c) != 0) {
+            drop_client(h, c);
+            return;
+        }
+        // What the socket took may make room for the requests still waiting,
+        // which no event would bring back
+        if (!has_room(c) || memchr(c->in, '\n', c->in_len) == NULL) { return; }
+        if (serve(h, c) != 0) {
+            drop_client(h, c);
+            return;
+        }
+    }
+}
+
+static void next_turn(hub* h) {
+    h->turn = (h->turn + 1) % HUB_CLIENTS;
+    h->turn_started = 0;
+}
+
+void hub_pump(hub* h) {
+    // Deficit round robin: each round a client gets HUB_QUANTUM more bytes
+    // and sends the messages that fit in what it has
+    while (h->queued > 0) {
+        hub_client* c = &h->clients[h->turn];
+        if (c->fd < 0 || c->count == 0) {
+            next_turn(h);
+            continue;
+        }
+        if (!h->turn_started) {
+            c->deficit += HUB_QUANTUM;
+            h->turn_started = 1;
+        }
+        hub_msg* m = &c->queue[c->head];
+        if (m->len > c->deficit) {
+            next_turn(h);
+            continue;
+        }
+        if (h->send(m->data, m->len, h->arg) != 0) { return; }
+        c->deficit -= m->len;
+        free(m->data);
+        c->head = (c->head + 1) % HUB_CLIENT_QUEUE;
+        c->count--;
+        h->queued--;
+        h->stats.sent++;
+        if (c->count == 0) {
+            // An idle client does not save up for later
+            c->deficit = 0;
+            next_turn(h);
+        }
+    }
+}
+
+int hub_pending(const hub* h) {
+    return h->queued > 0;
+}
+
+void hub_deliver(hub* h, const unsigned char* msg, size_t len) {
+    char text[HUB_LINE_MAX];
+    if (len > 0 && msg[len - 1] == '\0') { len--; }
+    if (len > sizeof(text)) { len = sizeof(text); }
+    // Lines frame the messages, so line breaks in one become spaces
+    for (size_t i = 0; i < len; ++i) {
+        text[i] = msg[i] == '\n' || msg[i] == '\r' ? ' ' : (char) msg[i];
+    }
+    for (int i = 0; i < HUB_CLIENTS; ++i) {
+        hub_client* c = &h->clients[i];
+        if (c->fd < 0 || !c->subscribed) { continue; }
+        if (reply(h, c, "MSG ", text, len) != 0) {
+            h->stats.dropped++;
+            continue;
+        }
+        h->stats.delivered++;
+        if (flush(h, c) != 0) { drop_client(h, c); }
+    }
+}
+
+void hub_close(hub* h) {
+    for (int i = 0; i < HUB_CLIENTS; ++i) {
+        if (h->clients[i].fd >= 0) { drop_client(h, &h->clients[i]); }
+    }
+    reactor_remove(h->loop, h->fd);
+    close(h->fd);
+    unlink(h->path);
+}
@@ -0,0 +1,126 @@
+#include "keycache.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sodium.h>
+
+#define KEY_LEN crypto_aead_chacha20poly1305_KEYBYTES
+#define TAG_LEN crypto_generichash_BYTES
+
+// Layout of the file: magic, limits the key was derived with, tag, key
+#define MAGIC "WIOK\x01"
+#define MAGIC_LEN 5
+#define LIMITS_LEN 16
+#define RECORD_LEN (MAGIC_LEN + LIMITS_LEN + TAG_LEN + KEY_LEN)
+
+static void put_le64(unsigned char* out, unsigned long long v) {
+    for (int i = 0; i < 8; ++i) { out[i] = (unsigned char) (v >> (8 * i)); }
+}
+
+// Tag binding the cached key to the passphrase it was derived from
+static void passphrase_tag(unsigned char* out, const unsigned char* key, const char* password) {
+    crypto_generichash(out, TAG_LEN, (const unsigned char*) password, strlen(password),
+                       key, KEY_LEN);
+}
+
+// Record for a key derived from password with the current limits
+static void make_record(unsigned char* rec, const unsigned char* key, const char* password) {
+    memcpy(rec, MAGIC, MAGIC_LEN);
+    put_le64(rec + MAGIC_LEN, crypto_pwhash_OPSLIMIT_INTERACTIVE);
+    put_le64(rec + MAGIC_LEN + 8, crypto_pwhash_MEMLIMIT_INTERACTIVE);
+    passphrase_tag(rec + MAGIC_LEN + LIMITS_LEN, key, password);
+    memcpy(rec + MAGIC_LEN + LIMITS_LEN + TAG_LEN, key, KEY_LEN);
+}
+
+// Reads the cached key if the file is private to the user and holds the key
+// of this passphrase
+static int load(unsigned char* key, const char* password, const char* path) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) { return -1; }
+    struct stat st;
+    unsigned char rec[RECORD_LEN];
+    int r = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+        && (st.st_mode & (S_IRWXG | S_IRWXO)) == 0 && st.st_size == RECORD_LEN
+        && read(fd, rec, sizeof(rec)) == RECORD_LEN) {
+        const unsigned char* cached = rec + MAGIC_LEN + LIMITS_LEN + TAG_LEN;
+        unsigned char expected[RECORD_LEN];
+        make_record(expected, cached, password);
+        if (sodium_memcmp(expected, rec, RECORD_LEN) == 0) {
+            memcpy(key, cached, KEY_LEN);
+            r = 0;
+        }
+        sodium_memzero(expected, sizeof(expected));
+    }
+    sodium_memzero(rec, sizeof(rec));
+    close(fd);
+    return r;
+}
+
+// Creates the directories leading to path, private to the user
+static void make_parents(const char* path) {
+    char dir[4096];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int) sizeof(dir)) { return; }
+    for (char* p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) { return; }
+        *p = '/';
+    }
+}
+
+// Writes a private temporary file next to path and renames it over path
+static int store(const unsigned char* key, const char* password, const char* path) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp)) { return -1; }
+    make_parents(path);
+    int fd = mkstemp(tmp);  // Mode 0600
+    if (fd < 0) { return -1; }
+    unsigned char rec[RECORD_LEN];
+    make_record(rec, key, password);
+    ssize_t r = write(fd, rec, sizeof(rec));
+    sodium_memzero(rec, sizeof(rec));
+    if (r != RECORD_LEN || fsync(fd) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int keycache_default_path(char* out, size_t len) {
+    const char* base = getenv("XDG_CACHE_HOME");
+    int r;
+    if (base != NULL && base[0] == '/') {
+        r = snprintf(out, len, "%s/%s", base, KEYCACHE_FILE);
+    } else if ((base = getenv("HOME")) != NULL && base[0] != '\0') {
+        r = snprintf(out, len, "%s/.cache/%s", base, KEYCACHE_FILE);
+    } else {
+        return -1;
+    }
+    return r < 0 || (size_t) r >= len ? -1 : 0;
+}
+
+int keycache_derive(unsigned char* key, const char* password, const char* path) {
+    int cached = path != NULL && path[0] != '\0';
+    if (cached && load(key, password, path) == 0) { return 0; }
+    unsigned char salt[crypto_pwhash_SALTBYTES];
+    memset(salt, 0, sizeof salt);
+    if (crypto_pwhash
+        (key, KEY_LEN, password, strlen(password), salt,
+         crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE,
+         crypto_pwhash_ALG_DEFAULT) != 0) {
+        // out of memory
+        return -1;
+    }
+    if (cached) { store(key, password, path); }
+    return 0;
+}
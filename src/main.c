@@ -1,41 +1,238 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include "term_interface.h"
 #include "ser.h"
 #include "wioe.h"
+#include "reactor.h"
+#include "frag.h"
+#include "arq.h"
+#include "airtime.h"
+#include "adr.h"
+#include "metrics.h"
+#include "bond.h"
+#include "mesh.h"
+#include "handshake.h"
+#include "keycache.h"
+#include "msglog.h"
+#include "xfer.h"
+#include "hub.h"
 
-// Callback for P2P using wioe.h
+#define FRAG_TIMEOUT_MS 30000 // Time allowed for all fragments of a message
+#define ARQ_WINDOW 8          // Default frames per burst
+#define ADR_MARGIN_DB 10      // SNR margin kept by the adaptive data rate
+#define METRICS_INTERVAL_MS 10000 // Statistics publishing period
+#define DUTY_WINDOW_MS 3600000    // Period of the duty cycle limit, one hour as in ETSI EN 300 220
+#define LOSS_GAIN 0.25        // Weight of each second in the loss estimate
+#define DAEMON_BATCH_MS 20    // Default coalescing in daemon mode, where clients send at once
+#define DAEMON_LINK_DEPTH 8   // Messages of local clients queued on the link at most
+
+// State shared by the event loop callbacks
 struct callback_args {
-    wioe* device;
-    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    bond radios;          // One or more modules used as one link
+    wioe* device;         // The first module
+    wioe_params params;
+    term* info;           // NULL in daemon mode
+    int term_timer;       // Next screen update of the terminal
+    reactor* loop;
+    int expire_timer;
+    frag_tx frag_out;
+    frag_rx frag_in;
+    arq link;
+    int arq_timer;
+    int adaptive;         // Adaptive data rate enabled
+    adr rate;
+    int adr_timer;
+    const char* metrics;  // Where statistics are published, NULL if nowhere
+    int meshed;           // Frames are routed through a mesh of nodes
+    mesh node;
+    int mesh_timer;
+    uint8_t peer;         // Node at the other end of the link
+    int keyed;            // Session keys are agreed with the peer
+    hs shake;
+    int hs_timer;
+    int fec;              // Parity percent, FRAG_FEC_AUTO, or 0 if off
+    double loss;          // Estimated loss of frames from the peer
+    wioe_link_stats seen; // Link counters at the last estimate
+    int loss_sent;        // Last loss reported to the peer, in 1/255
+    msglog* log;          // Messages sent and received, NULL if not logged
+    xfer files;           // Files sent with /send and received into -x
+    int xfer_timer;
+    int daemon;           // Headless, serving local clients on a socket
+    hub clients;
+    int hub_timer;
 };
+
+// Callback for P2P using wioe.h
 int p2p_callback(char* arg, void* info_args);
 
 // Callback for P2P using wioe.h
 int p2p_cleanup(void* info_args);
 
+// Event loop callbacks
+static void on_expire(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_arq_timeout(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_adr_timeout(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_metrics(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_mesh_timeout(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_hs_timeout(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_stdin(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_term(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_cancel(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_message(const unsigned char* msg, size_t len, void* arg);
+static void recall_history(struct callback_args* info, const char* dir);
+static void on_packet(const unsigned char* data, size_t len, int rssi, int snr, void* arg);
+static void on_radio_error(int radio, const char* what, int fatal, void* arg);
+
+// Link callbacks
+static size_t link_source(unsigned char* buf, size_t len, void* arg);
+static int link_emit(const unsigned char* frame, size_t len, void* arg);
+static void link_deliver(const unsigned char* data, size_t len, void* arg);
+
+// Adaptive data rate callbacks
+static int rate_send(const unsigned char* frame, size_t len, void* arg);
+static void rate_apply(unsigned sf, unsigned bw, void* arg);
+static void link_timing(struct callback_args* info);
+
+// Mesh callbacks
+static int mesh_emit(const unsigned char* frame, size_t len, int local, void* arg);
+static void mesh_deliver(uint8_t src, const unsigned char* data, size_t len, void* arg);
+
+// Handshake callbacks
+static int hs_send(const unsigned char* frame, size_t len, int passphrase, void* arg);
+static void hs_keyed(const unsigned char* key, int send, void* arg);
+static void arm_handshake(struct callback_args* info);
+
+// Forward error correction
+static void track_loss(struct callback_args* info);
+
+// File transfer callbacks
+static int xfer_send(const unsigned char* msg, size_t len, void* arg);
+static void xfer_note(const char* text, void* arg);
+static void arm_xfer(struct callback_args* info);
+static void on_xfer_timeout(reactor* loop, int fd, uint32_t events, void* arg);
+
+// Daemon mode callbacks
+static int hub_send(const unsigned char* msg, size_t len, void* arg);
+static long hub_stats_json(char* out, size_t size, void* arg);
+static void on_hub_timeout(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_stop(reactor* loop, int fd, uint32_t events, void* arg);
+static void on_signal(int sig);
+static int stop_event = -1;   // Signals only wake the loop, which stops from its own thread
+
+// Prints a line on the terminal, or on stdout in daemon mode
+static void show(struct callback_args* info, const char* text);
+
+// Monotonic time in milliseconds
+static long now_ms(void);
+
+// Where the sessions heard by a radio are kept across restarts
+static int sessions_path(char* out, size_t len, const char* key_cache, int radio);
+
 // Main loop, first we get the passkey from the user, setup the device and use
 // a basic listening/send protocol to allow users to message each other if
 // they are using the same wioe_params and encryption passkey
 int main(int argc, char** argv) {
     // Args
-    if (argc != 3){
-        puts("usage: ./wio device_path password");
+    int reliable = 0;
+    int adaptive = 0;
+    unsigned window = ARQ_WINDOW;
+    const char* metrics = NULL;
+    int node = 0;
+    int peer = 0;
+    double duty_cycle = 0;
+    long batch_ms = 0;
+    int batch_set = 0;
+    const char* socket_path = NULL;
+    int fec = 0;
+    long baud = 0;
+    const char* files_dir = NULL;
+    static char key_cache[4096];
+    if (keycache_default_path(key_cache, sizeof(key_cache)) != 0) { key_cache[0] = '\0'; }
+    static char log_dir[4096];
+    if (msglog_default_path(log_dir, sizeof(log_dir)) != 0) { log_dir[0] = '\0'; }
+    int opt;
+    while ((opt = getopt(argc, argv, "ab:c:D:d:f:k:l:m:n:rs:w:x:")) != -1) {
+        if (opt == 'a') {
+            adaptive = 1;
+        } else if (opt == 'b') {
+            batch_ms = atol(optarg);
+            batch_set = 1;
+        } else if (opt == 'c') {
+            duty_cycle = atof(optarg) / 100;
+        } else if (opt == 'D') {
+            socket_path = optarg;
+        } else if (opt == 'd') {
+            peer = atoi(optarg);
+        } else if (opt == 'f') {
+            fec = strcmp(optarg, "auto") == 0 ? FRAG_FEC_AUTO : atoi(optarg);
+        } else if (opt == 'k') {
+            snprintf(key_cache, sizeof(key_cache), "%s", optarg);
+        } else if (opt == 'l') {
+            snprintf(log_dir, sizeof(log_dir), "%s", optarg);
+        } else if (opt == 'm') {
+            metrics = optarg;
+        } else if (opt == 'n') {
+            node = atoi(optarg);
+        } else if (opt == 'r') {
+            reliable = 1;
+        } else if (opt == 's') {
+            baud = atol(optarg);
+        } else if (opt == 'w') {
+            window = (unsigned) atoi(optarg);
+        } else if (opt == 'x') {
+            files_dir = optarg;
+        } else {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 2 || (node != 0) != (peer != 0) || duty_cycle < 0 || duty_cycle > 1
+        || batch_ms < 0 || (fec < 0 && fec != FRAG_FEC_AUTO) || baud < 0) {
+        puts("usage: ./wio [-a] [-b batch_ms] [-c duty_cycle_percent] [-D socket] [-f parity_percent|auto] [-k key_cache] [-l log_dir] [-m metrics_target] [-n node -d peer] [-r] [-s baud] [-w window] [-x files_dir] device_path[,device_path...]|auto password");
         return EXIT_FAILURE;
     }
-    // Get path
-    char path[32];
-    int r = snprintf(path, sizeof(path), "/dev/cu.%s", argv[1]);  // For macos
-    if (r < 0) { return 1; }
-    // Get key from password
-    unsigned char salt[crypto_pwhash_SALTBYTES];
-    memset(salt, 0, sizeof salt);
+    argv += optind - 1;
+    // Get paths, several modules are bonded into one link
+    static char paths[BOND_MAX_RADIOS][SER_MAX_PATH];
+    char* path_list[BOND_MAX_RADIOS];
+    int radios = 0;
+    int r;
+    if (strcmp(argv[1], "auto") == 0) {
+        // Every module plugged in, bonded if there are several
+        radios = ser_autodetect(paths, BOND_MAX_RADIOS, (unsigned) baud);
+        if (radios == 0) {
+            puts("no Wio-E5 module answering in " SER_BY_ID);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < radios; ++i) { path_list[i] = paths[i]; }
+    }
+    char* name = radios > 0 ? NULL : strtok(argv[1], ",");
+    for (; name != NULL; name = strtok(NULL, ",")) {
+        if (radios == BOND_MAX_RADIOS) {
+            printf("at most %d devices can be bonded\n", BOND_MAX_RADIOS);
+            return EXIT_FAILURE;
+        }
+        if (strchr(name, '/') != NULL) {  // Full path (e.g. an emulated module)
+            r = snprintf(paths[radios], sizeof(paths[radios]), "%s", name);
+        } else {
+#ifdef __APPLE__
+            r = snprintf(paths[radios], sizeof(paths[radios]), "/dev/cu.%s", name);
+#else
+            r = snprintf(paths[radios], sizeof(paths[radios]), "/dev/%s", name);  // e.g. ttyUSB0
+#endif
+        }
+        if (r < 0) { return 1; }
+        path_list[radios] = paths[radios];
+        radios++;
+    }
+    if (radios == 0) { return 1; }
+    // Get key from password, cached so that restarts skip the derivation
     unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
-    if (crypto_pwhash
-        (key, sizeof key, argv[2], strlen(argv[2]), salt,
-         crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE,
-         crypto_pwhash_ALG_DEFAULT) != 0) {
+    if (keycache_derive(key, argv[2], key_cache) != 0) {
         // out of memory
         return EXIT_FAILURE;
     }
@@ -46,58 +243,691 @@ int main(int argc, char** argv) {
         .spreading_factor = 7,
         .bandwidth = 500,
         .tx_preamble = 12,
-        .rx_preamble = 15,
-        .power = -10,
+        .rx_preamble = 12,
+        .power = 14,
         .crc = 1,
         .inverted_iq = 0,
         .public_lorawan = 0,
+        .baud = (unsigned) baud,
     };
-    wioe* dev = wioe_init(&params, path);
-    if (dev == NULL || !wioe_is_valid(dev)) {
+
+    // Setup event loop, everything below runs on this thread
+    static struct callback_args info_args;
+    info_args.params = params;
+    info_args.loop = reactor_create();
+    if (info_args.loop == NULL) {
+        perror("Failed to create event loop");
+        return EXIT_FAILURE;
+    }
+    // The radios start listening right away and are driven by the event loop
+    if (bond_init(&info_args.radios, info_args.loop, path_list, radios, &params, key,
+                  on_packet, on_radio_error, &info_args) != 0) {
         perror("Failed to initilize device");
         return EXIT_FAILURE;
     }
-
-    // Setup terminal
-    struct callback_args info_args;
+    // Packets of sessions heard before a restart are not taken again. In a
+    // mesh every node may be heard, directly or forwarded, and each must be
+    // recognised from any of its packets.
+    for (int i = 0; i < radios; ++i) {
+        char path[4096 + 16];
+        if (node != 0) { wioe_set_peers(bond_device(&info_args.radios, i), WIOE_MAX_PEERS, 1); }
+        if (sessions_path(path, sizeof(path), key_cache, i) == 0) {
+            wioe_load_sessions(bond_device(&info_args.radios, i), path);
+        }
+    }
+    wioe* dev = bond_device(&info_args.radios, 0);
     info_args.device = dev;
-    memcpy(info_args.key, key, sizeof key);
-    term* info = term_interface_async(&p2p_callback, &p2p_cleanup, (void*) &info_args);
-
-    // Basic communication protocol
-    while (!term_is_complete(info)) {
-        unsigned char buf[256];
-        int bytes = wioe_recieve_encrypted(dev, buf, sizeof buf, key);
-        if (bytes > 0) {
-            // Null terminate buf
-            buf[bytes] = '\0';
-            // Output
-            char out[512];
-            snprintf(out, sizeof(out), "\033[1;31mRecieved:\033[0m %s", buf);
-            term_print(info, out);
-        } else if (bytes < 0) {
-            perror("Error recieving message");
+    // Each radio keeps to the duty cycle on its own channel
+    for (int i = 0; i < radios; ++i) {
+        wioe_set_duty_cycle(bond_device(&info_args.radios, i), duty_cycle, DUTY_WINDOW_MS);
+    }
+    info_args.expire_timer = reactor_timer(info_args.loop, on_expire, &info_args);
+    info_args.arq_timer = reactor_timer(info_args.loop, on_arq_timeout, &info_args);
+    info_args.adr_timer = reactor_timer(info_args.loop, on_adr_timeout, &info_args);
+    if (info_args.expire_timer < 0 || info_args.arq_timer < 0 || info_args.adr_timer < 0
+        || reactor_timer_set(info_args.loop, info_args.expire_timer, 1000, 1) != 0
+        || reactor_add(info_args.loop, wioe_cancel_fd(dev), EPOLLIN, on_cancel, &info_args) != 0
+        || (socket_path == NULL
+            && reactor_add(info_args.loop, STDIN_FILENO, EPOLLIN, on_stdin, &info_args) != 0)) {
+        perror("Failed to setup event loop");
+        return EXIT_FAILURE;
+    }
+    // Statistics go to a file or socket periodically so a deployment can be watched
+    info_args.metrics = metrics;
+    if (metrics != NULL) {
+        int timer = reactor_timer(info_args.loop, on_metrics, &info_args);
+        if (timer < 0 || reactor_timer_set(info_args.loop, timer, METRICS_INTERVAL_MS, 1) != 0) {
+            perror("Failed to setup event loop");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Messages longer than one frame are split into fragments, which go
+    // through the link (optionally retransmitted until acknowledged)
+    size_t mtu = bond_mtu(&info_args.radios);
+    // Other nodes may relay the frames, the link runs end to end with the peer
+    info_args.meshed = node != 0;
+    if (info_args.meshed) {
+        if (peer < 1 || peer >= MESH_BROADCAST || peer == node
+            || mesh_init(&info_args.node, node, mtu, randombytes_random(),
+                         mesh_emit, mesh_deliver, &info_args) != 0) {
+            puts("node and peer addresses must differ and be between 1 and 254");
+            return EXIT_FAILURE;
+        }
+        info_args.peer = peer;
+        mtu = mesh_mtu(&info_args.node);
+        info_args.mesh_timer = reactor_timer(info_args.loop, on_mesh_timeout, &info_args);
+        if (info_args.mesh_timer < 0
+            || reactor_timer_set(info_args.loop, info_args.mesh_timer, 1, 0) != 0) {
+            perror("Failed to setup event loop");
+            return EXIT_FAILURE;
+        }
+        // Both ends of a rate switch must hear each other directly
+        adaptive = 0;
+    }
+    frag_tx_init(&info_args.frag_out, mtu - ARQ_HEADER);
+    if (socket_path != NULL && !batch_set) { batch_ms = DAEMON_BATCH_MS; }
+    // Short messages queued within the latency budget share a frame
+    frag_tx_coalesce(&info_args.frag_out, batch_ms);
+    frag_tx_fec(&info_args.frag_out, fec);
+    info_args.fec = fec;
+    info_args.loss_sent = -1;
+    frag_rx_init(&info_args.frag_in, mtu - ARQ_HEADER, FRAG_TIMEOUT_MS, on_message, &info_args);
+    if (arq_init(&info_args.link, reliable, window, mtu, 0,
+                 link_source, link_emit, link_deliver, &info_args) != 0) {
+        puts("window must be between 1 and 16");
+        return EXIT_FAILURE;
+    }
+    // Files go as messages of several frames, next to the chat
+    xfer_init(&info_args.files, 4 * (mtu - ARQ_HEADER - FRAG_HEADER), files_dir, xfer_send,
+              xfer_note, &info_args);
+    info_args.xfer_timer = reactor_timer(info_args.loop, on_xfer_timeout, &info_args);
+    if (info_args.xfer_timer < 0) {
+        perror("Failed to setup event loop");
+        return EXIT_FAILURE;
+    }
+    link_timing(&info_args);
+    // Each run agrees on a fresh key with the peer. Relays have to read the
+    // mesh header, so meshed nodes keep to the passphrase key.
+    info_args.keyed = !info_args.meshed;
+    if (info_args.keyed) {
+        hs_init(&info_args.shake, key, info_args.link.rto_ms, hs_send, hs_keyed, &info_args);
+        info_args.hs_timer = reactor_timer(info_args.loop, on_hs_timeout, &info_args);
+        if (info_args.hs_timer < 0) {
+            perror("Failed to setup event loop");
             return EXIT_FAILURE;
         }
-        usleep(20000);  // 20 ms
+        hs_start(&info_args.shake, now_ms());
+        arm_handshake(&info_args);
+    }
+    sodium_memzero(key, sizeof(key));
+    // The data rate starts at the configured one and follows the link margin
+    info_args.adaptive = adaptive;
+    if (adr_init(&info_args.rate, params.spreading_factor, params.bandwidth, params.tx_preamble,
+                 params.crc, ADR_MARGIN_DB, rate_send, rate_apply, &info_args) != 0) {
+        info_args.adaptive = 0;
     }
 
+    // Messages are kept across restarts (see wiolog to read them)
+    if (log_dir[0] != '\0') {
+        info_args.log = msglog_open(log_dir);
+        if (info_args.log == NULL && errno == EWOULDBLOCK) {
+            printf("Message log %s in use by another client, not logging\n", log_dir);
+        } else if (info_args.log == NULL) {
+            perror("Failed to open message log");
+        }
+    }
+
+    if (socket_path != NULL) {
+        // Daemon mode: local clients share the radio through the socket, and
+        // SIGINT or SIGTERM stops it
+        info_args.daemon = 1;
+        stop_event = reactor_event(info_args.loop, on_stop, &info_args);
+        info_args.hub_timer = reactor_timer(info_args.loop, on_hub_timeout, &info_args);
+        if (stop_event < 0 || info_args.hub_timer < 0) {
+            perror("Failed to setup event loop");
+            return EXIT_FAILURE;
+        }
+        if (hub_open(&info_args.clients, info_args.loop, socket_path, hub_send, hub_stats_json,
+                     &info_args) != 0) {
+            perror(socket_path);
+            return EXIT_FAILURE;
+        }
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        signal(SIGPIPE, SIG_IGN);
+        printf("Serving %s\n", socket_path);
+        fflush(stdout);
+    } else {
+        // Setup terminal
+        info_args.info = term_interface_attach(&p2p_callback, &p2p_cleanup, (void*) &info_args);
+        if (info_args.log != NULL) { recall_history(&info_args, log_dir); }
+        // The screen is updated in frames, when printed lines or keystrokes are pending
+        info_args.term_timer = reactor_timer(info_args.loop, on_term, &info_args);
+        if (info_args.term_timer < 0
+            || reactor_add(info_args.loop, term_wake_fd(info_args.info), EPOLLIN, on_term,
+                           &info_args) != 0) {
+            perror("Failed to setup event loop");
+            term_join(info_args.info);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Basic communication protocol, listen whenever we are not sending
+    r = reactor_run(info_args.loop);
+
     // Cleanup
-    wioe_destroy(dev);
+    if (info_args.daemon) {
+        hub_close(&info_args.clients);
+    } else {
+        term_join(info_args.info);
+    }
+    msglog_close(info_args.log);
+    xfer_free(&info_args.files);
+    if (metrics != NULL) { on_metrics(info_args.loop, -1, 0, &info_args); }
+    wioe_compress_stats stats;
+    bond_get_compress_stats(&info_args.radios, &stats);
+    if (stats.bytes_in > 0) {
+        printf("Compression: %lu of %lu packets, %lu -> %lu bytes (%.0f%%), %.1f ms of airtime saved\n",
+               stats.compressed, stats.packets, stats.bytes_in, stats.bytes_out,
+               100.0 * stats.bytes_out / stats.bytes_in, stats.airtime_saved_us / 1000.0);
+    }
+    wioe_link_stats link;
+    bond_get_link_stats(&info_args.radios, &link);
+    if (link.received > 0 || link.rejected > 0) {
+        printf("Received: %lu packets, %lu lost, %lu reordered, %lu replayed, %lu rejected\n",
+               link.received, link.lost, link.reordered, link.replayed, link.rejected);
+    }
+    unsigned long predicted_us = 0, measured_us = 0, delays = 0, delay_us = 0;
+    for (int i = 0; i < radios; ++i) {
+        wioe_stats s;
+        wioe_get_stats(bond_device(&info_args.radios, i), &s);
+        if (i == 0 && s.at_rtt.count > 0) {
+            printf("Serial: %s backend at %u baud, AT round trip p50 %.2f ms, p99 %.2f ms\n",
+                   ser_name(), params.baud > 0 ? params.baud : SERIAL_BAUD,
+                   s.at_rtt.p50 / 1000.0, s.at_rtt.p99 / 1000.0);
+        }
+        predicted_us += s.airtime_us;
+        measured_us += s.tx_time_us;
+        delays += s.duty_delays;
+        delay_us += s.duty_delay_us;
+    }
+    if (measured_us > 0) {
+        printf("Airtime: %.1f ms predicted, %.1f ms from TXLRPKT to TX DONE",
+               predicted_us / 1000.0, measured_us / 1000.0);
+        if (duty_cycle > 0) {
+            printf(", %lu sends held %.1f s by the %g%% duty cycle", delays, delay_us / 1e6,
+                   duty_cycle * 100);
+        }
+        putchar('\n');
+    }
+    if (info_args.frag_out.batches > 0) {
+        printf("Coalescing: %lu messages sent in %lu frames\n", info_args.frag_out.batched,
+               info_args.frag_out.batches);
+    }
+    if (info_args.frag_out.coded > 0 || info_args.frag_in.rebuilt > 0) {
+        printf("FEC: %lu messages coded, %lu parity fragments sent, %lu messages rebuilt\n",
+               info_args.frag_out.coded, info_args.frag_out.parity, info_args.frag_in.rebuilt);
+    }
+    if (info_args.adaptive) {
+        printf("Data rate: %lu changes, %lu reverted, %lu fallbacks to SF%u, %u kHz\n",
+               info_args.rate.changes, info_args.rate.reverts, info_args.rate.fallbacks,
+               params.spreading_factor, params.bandwidth);
+    }
+    if (radios > 1) {
+        printf("Bonding: %d radios, %lu frames reordered, %lu skipped, %lu late, frames sent:",
+               radios, info_args.radios.stats.reordered, info_args.radios.stats.skipped,
+               info_args.radios.stats.late);
+        for (int i = 0; i < radios; ++i) { printf(" %lu", info_args.radios.radios[i].frames); }
+        putchar('\n');
+    }
+    if (info_args.meshed) {
+        mesh_stats* m = &info_args.node.stats;
+        printf("Mesh: node %d, %d routes, %lu sent, %lu delivered, %lu forwarded, %lu flooded, "
+               "%lu suppressed, %lu duplicates, %lu ignored, %lu dropped\n",
+               node, info_args.node.route_count, m->sent, m->delivered, m->forwarded,
+               m->flooded, m->suppressed, m->duplicates, m->ignored, m->dropped);
+    }
+    if (info_args.files.chunks_sent > 0 || info_args.files.files_received > 0) {
+        printf("Files: %lu sent in %lu chunks, %lu received, %lu chunks rejected\n",
+               info_args.files.files_sent, info_args.files.chunks_sent,
+               info_args.files.files_received, info_args.files.chunks_rejected);
+    }
+    if (info_args.daemon) {
+        hub_stats* h = &info_args.clients.stats;
+        printf("Daemon: %lu clients, %lu requests, %lu messages sent, %lu delivered, %lu dropped\n",
+               h->accepted, h->requests, h->sent, h->delivered, h->dropped);
+    }
+    if (info_args.keyed) {
+        printf("Handshake: %lu session keys agreed, %lu frames rejected\n",
+               info_args.shake.sessions, info_args.shake.rejected);
+        hs_clear(&info_args.shake);
+    }
+    reactor_destroy(info_args.loop);
+    frag_tx_free(&info_args.frag_out);
+    frag_rx_free(&info_args.frag_in);
+    for (int i = 0; i < radios; ++i) {
+        char path[4096 + 16];
+        if (sessions_path(path, sizeof(path), key_cache, i) == 0
+            && wioe_save_sessions(bond_device(&info_args.radios, i), path) != 0) {
+            perror("Failed to save sessions");
+        }
+    }
+    bond_destroy(&info_args.radios);
     if (r < 0 ) { return EXIT_FAILURE; }
     return EXIT_SUCCESS;
 }
 
+static void show(struct callback_args* info, const char* text) {
+    if (info->info != NULL) {
+        term_print(info->info, (char*) text);
+    } else {
+        puts(text);
+        fflush(stdout);
+    }
+}
+
+static int sessions_path(char* out, size_t len, const char* key_cache, int radio) {
+    // Next to the key cache, and not kept without one
+    if (key_cache[0] == '\0') { return -1; }
+    return snprintf(out, len, "%s.sessions%d", key_cache, radio) < (int) len ? 0 : -1;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Sends what the link allows and restarts its ACK timer, which also wakes
+// up messages held for coalescing
+static void next_frames(struct callback_args* info) {
+    long ms = arq_poll(&info->link, now_ms());
+    arq_pump(&info->link);
+    long held = frag_tx_wait(&info->frag_out, now_ms());
+    if (held > 0 && (ms <= 0 || held < ms)) { ms = held; }
+    reactor_timer_set(info->loop, info->arq_timer, ms > 0 ? ms : 0, 0);
+}
+
+static size_t link_source(unsigned char* buf, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    size_t n = frag_tx_next(&info->frag_out, buf, now_ms());
+    // Chunks waiting for room are queued once the link takes the ones before
+    if (info->files.sending && info->frag_out.count < FRAG_TX_DEPTH / 2) {
+        reactor_timer_set(info->loop, info->xfer_timer, 1, 0);
+    }
+    if (info->daemon && hub_pending(&info->clients) && info->frag_out.count < DAEMON_LINK_DEPTH) {
+        reactor_timer_set(info->loop, info->hub_timer, 1, 0);
+    }
+    return n;
+}
+
+// Reports the outcome of a frame to the link
+static void on_sent(int status, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (status != 0) { show(info, "Error sending message"); }
+    arq_sent(&info->link, status, now_ms());
+    next_frames(info);
+}
+
+// Runs the mesh and restarts its timer
+static void arm_mesh(struct callback_args* info) {
+    long ms = mesh_poll(&info->node, now_ms());
+    reactor_timer_set(info->loop, info->mesh_timer, ms, 0);
+}
+
+static int link_emit(const unsigned char* frame, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (info->meshed) { return mesh_send(&info->node, info->peer, frame, len, now_ms()); }
+    return bond_send(&info->radios, frame, len, on_sent, info);
+}
+
+// Only the frames of the link report their outcome to it, the ones the mesh
+// relays or announces itself do not
+static int mesh_emit(const unsigned char* frame, size_t len, int local, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    return bond_send(&info->radios, frame, len, local ? on_sent : NULL, info);
+}
+
+static void link_deliver(const unsigned char* data, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    frag_rx_push(&info->frag_in, data, len, now_ms());
+}
+
+// Derives the timeouts that depend on the time on air of the current rate
+static void link_timing(struct callback_args* info) {
+    wioe_params* p = &info->params;
+    size_t overhead = WIOE_MAX_PAYLOAD - WIOE_MAX_PLAINTEXT;
+    long frame_ms = airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc,
+                               WIOE_MAX_PAYLOAD) / 1000;
+    long ack_ms = airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc,
+                             overhead + 2 + sizeof(uint32_t)) / 1000;
+    info->link.rto_ms = arq_rto_ms(frame_ms, ack_ms);
+    // Every relay adds a frame and its ACK to the round trip
+    int hops = info->meshed ? mesh_hops(&info->node, info->peer, now_ms()) : 1;
+    if (hops > 1) { info->link.rto_ms *= hops; }
+    // Goodput is reported against full frames back to back on every radio
+    double frame_payload = info->link.mtu - ARQ_HEADER - FRAG_HEADER;
+    xfer_rate(&info->files, frame_payload * 1e6 * info->radios.count
+              / airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc,
+                           WIOE_MAX_PAYLOAD));
+}
+
+// Runs the data rate controller and restarts its timer
+static void arm_rate(struct callback_args* info) {
+    long ms = adr_poll(&info->rate, now_ms());
+    reactor_timer_set(info->loop, info->adr_timer, ms > 0 ? ms : (ms == 0 ? 1 : 0), 0);
+}
+
+// Reports the outcome of a control frame to the data rate controller, a
+// switch it triggers is applied by each radio once it is idle
+static void on_rate_sent(int status, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    adr_sent(&info->rate, status, now_ms());
+    arm_rate(info);
+}
+
+static int rate_send(const unsigned char* frame, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    unsigned char buf[1 + ADR_FRAME];
+    if (len > ADR_FRAME) { return -1; }
+    buf[0] = ARQ_CTRL;
+    memcpy(buf + 1, frame, len);
+    return bond_send(&info->radios, buf, len + 1, on_rate_sent, info);
+}
+
+static void rate_apply(unsigned sf, unsigned bw, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    info->params.spreading_factor = sf;
+    info->params.bandwidth = bw;
+    char out[64];
+    snprintf(out, sizeof(out), "Data rate: SF%u, %u kHz", sf, bw);
+    show(info, out);
+    link_timing(info);
+    bond_update(&info->radios, sf, bw);
+}
+
+// Sends a handshake frame in a control frame of the link
+static int hs_send(const unsigned char* frame, size_t len, int passphrase, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    unsigned char buf[1 + HS_FRAME];
+    if (len > HS_FRAME) { return -1; }
+    buf[0] = ARQ_CTRL;
+    memcpy(buf + 1, frame, len);
+    if (passphrase) { return bond_send_passphrase(&info->radios, buf, len + 1, NULL, NULL); }
+    return bond_send(&info->radios, buf, len + 1, NULL, NULL);
+}
+
+static void hs_keyed(const unsigned char* key, int send, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    bond_rekey(&info->radios, key, send);
+    if (send) { show(info, "Session key agreed"); }
+}
+
+// Runs the handshake and restarts its timer
+static void arm_handshake(struct callback_args* info) {
+    long ms = hs_poll(&info->shake, now_ms());
+    reactor_timer_set(info->loop, info->hs_timer, ms > 0 ? ms : (ms == 0 ? 1 : 0), 0);
+}
+
+// Latest messages sent in earlier runs, newest first
+struct recalled {
+    char lines[MAX_HISTORY_SIZE][MAX_COMMAND_LENGTH];
+    int count;
+};
+
+static int collect_sent(const msglog_entry* entry, void* arg) {
+    struct recalled* r = (struct recalled*) arg;
+    size_t len = entry->len < MAX_COMMAND_LENGTH - 1 ? entry->len : MAX_COMMAND_LENGTH - 1;
+    memcpy(r->lines[r->count], entry->data, len);
+    r->lines[r->count++][len] = '\0';
+    return r->count == MAX_HISTORY_SIZE;
+}
+
+// Makes the messages sent in earlier runs available with the arrow keys
+static void recall_history(struct callback_args* info, const char* dir) {
+    static struct recalled r;
+    msglog_query q = { .peer = -1, .sent = 1, .limit = MAX_HISTORY_SIZE, .newest_first = 1 };
+    msglog_search(dir, &q, collect_sent, &r);
+    while (r.count > 0) { term_history_add(info->info, r.lines[--r.count]); }
+}
+
+// Prints a reassembled message
+static void on_message(const unsigned char* msg, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (len > 0 && msg[0] == XFER_MAGIC) {
+        xfer_recv(&info->files, msg, len, now_ms());
+        arm_xfer(info);
+        return;
+    }
+    // Messages are null terminated by the sender, but do not rely on it
+    if (len > 0 && msg[len - 1] == '\0') { len--; }
+    if (info->log != NULL) { msglog_append(info->log, 0, info->peer, msg, len); }
+    if (info->daemon) {
+        hub_deliver(&info->clients, msg, len);
+        return;
+    }
+    size_t size = len + 32;
+    char* out = malloc(size);
+    if (out == NULL) { return; }
+    snprintf(out, size, "\033[1;31mRecieved:\033[0m %.*s", (int) len, (const char*) msg);
+    term_print(info->info, out);
+    free(out);
+}
+
+// Handles a frame of the link
+static void on_frame(struct callback_args* info, const unsigned char* data, size_t len, int snr) {
+    if (len == 0) { return; }
+    if (info->adaptive) { adr_sample(&info->rate, snr, now_ms()); }
+    if ((data[0] & ARQ_TYPE_MASK) == ARQ_CTRL && len == 3 && data[1] == LOSS_REPORT) {
+        frag_tx_loss(&info->frag_out, data[2] / 255.0);
+    } else if ((data[0] & ARQ_TYPE_MASK) == ARQ_CTRL && len > 1 && data[1] >= HS_HELLO
+               && data[1] <= HS_DONE) {
+        if (info->keyed) {
+            hs_recv(&info->shake, data + 1, len - 1, now_ms());
+            arm_handshake(info);
+        }
+    } else if ((data[0] & ARQ_TYPE_MASK) == ARQ_CTRL) {
+        if (info->adaptive) { adr_recv(&info->rate, data + 1, len - 1, now_ms()); }
+    } else if (arq_recv(&info->link, data, len, now_ms()) == 0) {
+        next_frames(info);
+    }
+    if (info->adaptive) { arm_rate(info); }
+}
+
+// Updates the loss estimate from the sequence numbers seen in the last
+// second and tells the peer, which sizes the parity of what it sends
+static void track_loss(struct callback_args* info) {
+    wioe_link_stats link;
+    bond_get_link_stats(&info->radios, &link);
+    unsigned long received = link.received - info->seen.received;
+    unsigned long lost = link.lost - info->seen.lost;
+    info->seen = link;
+    if (received == 0) { return; }
+    info->loss += LOSS_GAIN * ((double) lost / (received + lost) - info->loss);
+    int level = (int) (info->loss * 255 + 0.5);
+    if (level == info->loss_sent) { return; }
+    unsigned char buf[3] = { ARQ_CTRL, LOSS_REPORT, (unsigned char) level };
+    if (bond_send(&info->radios, buf, sizeof(buf), NULL, NULL) == 0) { info->loss_sent = level; }
+}
+
+// Handles a decrypted frame from any of the radios
+static void on_packet(const unsigned char* data, size_t len, int rssi, int snr, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (!info->meshed) {
+        on_frame(info, data, len, snr);
+        return;
+    }
+    int hops = mesh_hops(&info->node, info->peer, now_ms());
+    mesh_recv(&info->node, data, len, now_ms());
+    if (mesh_hops(&info->node, info->peer, now_ms()) != hops) { link_timing(info); }
+    arm_mesh(info);
+}
+
+// Receives data routed to this node, the link only talks to its peer
+static void mesh_deliver(uint8_t src, const unsigned char* data, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (src == info->peer) { on_frame(info, data, len, 0); }
+}
+
+static void on_radio_error(int radio, const char* what, int fatal, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    show(info, what);
+    if (fatal) { reactor_stop(info->loop); }
+}
+
+static void on_expire(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    frag_rx_expire(&info->frag_in, now_ms());
+    if (info->fec == FRAG_FEC_AUTO && !info->meshed) { track_loss(info); }
+}
+
+static void on_arq_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    next_frames(info);
+}
+
+static void on_adr_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    arm_rate(info);
+}
+
+static void on_mesh_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    arm_mesh(info);
+}
+
+static void on_hs_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    arm_handshake(info);
+}
+
+// Gets the statistics of every radio of the link, returning their number
+static int radio_stats(struct callback_args* info, wioe_stats stats[BOND_MAX_RADIOS]) {
+    for (int i = 0; i < info->radios.count; ++i) {
+        wioe_get_stats(bond_device(&info->radios, i), &stats[i]);
+    }
+    return info->radios.count;
+}
+
+static void on_metrics(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    wioe_stats stats[BOND_MAX_RADIOS];
+    int count = radio_stats(info, stats);
+    static char text[METRICS_MAX * BOND_MAX_RADIOS];
+    ssize_t len = metrics_render(text, sizeof(text), stats, count,
+                                 metrics_format_of(info->metrics));
+    if (len < 0 || metrics_publish(info->metrics, text, len) != 0) {
+        // The target may come and go (e.g., a collector restarting), keep running
+    }
+}
+
+// Updates the screen if a frame is due and restarts the frame timer
+static void arm_term(struct callback_args* info) {
+    long ms = term_flush(info->info);
+    reactor_timer_set(info->loop, info->term_timer, ms > 0 ? ms : (ms == 0 ? 1 : 0), 0);
+}
+
+static void on_stdin(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (term_input(info->info) != 0) {
+        reactor_stop(loop);
+        return;
+    }
+    arm_term(info);
+}
+
+static void on_term(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    arm_term(info);
+}
+
+// Queues a file transfer message, leaving room in the queue for the chat
+static int xfer_send(const unsigned char* msg, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (info->frag_out.count >= FRAG_TX_DEPTH / 2
+        || frag_tx_push(&info->frag_out, msg, len, now_ms()) != 0) {
+        return -1;
+    }
+    next_frames(info);
+    return 0;
+}
+
+static void xfer_note(const char* text, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    show(info, text);
+}
+
+// Runs the file transfers and restarts their timer
+static void arm_xfer(struct callback_args* info) {
+    long ms = xfer_poll(&info->files, now_ms());
+    reactor_timer_set(info->loop, info->xfer_timer, ms > 0 ? ms : (ms == 0 ? 1 : 0), 0);
+}
+
+static void on_xfer_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    arm_xfer(info);
+}
+
+static void on_cancel(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    wioe_cancel_clear(info->device);
+    reactor_stop(loop);
+}
+
+// Queues a message of a local client. The queue is kept short so that the
+// backlog waits in the hub, where it is shared fairly, yet long enough to
+// fill a frame.
+static int hub_send(const unsigned char* msg, size_t len, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    if (info->frag_out.count >= DAEMON_LINK_DEPTH
+        || frag_tx_push(&info->frag_out, msg, len, now_ms()) != 0) {
+        return -1;
+    }
+    if (info->log != NULL) { msglog_append(info->log, 1, info->peer, msg, len - 1); }
+    next_frames(info);
+    return 0;
+}
+
+static long hub_stats_json(char* out, size_t size, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    wioe_stats stats[BOND_MAX_RADIOS];
+    int count = radio_stats(info, stats);
+    return metrics_render(out, size, stats, count, METRICS_JSON);
+}
+
+static void on_hub_timeout(reactor* loop, int fd, uint32_t events, void* arg) {
+    struct callback_args* info = (struct callback_args*) arg;
+    hub_pump(&info->clients);
+}
+
+static void on_signal(int sig) {
+    reactor_notify(stop_event);
+}
+
+static void on_stop(reactor* loop, int fd, uint32_t events, void* arg) {
+    reactor_stop(loop);
+}
+
 int p2p_callback(char* arg, void* info_args) {
     // Recover args
     struct callback_args* info = (struct callback_args*) info_args;
-    wioe* device = info->device;
-    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
-    memcpy(key, &info->key, crypto_aead_chacha20poly1305_KEYBYTES);
-    // Stop the reading in the other thread
-    wioe_cancel_recieve(device);
-    // Send the message
-    wioe_send_encrypted(device, arg, strlen(arg) + 1, key);
+    if (strncmp(arg, "/send ", 6) == 0) {
+        if (xfer_start(&info->files, arg + 6, now_ms()) != 0) {
+            char out[128];
+            snprintf(out, sizeof(out), "Cannot send %.64s: %s", arg + 6, strerror(errno));
+            show(info, out);
+        }
+        arm_xfer(info);
+        return 0;
+    }
+    // Queue the message, the event loop sends it as soon as the radio is free
+    if (frag_tx_push(&info->frag_out, (unsigned char*) arg, strlen(arg) + 1, now_ms()) != 0) {
+        show(info, "Error sending message");
+        return 0;
+    }
+    if (info->log != NULL) { msglog_append(info->log, 1, info->peer, arg, strlen(arg)); }
+    next_frames(info);
     return 0;
 }
 
@@ -107,4 +937,4 @@ int p2p_cleanup(void* info_args) {
     wioe* device = info->device;
     wioe_cancel_recieve(device);
     return 0;
-}
\ No newline at end of file
+}
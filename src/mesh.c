@@ -0,0 +1,297 @@
+#include "mesh.h"
+#include <string.h>
+
+// Offsets in the header
+enum { H_TYPE_TTL, H_SRC, H_DST, H_FROM, H_NEXT, H_ID };
+
+#define TRIGGER_MS 1000     // Longest delay of a HELLO announcing a new node
+
+static unsigned rnd(mesh* m) {
+    unsigned x = m->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return m->rand_state = x;
+}
+
+// Duplicate cache
+
+static uint32_t bloom_hash(uint8_t src, uint16_t id, int i) {
+    uint32_t x = ((uint32_t) src << 16 | id) + 0x9e3779b9u * (i + 1);
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x % MESH_BLOOM_BITS;
+}
+
+static int bloom_seen(const mesh* m, uint8_t src, uint16_t id) {
+    for (int f = 0; f < 2; ++f) {
+        int all = 1;
+        for (int i = 0; i < MESH_BLOOM_HASHES && all; ++i) {
+            uint32_t bit = bloom_hash(src, id, i);
+            all = (m->bloom[f][bit / 8] >> (bit % 8)) & 1;
+        }
+        if (all) { return 1; }
+    }
+    return 0;
+}
+
+// Records a frame, clearing the older filter once the current one is full
+// so false positives stay rare
+static void bloom_add(mesh* m, uint8_t src, uint16_t id) {
+    if (m->bloom_count == MESH_BLOOM_ROTATE) {
+        m->bloom_cur ^= 1;
+        memset(m->bloom[m->bloom_cur], 0, sizeof(m->bloom[m->bloom_cur]));
+        m->bloom_count = 0;
+    }
+    for (int i = 0; i < MESH_BLOOM_HASHES; ++i) {
+        uint32_t bit = bloom_hash(src, id, i);
+        m->bloom[m->bloom_cur][bit / 8] |= 1 << (bit % 8);
+    }
+    m->bloom_count++;
+}
+
+// Routing table
+
+static const mesh_route* route_find(const mesh* m, uint8_t dest, long now_ms) {
+    for (int i = 0; i < m->route_count; ++i) {
+        const mesh_route* r = &m->routes[i];
+        if (r->dest == dest) {
+            int alive = now_ms - r->seen_ms < MESH_ROUTE_TIMEOUT_MS && r->hops < MESH_MAX_HOPS;
+            return alive ? r : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Takes a route into account. A route through the same neighbor replaces
+// the one known (it may have become longer), others only when no longer.
+//
+// @return 1 if the destination was not reachable before, 0 otherwise
+static int route_learn(mesh* m, uint8_t dest, uint8_t via, unsigned hops, long now_ms) {
+    if (dest == 0 || dest == m->addr || dest == MESH_BROADCAST) { return 0; }
+    if (hops > MESH_MAX_HOPS) { hops = MESH_MAX_HOPS; }
+    int known = route_find(m, dest, now_ms) != NULL;
+    mesh_route* r = NULL;
+    for (int i = 0; i < m->route_count && r == NULL; ++i) {
+        if (m->routes[i].dest == dest) { r = &m->routes[i]; }
+    }
+    if (r != NULL && known && via != r->via && hops > r->hops) { return 0; }
+    if (r == NULL) {
+        if (hops >= MESH_MAX_HOPS) { return 0; }
+        if (m->route_count < MESH_ROUTES) {
+            r = &m->routes[m->route_count++];
+        } else {
+            // Full, forget the route confirmed longest ago
+            r = &m->routes[0];
+            for (int i = 1; i < MESH_ROUTES; ++i) {
+                if (m->routes[i].seen_ms < r->seen_ms) { r = &m->routes[i]; }
+            }
+        }
+    }
+    r->dest = dest;
+    r->via = via;
+    r->hops = hops;
+    r->seen_ms = now_ms;
+    return !known && hops < MESH_MAX_HOPS;
+}
+
+static void put_header(unsigned char* f, int type, unsigned ttl, uint8_t src, uint8_t dst,
+                       uint8_t from, uint8_t next, uint16_t id) {
+    f[H_TYPE_TTL] = (unsigned char) (type << 4 | ttl);
+    f[H_SRC] = src;
+    f[H_DST] = dst;
+    f[H_FROM] = from;
+    f[H_NEXT] = next;
+    f[H_ID] = (unsigned char) id;
+    f[H_ID + 1] = (unsigned char) (id >> 8);
+}
+
+int mesh_init(mesh* m, uint8_t addr, size_t mtu, unsigned seed, mesh_send_cb send,
+              mesh_deliver_cb deliver, void* arg) {
+    if (addr == 0 || addr == MESH_BROADCAST || mtu <= MESH_HEADER || mtu > MESH_MAX_FRAME) {
+        return -1;
+    }
+    memset(m, 0, sizeof(*m));
+    m->addr = addr;
+    m->mtu = mtu;
+    m->send = send;
+    m->deliver = deliver;
+    m->arg = arg;
+    m->rand_state = seed != 0 ? seed : 2654435761u * addr;
+    m->next_id = (uint16_t) rnd(m);  // A restarted node does not reuse recent ids
+    m->next_hello = -1;
+    return 0;
+}
+
+size_t mesh_mtu(const mesh* m) {
+    return m->mtu - MESH_HEADER;
+}
+
+int mesh_send(mesh* m, uint8_t dst, const unsigned char* data, size_t len, long now_ms) {
+    if (len > mesh_mtu(m) || dst == 0 || dst == m->addr) { return -1; }
+    unsigned char frame[MESH_MAX_FRAME];
+    const mesh_route* r = dst == MESH_BROADCAST ? NULL : route_find(m, dst, now_ms);
+    uint16_t id = m->next_id++;
+    put_header(frame, MESH_DATA, MESH_TTL, m->addr, dst, m->addr,
+               r != NULL ? r->via : MESH_BROADCAST, id);
+    memcpy(frame + MESH_HEADER, data, len);
+    // Copies repeated by neighbors are recognized as already seen
+    bloom_add(m, m->addr, id);
+    if (m->send(frame, MESH_HEADER + len, 1, m->arg) != 0) { return -1; }
+    m->stats.sent++;
+    return 0;
+}
+
+// Queues a frame for repeating after a random delay, which spreads the
+// repeats of neighbors over time and lets each one hear the others'
+static void flood_later(mesh* m, const unsigned char* frame, size_t len, long now_ms) {
+    mesh_pending* p = NULL;
+    for (int i = 0; i < MESH_PENDING && p == NULL; ++i) {
+        if (!m->pending[i].used) { p = &m->pending[i]; }
+    }
+    if (p == NULL) {
+        m->stats.dropped++;
+        return;
+    }
+    p->used = 1;
+    p->due_ms = now_ms + rnd(m) % (MESH_JITTER_MS + 1);
+    p->heard = 0;
+    p->src = frame[H_SRC];
+    p->id = frame[H_ID] | frame[H_ID + 1] << 8;
+    p->len = len;
+    memcpy(p->frame, frame, len);
+}
+
+// Learns the routes of a neighbor
+//
+// @return 1 if a destination became reachable
+static int on_hello(mesh* m, const unsigned char* frame, size_t len, long now_ms) {
+    uint8_t from = frame[H_FROM];
+    int new_node = 0;
+    for (size_t i = MESH_HEADER; i + MESH_ENTRY <= len; i += MESH_ENTRY) {
+        // Routes through this node would only lead back here
+        if (frame[i + 2] == m->addr) { continue; }
+        new_node |= route_learn(m, frame[i], from, frame[i + 1] + 1u, now_ms);
+    }
+    return new_node;
+}
+
+// Tells the neighbors about a new node soon rather than at the next regular HELLO
+static void trigger_hello(mesh* m, long now_ms) {
+    long soon = now_ms + rnd(m) % TRIGGER_MS;
+    if (m->next_hello >= 0 && soon < m->next_hello) { m->next_hello = soon; }
+}
+
+int mesh_recv(mesh* m, const unsigned char* frame, size_t len, long now_ms) {
+    if (len < MESH_HEADER) { return -1; }
+    int type = frame[H_TYPE_TTL] >> 4;
+    unsigned ttl = frame[H_TYPE_TTL] & 0x0f;
+    uint8_t src = frame[H_SRC];
+    uint8_t dst = frame[H_DST];
+    uint8_t from = frame[H_FROM];
+    uint8_t next = frame[H_NEXT];
+    uint16_t id = frame[H_ID] | frame[H_ID + 1] << 8;
+    if (from == 0 || from == MESH_BROADCAST || src == 0 || src == MESH_BROADCAST) { return -1; }
+    if (from == m->addr) { return 0; }
+    // Whoever transmitted is a neighbor
+    int new_node = route_learn(m, from, from, 1, now_ms);
+    if (type == MESH_HELLO) {
+        if (on_hello(m, frame, len, now_ms) || new_node) { trigger_hello(m, now_ms); }
+        return 0;
+    }
+    if (type != MESH_DATA || ttl == 0 || ttl > MESH_TTL) { return -1; }
+    // The frame also shows the way back to its source
+    new_node |= route_learn(m, src, from, MESH_TTL - ttl + 1, now_ms);
+    if (new_node) { trigger_hello(m, now_ms); }
+    // Frames handed to another neighbor are not ours to handle
+    if (next != MESH_BROADCAST && next != m->addr) {
+        m->stats.ignored++;
+        return 0;
+    }
+    if (bloom_seen(m, src, id)) {
+        m->stats.duplicates++;
+        for (int i = 0; i < MESH_PENDING; ++i) {
+            mesh_pending* p = &m->pending[i];
+            if (p->used && p->src == src && p->id == id) { p->heard++; }
+        }
+        return 0;
+    }
+    bloom_add(m, src, id);
+    if (dst == m->addr || dst == MESH_BROADCAST) {
+        m->stats.delivered++;
+        m->deliver(src, frame + MESH_HEADER, len - MESH_HEADER, m->arg);
+        if (dst == m->addr) { return 0; }
+    }
+    if (ttl <= 1) {
+        m->stats.dropped++;
+        return 0;
+    }
+    unsigned char copy[MESH_MAX_FRAME];
+    memcpy(copy, frame, len);
+    copy[H_TYPE_TTL] = (unsigned char) (MESH_DATA << 4 | (ttl - 1));
+    copy[H_FROM] = m->addr;
+    const mesh_route* r = dst == MESH_BROADCAST ? NULL : route_find(m, dst, now_ms);
+    if (r != NULL && r->via != from) {
+        copy[H_NEXT] = r->via;
+        if (m->send(copy, len, 0, m->arg) == 0) {
+            m->stats.forwarded++;
+        } else {
+            m->stats.dropped++;
+        }
+    } else {
+        copy[H_NEXT] = MESH_BROADCAST;
+        flood_later(m, copy, len, now_ms);
+    }
+    return 0;
+}
+
+// Announces this node and the nodes it reaches to its neighbors
+static void send_hello(mesh* m, long now_ms) {
+    unsigned char frame[MESH_MAX_FRAME];
+    put_header(frame, MESH_HELLO, 1, m->addr, MESH_BROADCAST, m->addr, MESH_BROADCAST,
+               m->next_id++);
+    size_t len = MESH_HEADER;
+    for (int i = 0; i < m->route_count && len + MESH_ENTRY <= m->mtu; ++i) {
+        const mesh_route* r = &m->routes[i];
+        if (route_find(m, r->dest, now_ms) == NULL) { continue; }
+        frame[len++] = r->dest;
+        frame[len++] = r->hops;
+        frame[len++] = r->via;
+    }
+    m->send(frame, len, 0, m->arg);
+}
+
+long mesh_poll(mesh* m, long now_ms) {
+    // Nodes powered on together do not announce themselves all at once
+    if (m->next_hello < 0) { m->next_hello = now_ms + rnd(m) % TRIGGER_MS; }
+    if (now_ms >= m->next_hello) {
+        send_hello(m, now_ms);
+        // Some jitter keeps neighbors that started together from colliding forever
+        m->next_hello = now_ms + MESH_HELLO_MS - MESH_HELLO_MS / 10 + rnd(m) % (MESH_HELLO_MS / 5);
+    }
+    long next = m->next_hello - now_ms;
+    for (int i = 0; i < MESH_PENDING; ++i) {
+        mesh_pending* p = &m->pending[i];
+        if (p->used && now_ms >= p->due_ms) {
+            p->used = 0;
+            if (p->heard >= MESH_REDUNDANT) {
+                m->stats.suppressed++;
+            } else if (m->send(p->frame, p->len, 0, m->arg) == 0) {
+                m->stats.flooded++;
+            } else {
+                m->stats.dropped++;
+            }
+        } else if (p->used && p->due_ms - now_ms < next) {
+            next = p->due_ms - now_ms;
+        }
+    }
+    return next > 0 ? next : 1;
+}
+
+int mesh_hops(const mesh* m, uint8_t dst, long now_ms) {
+    const mesh_route* r = route_find(m, dst, now_ms);
+    return r != NULL ? r->hops : -1;
+}
@@ -0,0 +1,240 @@
+#include "metrics.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UNIX_PREFIX "unix:"
+
+// Text being rendered, stops growing once the buffer is full
+typedef struct {
+    char* out;
+    size_t size;
+    size_t len;
+    int overflow;
+} text;
+
+static void put(text* t, const char* fmt, ...) {
+    if (t->overflow) { return; }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->out + t->len, t->size - t->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t) n >= t->size - t->len) {
+        t->overflow = 1;
+        return;
+    }
+    t->len += n;
+}
+
+// Prometheus
+
+// Samples of each radio are told apart by a radio label, left out when
+// there is a single radio
+typedef struct {
+    const wioe_stats* stats;
+    int count;
+} radios;
+
+#define FIELD(s, type, offset) ((const type*) ((const char*) (s) + (offset)))
+
+// Label of radio i: "" or radio="i" followed by sep
+static const char* radio_label(char* out, size_t size, int i, int count, const char* sep) {
+    out[0] = '\0';
+    if (count > 1) { snprintf(out, size, "radio=\"%d\"%s", i, sep); }
+    return out;
+}
+
+static void prom_counter(text* t, const char* name, const char* help, radios r, size_t offset) {
+    put(t, "# HELP wio_%s %s\n# TYPE wio_%s counter\n", name, help, name);
+    for (int i = 0; i < r.count; ++i) {
+        char label[32];
+        radio_label(label, sizeof(label), i, r.count, "");
+        put(t, r.count > 1 ? "wio_%s{%s} %lu\n" : "wio_%s%s %lu\n", name, label,
+            *FIELD(&r.stats[i], unsigned long, offset));
+    }
+}
+
+static void prom_signal(text* t, const char* name, const char* help, radios r, size_t offset) {
+    put(t, "# HELP wio_%s %s\n# TYPE wio_%s gauge\n", name, help, name);
+    for (int i = 0; i < r.count; ++i) {
+        const wioe_signal_stats* s = FIELD(&r.stats[i], wioe_signal_stats, offset);
+        if (s->count == 0) { continue; }
+        char l[32];
+        radio_label(l, sizeof(l), i, r.count, ",");
+        put(t, "wio_%s{%sstat=\"last\"} %d\n", name, l, s->last);
+        put(t, "wio_%s{%sstat=\"min\"} %d\n", name, l, s->min);
+        put(t, "wio_%s{%sstat=\"max\"} %d\n", name, l, s->max);
+        put(t, "wio_%s{%sstat=\"mean\"} %.2f\n", name, l, s->mean);
+    }
+}
+
+// Latencies are exposed in seconds as Prometheus expects
+static void prom_latency(text* t, const char* name, const char* help, radios r, size_t offset) {
+    put(t, "# HELP wio_%s_seconds %s\n# TYPE wio_%s_seconds summary\n", name, help, name);
+    for (int i = 0; i < r.count; ++i) {
+        const hist_stats* h = FIELD(&r.stats[i], hist_stats, offset);
+        char l[32];
+        radio_label(l, sizeof(l), i, r.count, ",");
+        if (h->count > 0) {
+            put(t, "wio_%s_seconds{%squantile=\"0.5\"} %.6f\n", name, l, h->p50 / 1e6);
+            put(t, "wio_%s_seconds{%squantile=\"0.9\"} %.6f\n", name, l, h->p90 / 1e6);
+            put(t, "wio_%s_seconds{%squantile=\"0.99\"} %.6f\n", name, l, h->p99 / 1e6);
+            put(t, "wio_%s_seconds{%squantile=\"0.999\"} %.6f\n", name, l, h->p999 / 1e6);
+        }
+        radio_label(l, sizeof(l), i, r.count, "");
+        const char* fmt = r.count > 1 ? "wio_%s_seconds_%s{%s} " : "wio_%s_seconds_%s%s ";
+        put(t, fmt, name, "sum", l);
+        put(t, "%.6f\n", h->mean * h->count / 1e6);
+        put(t, fmt, name, "count", l);
+        put(t, "%lu\n", h->count);
+    }
+}
+
+#define AT(field) offsetof(wioe_stats, field)
+
+static void render_prometheus(text* t, radios r) {
+    prom_counter(t, "tx_packets_total", "Packets that left the air.", r, AT(tx_packets));
+    prom_counter(t, "tx_bytes_total", "Bytes that left the air.", r, AT(tx_bytes));
+    prom_counter(t, "tx_errors_total", "Sends rejected or never confirmed.", r, AT(tx_errors));
+    prom_counter(t, "rx_packets_total", "Packets received.", r, AT(rx_packets));
+    prom_counter(t, "rx_bytes_total", "Bytes received.", r, AT(rx_bytes));
+    prom_counter(t, "timeouts_total", "Commands left without a response.", r, AT(timeouts));
+    prom_counter(t, "cancelled_reads_total", "Reads cancelled.", r, AT(cancelled));
+    prom_counter(t, "decrypt_failures_total", "Packets failing authentication.", r,
+                 AT(decrypt_failures));
+    prom_counter(t, "packets_lost_total", "Sequence numbers never received.", r, AT(link.lost));
+    prom_counter(t, "packets_reordered_total", "Packets received after a later one.", r,
+                 AT(link.reordered));
+    prom_counter(t, "packets_replayed_total", "Packets rejected as replays.", r, AT(link.replayed));
+    prom_counter(t, "compress_bytes_in_total", "Plaintext bytes sent.", r, AT(compress.bytes_in));
+    prom_counter(t, "compress_bytes_out_total", "Plaintext bytes after compression.", r,
+                 AT(compress.bytes_out));
+    prom_counter(t, "airtime_predicted_microseconds_total", "Predicted time on air of packets sent.",
+                 r, AT(airtime_us));
+    prom_counter(t, "airtime_measured_microseconds_total", "TXLRPKT to TX DONE of packets sent.",
+                 r, AT(tx_time_us));
+    prom_counter(t, "duty_delays_total", "Sends held back by the duty cycle.", r, AT(duty_delays));
+    prom_counter(t, "duty_delay_microseconds_total", "Time sends were held back.", r,
+                 AT(duty_delay_us));
+    prom_signal(t, "rssi_dbm", "Signal strength of received packets.", r, AT(rssi));
+    prom_signal(t, "snr_db", "Signal to noise ratio of received packets.", r, AT(snr));
+    prom_latency(t, "at_rtt", "AT command written to its response.", r, AT(at_rtt));
+    prom_latency(t, "tx_time", "TXLRPKT written to TX DONE.", r, AT(tx_time));
+    prom_latency(t, "send_latency", "Send queued to TX DONE.", r, AT(send_latency));
+    prom_latency(t, "airtime", "Predicted time on air.", r, AT(airtime));
+}
+
+// JSON
+
+static void json_signal(text* t, const char* name, const wioe_signal_stats* s) {
+    put(t, "\"%s\":{\"count\":%lu", name, s->count);
+    if (s->count > 0) {
+        put(t, ",\"last\":%d,\"min\":%d,\"max\":%d,\"mean\":%.2f", s->last, s->min, s->max, s->mean);
+    }
+    put(t, "}");
+}
+
+static void json_latency(text* t, const char* name, const hist_stats* h) {
+    put(t, "\"%s\":{\"count\":%lu,\"min\":%u,\"max\":%u,\"mean\":%.1f,"
+           "\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u}",
+        name, h->count, h->min, h->max, h->mean, h->p50, h->p90, h->p99, h->p999);
+}
+
+static void render_json(text* t, const wioe_stats* s) {
+    put(t, "{\"tx\":{\"packets\":%lu,\"bytes\":%lu,\"errors\":%lu},",
+        s->tx_packets, s->tx_bytes, s->tx_errors);
+    put(t, "\"rx\":{\"packets\":%lu,\"bytes\":%lu,\"lost\":%lu,\"reordered\":%lu,"
+           "\"replayed\":%lu,\"decrypt_failures\":%lu},",
+        s->rx_packets, s->rx_bytes, s->link.lost, s->link.reordered, s->link.replayed,
+        s->decrypt_failures);
+    put(t, "\"timeouts\":%lu,\"cancelled_reads\":%lu,", s->timeouts, s->cancelled);
+    put(t, "\"compress\":{\"packets\":%lu,\"compressed\":%lu,\"bytes_in\":%lu,\"bytes_out\":%lu,"
+           "\"airtime_saved_us\":%lu},",
+        s->compress.packets, s->compress.compressed, s->compress.bytes_in, s->compress.bytes_out,
+        s->compress.airtime_saved_us);
+    put(t, "\"airtime\":{\"predicted_us\":%lu,\"measured_us\":%lu,\"duty_delays\":%lu,"
+           "\"duty_delay_us\":%lu},",
+        s->airtime_us, s->tx_time_us, s->duty_delays, s->duty_delay_us);
+    json_signal(t, "rssi_dbm", &s->rssi);
+    put(t, ",");
+    json_signal(t, "snr_db", &s->snr);
+    put(t, ",\"latency_us\":{");
+    json_latency(t, "at_rtt", &s->at_rtt);
+    put(t, ",");
+    json_latency(t, "tx_time", &s->tx_time);
+    put(t, ",");
+    json_latency(t, "send_latency", &s->send_latency);
+    put(t, ",");
+    json_latency(t, "airtime", &s->airtime);
+    put(t, "}}");
+}
+
+metrics_format metrics_format_of(const char* target) {
+    size_t len = strlen(target);
+    return len >= 5 && strcmp(target + len - 5, ".json") == 0 ? METRICS_JSON : METRICS_PROMETHEUS;
+}
+
+ssize_t metrics_render(char* out, size_t len, const wioe_stats* stats, int count,
+                       metrics_format format) {
+    if (len == 0 || count < 1) { return -1; }
+    text t = { .out = out, .size = len, .len = 0, .overflow = 0 };
+    out[0] = '\0';
+    if (format == METRICS_PROMETHEUS) {
+        render_prometheus(&t, (radios) { stats, count });
+    } else if (count == 1) {
+        render_json(&t, stats);
+        put(&t, "\n");
+    } else {
+        put(&t, "{\"radios\":[");
+        for (int i = 0; i < count; ++i) {
+            if (i > 0) { put(&t, ","); }
+            render_json(&t, &stats[i]);
+        }
+        put(&t, "]}\n");
+    }
+    return t.overflow ? -1 : (ssize_t) t.len;
+}
+
+// Sends the text as one datagram, never blocking the caller
+static int publish_socket(const char* path, const char* text, size_t len) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) { return -1; }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { return -1; }
+    ssize_t r = sendto(fd, text, len, 0, (struct sockaddr*) &addr, sizeof(addr));
+    close(fd);
+    return r == (ssize_t) len ? 0 : -1;
+}
+
+// Writes a temporary file next to path and renames it over path
+static int publish_file(const char* path, const char* text, size_t len) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) { return -1; }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { return -1; }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write(fd, text + done, len - done);
+        if (r < 0) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        done += r;
+    }
+    close(fd);
+    return rename(tmp, path);
+}
+
+int metrics_publish(const char* target, const char* text, size_t len) {
+    if (strncmp(target, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+        return publish_socket(target + sizeof(UNIX_PREFIX) - 1, text, len);
+    }
+    return publish_file(target, text, len);
+}
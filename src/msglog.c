@@ -0,0 +1,509 @@
+#define _GNU_SOURCE         // memmem
+#include "msglog.h"
+#include <errno.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Layout of a segment file, in host byte order: header, index, records
+#define MAGIC "WIOL\x01"
+#define SUFFIX ".wlog"
+#define NAME_DIGITS 20                  // Segments are named by their first sequence number
+#define DATA_START 32768
+#define BLOCKS ((MSGLOG_SEGMENT - DATA_START) / MSGLOG_BLOCK)
+#define RECORD_HEADER 32
+#define BLOCK_RECORDS (MSGLOG_BLOCK / RECORD_HEADER + 1)   // Most records starting in a block
+#define SEGMENT_RECORDS ((MSGLOG_SEGMENT - DATA_START) / RECORD_HEADER)  // Most records in a segment
+#define BAD_SUFFIX ".bad"               // Added to segments that cannot be recovered
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+typedef struct {
+    char magic[8];
+    uint64_t first_seq;
+    char reserved[48];
+} seg_header;
+
+// Records starting in one block
+typedef struct {
+    uint64_t first_seq;
+    int64_t min_ms;
+    int64_t max_ms;
+    uint32_t first;                 // Offset of the first one in the segment
+    uint32_t count;
+    uint8_t peers[32];              // Bitmap of their peers
+} seg_index;
+
+// Followed by the message and zeros up to a multiple of 8 bytes
+typedef struct {
+    _Atomic uint32_t size;          // Bytes of the record, stored last; 0 where the log ends
+    uint32_t crc;                   // Of the rest of the record
+    uint64_t seq;
+    int64_t time_ms;
+    uint8_t peer;
+    uint8_t sent;
+    uint16_t len;
+    uint32_t reserved;
+} record;
+
+_Static_assert(sizeof(seg_header) + BLOCKS * sizeof(seg_index) <= DATA_START, "index too large");
+_Static_assert(sizeof(record) == RECORD_HEADER, "record header size");
+
+typedef struct segment {
+    unsigned char* map;
+    int fd;
+    _Atomic size_t end;             // Bytes in use
+    size_t synced;                  // Bytes synced to disk, by the committer
+    struct segment* next;           // In the list of retired segments
+} segment;
+
+struct msglog {
+    char dir[4096];
+    int lock_fd;                    // Held with flock while the log is open
+    segment* seg;                   // Segment appended to, NULL before the first
+    uint64_t next_seq;
+    pthread_t committer;
+    pthread_mutex_t lock;           // Guards seg for the committer, and what follows
+    pthread_cond_t wake;
+    segment* retired;               // Full segments waiting for their last sync
+    int stop;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) { c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1; }
+        crc_table[i] = c;
+    }
+}
+
+// CRC-32 (IEEE 802.3)
+static uint32_t crc32(const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint32_t c = 0xffffffff;
+    for (size_t i = 0; i < len; ++i) { c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8); }
+    return c ^ 0xffffffff;
+}
+
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static seg_index* index_of(const unsigned char* map) {
+    return (seg_index*) (map + sizeof(seg_header));
+}
+
+// Gets the record at off if it is whole and has the sequence number expected
+static const record* valid_record(const unsigned char* map, size_t off, uint64_t seq) {
+    if (off < DATA_START || off + RECORD_HEADER > MSGLOG_SEGMENT) { return NULL; }
+    const record* rec = (const record*) (map + off);
+    uint32_t size = atomic_load_explicit((_Atomic uint32_t*) &rec->size, memory_order_acquire);
+    if (size == 0 || rec->seq != seq || size != ALIGN(RECORD_HEADER + rec->len)
+        || size > MSGLOG_SEGMENT - off) {
+        return NULL;
+    }
+    if (crc32(&rec->seq, size - offsetof(record, seq)) != rec->crc) { return NULL; }
+    return rec;
+}
+
+static void index_record(unsigned char* map, size_t off, const record* rec) {
+    seg_index* idx = index_of(map) + (off - DATA_START) / MSGLOG_BLOCK;
+    if (idx->count == 0) {
+        idx->first_seq = rec->seq;
+        idx->min_ms = rec->time_ms;
+        idx->max_ms = rec->time_ms;
+        idx->first = off;
+    }
+    if (rec->time_ms < idx->min_ms) { idx->min_ms = rec->time_ms; }
+    if (rec->time_ms > idx->max_ms) { idx->max_ms = rec->time_ms; }
+    idx->peers[rec->peer >> 3] |= 1 << (rec->peer & 7);
+    idx->count++;
+}
+
+// Marks off as the end of the log, so readers never walk onto older data
+static void terminate(unsigned char* map, size_t off) {
+    if (off + sizeof(uint32_t) <= MSGLOG_SEGMENT) {
+        atomic_store_explicit(&((record*) (map + off))->size, 0, memory_order_release);
+    }
+}
+
+static void segment_path(char* out, size_t len, const char* dir, uint64_t first_seq) {
+    snprintf(out, len, "%s/%0*" PRIu64 SUFFIX, dir, NAME_DIGITS, first_seq);
+}
+
+// Maps a segment file, checking that it is one
+//
+// @return The mapping, or NULL with errno EBADMSG if the file is not a
+//         segment, or another errno if it could not be read
+static unsigned char* map_segment(int fd, int writable) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) { return NULL; }
+    if (st.st_size != MSGLOG_SEGMENT) {
+        errno = EBADMSG;
+        return NULL;
+    }
+    unsigned char* map = mmap(NULL, MSGLOG_SEGMENT, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                              MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { return NULL; }
+    if (memcmp(map, MAGIC, sizeof(MAGIC)) != 0) {
+        munmap(map, MSGLOG_SEGMENT);
+        errno = EBADMSG;
+        return NULL;
+    }
+    return map;
+}
+
+static void free_segment(segment* s) {
+    munmap(s->map, MSGLOG_SEGMENT);
+    close(s->fd);
+    free(s);
+}
+
+// Creates an empty segment. Its blocks are allocated up front, as running
+// out of disk space while writing to the mapping would raise SIGBUS. An
+// existing file is never replaced.
+static segment* create_segment(const char* dir, uint64_t first_seq) {
+    char path[4200];
+    segment_path(path, sizeof(path), dir, first_seq);
+    segment* s = calloc(1, sizeof(segment));
+    if (s == NULL) { return NULL; }
+    s->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (s->fd < 0) {
+        free(s);
+        return NULL;
+    }
+    seg_header h = { .first_seq = first_seq };
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    if (posix_fallocate(s->fd, 0, MSGLOG_SEGMENT) != 0
+        || pwrite(s->fd, &h, sizeof(h), 0) != sizeof(h)
+        || (s->map = map_segment(s->fd, 1)) == NULL) {
+        close(s->fd);
+        unlink(path);
+        free(s);
+        return NULL;
+    }
+    atomic_init(&s->end, DATA_START);
+    return s;
+}
+
+// Opens the last segment and finds the end of the log in it
+static segment* recover_segment(const char* dir, uint64_t first_seq, uint64_t* next_seq) {
+    char path[4200];
+    segment_path(path, sizeof(path), dir, first_seq);
+    segment* s = calloc(1, sizeof(segment));
+    if (s == NULL) { return NULL; }
+    s->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (s->fd < 0 || (s->map = map_segment(s->fd, 1)) == NULL) {
+        int err = errno;
+        if (s->fd >= 0) { close(s->fd); }
+        free(s);
+        errno = err;
+        return NULL;
+    }
+    seg_index* index = index_of(s->map);
+    // Entries are updated before their record is complete, so the last one
+    // in use may point at a record torn by a crash; the one before it then
+    // leads to the end of the log
+    int b = BLOCKS - 1;
+    while (b > 0 && (index[b].count == 0
+                     || valid_record(s->map, index[b].first, index[b].first_seq) == NULL)) {
+        b--;
+    }
+    size_t off = DATA_START;
+    uint64_t seq = ((seg_header*) s->map)->first_seq;
+    if (index[b].count > 0 && valid_record(s->map, index[b].first, index[b].first_seq) != NULL) {
+        off = index[b].first;
+        seq = index[b].first_seq;
+    }
+    memset(&index[b], 0, (BLOCKS - b) * sizeof(seg_index));
+    const record* rec;
+    while ((rec = valid_record(s->map, off, seq)) != NULL) {
+        index_record(s->map, off, rec);
+        off += rec->size;
+        seq++;
+    }
+    terminate(s->map, off);
+    atomic_init(&s->end, off);
+    *next_seq = seq;
+    return s;
+}
+
+// Syncs the records appended to a segment since the last time
+static void sync_segment(segment* s) {
+    size_t end = atomic_load_explicit(&s->end, memory_order_acquire);
+    if (end == s->synced) { return; }
+    // Only dirty pages are written, the index with them
+    if (msync(s->map, end, MS_SYNC) == 0) { s->synced = end; }
+}
+
+static void* commit_loop(void* arg) {
+    msglog* log = (msglog*) arg;
+    pthread_mutex_lock(&log->lock);
+    for (;;) {
+        int stop = log->stop;
+        segment* retired = log->retired;
+        segment* current = log->seg;
+        log->retired = NULL;
+        pthread_mutex_unlock(&log->lock);
+        // Older segments first, so that what is on disk has no holes
+        while (retired != NULL) {
+            segment* next = retired->next;
+            sync_segment(retired);
+            free_segment(retired);
+            retired = next;
+        }
+        if (current != NULL) { sync_segment(current); }
+        if (stop) { return NULL; }
+        pthread_mutex_lock(&log->lock);
+        if (!log->stop && log->retired == NULL) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += MSGLOG_COMMIT_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+        }
+    }
+}
+
+// Starts a new segment, handing the full one to the committer
+static int roll(msglog* log) {
+    segment* s = create_segment(log->dir, log->next_seq);
+    if (s == NULL) { return -1; }
+    pthread_mutex_lock(&log->lock);
+    segment** last = &log->retired;
+    while (*last != NULL) { last = &(*last)->next; }
+    *last = log->seg;
+    log->seg = s;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+}
+
+static int is_segment(const struct dirent* d) {
+    return strlen(d->d_name) == NAME_DIGITS + strlen(SUFFIX)
+        && strcmp(d->d_name + NAME_DIGITS, SUFFIX) == 0;
+}
+
+// Creates the directories of path, private to the user
+static int make_dirs(const char* path) {
+    char dir[4096];
+    if (snprintf(dir, sizeof(dir), "%s/", path) >= (int) sizeof(dir)) { return -1; }
+    for (char* p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) { return -1; }
+        *p = '/';
+    }
+    return 0;
+}
+
+int msglog_default_path(char* out, size_t len) {
+    const char* base = getenv("XDG_DATA_HOME");
+    int r;
+    if (base != NULL && base[0] == '/') {
+        r = snprintf(out, len, "%s/%s", base, MSGLOG_DIR);
+    } else if ((base = getenv("HOME")) != NULL && base[0] != '\0') {
+        r = snprintf(out, len, "%s/.local/share/%s", base, MSGLOG_DIR);
+    } else {
+        return -1;
+    }
+    return r < 0 || (size_t) r >= len ? -1 : 0;
+}
+
+msglog* msglog_open(const char* dir) {
+    pthread_once(&crc_once, crc_init);
+    msglog* log = calloc(1, sizeof(msglog));
+    if (log == NULL) { return NULL; }
+    char path[4200];
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    if (make_dirs(dir) != 0
+        || (log->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        free(log);
+        return NULL;
+    }
+    if (flock(log->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(log->lock_fd);
+        free(log);
+        return NULL;
+    }
+    log->next_seq = 1;
+    struct dirent** names;
+    int n = scandir(dir, &names, is_segment, alphasort);
+    int failed = n < 0;
+    if (n > 0) {
+        // The last segment is appended to. One that is not a segment (e.g.,
+        // resized) is kept aside for inspection and numbering resumes past
+        // any record it may hold; one that cannot be read now (e.g., EMFILE)
+        // fails the open, as appending would have to skip or reuse its records.
+        uint64_t first_seq = strtoull(names[n - 1]->d_name, NULL, 10);
+        log->seg = recover_segment(dir, first_seq, &log->next_seq);
+        if (log->seg == NULL && errno == EBADMSG) {
+            char bad[4200 + sizeof(BAD_SUFFIX)];
+            segment_path(path, sizeof(path), dir, first_seq);
+            snprintf(bad, sizeof(bad), "%s" BAD_SUFFIX, path);
+            failed = rename(path, bad) != 0;
+            log->next_seq = first_seq + SEGMENT_RECORDS;
+        } else if (log->seg == NULL) {
+            failed = 1;
+        }
+    }
+    int err = errno;
+    for (int i = 0; i < n; ++i) { free(names[i]); }
+    if (n >= 0) { free(names); }
+    if (failed) {
+        close(log->lock_fd);
+        free(log);
+        errno = err;
+        return NULL;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+    if (pthread_create(&log->committer, NULL, commit_loop, log) != 0) {
+        if (log->seg != NULL) { free_segment(log->seg); }
+        close(log->lock_fd);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+uint64_t msglog_append(msglog* log, int sent, uint8_t peer, const void* data, size_t len) {
+    if (len > MSGLOG_MAX_MSG) { len = MSGLOG_MAX_MSG; }
+    size_t size = ALIGN(RECORD_HEADER + len);
+    size_t off = log->seg != NULL ? atomic_load_explicit(&log->seg->end, memory_order_relaxed)
+                                  : MSGLOG_SEGMENT;
+    if (off + size > MSGLOG_SEGMENT) {
+        if (roll(log) != 0) { return 0; }
+        off = DATA_START;
+    }
+    unsigned char* map = log->seg->map;
+    record* rec = (record*) (map + off);
+    rec->seq = log->next_seq;
+    rec->time_ms = wall_ms();
+    rec->peer = peer;
+    rec->sent = sent != 0;
+    rec->len = len;
+    rec->reserved = 0;
+    memcpy(rec + 1, data, len);
+    memset((unsigned char*) (rec + 1) + len, 0, size - RECORD_HEADER - len);
+    rec->crc = crc32(&rec->seq, size - offsetof(record, seq));
+    index_record(map, off, rec);
+    // Readers see the record once its size is set, and stop right after it
+    terminate(map, off + size);
+    atomic_store_explicit(&rec->size, size, memory_order_release);
+    atomic_store_explicit(&log->seg->end, off + size, memory_order_release);
+    return log->next_seq++;
+}
+
+void msglog_close(msglog* log) {
+    if (log == NULL) { return; }
+    pthread_mutex_lock(&log->lock);
+    log->stop = 1;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->committer, NULL);
+    if (log->seg != NULL) { free_segment(log->seg); }
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    close(log->lock_fd);
+    free(log);
+}
+
+static int block_matches(const seg_index* idx, const msglog_query* q) {
+    if (idx->count == 0) { return 0; }
+    if (q->seq_to != 0 && idx->first_seq > q->seq_to) { return 0; }
+    if (q->seq_from != 0 && idx->first_seq + idx->count <= q->seq_from) { return 0; }
+    if (q->since_ms != 0 && idx->max_ms < q->since_ms) { return 0; }
+    if (q->until_ms != 0 && idx->min_ms > q->until_ms) { return 0; }
+    if (q->peer >= 0 && !(idx->peers[q->peer >> 3] & (1 << (q->peer & 7)))) { return 0; }
+    return 1;
+}
+
+static int record_matches(const record* rec, const msglog_query* q) {
+    return (q->seq_from == 0 || rec->seq >= q->seq_from)
+        && (q->seq_to == 0 || rec->seq <= q->seq_to)
+        && (q->since_ms == 0 || rec->time_ms >= q->since_ms)
+        && (q->until_ms == 0 || rec->time_ms <= q->until_ms)
+        && (q->peer < 0 || rec->peer == q->peer)
+        && (q->sent < 0 || rec->sent == q->sent)
+        && (q->text == NULL || memmem(rec + 1, rec->len, q->text, strlen(q->text)) != NULL);
+}
+
+// Visits the matches in one segment
+//
+// @return 1 once the search is over, 0 otherwise
+static int search_segment(const unsigned char* map, const msglog_query* q,
+                          msglog_visit visit, void* arg, long* found) {
+    const seg_index* index = index_of(map);
+    for (int i = 0; i < BLOCKS; ++i) {
+        int b = q->newest_first ? BLOCKS - 1 - i : i;
+        seg_index idx = index[b];   // May change under a process appending
+        if (!block_matches(&idx, q)) { continue; }
+        const record* recs[BLOCK_RECORDS];
+        int n = 0;
+        size_t off = idx.first;
+        for (uint64_t seq = idx.first_seq; n < (int) idx.count && n < BLOCK_RECORDS; ++seq) {
+            const record* rec = valid_record(map, off, seq);
+            if (rec == NULL) { break; }
+            recs[n++] = rec;
+            off += rec->size;
+        }
+        for (int j = 0; j < n; ++j) {
+            const record* rec = recs[q->newest_first ? n - 1 - j : j];
+            if (!record_matches(rec, q)) { continue; }
+            msglog_entry e = {
+                .seq = rec->seq, .time_ms = rec->time_ms, .peer = rec->peer, .sent = rec->sent,
+                .data = (const unsigned char*) (rec + 1), .len = rec->len,
+            };
+            ++*found;
+            if (visit(&e, arg) != 0 || (q->limit != 0 && (size_t) *found >= q->limit)) { return 1; }
+        }
+    }
+    return 0;
+}
+
+long msglog_search(const char* dir, const msglog_query* q, msglog_visit visit, void* arg) {
+    pthread_once(&crc_once, crc_init);
+    struct dirent** names;
+    int n = scandir(dir, &names, is_segment, alphasort);
+    if (n < 0) { return -1; }
+    long found = 0;
+    int done = 0;
+    for (int i = 0; i < n && !done; ++i) {
+        int s = q->newest_first ? n - 1 - i : i;
+        // Segments are skipped by their sequence numbers without opening them
+        uint64_t first_seq = strtoull(names[s]->d_name, NULL, 10);
+        uint64_t next_seq = s + 1 < n ? strtoull(names[s + 1]->d_name, NULL, 10) : UINT64_MAX;
+        if ((q->seq_to != 0 && first_seq > q->seq_to)
+            || (q->seq_from != 0 && next_seq <= q->seq_from)) {
+            continue;
+        }
+        char path[4200];
+        segment_path(path, sizeof(path), dir, first_seq);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { continue; }
+        unsigned char* map = map_segment(fd, 0);
+        close(fd);
+        if (map == NULL) { continue; }
+        done = search_segment(map, q, visit, arg, &found);
+        munmap(map, MSGLOG_SEGMENT);
+    }
+    for (int i = 0; i < n; ++i) { free(names[i]); }
+    free(names);
+    return found;
+}
@@ -0,0 +1,152 @@
+#include "reactor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define MAX_EVENTS 16
+
+// Kinds of watched descriptors, timers and events are owned by the reactor
+enum { SLOT_FREE, SLOT_IO, SLOT_TIMER, SLOT_EVENT };
+
+typedef struct {
+    int kind;
+    reactor_cb cb;
+    void* arg;
+} slot;
+
+struct reactor {
+    int epoll_fd;
+    int stop_fd;
+    volatile int running;
+    slot* slots;    // Indexed by descriptor
+    int nslots;
+};
+
+static int reactor_watch(reactor* r, int fd, int kind, uint32_t events, reactor_cb cb, void* arg) {
+    if (fd < 0) { return -1; }
+    if (fd >= r->nslots) {
+        int n = r->nslots ? r->nslots : 16;
+        while (n <= fd) { n *= 2; }
+        slot* slots = realloc(r->slots, n * sizeof(slot));
+        if (slots == NULL) { return -1; }
+        memset(slots + r->nslots, 0, (n - r->nslots) * sizeof(slot));
+        r->slots = slots;
+        r->nslots = n;
+    }
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) { return -1; }
+    r->slots[fd].kind = kind;
+    r->slots[fd].cb = cb;
+    r->slots[fd].arg = arg;
+    return 0;
+}
+
+static void reactor_wakeup(reactor* r, int fd, uint32_t events, void* arg) {
+    (void) fd; (void) events; (void) arg;
+    r->running = 0;
+}
+
+reactor* reactor_create(void) {
+    reactor* r = calloc(1, sizeof(reactor));
+    if (r == NULL) { return NULL; }
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    r->stop_fd = -1;
+    if (r->epoll_fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->stop_fd = reactor_event(r, reactor_wakeup, NULL);
+    if (r->stop_fd < 0) {
+        reactor_destroy(r);
+        return NULL;
+    }
+    return r;
+}
+
+int reactor_add(reactor* r, int fd, uint32_t events, reactor_cb cb, void* arg) {
+    return reactor_watch(r, fd, SLOT_IO, events, cb, arg);
+}
+
+int reactor_remove(reactor* r, int fd) {
+    if (fd < 0 || fd >= r->nslots || r->slots[fd].kind == SLOT_FREE) { return -1; }
+    // Pending events for this descriptor in the current batch are skipped
+    r->slots[fd].kind = SLOT_FREE;
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int reactor_timer(reactor* r, reactor_cb cb, void* arg) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) { return -1; }
+    if (reactor_watch(r, fd, SLOT_TIMER, EPOLLIN, cb, arg) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int reactor_timer_set(reactor* r, int timer_fd, unsigned ms, int periodic) {
+    (void) r;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (long) (ms % 1000) * 1000000L;
+    if (periodic) { its.it_interval = its.it_value; }
+    return timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+int reactor_event(reactor* r, reactor_cb cb, void* arg) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) { return -1; }
+    if (reactor_watch(r, fd, SLOT_EVENT, EPOLLIN, cb, arg) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void reactor_notify(int event_fd) {
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0) { /* counter saturated, still pending */ }
+}
+
+int reactor_run(reactor* r) {
+    struct epoll_event events[MAX_EVENTS];
+    r->running = 1;
+    while (r->running) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd >= r->nslots || r->slots[fd].kind == SLOT_FREE) { continue; }
+            slot s = r->slots[fd];
+            // Timers and events are level triggered, consume them before dispatch
+            if (s.kind == SLOT_TIMER || s.kind == SLOT_EVENT) {
+                uint64_t count;
+                if (read(fd, &count, sizeof(count)) < 0) { continue; }
+            }
+            s.cb(r, fd, events[i].events, s.arg);
+        }
+    }
+    return 0;
+}
+
+void reactor_stop(reactor* r) {
+    reactor_notify(r->stop_fd);
+}
+
+void reactor_destroy(reactor* r) {
+    for (int fd = 0; fd < r->nslots; ++fd) {
+        if (r->slots[fd].kind == SLOT_TIMER || r->slots[fd].kind == SLOT_EVENT) {
+            close(fd);
+        }
+    }
+    close(r->epoll_fd);
+    free(r->slots);
+    free(r);
+}
@@ -0,0 +1,121 @@
+#include "replay.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define HISTORY_MAGIC "wioreplay1"  // Start of a history file
+
+void replay_init(replay_window* w) {
+    memset(w, 0, sizeof(*w));
+}
+
+int replay_check(const replay_window* w, uint32_t seq) {
+    if (!w->started || seq > w->top) { return 1; }
+    uint32_t age = w->top - seq;
+    if (age >= REPLAY_WINDOW) { return 0; }
+    return !(w->bitmap & (1ULL << age));
+}
+
+void replay_update(replay_window* w, uint32_t seq) {
+    w->received++;
+    if (!w->started) {
+        // Whatever came before this session started is unknown, not lost
+        w->started = 1;
+        w->top = seq;
+        w->bitmap = 1;
+        return;
+    }
+    if (seq > w->top) {
+        uint32_t shift = seq - w->top;
+        w->lost += shift - 1;
+        w->bitmap = shift >= REPLAY_WINDOW ? 0 : w->bitmap << shift;
+        w->bitmap |= 1;
+        w->top = seq;
+    } else {
+        // A packet counted as lost showed up late
+        w->bitmap |= 1ULL << (w->top - seq);
+        w->reordered++;
+        if (w->lost > 0) { w->lost--; }
+    }
+}
+
+void replay_history_init(replay_history* h) {
+    h->next = 0;
+    h->count = 0;
+}
+
+static replay_retired* history_find(const replay_history* h, const unsigned char* id) {
+    for (int i = 0; i < h->count; ++i) {
+        if (memcmp(h->entries[i].id, id, REPLAY_ID_BYTES) == 0) {
+            return (replay_retired*) &h->entries[i];
+        }
+    }
+    return NULL;
+}
+
+void replay_retire(replay_history* h, const unsigned char* id, const replay_window* w) {
+    if (!w->started) { return; }
+    replay_retired* e = history_find(h, id);
+    if (e == NULL) {
+        e = &h->entries[h->next];
+        h->next = (h->next + 1) % REPLAY_HISTORY;
+        if (h->count < REPLAY_HISTORY) { h->count++; }
+        memcpy(e->id, id, REPLAY_ID_BYTES);
+    } else if (e->top > w->top) {
+        return;
+    }
+    e->top = w->top;
+}
+
+void replay_recall(const replay_history* h, const unsigned char* id, replay_window* w) {
+    replay_init(w);
+    const replay_retired* e = history_find(h, id);
+    if (e == NULL) { return; }
+    w->started = 1;
+    w->top = e->top;
+    w->bitmap = ~0ULL;
+}
+
+int replay_history_save(const replay_history* h, const char* path) {
+    char tmp[4096];
+    // Named after the process, clients sharing a cache may save at once
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid()) >= (int) sizeof(tmp)) {
+        return -1;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) { return -1; }
+    // Oldest first, so loading replays the evictions in order
+    int ok = write(fd, HISTORY_MAGIC, sizeof(HISTORY_MAGIC)) == sizeof(HISTORY_MAGIC);
+    int first = h->count < REPLAY_HISTORY ? 0 : h->next;
+    for (int i = 0; ok && i < h->count; ++i) {
+        const replay_retired* e = &h->entries[(first + i) % REPLAY_HISTORY];
+        ok = write(fd, e, sizeof(*e)) == sizeof(*e);
+    }
+    if (close(fd) != 0 || !ok) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+int replay_history_load(replay_history* h, const char* path) {
+    replay_history_init(h);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return -1; }
+    char magic[sizeof(HISTORY_MAGIC)];
+    int ok = read(fd, magic, sizeof(magic)) == sizeof(magic)
+             && memcmp(magic, HISTORY_MAGIC, sizeof(magic)) == 0;
+    replay_retired e;
+    ssize_t r = 0;
+    while (ok && (r = read(fd, &e, sizeof(e))) == sizeof(e)) {
+        replay_window w = { .started = 1, .top = e.top };
+        replay_retire(h, e.id, &w);
+    }
+    close(fd);
+    if (!ok || r != 0) {
+        replay_history_init(h);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include "rs.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Field tables for the polynomial x^8 + x^4 + x^3 + x^2 + 1, exp doubled so
+// that products skip the modulo
+static uint8_t gf_exp[510];
+static uint8_t gf_log[256];
+static int gf_ready = 0;
+
+static void gf_init(void) {
+    if (gf_ready) { return; }
+    unsigned x = 1;
+    for (int i = 0; i < 255; ++i) {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t) x;
+        gf_log[x] = (uint8_t) i;
+        x <<= 1;
+        if (x & 0x100) { x ^= 0x11d; }
+    }
+    gf_ready = 1;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// Coefficient of data symbol i in parity row: 1 / (x + y) with x = k + row
+// and y = i, all distinct, which makes every square submatrix invertible
+static uint8_t coef(unsigned k, unsigned row, unsigned i) {
+    return gf_inv((uint8_t) ((k + row) ^ i));
+}
+
+// out += c * in, over len bytes
+static void mul_add(unsigned char* out, const unsigned char* in, uint8_t c, size_t len) {
+    if (c == 0) { return; }
+    if (c == 1) {
+        for (size_t n = 0; n < len; ++n) { out[n] ^= in[n]; }
+        return;
+    }
+    // One table per coefficient keeps the inner loop to a lookup
+    uint8_t table[256];
+    for (int b = 0; b < 256; ++b) { table[b] = gf_mul((uint8_t) b, c); }
+    for (size_t n = 0; n < len; ++n) { out[n] ^= table[in[n]]; }
+}
+
+void rs_encode(const unsigned char* data, unsigned k, size_t len, unsigned row,
+               unsigned char* out) {
+    gf_init();
+    memset(out, 0, len);
+    for (unsigned i = 0; i < k; ++i) { mul_add(out, data + i * len, coef(k, row, i), len); }
+}
+
+// Inverts an n x n matrix in place by Gauss-Jordan elimination
+static int invert(uint8_t* m, unsigned n) {
+    uint8_t* inv = calloc((size_t) n * n, 1);
+    if (inv == NULL) { return -1; }
+    for (unsigned i = 0; i < n; ++i) { inv[i * n + i] = 1; }
+    for (unsigned col = 0; col < n; ++col) {
+        unsigned pivot = col;
+        while (pivot < n && m[pivot * n + col] == 0) { pivot++; }
+        if (pivot == n) {
+            free(inv);
+            return -1;
+        }
+        if (pivot != col) {
+            for (unsigned j = 0; j < n; ++j) {
+                uint8_t t = m[col * n + j];
+                m[col * n + j] = m[pivot * n + j];
+                m[pivot * n + j] = t;
+                t = inv[col * n + j];
+                inv[col * n + j] = inv[pivot * n + j];
+                inv[pivot * n + j] = t;
+            }
+        }
+        uint8_t scale = gf_inv(m[col * n + col]);
+        for (unsigned j = 0; j < n; ++j) {
+            m[col * n + j] = gf_mul(m[col * n + j], scale);
+            inv[col * n + j] = gf_mul(inv[col * n + j], scale);
+        }
+        for (unsigned r = 0; r < n; ++r) {
+            uint8_t f = m[r * n + col];
+            if (r == col || f == 0) { continue; }
+            for (unsigned j = 0; j < n; ++j) {
+                m[r * n + j] ^= gf_mul(f, m[col * n + j]);
+                inv[r * n + j] ^= gf_mul(f, inv[col * n + j]);
+            }
+        }
+    }
+    memcpy(m, inv, (size_t) n * n);
+    free(inv);
+    return 0;
+}
+
+int rs_decode(unsigned char* data, const uint8_t* have, unsigned k, size_t len,
+              const unsigned char* parity, const uint8_t* rows, unsigned count) {
+    gf_init();
+    // Only the missing symbols are unknowns: subtract the known data from
+    // as many parity symbols as there are gaps, leaving a small system
+    unsigned missing[RS_MAX_SYMBOLS];
+    unsigned n = 0;
+    for (unsigned i = 0; i < k; ++i) {
+        if (!have[i]) { missing[n++] = i; }
+    }
+    if (n == 0) { return 0; }
+    if (count < n) { return -1; }
+    uint8_t* m = malloc((size_t) n * n);
+    unsigned char* rhs = malloc(n * len);
+    if (m == NULL || rhs == NULL) {
+        free(m);
+        free(rhs);
+        return -1;
+    }
+    for (unsigned r = 0; r < n; ++r) {
+        unsigned char* s = rhs + r * len;
+        memcpy(s, parity + r * len, len);
+        for (unsigned i = 0; i < k; ++i) {
+            if (have[i]) { mul_add(s, data + i * len, coef(k, rows[r], i), len); }
+        }
+        for (unsigned c = 0; c < n; ++c) { m[r * n + c] = coef(k, rows[r], missing[c]); }
+    }
+    int r = invert(m, n);
+    if (r == 0) {
+        for (unsigned e = 0; e < n; ++e) {
+            unsigned char* out = data + missing[e] * len;
+            memset(out, 0, len);
+            for (unsigned c = 0; c < n; ++c) { mul_add(out, rhs + c * len, m[e * n + c], len); }
+        }
+    }
+    free(m);
+    free(rhs);
+    return r;
+}
@@ -1,25 +1,37 @@
 #include "ser.h"
+#include "ser_linux.h"
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
 
-int open_serial(char* serial_port) {
-    int serial_fd;
-    struct termios tty;
-    
-    // Open serial port
-    serial_fd = open(serial_port, O_RDWR);
-    if (serial_fd < 0) {
-        perror("Error opening serial port");
-        return -1;
+// Configures a port with termios, which only knows the standard rates
+static int posix_configure(int serial_fd, unsigned baud) {
+    speed_t speed;
+    switch (baud) {
+        case 9600: speed = B9600; break;
+        case 19200: speed = B19200; break;
+        case 38400: speed = B38400; break;
+        case 57600: speed = B57600; break;
+        case 115200: speed = B115200; break;
+        case 230400: speed = B230400; break;
+#ifdef B460800
+        case 460800: speed = B460800; break;
+#endif
+#ifdef B921600
+        case 921600: speed = B921600; break;
+#endif
+        default:
+            fprintf(stderr, "Unsupported baud rate %u\n", baud);
+            return -1;
     }
-
-    // Configure serial port
+    struct termios tty;
     memset(&tty, 0, sizeof(tty));
     if (tcgetattr(serial_fd, &tty) != 0) {
         perror("Error from tcgetattr");
-        close(serial_fd);
         return -1;
     }
-    cfsetospeed(&tty, B230400); // Set baud rate to 230400
-    cfsetispeed(&tty, B230400);
+    cfsetospeed(&tty, speed);
+    cfsetispeed(&tty, speed);
     tty.c_cflag |= (CLOCAL | CREAD); // Enable reading and ignore modem control signals
     tty.c_cflag &= ~PARENB; // No parity
     tty.c_cflag &= ~CSTOPB; // One stop bit
@@ -30,89 +42,159 @@ int open_serial(char* serial_port) {
     tty.c_oflag &= ~OPOST; // Raw output
     if (tcsetattr(serial_fd, TCSANOW, &tty) != 0) { // Set new attributes
         perror("Error from tcsetattr");
-        close(serial_fd);
         return -1;
     }
-    return serial_fd;
+    return 0;
 }
 
-ssize_t read_serial(int serial_fd, size_t ms, unsigned char* buf, size_t len) {
-    // Read with timeout
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(serial_fd, &read_fds);
-    struct timeval init_t = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
-    int select_result = select(serial_fd + 1, &read_fds, NULL, NULL, ms != 0 ? &init_t : NULL);
-    // If select timeouts, quit early
-    if (select_result < 0 || !FD_ISSET(serial_fd, &read_fds)) {
-        perror("Timeout");
+#ifdef __linux__
+static ser_impl impl = SER_LINUX;
+#else
+static ser_impl impl = SER_POSIX;
+#endif
+
+int ser_use(ser_impl which) {
+#ifndef __linux__
+    if (which == SER_LINUX) { return -1; }
+#endif
+    impl = which;
+    return 0;
+}
+
+const char* ser_name(void) {
+    return impl == SER_LINUX ? "linux" : "posix";
+}
+
+int open_serial(char* serial_port, unsigned baud) {
+    // Open serial port
+    int serial_fd = open(serial_port, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (serial_fd < 0) {
+        perror("Error opening serial port");
         return -1;
     }
-    // Read response continously
-    int bytes_read = 0;
-    while (FD_ISSET(serial_fd, &read_fds)) {
-        // Read response
-        bytes_read += read(serial_fd, buf + bytes_read, len - bytes_read);
-        if (bytes_read < 0) {
-            perror("Serial Error");
-            return -1;
+    if (baud == 0) { baud = SERIAL_BAUD; }
+    int r;
+#ifdef __linux__
+    if (impl == SER_LINUX) {
+        r = ser_linux_configure(serial_fd, baud);
+    } else {
+        r = posix_configure(serial_fd, baud);
+    }
+#else
+    r = posix_configure(serial_fd, baud);
+#endif
+    if (r < 0) {
+        close(serial_fd);
+        return -1;
+    }
+    return serial_fd;
+}
+
+ssize_t write_serial(int serial_fd, const void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write(serial_fd, (const char*) buf + done, len - done);
+        if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+            // Output queue is full, wait for the UART to drain it
+            struct pollfd pfd = { .fd = serial_fd, .events = POLLOUT };
+            poll(&pfd, 1, 1000);
+            continue;
         }
-        // Select again in case we are reading faster than we are recieving data
-        // Setup timeout
-        struct timeval norm_t = { .tv_sec = 0, .tv_usec = NORM_TIMEOUT};
-        FD_ZERO(&read_fds); FD_SET(serial_fd, &read_fds);
-        // Wait for next bytes to come in
-        select_result = select(serial_fd + 1, &read_fds, NULL, NULL, &norm_t);
-        if (select_result < 0) {
-            perror("Select Error");
+        if (r < 0) {
+            perror("Serial Error");
             return -1;
         }
+        done += r;
     }
-    buf[bytes_read - 2] = '\0'; // null terminate and strip new lines
-    return bytes_read - 2;
+    return done;
 }
 
-ssize_t read_serial_trigger(int serial_fd, size_t ms, unsigned char* buf, size_t len, int trigger_fd) {
-    // Read with timeout
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(serial_fd, &read_fds);
-    FD_SET(trigger_fd, &read_fds);
-    struct timeval init_t = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
-    int max_fd = serial_fd > trigger_fd ? serial_fd : trigger_fd;
-    int select_result = select(max_fd + 1, &read_fds, NULL, NULL, ms != 0 ? &init_t : NULL);
-    // If select timeouts, quit early
-    if (select_result < 0) {
-        perror("Timeout");
+int wait_serial(int serial_fd, int ms, int trigger_fd) {
+    struct pollfd fds[2] = {
+        { .fd = serial_fd, .events = POLLIN },
+        { .fd = trigger_fd, .events = POLLIN },
+    };
+    int r;
+    do {
+        r = poll(fds, trigger_fd >= 0 ? 2 : 1, ms);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        perror("Poll Error");
         return -1;
     }
-    // If trigger is activated, return early as well
-    if (FD_ISSET(trigger_fd, &read_fds)) {
-        // Read from the pipe until it is empty
-        char buf;
-        read(trigger_fd, &buf, sizeof(buf));
+    // If trigger is activated, return early
+    if (trigger_fd >= 0 && (fds[1].revents & POLLIN)) {
+        char c;
+        if (read(trigger_fd, &c, sizeof(c)) < 0) { return -1; }
         return 0;
     }
-    // Read response continously
-    int bytes_read = 0;
-    while (FD_ISSET(serial_fd, &read_fds)) {
-        // Read response
-        bytes_read += read(serial_fd, buf + bytes_read, len - bytes_read);
-        if (bytes_read < 0) {
-            perror("Serial Error");
-            return -1;
+    return (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0;
+}
+
+// Names of the USB serial adapters on Wio-E5 boards, as udev lists them:
+// the CP2102N of the Dev Kit, the CH340 of the mini, and boards that name
+// themselves. The generic ones are only kept if a module answers.
+static const char* const known_adapters[] = {
+    "Wio-E5", "LoRa-E5", "CP2102N", "1a86_USB_Serial",
+};
+
+static int by_name(const void* a, const void* b) {
+    return strcmp((const char*) a, (const char*) b);
+}
+
+static long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Checks that a module answers AT on a port, as the same adapters are
+// found on boards of all kinds (e.g., Arduinos and GPS receivers)
+static int probe(char* path, unsigned baud) {
+    int fd = open_serial(path, baud);
+    if (fd < 0) { return 0; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    tcflush(fd, TCIOFLUSH);
+    char buf[256];
+    size_t len = 0;
+    int found = 0;
+    if (write_serial(fd, "AT\n", 3) == 3) {
+        long deadline = monotonic_ms() + SER_PROBE_MS;
+        for (long left = SER_PROBE_MS; !found && left > 0; left = deadline - monotonic_ms()) {
+            if (wait_serial(fd, left, -1) != 1) { break; }
+            ssize_t r = read(fd, buf + len, sizeof(buf) - 1 - len);
+            if (r < 0 && (errno == EAGAIN || errno == EINTR)) { continue; }
+            if (r <= 0) { break; }
+            len += r;
+            buf[len] = '\0';
+            found = strstr(buf, "+AT: OK") != NULL;
+            // Keeps the end of what an unknown device keeps sending
+            if (len == sizeof(buf) - 1) {
+                memmove(buf, buf + len / 2, len - len / 2);
+                len -= len / 2;
+            }
         }
-        // Select again in case we are reading faster than we are recieving data
-        // Setup timeout
-        struct timeval norm_t = { .tv_sec = 0, .tv_usec = NORM_TIMEOUT};
-        FD_ZERO(&read_fds); FD_SET(serial_fd, &read_fds);
-        // Wait for next bytes to come in
-        select_result = select(serial_fd + 1, &read_fds, NULL, NULL, &norm_t);
-        if (select_result < 0) {
-            perror("Select Error");
-            return -1;
+    }
+    close(fd);
+    return found;
+}
+
+int ser_autodetect(char paths[][SER_MAX_PATH], int max, unsigned baud) {
+    DIR* dir = opendir(SER_BY_ID);
+    if (dir == NULL) { return 0; }
+    int n = 0;
+    struct dirent* entry;
+    while (n < max && (entry = readdir(dir)) != NULL) {
+        // One entry per USB interface, the modules have a single one
+        if (strstr(entry->d_name, "-if00") == NULL) { continue; }
+        for (size_t i = 0; i < sizeof(known_adapters) / sizeof(known_adapters[0]); ++i) {
+            if (strstr(entry->d_name, known_adapters[i]) == NULL) { continue; }
+            int r = snprintf(paths[n], SER_MAX_PATH, "%s/%s", SER_BY_ID, entry->d_name);
+            if (r > 0 && r < SER_MAX_PATH && probe(paths[n], baud)) { n++; }
+            break;
         }
     }
-    buf[bytes_read - 2] = '\0'; // null terminate and strip new lines
-    return bytes_read - 2;
-}
\ No newline at end of file
+    closedir(dir);
+    qsort(paths, n, SER_MAX_PATH, by_name);
+    return n;
+}
@@ -0,0 +1,40 @@
+#ifdef __linux__
+
+#include "ser_linux.h"
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+int ser_linux_configure(int fd, unsigned baud) {
+    struct termios2 tty;
+    if (ioctl(fd, TCGETS2, &tty) != 0) {
+        perror("Error from TCGETS2");
+        return -1;
+    }
+    // Same rate both ways, given in bits per second instead of a B constant
+    tty.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tty.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tty.c_ispeed = baud;
+    tty.c_ospeed = baud;
+    tty.c_cflag |= (CLOCAL | CREAD); // Enable reading and ignore modem control signals
+    tty.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS); // No parity, one stop bit, no flow control
+    tty.c_cflag |= CS8; // 8 bits per byte
+    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG | IEXTEN); // Raw input
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY | ISTRIP | INLCR | IGNCR | ICRNL); // Bytes as sent
+    tty.c_oflag &= ~OPOST; // Raw output
+    // poll reports the first byte instead of waiting for more or a timer
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    if (ioctl(fd, TCSETS2, &tty) != 0) {
+        perror("Error from TCSETS2");
+        return -1;
+    }
+    // Drivers without the setting (e.g., pseudo-terminals) are fine as they are
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) != 0) { return 0; }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &serial) == 0 ? 1 : 0;
+}
+
+#endif  // __linux__
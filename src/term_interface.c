@@ -1,5 +1,13 @@
 #include "term_interface.h"
 #include "wioe.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define PROMPT "\033[1;34m~$\033[0m "
+#define PROMPT_COLUMNS 3    // Columns the prompt takes on screen
 
 typedef struct {
     int (*callback)(char*, void*);
@@ -8,143 +16,358 @@ typedef struct {
     int cursor_position;
     char command_line[MAX_COMMAND_LENGTH];
     int complete;
-    pthread_mutex_t lock;
+    // Line editing state
+    char command_history[MAX_HISTORY_SIZE][MAX_COMMAND_LENGTH];
+    int history_size;
+    int history_index;
+    int curr_history_index;
+    int current_index;
+    int escape;             // Position within an arrow key escape sequence
+    struct termios old;     // Terminal settings to restore on exit
+    // Screen, only touched by the owner thread
+    pthread_t owner;
+    char* scrollback[TERM_SCROLLBACK];  // Printed lines, a ring indexed by count
+    unsigned long lines;    // Lines printed so far
+    unsigned long drawn;    // Lines on screen so far
+    char shown[MAX_COMMAND_LENGTH];     // Command line as on screen
+    int shown_valid;        // 0 when the command line has to be drawn in full
+    int shown_cursor;       // Cursor position on screen
+    int repaint;            // Clear the screen and draw the scrollback again
+    long last_frame_ms;
+    char* frame;            // Output of one update, sent with a single write
+    size_t frame_len;
+    size_t frame_cap;
+    // Wakeup of the owner: a byte is in the pipe while an update is pending
+    int wake_fd[2];
+    atomic_int woken;
+    // Lines printed by another thread, single producer and single consumer
+    char* queue[TERM_QUEUE_LEN];
+    _Alignas(64) atomic_size_t queue_head;  // Advanced by the producer
+    _Alignas(64) atomic_size_t queue_tail;  // Advanced by the owner
 } term_args;
 
 struct term {
     term_args* data;
     pthread_t term_thread;
+    int threaded;
 };
 
-// Function to clear the line
-static void clear_line() {
-    printf("\033[2K"); // Clear the entire line
-    printf("\r");      // Move the cursor to the beginning of the line
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
-// Function to display the current command line
-static void display_command_line(const char* command_line, int cursor_position) {
-    clear_line();
-    printf("\033[1;34m~$\033[0m %s", command_line);
-    printf("\033[%dG", cursor_position + 4); // Move cursor to current position
-    fflush(stdout); // Flush the output buffer
+// Has the owner look at the screen, once until it does
+static void wake(term_args* data) {
+    if (atomic_exchange(&data->woken, 1) == 0) {
+        ssize_t r = write(data->wake_fd[1], "x", 1);
+        (void) r;
+    }
 }
 
-void* backend_term(void* args) {
-    term_args* data = (term_args*) args;
-    // Setting up terminal
-    struct termios old, new;
-    tcgetattr(STDIN_FILENO, &old);
-    new = old;
+// Takes ownership of a line printed on the owner thread
+static void add_line(term_args* data, char* line) {
+    size_t slot = data->lines % TERM_SCROLLBACK;
+    free(data->scrollback[slot]);
+    data->scrollback[slot] = line;
+    data->lines++;
+}
+
+// Moves the lines printed by the other thread into the scrollback
+static void drain_queue(term_args* data) {
+    size_t tail = atomic_load_explicit(&data->queue_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&data->queue_head, memory_order_acquire);
+    for (; tail != head; ++tail) { add_line(data, data->queue[tail % TERM_QUEUE_LEN]); }
+    atomic_store_explicit(&data->queue_tail, tail, memory_order_release);
+}
+
+static void emit(term_args* data, const char* s, size_t len) {
+    if (data->frame_len + len > data->frame_cap) {
+        size_t cap = data->frame_cap ? data->frame_cap : 4096;
+        while (cap < data->frame_len + len) { cap *= 2; }
+        char* frame = realloc(data->frame, cap);
+        if (frame == NULL) { return; }
+        data->frame = frame;
+        data->frame_cap = cap;
+    }
+    memcpy(data->frame + data->frame_len, s, len);
+    data->frame_len += len;
+}
+
+static void emit_str(term_args* data, const char* s) {
+    emit(data, s, strlen(s));
+}
+
+// Moves the cursor to a position on the command line
+static void emit_column(term_args* data, int position) {
+    char move[16];
+    emit(data, move, snprintf(move, sizeof(move), "\033[%dG", position + PROMPT_COLUMNS + 1));
+}
+
+static void emit_line(term_args* data, unsigned long n) {
+    emit_str(data, data->scrollback[n % TERM_SCROLLBACK]);
+    emit_str(data, "\r\n");
+}
+
+// Writes the frame out, waiting when stdout is full
+static void send_frame(term_args* data) {
+    size_t off = 0;
+    while (off < data->frame_len) {
+        ssize_t n = write(STDOUT_FILENO, data->frame + off, data->frame_len - off);
+        if (n > 0) {
+            off += n;
+        } else if (n < 0 && errno == EAGAIN) {
+            struct pollfd pfd = { .fd = STDOUT_FILENO, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+        } else if (n < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    data->frame_len = 0;
+}
+
+// Builds the update of the screen since the last one and writes it out
+static void render(term_args* data) {
+    if (data->repaint) {
+        // The screen is cleared and refilled from the scrollback
+        struct winsize ws;
+        unsigned long rows = 24;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1) { rows = ws.ws_row; }
+        unsigned long kept = data->lines < TERM_SCROLLBACK ? data->lines : TERM_SCROLLBACK;
+        data->drawn = data->lines - (kept < rows - 1 ? kept : rows - 1);
+        emit_str(data, "\033[H\033[2J");
+        data->shown_valid = 0;
+        data->repaint = 0;
+    }
+    if (data->drawn < data->lines) {
+        // New lines go where the command line is, which is drawn again below them
+        if (data->lines - data->drawn > TERM_SCROLLBACK) { data->drawn = data->lines - TERM_SCROLLBACK; }
+        emit_str(data, "\r\033[2K");
+        for (; data->drawn < data->lines; ++data->drawn) { emit_line(data, data->drawn); }
+        data->shown_valid = 0;
+    }
+    if (!data->shown_valid) {
+        emit_str(data, "\r\033[2K" PROMPT);
+        emit_str(data, data->command_line);
+        data->shown_cursor = strlen(data->command_line);
+        data->shown_valid = 1;
+    } else if (strcmp(data->shown, data->command_line) != 0) {
+        // Only from the first column that changed
+        int i = 0;
+        while (data->shown[i] != '\0' && data->shown[i] == data->command_line[i]) { i++; }
+        if (i != data->shown_cursor) { emit_column(data, i); }
+        emit_str(data, data->command_line + i);
+        emit_str(data, "\033[K");
+        data->shown_cursor = strlen(data->command_line);
+    }
+    strcpy(data->shown, data->command_line);
+    if (data->shown_cursor != data->cursor_position) {
+        emit_column(data, data->cursor_position);
+        data->shown_cursor = data->cursor_position;
+    }
+    if (data->frame_len > 0) { send_frame(data); }
+}
+
+// Updates the screen when a frame is due, or now when forced
+//
+// @return Milliseconds until the next frame is due, or -1 if up to date
+static long flush(term_args* data, int force) {
+    if (atomic_exchange(&data->woken, 0)) {
+        char buf[16];
+        while (read(data->wake_fd[0], buf, sizeof(buf)) > 0) { }
+    }
+    drain_queue(data);
+    int dirty = data->repaint || data->drawn < data->lines || !data->shown_valid
+        || data->shown_cursor != data->cursor_position
+        || strcmp(data->shown, data->command_line) != 0;
+    if (!dirty) { return -1; }
+    long now = now_ms();
+    long wait = data->last_frame_ms + TERM_FRAME_MS - now;
+    if (!force && wait > 0) { return wait; }
+    render(data);
+    data->last_frame_ms = now;
+    return -1;
+}
+
+static void history_add(term_args* data, const char* command) {
+    snprintf(data->command_history[data->history_index], MAX_COMMAND_LENGTH, "%s", command);
+    data->history_index = (data->history_index + 1) % MAX_HISTORY_SIZE;
+    data->history_size = data->history_size < MAX_HISTORY_SIZE ? (data->history_size + 1) : MAX_HISTORY_SIZE;
+}
+
+// Initilize args and shared command_line
+static term_args* term_args_create(int (*callback)(char*, void*),
+                                   int (*cleanup)(void*),
+                                   void* ptr) {
+    term_args* data = calloc(1, sizeof(term_args));
+    if (data == NULL) { return NULL; }
+    if (pipe(data->wake_fd) != 0) {
+        free(data);
+        return NULL;
+    }
+    fcntl(data->wake_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(data->wake_fd[1], F_SETFL, O_NONBLOCK);
+    data->callback = callback;
+    data->cleanup = cleanup;
+    data->callback_ptr = ptr;
+    data->last_frame_ms = now_ms() - TERM_FRAME_MS;
+    atomic_init(&data->woken, 0);
+    atomic_init(&data->queue_head, 0);
+    atomic_init(&data->queue_tail, 0);
+    return data;
+}
+
+static void term_args_destroy(term_args* data) {
+    drain_queue(data);
+    for (size_t i = 0; i < TERM_SCROLLBACK; ++i) { free(data->scrollback[i]); }
+    close(data->wake_fd[0]);
+    close(data->wake_fd[1]);
+    free(data->frame);
+    free(data);
+}
+
+// Setting up terminal, on the thread that owns the screen from now on
+static void term_setup(term_args* data) {
+    struct termios new;
+    data->owner = pthread_self();
+    tcgetattr(STDIN_FILENO, &data->old);
+    new = data->old;
     new.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &new);
-    // Setting up data for terminal interface
-    char command_history[MAX_HISTORY_SIZE][MAX_COMMAND_LENGTH] = {0};
-    //char command_line[MAX_COMMAND_LENGTH] = {0};
-    int history_size = 0;
-    int history_index = 0;
-    int curr_history_index = 0;
-    int current_index = 0;
-    //int cursor_position = 0;
-    display_command_line(data->command_line, data->cursor_position);
-    int ch;
-    while ((ch = getchar()) != '~') {
-        pthread_mutex_lock(&data->lock);
-        if (ch == '\033') { // Check for escape sequence (arrow keys)
-            getchar();
-            int arrow_key = getchar();
-            if (arrow_key == 'A' && history_size != 0) { // Up arrow key
-                // Display previous command
-                clear_line();
-                curr_history_index = (curr_history_index - 1 + history_size) % history_size;
-                strncpy(data->command_line, command_history[curr_history_index], MAX_COMMAND_LENGTH);
-                current_index = strlen(data->command_line);
-                data->cursor_position = current_index;
-                display_command_line(data->command_line, data->cursor_position);
-            } else if (arrow_key == 'B' && history_size != 0) { // Down arrow key
-                // Display next command
-                clear_line();
-                curr_history_index = (curr_history_index + 1) % history_size;
-                strncpy(data->command_line, command_history[curr_history_index], MAX_COMMAND_LENGTH);
-                current_index = strlen(data->command_line);
-                data->cursor_position = current_index;
-                display_command_line(data->command_line, current_index);
-            } else if (arrow_key == 'C' && data->cursor_position < current_index) { // Right arrow key
-                // Move cursor to the right
-                data->cursor_position++;
-                display_command_line(data->command_line, data->cursor_position);
-            } else if (arrow_key == 'D' && data->cursor_position > 0) { // Left arrow key
-                // Move cursor to the left
-                data->cursor_position--;
-                display_command_line(data->command_line, data->cursor_position);
-            }
-        } else if (ch == '\n') { // Enter key
-            // Output           
-            char out[MAX_COMMAND_LENGTH];
-            int len = current_index + 1;
-            strncpy(out, data->command_line, MAX_COMMAND_LENGTH);
-            out[len - 1] = '\0';
-            // Store command in history
-            strncpy(command_history[history_index], data->command_line, MAX_COMMAND_LENGTH);
-            history_index = (history_index + 1) % MAX_HISTORY_SIZE;
-            history_size = history_size < MAX_HISTORY_SIZE ? (history_size + 1) : MAX_HISTORY_SIZE;
-            // Clear command line for next input
-            memset(data->command_line, 0, MAX_COMMAND_LENGTH);
-            putc('\n', stdout);
-            // Reset current index for new input
-            data->cursor_position = 0;
-            current_index = 0;
-            curr_history_index = history_index;
-            // Call callback
-            if (data->callback(out, data->callback_ptr) < 0) { return (void*) -1; }
-            // Reset terminal
-            display_command_line(data->command_line, data->cursor_position);
-        } else if (ch == 127) { // Backspace key
-            // Handle backspace to delete characters from the command line
-            if (current_index > 0) {
-                memmove(&data->command_line[data->cursor_position - 1],
-                        &data->command_line[data->cursor_position],
-                        MAX_COMMAND_LENGTH - data->cursor_position);
-                data->cursor_position--;
-                current_index--;
-                display_command_line(data->command_line, data->cursor_position);
-            }
-        } else if (ch >= 32 && ch <= 126) { // Printable ASCII characters
-            // Add printable characters to the command line
-            if (current_index < MAX_COMMAND_LENGTH - 1) {
-                memmove(&data->command_line[data->cursor_position + 1],
-                        &data->command_line[data->cursor_position],
-                        MAX_COMMAND_LENGTH - data->cursor_position - 1);
-                data->command_line[data->cursor_position++] = ch;
-                current_index++;
-                display_command_line(data->command_line, data->cursor_position);
-                curr_history_index = history_index;
-            }
+    flush(data, 1);
+}
+
+// Restores the terminal and runs cleanup once the user quits
+static int term_finish(term_args* data) {
+    flush(data, 1);
+    tcsetattr(STDIN_FILENO, TCSANOW, &data->old);
+    emit_str(data, "\n");
+    send_frame(data);
+    data->complete = 1;
+    if (data->cleanup(data->callback_ptr) < 0) { return -1; }
+    return 0;
+}
+
+// Handles one keystroke, on the owner thread. The screen catches up with the
+// line editing state at the next frame.
+//
+// @return 0 to keep going, or -1 if the callback failed
+static int term_key(term_args* data, int ch) {
+    if (data->escape == 1) { // Skip the '[' of an escape sequence
+        data->escape = 2;
+        return 0;
+    }
+    if (data->escape == 2) { // Check for escape sequence (arrow keys)
+        data->escape = 0;
+        int arrow_key = ch;
+        if (arrow_key == 'A' && data->history_size != 0) { // Up arrow key
+            // Display previous command
+            data->curr_history_index = (data->curr_history_index - 1 + data->history_size) % data->history_size;
+            strncpy(data->command_line, data->command_history[data->curr_history_index], MAX_COMMAND_LENGTH - 1);
+            data->current_index = strlen(data->command_line);
+            data->cursor_position = data->current_index;
+        } else if (arrow_key == 'B' && data->history_size != 0) { // Down arrow key
+            // Display next command
+            data->curr_history_index = (data->curr_history_index + 1) % data->history_size;
+            strncpy(data->command_line, data->command_history[data->curr_history_index], MAX_COMMAND_LENGTH - 1);
+            data->current_index = strlen(data->command_line);
+            data->cursor_position = data->current_index;
+        } else if (arrow_key == 'C' && data->cursor_position < data->current_index) { // Right arrow key
+            // Move cursor to the right
+            data->cursor_position++;
+        } else if (arrow_key == 'D' && data->cursor_position > 0) { // Left arrow key
+            // Move cursor to the left
+            data->cursor_position--;
+        }
+    } else if (ch == '\033') { // Start of escape sequence
+        data->escape = 1;
+    } else if (ch == '\n') { // Enter key
+        // Output
+        char out[MAX_COMMAND_LENGTH];
+        int len = data->current_index + 1;
+        strncpy(out, data->command_line, MAX_COMMAND_LENGTH);
+        out[len - 1] = '\0';
+        // The command stays on screen above the new command line
+        char* echo = malloc(sizeof(PROMPT) + len);
+        if (echo != NULL) {
+            snprintf(echo, sizeof(PROMPT) + len, PROMPT "%s", out);
+            add_line(data, echo);
+        }
+        // Store command in history
+        history_add(data, data->command_line);
+        // Clear command line for next input
+        memset(data->command_line, 0, MAX_COMMAND_LENGTH);
+        // Reset current index for new input
+        data->cursor_position = 0;
+        data->current_index = 0;
+        data->curr_history_index = data->history_index;
+        if (data->callback(out, data->callback_ptr) < 0) { return -1; }
+    } else if (ch == 12) { // Ctrl-L
+        data->repaint = 1;
+    } else if (ch == 127) { // Backspace key
+        // Handle backspace to delete characters from the command line
+        if (data->current_index > 0) {
+            memmove(&data->command_line[data->cursor_position - 1],
+                    &data->command_line[data->cursor_position],
+                    MAX_COMMAND_LENGTH - data->cursor_position);
+            data->cursor_position--;
+            data->current_index--;
+        }
+    } else if (ch >= 32 && ch <= 126) { // Printable ASCII characters
+        // Add printable characters to the command line
+        if (data->current_index < MAX_COMMAND_LENGTH - 1) {
+            memmove(&data->command_line[data->cursor_position + 1],
+                    &data->command_line[data->cursor_position],
+                    MAX_COMMAND_LENGTH - data->cursor_position - 1);
+            data->command_line[data->cursor_position++] = ch;
+            data->current_index++;
+            data->curr_history_index = data->history_index;
         }
-        pthread_mutex_unlock(&data->lock);
     }
-    tcsetattr(STDIN_FILENO, TCSANOW, &old);
-    putc('\n', stdout);
-    data->complete = 1;
-    if (data->cleanup(data->callback_ptr) < 0) { return (void*) -1; }
-    // wioe_cancel_recieve((wioe*) data->callback_ptr);
-    return (void*) 0;
+    return 0;
+}
+
+// Processes the keystrokes available on stdin
+//
+// @return 0 to keep going, 1 once the user has quit, or -1 on error
+static int read_keys(term_args* data) {
+    char keys[64];
+    ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+    if (n < 0) { return 0; }
+    if (n == 0) { return term_finish(data) < 0 ? -1 : 1; } // stdin closed
+    for (ssize_t i = 0; i < n; ++i) {
+        if (keys[i] == '~') { return term_finish(data) < 0 ? -1 : 1; }
+        if (term_key(data, (unsigned char) keys[i]) < 0) { return -1; }
+    }
+    return 0;
+}
+
+void* backend_term(void* args) {
+    term_args* data = (term_args*) args;
+    term_setup(data);
+    for (;;) {
+        // Sleeps until a key, a line printed by another thread or the next frame
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = data->wake_fd[0], .events = POLLIN },
+        };
+        long ms = flush(data, 0);
+        if (poll(fds, 2, ms) < 0 && errno != EINTR) { return (void*) -1; }
+        if (fds[0].revents == 0) { continue; }
+        int r = read_keys(data);
+        if (r != 0) { return (void*) (long) (r < 0 ? -1 : 0); }
+    }
 }
 
 // Function used to display terminal UI for user
 int term_interface(int (*callback)(char*, void*),
                    int (*cleanup)(void*),
                    void* ptr) {
-    // Initilize args and shared command_line
-    term_args* data = malloc(sizeof(term_args));
-    data->callback = callback;
-    data->cleanup = cleanup;
-    data->callback_ptr = ptr;
-    data->complete = 0;
-    memset(data->command_line, 0, sizeof(data->command_line));
-    pthread_mutex_init(&data->lock, NULL);
+    term_args* data = term_args_create(callback, cleanup, ptr);
+    if (data == NULL) { return -1; }
     void* ret = backend_term((void*) data);
-    pthread_mutex_destroy(&data->lock);
+    term_args_destroy(data);
     return (int) (long) ret;
 }
 
@@ -152,33 +375,77 @@ int term_interface(int (*callback)(char*, void*),
 term* term_interface_async(int (*callback)(char*, void*),
                            int (*cleanup)(void*),
                            void* ptr) {
-    // Initilize args and shared command_line
-    term_args* data = malloc(sizeof(term_args));
-    data->callback = callback;
-    data->cleanup = cleanup;
-    data->callback_ptr = ptr;
-    memset(data->command_line, 0, sizeof(data->command_line));
-    pthread_mutex_init(&data->lock, NULL);
+    term_args* data = term_args_create(callback, cleanup, ptr);
+    if (data == NULL) { return NULL; }
     // Initilize term struct to be handed over
     term* info = malloc(sizeof(term));
     info->data = data;
+    info->threaded = 1;
     pthread_create(&info->term_thread, NULL, backend_term, (void*) data);
     return info;
 }
 
+// Function used to display terminal UI for user driven by an event loop
+term* term_interface_attach(int (*callback)(char*, void*),
+                            int (*cleanup)(void*),
+                            void* ptr) {
+    term_args* data = term_args_create(callback, cleanup, ptr);
+    if (data == NULL) { return NULL; }
+    term* info = malloc(sizeof(term));
+    info->data = data;
+    info->threaded = 0;
+    term_setup(data);
+    return info;
+}
+
+int term_input(term* info) {
+    if (info->data->complete) { return 1; }
+    return read_keys(info->data);
+}
+
 void term_print(term* info, char* str) {
-    clear_line();
-    printf("%s\n", str);
-    pthread_mutex_lock(&info->data->lock);
-    display_command_line(info->data->command_line, info->data->cursor_position);
-    pthread_mutex_unlock(&info->data->lock);
+    term_args* data = info->data;
+    char* line = strdup(str);
+    if (line == NULL) { return; }
+    if (pthread_equal(pthread_self(), data->owner)) {
+        drain_queue(data); // Keeps the order of lines printed before
+        add_line(data, line);
+    } else {
+        size_t head = atomic_load_explicit(&data->queue_head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&data->queue_tail, memory_order_acquire);
+        if (head - tail == TERM_QUEUE_LEN) { // The owner is far behind
+            free(line);
+            return;
+        }
+        data->queue[head % TERM_QUEUE_LEN] = line;
+        atomic_store_explicit(&data->queue_head, head + 1, memory_order_release);
+    }
+    wake(data);
+}
+
+void term_history_add(term* info, const char* command) {
+    history_add(info->data, command);
+    info->data->curr_history_index = info->data->history_index;
+}
+
+int term_wake_fd(term* info) {
+    return info->data->wake_fd[0];
+}
+
+long term_flush(term* info) {
+    if (info->data->complete) { return -1; }
+    return flush(info->data, 0);
 }
 
 int term_join(term* info) {
-    void* ret;
-    pthread_join(info->term_thread, (void**) &ret);
-    pthread_mutex_destroy(&(info->data->lock));
-    free(info->data);
+    void* ret = (void*) 0;
+    if (info->threaded) {
+        pthread_join(info->term_thread, (void**) &ret);
+    } else if (!info->data->complete) {
+        flush(info->data, 1);
+        tcsetattr(STDIN_FILENO, TCSANOW, &info->data->old);
+    }
+    term_args_destroy(info->data);
     free(info);
     return (int) (long) ret;
 }
@@ -0,0 +1,78 @@
+#include "txq.h"
+#include <string.h>
+
+// Bounded queue after Dmitry Vyukov: a slot is free for the producer that
+// claims position pos when its seq equals pos, and holds a packet for the
+// consumer when its seq equals pos + 1.
+
+void txq_init(txq* q) {
+    for (size_t i = 0; i < TXQ_LEN; ++i) {
+        atomic_init(&q->cells[i].seq, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    q->dequeue_pos = 0;
+}
+
+txq_cell* txq_reserve(txq* q) {
+    txq_cell* cell;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = &q->cells[pos & (TXQ_LEN - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long) seq - (long) pos;
+        if (diff == 0) {
+            // Slot is free, claim it
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;  // Full, the consumer has not released this slot yet
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    return cell;
+}
+
+int txq_commit(txq_cell* cell, const unsigned char* data, size_t len, txq_done done, void* arg,
+               uint64_t stamp) {
+    int r = 0;
+    if (len > TXQ_PAYLOAD) {
+        len = 0;
+        r = -1;
+    }
+    if (len > 0) { memcpy(cell->data, data, len); }
+    cell->len = len;
+    cell->done = len > 0 ? done : NULL;
+    cell->arg = arg;
+    cell->stamp = stamp;
+    // A claimed slot keeps the position it was claimed at until published
+    size_t pos = atomic_load_explicit(&cell->seq, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return r;
+}
+
+int txq_push(txq* q, const unsigned char* data, size_t len, txq_done done, void* arg,
+             uint64_t stamp) {
+    if (len > TXQ_PAYLOAD) { return -1; }
+    txq_cell* cell = txq_reserve(q);
+    if (cell == NULL) { return -1; }
+    return txq_commit(cell, data, len, done, arg, stamp);
+}
+
+txq_cell* txq_peek(txq* q) {
+    txq_cell* cell = &q->cells[q->dequeue_pos & (TXQ_LEN - 1)];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    return seq == q->dequeue_pos + 1 ? cell : NULL;
+}
+
+void txq_release(txq* q, int status) {
+    txq_cell* cell = &q->cells[q->dequeue_pos & (TXQ_LEN - 1)];
+    txq_done done = cell->done;
+    void* arg = cell->arg;
+    // Hand the slot back to producers before the callback so it can queue more
+    atomic_store_explicit(&cell->seq, q->dequeue_pos + TXQ_LEN, memory_order_release);
+    q->dequeue_pos++;
+    if (done != NULL) { done(status, arg); }
+}
@@ -1,42 +1,316 @@
 #include "wioe.h"
+#include "at.h"
+#include "txq.h"
+#include "hex.h"
+#include "compress.h"
+#include "airtime.h"
+#include "replay.h"
+#include "duty.h"
 #include <stdint.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #define BUFLEN 528
+#define PENDING_LEN 8   // Packets kept while waiting for a command response
+#define CMD_MARGIN_MS 500   // Time allowed for the module to process a command
+#define SERIAL_BYTE_US (10 * 1000000 / SERIAL_BAUD)  // Start, 8 data and stop bits
+#define RESPONSE_LEN 64     // Longest response to a command other than RXLRPKT
+#define TX_PREFIX "AT+TEST=TXLRPKT,\""
+#define CMD_LEN (sizeof(TX_PREFIX) + 2 * WIOE_MAX_PAYLOAD + 2)
+#define SEQ_LIMIT (1u << (7 * WIOE_SEQ_BYTES))    // First sequence number needing a longer varint
 #define ISON(x) (x ? "ON" : "OFF")
 #define init_t &()
 
 // Structs and helper methods
 
+// Key of a session, derived from the last key used with it
+typedef struct {
+    int valid;
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    unsigned char subkey[crypto_aead_chacha20poly1305_KEYBYTES];
+} wioe_subkey;
+
+// Structure to hold the replay window of a sender's session
+typedef struct {
+    unsigned char session[WIOE_SESSION_BYTES];
+    replay_window window;
+    unsigned long last_used;            // For evicting the least recently heard
+    wioe_subkey keys[2];                // Under the passphrase and the handshake key
+} wioe_peer;
+
 struct wioe {
     wioe_params* actual_params;
     int serial_fd;
     int pipe_fd[2];
     char valid;
     pthread_mutex_t lock;
+    char tx_busy;                       // Transmission started by wioe_tx_start in progress
+    char cfg_busy;                      // Configuration change by wioe_update_start in progress
+    wioe_params cfg_params;             // The configuration it sets
+    size_t cfg_len;                     // Length of its command
+    at_parser parser;                   // Serial input, parsed a line at a time
+    at_response pending[PENDING_LEN];   // Packets received while waiting for something else
+    unsigned char pending_data[PENDING_LEN][AT_MAX_PAYLOAD];
+    int pending_head;
+    int pending_count;
+    txq queue;                          // Sends waiting for the radio
+    int send_fd;                        // Signalled when a send is queued
+    char inflight;                      // The queue head is being transmitted
+    char listening;                     // RXLRPKT sent since the last transmission
+    char persistent;                    // Re-enter receive mode automatically
+    wioe_rx_cb rx_cb;                   // Packets in persistent mode, NULL for events
+    wioe_rx_frame_cb rx_frame_cb;       // Or frames, decoded into buffers from rx_pool
+    frame_pool* rx_pool;
+    void* rx_arg;
+    char cmd[CMD_LEN];                  // Reusable buffer for framing TXLRPKT
+    atomic_ulong packets;               // Compression counters, see wioe_compress_stats
+    atomic_ulong compressed;
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong airtime_saved_us;
+    pthread_mutex_t seal_lock;          // Senders may seal from any thread
+    unsigned char session[WIOE_SESSION_BYTES];  // Our session id, random
+    uint32_t seq;                       // Next sequence number in our session
+    wioe_subkey tx_keys[2];             // Its keys, under seal_lock like the above
+    wioe_peer peers[WIOE_MAX_PEERS];    // Sessions heard, used by the receiving thread only
+    int peer_count;
+    int peer_limit;                     // Sessions tracked at most, see wioe_set_peers
+    char announce_all;                  // Every packet carries the session id
+    unsigned long peer_clock;
+    wioe_link_stats retired;            // Counters of evicted peers
+    replay_history history;             // Where evicted sessions resume
+    int have_signal;                    // Signal of the last packet received
+    int last_rssi;
+    int last_snr;
+    wioe_signal_stats rssi;             // Signal of all packets received
+    wioe_signal_stats snr;
+    atomic_ulong tx_packets;            // Counters, see wioe_stats
+    atomic_ulong tx_bytes;
+    atomic_ulong tx_errors;
+    atomic_ulong rx_packets;
+    atomic_ulong rx_bytes;
+    atomic_ulong timeouts;
+    atomic_ulong cancelled;
+    atomic_ullong cmd_us;               // When the command awaiting its echo was written, 0 if none
+    uint64_t tx_us;                     // When the transmission in progress was started
+    uint64_t tx_queued_us;              // When it was queued
+    size_t tx_len;
+    uint32_t tx_airtime_us;             // Its predicted time on air
+    duty budget;                        // Share of time on air left to the radio
+    atomic_ulong airtime_us;            // Predicted and measured time on air of packets sent
+    atomic_ulong tx_time_us;
+    hist at_rtt;                        // Latencies, see wioe_stats
+    hist tx_time;
+    hist send_latency;
+    hist airtime;
 };
 
-int wioe_handle_packet(char* buf, size_t len) {
-    // Check for error
-    if (strstr(buf, "ERROR") != NULL)
-        return 0;
-    // Get the packet in hexadecimal format
-    char pkt[BUFLEN];
-    if (sscanf(buf, "+TEST: LEN:%*d, RSSI:%*d, SNR:%*d\n\n+TEST: RX \"%[^\"]\"", pkt) != 1)
-        return 0; // Handle parsing error
-    // Buffer to hold the converted bytes
-    char temp_buf[BUFLEN];
-    char* pos = pkt;
-    size_t count = 0;
-    // Convert hex string to bytes
-    while (count < len && sscanf(pos, "%2hhx", (unsigned char*)&temp_buf[count]) == 1) {
-        pos += 2;
-        count++;
-    }
-    // Copy the binary data to the original buffer
-    len = count <= len ? count : len;
-    memcpy(buf, temp_buf, len);
-    return len;
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Time allowed for the response to a command of len bytes: both cross the
+// serial line, then the module may take a while to answer
+static int cmd_timeout_ms(size_t len) {
+    return (int) ((len + RESPONSE_LEN) * SERIAL_BYTE_US / 1000) + CMD_MARGIN_MS;
+}
+
+// Predicts the time on air of a packet with the current parameters
+static uint32_t wioe_airtime(wioe* device, size_t len) {
+    wioe_params* p = device->actual_params;
+    return airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc, len);
+}
+
+// Writes a command to the module, noting when for its round trip time
+static ssize_t wioe_command(wioe* device, const char* cmd, size_t len) {
+    pthread_mutex_lock(&device->lock);
+    atomic_store(&device->cmd_us, now_us());
+    ssize_t r = write_serial(device->serial_fd, cmd, len);
+    pthread_mutex_unlock(&device->lock);
+    return r;
+}
+
+// Records the round trip time of the command that was just answered
+static void wioe_answered(wioe* device) {
+    uint64_t start = atomic_exchange(&device->cmd_us, 0);
+    if (start != 0) { hist_record(&device->at_rtt, now_us() - start); }
+}
+
+// Records a transmission that left the air
+static void wioe_sent(wioe* device) {
+    uint64_t now = now_us();
+    atomic_fetch_add(&device->tx_packets, 1);
+    atomic_fetch_add(&device->tx_bytes, device->tx_len);
+    hist_record(&device->tx_time, now - device->tx_us);
+    hist_record(&device->send_latency, now - device->tx_queued_us);
+    hist_record(&device->airtime, device->tx_airtime_us);
+    atomic_fetch_add(&device->airtime_us, device->tx_airtime_us);
+    atomic_fetch_add(&device->tx_time_us, now - device->tx_us);
+}
+
+// Frames a TXLRPKT command in the device's command buffer in a single pass
+// and writes it to the module
+static ssize_t wioe_write_tx(wioe* device, const unsigned char* data, size_t len) {
+    pthread_mutex_lock(&device->lock);
+    char* p = device->cmd;
+    memcpy(p, TX_PREFIX, sizeof(TX_PREFIX) - 1);
+    p += sizeof(TX_PREFIX) - 1;
+    p += hex_encode(p, data, len);
+    *p++ = '"';
+    *p++ = '\n';
+    uint64_t now = now_us();
+    atomic_store(&device->cmd_us, now);
+    device->listening = 0;
+    device->tx_us = now;
+    device->tx_queued_us = now;
+    device->tx_len = len;
+    device->tx_airtime_us = wioe_airtime(device, len);
+    duty_take(&device->budget, device->tx_airtime_us, now);
+    ssize_t r = write_serial(device->serial_fd, device->cmd, p - device->cmd);
+    pthread_mutex_unlock(&device->lock);
+    return r;
+}
+
+// Finishes the queued send being transmitted, if any
+static void wioe_complete(wioe* device, int status) {
+    if (device->tx_busy && status == 0) {
+        wioe_sent(device);
+    } else if (device->tx_busy) {
+        atomic_fetch_add(&device->tx_errors, 1);
+    }
+    device->tx_busy = 0;
+    if (device->inflight) {
+        device->inflight = 0;
+        txq_release(&device->queue, status);
+    }
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Reads whatever serial input is available into the parser
+//
+// @return bytes read, 0 if none was available, or -1 on error
+static ssize_t wioe_fill(wioe* device) {
+    char* dst;
+    pthread_mutex_lock(&device->lock);
+    size_t space = at_space(&device->parser, &dst);
+    ssize_t r = space ? read(device->serial_fd, dst, space) : 0;
+    if (r > 0) { at_commit(&device->parser, r); }
+    pthread_mutex_unlock(&device->lock);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) { return 0; }
+    if (r < 0) { perror("Serial Error"); }
+    return r;
+}
+
+// Gets the next complete response already received
+static int wioe_next(wioe* device, at_response* res) {
+    pthread_mutex_lock(&device->lock);
+    int r = at_next(&device->parser, res);
+    pthread_mutex_unlock(&device->lock);
+    return r;
+}
+
+// Keeps a packet that arrived while waiting for a command response
+static void wioe_stash(wioe* device, const at_response* res) {
+    pthread_mutex_lock(&device->lock);
+    if (device->pending_count == PENDING_LEN) {  // Drop the oldest
+        device->pending_head = (device->pending_head + 1) % PENDING_LEN;
+        device->pending_count--;
+    }
+    int i = (device->pending_head + device->pending_count) % PENDING_LEN;
+    device->pending[i] = *res;
+    device->pending[i].data = device->pending_data[i];
+    memcpy(device->pending_data[i], res->data, res->len);
+    device->pending_count++;
+    pthread_mutex_unlock(&device->lock);
+}
+
+// Takes the oldest kept packet
+//
+// @return 1 if res was filled, 0 if no packet was kept
+static int wioe_unstash(wioe* device, at_response* res) {
+    pthread_mutex_lock(&device->lock);
+    int r = device->pending_count > 0;
+    if (r) {
+        const at_response* kept = &device->pending[device->pending_head];
+        unsigned char* data = res->data;
+        *res = *kept;
+        res->data = data;
+        memcpy(data, kept->data, kept->len);
+        device->pending_head = (device->pending_head + 1) % PENDING_LEN;
+        device->pending_count--;
+    }
+    pthread_mutex_unlock(&device->lock);
+    return r;
+}
+
+// Waits for the response that completes a command, keeping any packets
+// received in the meantime
+//
+// @return 0 on success, or -1 on error or timeout
+static int wioe_expect(wioe* device, at_kind kind, int ms) {
+    long deadline = now_ms() + ms;
+    unsigned char data[AT_MAX_PAYLOAD];
+    at_response res = { .data = data };
+    for (;;) {
+        while (wioe_next(device, &res)) {
+            if (res.kind == kind) {
+                if (kind != AT_TX_DONE) { wioe_answered(device); }
+                return 0;
+            }
+            if (res.kind == AT_ERROR) {
+                wioe_answered(device);
+                return -1;
+            }
+            if (res.kind == AT_RX) { wioe_stash(device, &res); }
+        }
+        long left = deadline - now_ms();
+        int r = left > 0 ? wait_serial(device->serial_fd, (int) left, -1) : 0;
+        if (r == 0) {
+            atomic_fetch_add(&device->timeouts, 1);
+            fputs("Timeout\n", stderr);
+            return -1;
+        }
+        if (r < 0 || wioe_fill(device) < 0) { return -1; }
+    }
+}
+
+// Adds a measure to the statistics of a signal
+static void wioe_signal_add(wioe_signal_stats* s, int v) {
+    if (s->count == 0 || v < s->min) { s->min = v; }
+    if (s->count == 0 || v > s->max) { s->max = v; }
+    s->count++;
+    s->mean += (v - s->mean) / s->count;
+    s->last = v;
+}
+
+// Counts a packet handed out and remembers the signal it was received with
+static void wioe_received(wioe* device, const at_response* res) {
+    atomic_fetch_add(&device->rx_packets, 1);
+    atomic_fetch_add(&device->rx_bytes, res->len);
+    device->have_signal = 1;
+    device->last_rssi = res->rssi;
+    device->last_snr = res->snr;
+    wioe_signal_add(&device->rssi, res->rssi);
+    wioe_signal_add(&device->snr, res->snr);
+}
+
+// Parses everything already received so packets are kept in order
+static void wioe_drain(wioe* device) {
+    unsigned char data[AT_MAX_PAYLOAD];
+    at_response res = { .data = data };
+    while (wioe_next(device, &res)) {
+        if (res.kind == AT_RX) { wioe_stash(device, &res); }
+    }
 }
 
 // Main methods
@@ -45,32 +319,83 @@ wioe* wioe_init(wioe_params* params, char* serial_port) {
     if (sodium_init() < 0) { return NULL; }
     int pipe_fd[2];
     if (pipe(pipe_fd) == -1) { return NULL; }
-    int serial_fd = open_serial(serial_port);
+    int serial_fd = open_serial(serial_port, params->baud);
     wioe* device = NULL;
     if (serial_fd >= 0) {
-        device = (wioe*) malloc(sizeof(wioe));
-        device->actual_params = (wioe_params*) malloc(sizeof(wioe));
+        // Reads are always preceded by poll, the event interface relies on this
+        fcntl(serial_fd, F_SETFL, fcntl(serial_fd, F_GETFL) | O_NONBLOCK);
+        // The send queue keeps producer and consumer indices on separate cache lines
+        if (posix_memalign((void**) &device, 64, sizeof(wioe)) != 0) { return NULL; }
+        device->actual_params = (wioe_params*) malloc(sizeof(wioe_params));
         device->serial_fd = serial_fd;
         device->pipe_fd[0] = pipe_fd[0];
         device->pipe_fd[1] = pipe_fd[1];
-        unsigned char buf[BUFLEN];
-        int r = write(serial_fd, "AT+MODE=TEST\n", 14);
-        r = read_serial(serial_fd, 1000, buf, sizeof(buf));
-        if (r > 0) {
-            r = wioe_update(device, params);
-            device->valid = r ? 1 : 0;
-        }
-        if (pthread_mutex_init(&device->lock, NULL) != 0) { 
+        device->valid = 0;
+        device->tx_busy = 0;
+        device->cfg_busy = 0;
+        device->pending_head = 0;
+        device->pending_count = 0;
+        at_init(&device->parser);
+        txq_init(&device->queue);
+        device->inflight = 0;
+        device->listening = 0;
+        device->persistent = 0;
+        device->rx_cb = NULL;
+        device->rx_frame_cb = NULL;
+        device->rx_pool = NULL;
+        device->rx_arg = NULL;
+        device->send_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        atomic_init(&device->packets, 0);
+        atomic_init(&device->compressed, 0);
+        atomic_init(&device->bytes_in, 0);
+        atomic_init(&device->bytes_out, 0);
+        atomic_init(&device->airtime_saved_us, 0);
+        randombytes_buf(device->session, sizeof(device->session));
+        device->seq = 0;
+        memset(device->tx_keys, 0, sizeof(device->tx_keys));
+        device->peer_count = 0;
+        device->peer_limit = WIOE_PEERS;
+        device->announce_all = 0;
+        device->peer_clock = 0;
+        replay_history_init(&device->history);
+        device->have_signal = 0;
+        memset(&device->retired, 0, sizeof(device->retired));
+        memset(&device->rssi, 0, sizeof(device->rssi));
+        memset(&device->snr, 0, sizeof(device->snr));
+        atomic_init(&device->tx_packets, 0);
+        atomic_init(&device->tx_bytes, 0);
+        atomic_init(&device->tx_errors, 0);
+        atomic_init(&device->rx_packets, 0);
+        atomic_init(&device->rx_bytes, 0);
+        atomic_init(&device->timeouts, 0);
+        atomic_init(&device->cancelled, 0);
+        atomic_init(&device->cmd_us, 0);
+        hist_init(&device->at_rtt);
+        hist_init(&device->tx_time);
+        hist_init(&device->send_latency);
+        hist_init(&device->airtime);
+        atomic_init(&device->airtime_us, 0);
+        atomic_init(&device->tx_time_us, 0);
+        duty_init(&device->budget, 0, 0, now_us());
+        if (pthread_mutex_init(&device->lock, NULL) != 0
+            || pthread_mutex_init(&device->seal_lock, NULL) != 0) { 
             wioe_destroy(device);
             return NULL;
         }
+        int r = wioe_command(device, "AT+MODE=TEST\n", 14);
+        if (r > 0) { r = wioe_expect(device, AT_MODE, cmd_timeout_ms(14)); }
+        if (r == 0) {
+            r = wioe_update(device, params);
+            device->valid = r ? 0 : 1;
+        }
     }
     return device;
 }
 
-int wioe_update(wioe* device, wioe_params* params) {
-    ssize_t r = 0;
-    // First verify params
+// Verifies params and writes the command setting them to the module
+//
+// @return length of the command, or -1 on invalid params or error
+static ssize_t wioe_write_rfcfg(wioe* device, const wioe_params* params) {
     if (params->frequency < MINFREQ || params->frequency > MAXFREQ
         || params->spreading_factor < MINSF || params->spreading_factor > MAXSF
         || (params->bandwidth != BW1 && params->bandwidth != BW2 && params->bandwidth != BW3)
@@ -79,9 +404,8 @@ int wioe_update(wioe* device, wioe_params* params) {
         || params->power < MINPOW || params->power > MAXPOW) {
         return -1;
     }
-    // Write command to update configuration
-    unsigned char buf[BUFLEN];
-    snprintf((char*) buf, BUFLEN - 1, "AT+TEST=RFCFG,F:%.6f,SF%i,%i,%i,%i,%i,%s,%s,%s\n",
+    char buf[BUFLEN];
+    snprintf(buf, BUFLEN - 1, "AT+TEST=RFCFG,F:%.6f,SF%i,%i,%i,%i,%i,%s,%s,%s\n",
         params->frequency,
         params->spreading_factor,
         params->bandwidth,
@@ -91,110 +415,708 @@ int wioe_update(wioe* device, wioe_params* params) {
         ISON(params->crc),
         ISON(params->inverted_iq),
         ISON(params->public_lorawan));
-    pthread_mutex_lock(&device->lock);
-    r = write(device->serial_fd, (char*) buf, strlen((char*) buf) + 1);
-    pthread_mutex_unlock(&device->lock);
-    if (r < 0) { return r; }
-    // Read to make sure there is no error
-    pthread_mutex_lock(&device->lock);
-    r = read_serial(device->serial_fd, 1000, buf, BUFLEN);
-    pthread_mutex_unlock(&device->lock);
-    if (r < 0) { return r; }
-    if (strstr((char*) buf, "ERROR") != NULL) { return -1; }
+    device->listening = 0;
+    size_t len = strlen(buf) + 1;
+    if (wioe_command(device, buf, len) < 0) { return -1; }
+    return len;
+}
+
+int wioe_update(wioe* device, wioe_params* params) {
+    ssize_t len = wioe_write_rfcfg(device, params);
+    if (len < 0) { return -1; }
+    // Wait for the module to accept the configuration
+    if (wioe_expect(device, AT_RFCFG, cmd_timeout_ms(len)) != 0) { return -1; }
     // Copy new parameters
-    memcpy(&device->actual_params, params, sizeof(wioe_params));
+    memcpy(device->actual_params, params, sizeof(wioe_params));
+    if (device->persistent && !device->tx_busy) { return wioe_rx_start(device); }
+    return 0;
+}
+
+int wioe_update_start(wioe* device, const wioe_params* params) {
+    if (!wioe_is_valid(device) || device->tx_busy || device->cfg_busy) { return -1; }
+    ssize_t len = wioe_write_rfcfg(device, params);
+    if (len < 0) { return -1; }
+    device->cfg_params = *params;
+    device->cfg_len = len;
+    device->cfg_busy = 1;
     return 0;
 }
 
 int wioe_send_bytes(wioe* device, unsigned char* data, size_t len) {
-    // Convert to a character representation of hex for wio-e5 device
-    unsigned char hex_data[len*2+1];
-    for (size_t i = 0; i < len; ++i)
-        sprintf((char*) &hex_data[2*i], "%02hhX", data[i]);
-    hex_data[len*2+1] = '\0';
     // Try sending to device
-    if (!wioe_is_valid(device)) { return -1; }
-    unsigned char buf[BUFLEN];
-    snprintf((char*) buf, BUFLEN - 1, "AT+TEST=TXLRPKT,\"%s\"\n", hex_data);
-    pthread_mutex_lock(&device->lock);
-    ssize_t r = write(device->serial_fd, (char*) buf, strlen((char*) buf) + 1);
-    pthread_mutex_unlock(&device->lock);
-    if (r < 0) { return r; }
-    // Read to make sure there is no error
-    pthread_mutex_lock(&device->lock);
-    r = read_serial(device->serial_fd, 1000, buf, BUFLEN);
-    pthread_mutex_unlock(&device->lock);
+    if (!wioe_is_valid(device) || len == 0 || len > WIOE_MAX_PAYLOAD) { return -1; }
+    // Wait for the duty cycle to allow the transmission
+    uint64_t wait = duty_wait_us(&device->budget, wioe_airtime(device, len), now_us());
+    if (wait > 0) {
+        struct timespec ts = { .tv_sec = wait / 1000000, .tv_nsec = wait % 1000000 * 1000 };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+    }
+    ssize_t r = wioe_write_tx(device, data, len);
     if (r < 0) { return r; }
-    if (strstr((char*) buf, "ERROR") != NULL) { return -1; }
-    // Read again if necessary to get +TEST: TX DONE
-    if (strstr((char*) buf, "\n\n") == NULL) {
-        pthread_mutex_lock(&device->lock);
-        r = read_serial(device->serial_fd, 1000, buf, BUFLEN);
-        pthread_mutex_unlock(&device->lock);
-        if (r < 0) { return r; }
-        if (strstr((char*) buf, "ERROR") != NULL) { return -1; }
+    // Wait for the echo, then for the packet to leave the air
+    if (wioe_expect(device, AT_TXLRPKT, cmd_timeout_ms(sizeof(TX_PREFIX) + 2 * len + 2)) != 0
+        || wioe_expect(device, AT_TX_DONE, wioe_tx_timeout_ms(device)) != 0) {
+        atomic_fetch_add(&device->tx_errors, 1);
+        return -1;
     }
+    wioe_sent(device);
+    if (device->persistent) { return wioe_rx_start(device); }
     return 0;
 }
 
-int wioe_send_encrypted(wioe* device, char* data, size_t len, const unsigned char *key) {
-    // Get timestamp in nanoseconds as nonce
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    uint64_t timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+static size_t varint_put(unsigned char* out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char) v;
+    return n;
+}
+
+// @return bytes read, or 0 if the varint is truncated or too long
+static size_t varint_get(const unsigned char* in, size_t len, uint32_t* v) {
+    *v = 0;
+    for (size_t n = 0; n < len && n < WIOE_SEQ_BYTES; ++n) {
+        *v |= (uint32_t) (in[n] & 0x7f) << (7 * n);
+        if (!(in[n] & 0x80)) { return n + 1; }
+    }
+    return 0;
+}
+
+static void put_le32(unsigned char* out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) { out[i] = (unsigned char) (v >> (8 * i)); }
+}
+
+// Gets the key of a session: BLAKE2b of its id keyed with the shared key.
+// Every session has its own key, so its sequence numbers alone make unique
+// nonces however many nodes share the passphrase.
+static const unsigned char* wioe_subkey_of(wioe_subkey* cache, const unsigned char* session,
+                                           const unsigned char* key) {
+    if (!cache->valid || sodium_memcmp(cache->key, key, sizeof(cache->key)) != 0) {
+        crypto_generichash(cache->subkey, sizeof(cache->subkey), session, WIOE_SESSION_BYTES,
+                           key, sizeof(cache->key));
+        memcpy(cache->key, key, sizeof(cache->key));
+        cache->valid = 1;
+    }
+    return cache->subkey;
+}
+
+// The nonce is the sequence number, the session is in the key
+static void wioe_nonce(unsigned char* nonce, uint32_t seq) {
+    memset(nonce, 0, crypto_aead_chacha20poly1305_NPUBBYTES);
+    put_le32(nonce, seq);
+}
+
+// Counts what compression saved on a packet sealed from len bytes of data
+static void wioe_account(wioe* device, size_t len, size_t packed_len, size_t pkt_len) {
+    atomic_fetch_add(&device->packets, 1);
+    atomic_fetch_add(&device->bytes_in, len);
+    atomic_fetch_add(&device->bytes_out, packed_len);
+    if (packed_len == len) { return; }
+    wioe_params* p = device->actual_params;
+    size_t full_len = pkt_len - packed_len + len;
+    uint32_t full_us = airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc, full_len);
+    uint32_t pkt_us = airtime_us(p->spreading_factor, p->bandwidth, p->tx_preamble, p->crc, pkt_len);
+    atomic_fetch_add(&device->compressed, 1);
+    atomic_fetch_add(&device->airtime_saved_us, full_us - pkt_us);
+}
+
+ssize_t wioe_seal_frame(wioe* device, frame* f, const unsigned char* key, int ephemeral) {
+    // The header goes in front of the data and the tag after it
+    if (f->len > WIOE_MAX_PLAINTEXT || (size_t) (f->data - f->buf) < WIOE_MAX_HEADER
+        || frame_tailroom(f) < crypto_aead_chacha20poly1305_ABYTES) { return -1; }
+    size_t plain_len = f->len;
+    // Send compressed only when it is shorter
+    unsigned char packed[WIOE_MAX_PLAINTEXT];
+    size_t packed_len = compress_bytes(packed, sizeof(packed), f->data, f->len);
+    if (packed_len > 0) {
+        memcpy(f->data, packed, packed_len);
+        f->len = packed_len;
+    }
+    // Take the next sequence number, starting a new session before the
+    // varint outgrows the header
+    unsigned char session[WIOE_SESSION_BYTES];
+    unsigned char subkey[crypto_aead_chacha20poly1305_KEYBYTES];
+    pthread_mutex_lock(&device->seal_lock);
+    if (device->seq == SEQ_LIMIT) {
+        randombytes_buf(device->session, sizeof(device->session));
+        device->seq = 0;
+        memset(device->tx_keys, 0, sizeof(device->tx_keys));
+    }
+    memcpy(session, device->session, sizeof(session));
+    memcpy(subkey, wioe_subkey_of(&device->tx_keys[ephemeral ? 1 : 0], session, key),
+           sizeof(subkey));
+    uint32_t seq = device->seq++;
+    pthread_mutex_unlock(&device->seal_lock);
+    // Header
+    unsigned char header[WIOE_MAX_HEADER];
+    size_t header_len = 1;
+    header[0] = WIOE_VERSION << 5 | (packed_len > 0 ? WIOE_FLAG_COMPRESSED : 0)
+                | (ephemeral ? WIOE_FLAG_EPHEMERAL : 0);
+    if (device->announce_all || seq < WIOE_ANNOUNCE || seq % WIOE_ANNOUNCE_EVERY == 0) {
+        header[0] |= WIOE_FLAG_SESSION;
+        memcpy(header + header_len, session, WIOE_SESSION_BYTES);
+        header_len += WIOE_SESSION_BYTES;
+    }
+    header_len += varint_put(header + header_len, seq);
+    unsigned char* body = f->data;
+    size_t body_len = f->len;
+    memcpy(frame_push(f, header_len), header, header_len);
+    unsigned char* mac = frame_put(f, crypto_aead_chacha20poly1305_ABYTES);
     unsigned char nonce[crypto_aead_chacha20poly1305_NPUBBYTES];
-    memcpy(nonce, &timestamp_ns, sizeof(timestamp_ns));
-    // Encrypt data using libsodium's chacha20poly1305
-    unsigned char nonce_ciphertext[crypto_aead_chacha20poly1305_NPUBBYTES + 
-                                   len + crypto_aead_chacha20poly1305_ABYTES];
-    memcpy(nonce_ciphertext, &timestamp_ns, sizeof(timestamp_ns));
-    unsigned long long ciphertext_len;
-    crypto_aead_chacha20poly1305_encrypt(nonce_ciphertext + crypto_aead_chacha20poly1305_NPUBBYTES, &ciphertext_len,
-                                         (unsigned char*) data, len,
-                                         NULL, 0,
-                                         NULL, nonce, key);
-    return wioe_send_bytes(device, nonce_ciphertext, sizeof nonce_ciphertext);
+    wioe_nonce(nonce, seq);
+    // Encrypt in place using libsodium's chacha20poly1305, the header is authenticated too
+    crypto_aead_chacha20poly1305_encrypt_detached(body, mac, NULL, body, body_len,
+                                                  f->data, header_len, NULL, nonce, subkey);
+    sodium_memzero(subkey, sizeof(subkey));
+    wioe_account(device, plain_len, body_len, f->len);
+    return f->len;
 }
 
-int wioe_recieve_bytes(wioe* device, unsigned char* buf, size_t len) {
+ssize_t wioe_seal(wioe* device, unsigned char* out, size_t out_len, const unsigned char* data,
+                  size_t len, const unsigned char* key) {
+    if (len > WIOE_MAX_PLAINTEXT) { return -1; }
+    frame f;
+    frame_init(&f);
+    memcpy(frame_put(&f, len), data, len);
+    // Sized for the longest header, so a packet never fails after taking a sequence number
+    if (len + WIOE_MAX_HEADER + crypto_aead_chacha20poly1305_ABYTES > out_len
+        || wioe_seal_frame(device, &f, key, 0) < 0) { return -1; }
+    memcpy(out, f.data, f.len);
+    return f.len;
+}
+
+static wioe_peer* wioe_find_peer(wioe* device, const unsigned char* session) {
+    for (int i = 0; i < device->peer_count; ++i) {
+        if (memcmp(device->peers[i].session, session, WIOE_SESSION_BYTES) == 0) {
+            return &device->peers[i];
+        }
+    }
+    return NULL;
+}
+
+// Starts tracking a session with its window, replacing the one heard least
+// recently if full. The history keeps the replaced session from starting
+// over when it is heard again.
+static wioe_peer* wioe_add_peer(wioe* device, const unsigned char* session,
+                                const replay_window* window) {
+    wioe_peer* peer;
+    if (device->peer_count < device->peer_limit) {
+        peer = &device->peers[device->peer_count++];
+    } else {
+        peer = &device->peers[0];
+        for (int i = 1; i < device->peer_count; ++i) {
+            if (device->peers[i].last_used < peer->last_used) { peer = &device->peers[i]; }
+        }
+        device->retired.received += peer->window.received;
+        device->retired.lost += peer->window.lost;
+        device->retired.reordered += peer->window.reordered;
+        device->retired.replayed += peer->window.replayed;
+        replay_retire(&device->history, peer->session, &peer->window);
+    }
+    memcpy(peer->session, session, WIOE_SESSION_BYTES);
+    peer->window = *window;
+    memset(peer->keys, 0, sizeof(peer->keys));
+    return peer;
+}
+
+// Authenticates and decrypts the body of a packet in place. With verify_only
+// the packet is left untouched, since a failed decryption wipes the body.
+static int wioe_decrypt(frame* f, size_t header_len, uint32_t seq, const unsigned char* key,
+                        int verify_only) {
+    unsigned char nonce[crypto_aead_chacha20poly1305_NPUBBYTES];
+    wioe_nonce(nonce, seq);
+    unsigned char* body = f->data + header_len;
+    size_t body_len = f->len - header_len - crypto_aead_chacha20poly1305_ABYTES;
+    return crypto_aead_chacha20poly1305_decrypt_detached(verify_only ? NULL : body, NULL,
+                                                         body, body_len, body + body_len,
+                                                         f->data, header_len, nonce, key);
+}
+
+ssize_t wioe_open_frame(wioe* device, frame* f, const unsigned char* key,
+                        const unsigned char* ephemeral_key) {
+    const unsigned char* pkt = f->data;
+    size_t len = f->len;
+    if (len < 2 + crypto_aead_chacha20poly1305_ABYTES || pkt[0] >> 5 != WIOE_VERSION) {
+        device->retired.rejected++;
+        return -1;
+    }
+    // Parse the header
+    size_t header_len = 1;
+    int announced = pkt[0] & WIOE_FLAG_SESSION;
+    int compressed = pkt[0] & WIOE_FLAG_COMPRESSED;
+    if (pkt[0] & WIOE_FLAG_EPHEMERAL) {
+        // Sealed with a handshake key this end does not have (e.g., it restarted)
+        if (ephemeral_key == NULL) {
+            device->retired.rejected++;
+            return -1;
+        }
+        key = ephemeral_key;
+    }
+    const unsigned char* session = NULL;
+    if (announced) {
+        session = pkt + header_len;
+        header_len += WIOE_SESSION_BYTES;
+    }
+    uint32_t seq;
+    size_t n = len > header_len ? varint_get(pkt + header_len, len - header_len, &seq) : 0;
+    if (n == 0 || header_len + n + crypto_aead_chacha20poly1305_ABYTES > len) {
+        device->retired.rejected++;
+        return -1;
+    }
+    header_len += n;
+    // Decrypt with the announced session, or try the sessions heard so far
+    // starting with the most recent. Only the last candidate is decrypted
+    // straight away, the others are verified first.
+    wioe_peer* peer = announced ? wioe_find_peer(device, session) : NULL;
+    char tried[WIOE_MAX_PEERS] = { 0 };
+    int left = device->peer_count;
+    int which = pkt[0] & WIOE_FLAG_EPHEMERAL ? 1 : 0;
+    wioe_subkey fresh = { 0 };          // Key of a session not tracked
+    replay_window recalled;             // And its window
+    if (announced && peer == NULL) { replay_recall(&device->history, session, &recalled); }
+    wioe_peer* replayed = NULL;
+    int stale = 0;                      // Old packet of a session no longer tracked
+    int ok = 0;
+    while (!ok) {
+        if (!announced) {
+            peer = NULL;
+            for (int i = 0; i < device->peer_count; ++i) {
+                if (!tried[i] && (peer == NULL || device->peers[i].last_used > peer->last_used)) {
+                    peer = &device->peers[i];
+                }
+            }
+            if (peer == NULL) { break; }
+            tried[peer - device->peers] = 1;
+            left--;
+            session = peer->session;
+        }
+        // Replays are dropped before spending time on decryption
+        if (peer != NULL && !replay_check(&peer->window, seq)) {
+            replayed = peer;
+        } else if (peer == NULL && !replay_check(&recalled, seq)) {
+            stale = 1;
+        } else {
+            const unsigned char* subkey =
+                wioe_subkey_of(peer != NULL ? &peer->keys[which] : &fresh, session, key);
+            if (announced || left == 0) {
+                ok = wioe_decrypt(f, header_len, seq, subkey, 0) == 0;
+            } else {
+                ok = wioe_decrypt(f, header_len, seq, subkey, 1) == 0
+                     && wioe_decrypt(f, header_len, seq, subkey, 0) == 0;
+            }
+        }
+        if (announced) { break; }
+    }
+    if (!ok) {
+        /* message forged! ... or not intended for us, or seen before */
+        sodium_memzero(&fresh, sizeof(fresh));
+        if (replayed != NULL) {
+            replayed->window.replayed++;
+        } else if (stale) {
+            device->retired.replayed++;
+        } else {
+            device->retired.rejected++;
+        }
+        return -1;
+    }
+    if (peer == NULL) {
+        peer = wioe_add_peer(device, session, &recalled);
+        peer->keys[which] = fresh;
+    }
+    sodium_memzero(&fresh, sizeof(fresh));
+    replay_update(&peer->window, seq);
+    peer->last_used = ++device->peer_clock;
+    // Strip header and tag, leaving the plaintext where it was decrypted
+    frame_pull(f, header_len);
+    f->len -= crypto_aead_chacha20poly1305_ABYTES;
+    if (compressed) {
+        // The sender only compresses what fits in one packet
+        unsigned char unpacked[WIOE_MAX_PLAINTEXT];
+        ssize_t r = decompress_bytes(unpacked, sizeof(unpacked), f->data, f->len);
+        if (r < 0 || (size_t) r > f->len + frame_tailroom(f)) {
+            device->retired.rejected++;
+            return -1;
+        }
+        memcpy(f->data, unpacked, r);
+        f->len = r;
+    }
+    return f->len;
+}
+
+ssize_t wioe_open(wioe* device, unsigned char* out, size_t out_len, const unsigned char* pkt,
+                  size_t len, const unsigned char* key) {
+    if (len > WIOE_MAX_PAYLOAD) {
+        device->retired.rejected++;
+        return -1;
+    }
+    frame f;
+    frame_init(&f);
+    memcpy(frame_put(&f, len), pkt, len);
+    ssize_t plain_len = wioe_open_frame(device, &f, key, NULL);
+    if (plain_len < 0) { return -1; }
+    memcpy(out, f.data, (size_t) plain_len > out_len ? out_len : (size_t) plain_len);
+    return plain_len;
+}
+
+int wioe_last_signal(wioe* device, int* rssi, int* snr) {
+    if (!device->have_signal) { return -1; }
+    *rssi = device->last_rssi;
+    *snr = device->last_snr;
+    return 0;
+}
+
+void wioe_get_link_stats(wioe* device, wioe_link_stats* stats) {
+    *stats = device->retired;
+    for (int i = 0; i < device->peer_count; ++i) {
+        const replay_window* w = &device->peers[i].window;
+        stats->received += w->received;
+        stats->lost += w->lost;
+        stats->reordered += w->reordered;
+        stats->replayed += w->replayed;
+    }
+}
+
+int wioe_set_peers(wioe* device, int count, int announce_all) {
+    if (count < 1 || count > WIOE_MAX_PEERS) { return -1; }
+    // Sessions beyond the new limit are evicted
+    while (device->peer_count > count) {
+        wioe_peer* peer = &device->peers[--device->peer_count];
+        replay_retire(&device->history, peer->session, &peer->window);
+    }
+    device->peer_limit = count;
+    device->announce_all = announce_all != 0;
+    return 0;
+}
+
+int wioe_save_sessions(wioe* device, const char* path) {
+    replay_history h = device->history;
+    for (int i = 0; i < device->peer_count; ++i) {
+        replay_retire(&h, device->peers[i].session, &device->peers[i].window);
+    }
+    return replay_history_save(&h, path);
+}
+
+int wioe_load_sessions(wioe* device, const char* path) {
+    return replay_history_load(&device->history, path);
+}
+
+void wioe_get_compress_stats(wioe* device, wioe_compress_stats* stats) {
+    stats->packets = atomic_load(&device->packets);
+    stats->compressed = atomic_load(&device->compressed);
+    stats->bytes_in = atomic_load(&device->bytes_in);
+    stats->bytes_out = atomic_load(&device->bytes_out);
+    stats->airtime_saved_us = atomic_load(&device->airtime_saved_us);
+}
+
+void wioe_get_stats(wioe* device, wioe_stats* stats) {
+    stats->tx_packets = atomic_load(&device->tx_packets);
+    stats->tx_bytes = atomic_load(&device->tx_bytes);
+    stats->tx_errors = atomic_load(&device->tx_errors);
+    stats->rx_packets = atomic_load(&device->rx_packets);
+    stats->rx_bytes = atomic_load(&device->rx_bytes);
+    stats->timeouts = atomic_load(&device->timeouts);
+    stats->cancelled = atomic_load(&device->cancelled);
+    stats->rssi = device->rssi;
+    stats->snr = device->snr;
+    hist_summary(&device->at_rtt, &stats->at_rtt);
+    hist_summary(&device->tx_time, &stats->tx_time);
+    hist_summary(&device->send_latency, &stats->send_latency);
+    hist_summary(&device->airtime, &stats->airtime);
+    stats->airtime_us = atomic_load(&device->airtime_us);
+    stats->tx_time_us = atomic_load(&device->tx_time_us);
+    stats->duty_delays = device->budget.delays;
+    stats->duty_delay_us = device->budget.delay_us;
+    wioe_get_compress_stats(device, &stats->compress);
+    wioe_get_link_stats(device, &stats->link);
+    stats->decrypt_failures = stats->link.rejected;
+}
+
+int wioe_send_encrypted(wioe* device, char* data, size_t len, const unsigned char *key) {
+    if (len > WIOE_MAX_PLAINTEXT) { return -1; }
+    frame f;
+    frame_init(&f);
+    memcpy(frame_put(&f, len), data, len);
+    if (wioe_seal_frame(device, &f, key, 0) < 0) { return -1; }
+    return wioe_send_bytes(device, f.data, f.len);
+}
+
+// Waits for the next packet, decoding it into res->data
+//
+// @return 1 on success, 0 if cancelled, or -1 on error
+static int wioe_recieve_into(wioe* device, at_response* res) {
     if (!wioe_is_valid(device)) { return -1; }
-    unsigned char cmd[BUFLEN];
-    pthread_mutex_lock(&device->lock);
-    ssize_t r = write(device->serial_fd, "AT+TEST=RXLRPKT\n", 17);
-    pthread_mutex_unlock(&device->lock);
-    if (r < 0) { return r; }
-    // Read to make sure there is no error and to clear buffer
-    pthread_mutex_lock(&device->lock);
-    r = read_serial(device->serial_fd, 1000, cmd, BUFLEN);
-    pthread_mutex_unlock(&device->lock);
-    if (r < 0) { return r; }
-    if (strstr((char*) buf, "ERROR") != NULL) { return -1; }
-    // Start reading message while blocking
-    pthread_mutex_lock(&device->lock);
-    r = read_serial_trigger(device->serial_fd, 0, buf, len, device->pipe_fd[0]);
-    pthread_mutex_unlock(&device->lock);
+    // Packets that already arrived are handed out first, in order
+    wioe_drain(device);
+    if (!wioe_unstash(device, res)) {
+        if (!device->listening) {
+            ssize_t r = wioe_command(device, "AT+TEST=RXLRPKT\n", 17);
+            if (r < 0) { return r; }
+            // Make sure there is no error
+            if (wioe_expect(device, AT_RXLRPKT, cmd_timeout_ms(17)) != 0) { return -1; }
+            device->listening = 1;
+        }
+        // Start reading message while blocking
+        while (!wioe_unstash(device, res)) {
+            int ready = wait_serial(device->serial_fd, -1, device->pipe_fd[0]);
+            if (ready == 0) { atomic_fetch_add(&device->cancelled, 1); }
+            if (ready <= 0) { return ready; }
+            if (wioe_fill(device) < 0) { return -1; }
+            wioe_drain(device);
+        }
+    }
+    wioe_received(device, res);
+    return 1;
+}
+
+int wioe_recieve_bytes(wioe* device, unsigned char* buf, size_t len) {
+    // Decoded straight into buf when it holds any packet
+    unsigned char data[AT_MAX_PAYLOAD];
+    at_response res = { .data = len >= AT_MAX_PAYLOAD ? buf : data };
+    int r = wioe_recieve_into(device, &res);
     if (r <= 0) { return r; }
-    return wioe_handle_packet((char*) buf, len);
+    len = res.len <= len ? res.len : len;
+    if (res.data != buf) { memcpy(buf, res.data, len); }
+    return len;
 }
 
 int wioe_recieve_encrypted(wioe* device, unsigned char* buf, size_t len, const unsigned char *key) {
-    unsigned char nonce_ciphertext[BUFLEN];
-    int ciphertext_len = wioe_recieve_bytes(device, nonce_ciphertext, sizeof nonce_ciphertext);
-    if (ciphertext_len <= 0) { return ciphertext_len; }
-    unsigned char decrypted[BUFLEN];
-    unsigned long long decrypted_len;
-    if (crypto_aead_chacha20poly1305_decrypt(decrypted, &decrypted_len,
-                                             NULL,
-                                             nonce_ciphertext + crypto_aead_chacha20poly1305_NPUBBYTES, 
-                                             ciphertext_len - crypto_aead_chacha20poly1305_NPUBBYTES,
-                                             NULL, 0,
-                                             nonce_ciphertext, key) != 0) {
-        /* message forged! ... or not intended for us */
+    frame f;
+    frame_init(&f);
+    at_response res = { .data = f.data };
+    int r = wioe_recieve_into(device, &res);
+    if (r <= 0) { return r; }
+    f.len = res.len;
+    ssize_t plain_len = wioe_open_frame(device, &f, key, NULL);
+    if (plain_len < 0) { return -1; }
+    memcpy(buf, f.data, (size_t) plain_len > len ? len : (size_t) plain_len);
+    return plain_len;
+}
+
+int wioe_fd(wioe* device) {
+    return device->serial_fd;
+}
+
+int wioe_cancel_fd(wioe* device) {
+    return device->pipe_fd[0];
+}
+
+int wioe_cancel_clear(wioe* device) {
+    struct pollfd pfd = { .fd = device->pipe_fd[0], .events = POLLIN };
+    int pending = 0;
+    char c;
+    while (poll(&pfd, 1, 0) > 0 && read(device->pipe_fd[0], &c, 1) == 1) { pending = 1; }
+    if (pending) { atomic_fetch_add(&device->cancelled, 1); }
+    return pending;
+}
+
+int wioe_rx_start(wioe* device) {
+    if (!wioe_is_valid(device)) { return -1; }
+    if (device->listening || device->cfg_busy) { return 0; }  // Listens once configured
+    ssize_t r = wioe_command(device, "AT+TEST=RXLRPKT\n", 17);
+    if (r < 0) { return -1; }
+    device->listening = 1;
+    return 0;
+}
+
+int wioe_rx_persistent(wioe* device, int on, wioe_rx_cb cb, void* arg) {
+    device->persistent = on ? 1 : 0;
+    device->rx_cb = on ? cb : NULL;
+    device->rx_frame_cb = NULL;
+    device->rx_arg = arg;
+    if (!on || device->tx_busy) { return 0; }
+    return wioe_rx_start(device);
+}
+
+int wioe_rx_frames(wioe* device, frame_pool* pool, wioe_rx_frame_cb cb, void* arg) {
+    device->persistent = 1;
+    device->rx_cb = NULL;
+    device->rx_frame_cb = cb;
+    device->rx_pool = pool;
+    device->rx_arg = arg;
+    if (device->tx_busy) { return 0; }
+    return wioe_rx_start(device);
+}
+
+int wioe_tx_start(wioe* device, const unsigned char* data, size_t len) {
+    if (!wioe_is_valid(device) || device->tx_busy || device->cfg_busy || len == 0 || len > WIOE_MAX_PAYLOAD) { return -1; }
+    if (wioe_write_tx(device, data, len) < 0) { return -1; }
+    device->tx_busy = 1;
+    return 0;
+}
+
+long wioe_tx_timeout_ms(wioe* device) {
+    if (device->cfg_busy) { return cmd_timeout_ms(device->cfg_len); }
+    // The TXLRPKT line crosses the serial line before the packet goes on
+    // the air, TX DONE comes back once it left
+    size_t cmd_len = sizeof(TX_PREFIX) + 2 * device->tx_len + 2;
+    return device->tx_airtime_us / 1000 + cmd_timeout_ms(cmd_len);
+}
+
+uint32_t wioe_airtime_us(wioe* device, size_t len) {
+    return wioe_airtime(device, len);
+}
+
+void wioe_set_duty_cycle(wioe* device, double ratio, uint32_t window_ms) {
+    duty_init(&device->budget, ratio, window_ms, now_us());
+}
+
+long wioe_tx_wait_ms(wioe* device) {
+    txq_cell* cell = txq_peek(&device->queue);
+    if (device->tx_busy || cell == NULL) { return 0; }
+    uint64_t wait = duty_wait_us(&device->budget, wioe_airtime(device, cell->len), now_us());
+    return (long) ((wait + 999) / 1000);
+}
+
+int wioe_tx_busy(wioe* device) {
+    return device->tx_busy || device->cfg_busy;
+}
+
+void wioe_tx_abort(wioe* device) {
+    if (device->tx_busy || device->cfg_busy) { atomic_fetch_add(&device->timeouts, 1); }
+    device->cfg_busy = 0;
+    wioe_complete(device, -1);
+}
+
+int wioe_send_async(wioe* device, const unsigned char* data, size_t len,
+                    wioe_send_cb done, void* arg) {
+    if (len == 0) { return -1; }
+    txq_cell* slot = wioe_send_reserve(device);
+    if (slot == NULL) { return -1; }
+    return wioe_send_commit(device, slot, data, len, done, arg);
+}
+
+txq_cell* wioe_send_reserve(wioe* device) {
+    return txq_reserve(&device->queue);
+}
+
+int wioe_send_commit(wioe* device, txq_cell* slot, const unsigned char* data, size_t len,
+                     wioe_send_cb done, void* arg) {
+    int r = txq_commit(slot, data, len, done, arg, now_us());
+    // Also for a slot given back, so the pump skips it at once
+    uint64_t one = 1;
+    if (write(device->send_fd, &one, sizeof(one)) < 0) { /* already signalled */ }
+    return len == 0 ? -1 : r;
+}
+
+int wioe_send_encrypted_async(wioe* device, const char* data, size_t len,
+                              const unsigned char* key, wioe_send_cb done, void* arg) {
+    if (len > WIOE_MAX_PLAINTEXT) { return -1; }
+    txq_cell* slot = wioe_send_reserve(device);
+    if (slot == NULL) { return -1; }
+    frame f;
+    frame_init(&f);
+    memcpy(frame_put(&f, len), data, len);
+    if (wioe_seal_frame(device, &f, key, 0) < 0) {
+        wioe_send_commit(device, slot, NULL, 0, NULL, NULL);
         return -1;
     }
-    len = decrypted_len > len ? len : decrypted_len;
-    memcpy(buf, decrypted, len);
-    return decrypted_len;
+    return wioe_send_commit(device, slot, f.data, f.len, done, arg);
+}
+
+int wioe_send_fd(wioe* device) {
+    return device->send_fd;
+}
+
+int wioe_send_pump(wioe* device) {
+    uint64_t count;
+    if (read(device->send_fd, &count, sizeof(count)) < 0) { /* nothing signalled */ }
+    if (device->tx_busy || device->cfg_busy) { return 1; }
+    txq_cell* cell;
+    while ((cell = txq_peek(&device->queue)) != NULL) {
+        // A slot given back unused
+        if (cell->len == 0) {
+            txq_release(&device->queue, -1);
+            continue;
+        }
+        // Held back by the duty cycle, wioe_tx_wait_ms tells for how long
+        if (duty_wait_us(&device->budget, wioe_airtime(device, cell->len), now_us()) > 0) {
+            return 0;
+        }
+        if (wioe_tx_start(device, cell->data, cell->len) == 0) {
+            device->tx_queued_us = cell->stamp;
+            device->inflight = 1;
+            return 1;
+        }
+        txq_release(&device->queue, -1);
+    }
+    return 0;
+}
+
+int wioe_poll(wioe* device, wioe_event* ev) {
+    // Packets are decoded into a frame for the frame callback, straight into
+    // the event otherwise
+    frame* f = NULL;
+    unsigned char scratch[AT_MAX_PAYLOAD];
+    at_response res;
+    int did_read = 0;
+    int r = 0;
+    for (;;) {
+        if (device->rx_frame_cb != NULL && f == NULL) { f = frame_alloc(device->rx_pool); }
+        res.data = f != NULL ? f->data : (device->rx_cb != NULL ? scratch : ev->data);
+        if (wioe_unstash(device, &res) || wioe_next(device, &res)) {
+            if (res.kind == AT_RX && device->rx_frame_cb != NULL) {
+                // Without a free frame the packet is dropped, see frame_pool.exhausted
+                if (f == NULL) { continue; }
+                wioe_received(device, &res);
+                f->len = res.len;
+                frame* owned = f;
+                f = NULL;
+                device->rx_frame_cb(owned, res.rssi, res.snr, device->rx_arg);
+                continue;
+            } else if (res.kind == AT_RX && device->rx_cb != NULL) {
+                wioe_received(device, &res);
+                device->rx_cb(res.data, res.len, res.rssi, res.snr, device->rx_arg);
+                continue;
+            } else if (res.kind == AT_RX) {
+                ev->type = WIOE_EV_RX;
+                ev->len = res.len;
+                ev->rssi = res.rssi;
+                ev->snr = res.snr;
+                wioe_received(device, &res);
+                r = 1;
+                break;
+            } else if (res.kind == AT_RFCFG && device->cfg_busy) {
+                wioe_answered(device);
+                memcpy(device->actual_params, &device->cfg_params, sizeof(wioe_params));
+                device->cfg_busy = 0;
+                if (device->persistent && txq_peek(&device->queue) == NULL
+                    && wioe_rx_start(device) != 0) {
+                    r = -1;
+                    break;
+                }
+                ev->type = WIOE_EV_UPDATED;
+                r = 1;
+                break;
+            } else if (res.kind == AT_TX_DONE || res.kind == AT_ERROR) {
+                if (res.kind == AT_ERROR) { wioe_answered(device); }
+                device->cfg_busy = 0;   // Rejected, the previous configuration stays
+                if (res.kind == AT_ERROR && !device->tx_busy) { device->listening = 0; }
+                wioe_complete(device, res.kind == AT_TX_DONE ? 0 : -1);
+                // Back to listening right away unless the callbacks queued more
+                if (device->persistent && txq_peek(&device->queue) == NULL
+                    && wioe_rx_start(device) != 0) {
+                    r = -1;
+                    break;
+                }
+                ev->type = res.kind == AT_TX_DONE ? WIOE_EV_TX_DONE : WIOE_EV_ERROR;
+                r = 1;
+                break;
+            }
+            wioe_answered(device);  // Command echoes only tell the command's latency
+            continue;
+        }
+        if (did_read) { break; }
+        ssize_t n = wioe_fill(device);
+        if (n <= 0) {
+            r = n < 0 ? -1 : 0;
+            break;
+        }
+        did_read = 1;
+    }
+    frame_release(f);
+    return r;
 }
 
 void wioe_cancel_recieve(wioe* device) {
@@ -209,7 +1131,9 @@ void wioe_destroy(wioe* device) {
     close(device->serial_fd);
     close(device->pipe_fd[0]);
     close(device->pipe_fd[1]);
+    close(device->send_fd);
     pthread_mutex_destroy(&device->lock);
+    pthread_mutex_destroy(&device->seal_lock);
     free(device->actual_params);
     free(device);
 }
@@ -0,0 +1,543 @@
+#include "xfer.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Receiver state file: magic, the offer it belongs to, then the bitmap
+#define STATE_MAGIC "WIOX\x01"
+#define STATE_HEADER 64
+#define MAX_PATH 4200
+
+static void put_le32(unsigned char* out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) { out[i] = (unsigned char) (v >> (8 * i)); }
+}
+
+static void put_le64(unsigned char* out, uint64_t v) {
+    for (int i = 0; i < 8; ++i) { out[i] = (unsigned char) (v >> (8 * i)); }
+}
+
+static uint32_t get_le32(const unsigned char* in) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; --i) { v = (v << 8) | in[i]; }
+    return v;
+}
+
+static uint64_t get_le64(const unsigned char* in) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) { v = (v << 8) | in[i]; }
+    return v;
+}
+
+static int bit(const uint8_t* map, uint32_t i) {
+    return (map[i >> 3] >> (i & 7)) & 1;
+}
+
+static void set_bit(uint8_t* map, uint32_t i) {
+    map[i >> 3] |= 1 << (i & 7);
+}
+
+static void notef(xfer* x, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void notef(xfer* x, const char* fmt, ...) {
+    char text[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    x->note(text, x->arg);
+}
+
+// Mac of a chunk: SipHash of its index and data, keyed with the file hash
+static void chunk_mac(unsigned char* out, const unsigned char* hash, const unsigned char* indexed,
+                      size_t len) {
+    crypto_shorthash(out, indexed, len, hash);
+}
+
+// Names of received files are kept to one plain entry of the directory
+static int valid_name(const char* name, size_t len) {
+    if (len == 0 || len > XFER_MAX_NAME || name[0] == '.') { return 0; }
+    for (size_t i = 0; i < len; ++i) {
+        if (name[i] == '/' || name[i] < 32 || name[i] > 126) { return 0; }
+    }
+    return 1;
+}
+
+static size_t chunk_len(uint64_t size, uint32_t chunk, uint32_t index) {
+    uint64_t off = (uint64_t) index * chunk;
+    return size - off < chunk ? size - off : chunk;
+}
+
+void xfer_init(xfer* x, size_t max_msg, const char* dir, xfer_send_cb send, xfer_note_cb note,
+               void* arg) {
+    memset(x, 0, sizeof(*x));
+    x->chunk = max_msg - XFER_CHUNK_HEADER;
+    if (x->chunk > UINT16_MAX) { x->chunk = UINT16_MAX; }
+    x->dir = dir;
+    x->send = send;
+    x->note = note;
+    x->arg = arg;
+    x->part_fd = -1;
+    x->state_fd = -1;
+}
+
+void xfer_rate(xfer* x, double bytes_per_s) {
+    x->link_rate = bytes_per_s;
+}
+
+static void stop_sending(xfer* x) {
+    if (x->sending) { munmap((void*) x->map, x->size); }
+    x->sending = 0;
+}
+
+// Writes the bitmap out, after the chunks it covers
+static void save_state(xfer* x) {
+    fdatasync(x->part_fd);
+    if (pwrite(x->state_fd, x->bitmap, (x->rx_count + 7) / 8, STATE_HEADER) < 0) {
+        // A resume then starts over, the transfer itself goes on
+    }
+}
+
+static void stop_receiving(xfer* x) {
+    if (!x->receiving) { return; }
+    save_state(x);
+    close(x->part_fd);
+    close(x->state_fd);
+    free(x->bitmap);
+    x->part_fd = -1;
+    x->state_fd = -1;
+    x->bitmap = NULL;
+    x->receiving = 0;
+}
+
+static int send_offer(xfer* x) {
+    unsigned char msg[2 + XFER_HASH + 8 + 2 + XFER_MAX_NAME];
+    size_t name_len = strlen(x->name);
+    msg[0] = XFER_MAGIC;
+    msg[1] = XFER_OFFER;
+    memcpy(msg + 2, x->hash, XFER_HASH);
+    put_le64(msg + 2 + XFER_HASH, x->size);
+    msg[2 + XFER_HASH + 8] = x->chunk & 0xff;
+    msg[2 + XFER_HASH + 9] = x->chunk >> 8;
+    memcpy(msg + 2 + XFER_HASH + 10, x->name, name_len);
+    return x->send(msg, 2 + XFER_HASH + 10 + name_len, x->arg);
+}
+
+static int send_chunk(xfer* x, uint32_t index, int last) {
+    unsigned char msg[XFER_CHUNK_HEADER + UINT16_MAX];
+    size_t len = chunk_len(x->size, x->chunk, index);
+    unsigned char* indexed = msg + 2 + XFER_TAG + 1 + XFER_MAC;
+    msg[0] = XFER_MAGIC;
+    msg[1] = XFER_CHUNK;
+    memcpy(msg + 2, x->hash, XFER_TAG);
+    msg[2 + XFER_TAG] = last ? XFER_LAST : 0;
+    put_le32(indexed, index);
+    memcpy(indexed + 4, x->map + (uint64_t) index * x->chunk, len);
+    chunk_mac(msg + 2 + XFER_TAG + 1, x->hash, indexed, 4 + len);
+    if (x->send(msg, XFER_CHUNK_HEADER + len, x->arg) != 0) { return -1; }
+    x->chunks_sent++;
+    x->round_chunks++;
+    x->round_bytes += XFER_CHUNK_HEADER + len;
+    return 0;
+}
+
+// Reports the first chunk missing and the window after it
+static int send_status(xfer* x, const unsigned char* hash, int flags) {
+    unsigned char msg[XFER_STATUS_LEN];
+    memset(msg, 0, sizeof(msg));
+    msg[0] = XFER_MAGIC;
+    msg[1] = XFER_STATUS;
+    memcpy(msg + 2, hash, XFER_TAG);
+    msg[2 + XFER_TAG] = flags;
+    uint32_t base = 0;
+    if (flags == 0) {
+        while (base < x->rx_count && bit(x->bitmap, base)) { base++; }
+        uint8_t* window = msg + 2 + XFER_TAG + 1 + 4;
+        for (uint32_t i = 0; i < XFER_WINDOW && base + i < x->rx_count; ++i) {
+            if (bit(x->bitmap, base + i)) { set_bit(window, i); }
+        }
+    }
+    put_le32(msg + 2 + XFER_TAG + 1, base);
+    return x->send(msg, sizeof(msg), x->arg);
+}
+
+// Reports to the sender, with the bitmap on disk first so the report holds
+// after a crash
+static void report(xfer* x) {
+    save_state(x);
+    if (send_status(x, x->rx_hash, 0) == 0) { x->unreported = 0; }
+}
+
+int xfer_start(xfer* x, const char* path, long now_ms) {
+    stop_sending(x);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return -1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || st.st_size > XFER_MAX_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return -1; }
+    const char* name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    if (!valid_name(name, strlen(name))) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(x->name, sizeof(x->name), "%s", name);
+    x->map = map;
+    x->size = st.st_size;
+    x->count = (x->size + x->chunk - 1) / x->chunk;
+    crypto_generichash(x->hash, XFER_HASH, x->map, x->size, NULL, 0);
+    // Nothing is sent before the receiver tells what it misses
+    x->sending = 1;
+    x->next = XFER_WINDOW;
+    x->acked = 0;
+    x->round_chunks = 0;
+    x->tries = 0;
+    x->offered = 0;
+    x->deadline = now_ms;
+    x->started_ms = now_ms;
+    x->progress_ms = now_ms + XFER_PROGRESS_MS;
+    notef(x, "Offering %s (%llu bytes)", x->name, (unsigned long long) x->size);
+    return 0;
+}
+
+// Opens the files of an offered file, resuming if its state matches
+static int open_receive(xfer* x, const unsigned char* hash, uint64_t size, uint32_t chunk) {
+    char path[MAX_PATH];
+    unsigned char header[STATE_HEADER];
+    memset(header, 0, sizeof(header));
+    memcpy(header, STATE_MAGIC, sizeof(STATE_MAGIC));
+    memcpy(header + 8, hash, XFER_HASH);
+    put_le64(header + 8 + XFER_HASH, size);
+    put_le32(header + 16 + XFER_HASH, chunk);
+    x->rx_count = (size + chunk - 1) / chunk;
+    size_t map_len = (x->rx_count + 7) / 8;
+    x->bitmap = calloc(map_len, 1);
+    snprintf(path, sizeof(path), "%s/%s.part", x->dir, x->rx_name);
+    x->part_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    snprintf(path, sizeof(path), "%s/%s.xfer", x->dir, x->rx_name);
+    x->state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (x->bitmap == NULL || x->part_fd < 0 || x->state_fd < 0) {
+        if (x->part_fd >= 0) { close(x->part_fd); }
+        if (x->state_fd >= 0) { close(x->state_fd); }
+        free(x->bitmap);
+        x->bitmap = NULL;
+        x->part_fd = x->state_fd = -1;
+        return -1;
+    }
+    unsigned char saved[STATE_HEADER];
+    struct stat st;
+    x->rx_have = 0;
+    // The bitmap is only worth as much as the part file it describes, which
+    // may have been removed or cut short since
+    if (pread(x->state_fd, saved, sizeof(saved), 0) == sizeof(saved)
+        && memcmp(saved, header, sizeof(header)) == 0
+        && pread(x->state_fd, x->bitmap, map_len, STATE_HEADER) == (ssize_t) map_len
+        && fstat(x->part_fd, &st) == 0 && (uint64_t) st.st_size == size) {
+        for (uint32_t i = 0; i < x->rx_count; ++i) { x->rx_have += bit(x->bitmap, i); }
+    } else {
+        memset(x->bitmap, 0, map_len);
+        // The file is mapped once complete, so it must have its full size
+        if (ftruncate(x->part_fd, size) != 0) {
+            int err = errno;
+            close(x->part_fd);
+            close(x->state_fd);
+            free(x->bitmap);
+            x->bitmap = NULL;
+            x->part_fd = x->state_fd = -1;
+            errno = err;
+            return -1;
+        }
+        if (ftruncate(x->state_fd, 0) != 0
+            || pwrite(x->state_fd, header, sizeof(header), 0) != sizeof(header)) {
+            // Chunks still land, only resuming suffers
+        }
+    }
+    memcpy(x->rx_hash, hash, XFER_HASH);
+    x->rx_size = size;
+    x->rx_chunk = chunk;
+    x->receiving = 1;
+    return 0;
+}
+
+// Checks a complete file against its hash and puts it in place
+static void finish(xfer* x, long now_ms) {
+    unsigned char hash[XFER_HASH];
+    struct stat st;
+    fdatasync(x->part_fd);
+    // Reading a mapping past the end of a file cut short faults, so the size
+    // is checked first and a wrong one fails like a wrong hash
+    int intact = fstat(x->part_fd, &st) == 0 && (uint64_t) st.st_size == x->rx_size;
+    if (intact) {
+        void* map = mmap(NULL, x->rx_size, PROT_READ, MAP_SHARED, x->part_fd, 0);
+        if (map == MAP_FAILED) { return; }
+        crypto_generichash(hash, XFER_HASH, map, x->rx_size, NULL, 0);
+        munmap(map, x->rx_size);
+        intact = memcmp(hash, x->rx_hash, XFER_HASH) == 0;
+    }
+    if (!intact) {
+        // Every chunk passed its mac, so only a part file changed under us
+        // (or lost to a crash) gets here: start over
+        notef(x, "%s failed verification, receiving it again", x->rx_name);
+        memset(x->bitmap, 0, (x->rx_count + 7) / 8);
+        x->rx_have = 0;
+        if (ftruncate(x->part_fd, x->rx_size) != 0) {
+            notef(x, "Failed to receive %s in %s: %s", x->rx_name, x->dir, strerror(errno));
+            stop_receiving(x);
+            return;
+        }
+        report(x);
+        return;
+    }
+    char part[MAX_PATH], path[MAX_PATH];
+    snprintf(part, sizeof(part), "%s/%s.part", x->dir, x->rx_name);
+    snprintf(path, sizeof(path), "%s/%s", x->dir, x->rx_name);
+    if (rename(part, path) != 0) {
+        notef(x, "Failed to store %s: %s", path, strerror(errno));
+        return;
+    }
+    snprintf(part, sizeof(part), "%s/%s.xfer", x->dir, x->rx_name);
+    unlink(part);
+    double secs = (now_ms - x->rx_started_ms) / 1000.0;
+    notef(x, "Received %s (%llu bytes) in %.1f s", path, (unsigned long long) x->rx_size, secs);
+    x->files_received++;
+    memcpy(x->done_hash, x->rx_hash, XFER_HASH);
+    close(x->part_fd);
+    close(x->state_fd);
+    free(x->bitmap);
+    x->part_fd = x->state_fd = -1;
+    x->bitmap = NULL;
+    x->receiving = 0;
+    send_status(x, x->done_hash, XFER_DONE);
+}
+
+static int recv_offer(xfer* x, const unsigned char* msg, size_t len, long now_ms) {
+    if (len < 2 + XFER_HASH + 10 + 1) { return -1; }
+    const unsigned char* hash = msg + 2;
+    uint64_t size = get_le64(msg + 2 + XFER_HASH);
+    uint32_t chunk = msg[2 + XFER_HASH + 8] | (msg[2 + XFER_HASH + 9] << 8);
+    const char* name = (const char*) msg + 2 + XFER_HASH + 10;
+    size_t name_len = len - (2 + XFER_HASH + 10);
+    if (size == 0 || size > XFER_MAX_SIZE || chunk == 0 || !valid_name(name, name_len)) {
+        return -1;
+    }
+    if (x->dir == NULL) { return send_status(x, hash, XFER_REFUSED); }
+    // Answered again, in case the sender missed the answers
+    if (memcmp(hash, x->done_hash, XFER_HASH) == 0) { return send_status(x, hash, XFER_DONE); }
+    if (x->receiving && memcmp(hash, x->rx_hash, XFER_HASH) == 0) {
+        report(x);
+        return 0;
+    }
+    stop_receiving(x);
+    memcpy(x->rx_name, name, name_len);
+    x->rx_name[name_len] = '\0';
+    if (open_receive(x, hash, size, chunk) != 0) {
+        notef(x, "Failed to receive %s in %s: %s", x->rx_name, x->dir, strerror(errno));
+        return send_status(x, hash, XFER_REFUSED);
+    }
+    x->rx_started_ms = now_ms;
+    x->unreported = 0;
+    if (x->rx_have > 0) {
+        notef(x, "Resuming %s (%llu bytes) at %u%%", x->rx_name, (unsigned long long) size,
+              (unsigned) (100ULL * x->rx_have / x->rx_count));
+    } else {
+        notef(x, "Receiving %s (%llu bytes)", x->rx_name, (unsigned long long) size);
+    }
+    if (x->rx_have == x->rx_count) {
+        finish(x, now_ms);
+        return 0;
+    }
+    report(x);
+    return 0;
+}
+
+static int recv_chunk(xfer* x, const unsigned char* msg, size_t len, long now_ms) {
+    if (len <= XFER_CHUNK_HEADER) { return -1; }
+    if (!x->receiving || memcmp(msg + 2, x->rx_hash, XFER_TAG) != 0) {
+        // Late copies of a finished file are expected. Others belong to an
+        // offer this side does not know (e.g., it restarted), asked again.
+        if (memcmp(msg + 2, x->done_hash, XFER_TAG) == 0) { return 0; }
+        if (x->dir != NULL && now_ms - x->unknown_ms >= XFER_IDLE_MS) {
+            x->unknown_ms = now_ms;
+            send_status(x, msg + 2, XFER_UNKNOWN);
+        }
+        return -1;
+    }
+    int flags = msg[2 + XFER_TAG];
+    const unsigned char* mac = msg + 2 + XFER_TAG + 1;
+    const unsigned char* indexed = mac + XFER_MAC;
+    uint32_t index = get_le32(indexed);
+    size_t data_len = len - XFER_CHUNK_HEADER;
+    unsigned char expected[XFER_MAC];
+    chunk_mac(expected, x->rx_hash, indexed, 4 + data_len);
+    if (index >= x->rx_count || data_len != chunk_len(x->rx_size, x->rx_chunk, index)
+        || sodium_memcmp(expected, mac, XFER_MAC) != 0) {
+        x->chunks_rejected++;
+        return -1;
+    }
+    if (!bit(x->bitmap, index)) {
+        if (pwrite(x->part_fd, indexed + 4, data_len, (uint64_t) index * x->rx_chunk)
+            != (ssize_t) data_len) {
+            return -1;
+        }
+        set_bit(x->bitmap, index);
+        x->rx_have++;
+        if (x->rx_have % XFER_SAVE_CHUNKS == 0) { save_state(x); }
+    }
+    x->unreported++;
+    x->last_chunk_ms = now_ms;
+    if (x->rx_have == x->rx_count) {
+        finish(x, now_ms);
+    } else if (flags & XFER_LAST) {
+        report(x);
+    }
+    return 0;
+}
+
+static int recv_status(xfer* x, const unsigned char* msg, size_t len, long now_ms) {
+    if (len != XFER_STATUS_LEN) { return -1; }
+    if (!x->sending || memcmp(msg + 2, x->hash, XFER_TAG) != 0) { return -1; }
+    int flags = msg[2 + XFER_TAG];
+    uint32_t base = get_le32(msg + 2 + XFER_TAG + 1);
+    const uint8_t* window = msg + 2 + XFER_TAG + 1 + 4;
+    if (flags & XFER_REFUSED) {
+        notef(x, "The peer does not accept %s (see -x)", x->name);
+        stop_sending(x);
+        return 0;
+    }
+    double secs = (now_ms - x->started_ms) / 1000.0;
+    if (flags & XFER_DONE) {
+        double goodput = secs > 0 ? x->size / secs : 0;
+        notef(x, "Sent %s: %llu bytes in %.1f s, %.0f B/s goodput, %.0f%% of the %.0f B/s link",
+              x->name, (unsigned long long) x->size, secs, goodput,
+              x->link_rate > 0 ? 100 * goodput / x->link_rate : 0, x->link_rate);
+        x->files_sent++;
+        stop_sending(x);
+        return 0;
+    }
+    if (flags & XFER_UNKNOWN) {
+        x->deadline = now_ms;
+        return 0;
+    }
+    if (base >= x->count) { return -1; }
+    // The link keeps the order, so an answer to an offer covers all the
+    // chunks queued before it. A STATUS the receiver sent on its own may
+    // overtake chunks still queued after the last one it has, not sent again.
+    uint32_t queued_end = x->offered ? base : x->base + x->next;
+    uint32_t highest = base;
+    uint32_t acked = base;
+    for (uint32_t i = 0; i < XFER_WINDOW && base + i < x->count; ++i) {
+        if (bit(window, i)) {
+            highest = base + i;
+            acked++;
+        }
+    }
+    memset(x->need, 0, sizeof(x->need));
+    for (uint32_t i = 0; i < XFER_WINDOW && base + i < x->count; ++i) {
+        if (!bit(window, i) && (base + i < highest || base + i >= queued_end)) {
+            set_bit(x->need, i);
+            x->last = i;
+        }
+    }
+    x->offered = 0;
+    if (acked > x->acked) { x->acked = acked; }
+    x->base = base;
+    x->next = 0;
+    x->tries = 0;
+    x->round_ms = now_ms;
+    x->round_bytes = 0;
+    x->round_chunks = 0;
+    x->deadline = now_ms + XFER_RETRY_MS;
+    return 0;
+}
+
+int xfer_recv(xfer* x, const unsigned char* msg, size_t len, long now_ms) {
+    if (len < 2 + XFER_TAG || msg[0] != XFER_MAGIC) { return -1; }
+    if (msg[1] == XFER_OFFER) { return recv_offer(x, msg, len, now_ms); }
+    if (msg[1] == XFER_CHUNK) { return recv_chunk(x, msg, len, now_ms); }
+    if (msg[1] == XFER_STATUS) { return recv_status(x, msg, len, now_ms); }
+    return -1;
+}
+
+static long earliest(long a, long b) {
+    return a < 0 || (b >= 0 && b < a) ? b : a;
+}
+
+long xfer_poll(xfer* x, long now_ms) {
+    long wait = -1;
+    if (x->sending) {
+        size_t queued = x->round_bytes;
+        while (x->next < XFER_WINDOW) {
+            if (bit(x->need, x->next)
+                && send_chunk(x, x->base + x->next, x->next == x->last) != 0) {
+                break;  // No room, tried again on the next call
+            }
+            x->next++;
+        }
+        if (x->round_bytes > queued) {
+            // The STATUS is due once the chunks queued are on the air, with
+            // room for retransmissions
+            long airtime_ms = x->link_rate > 0 ? (long) (2000 * x->round_bytes / x->link_rate) : 0;
+            x->deadline = x->round_ms + airtime_ms + XFER_RETRY_MS;
+            if (x->deadline < now_ms + XFER_RETRY_MS && x->next < XFER_WINDOW) {
+                x->deadline = now_ms + XFER_RETRY_MS;
+            }
+        }
+        if (now_ms >= x->deadline) {
+            if (x->tries == XFER_TRIES) {
+                notef(x, "Gave up sending %s, the peer does not answer", x->name);
+                stop_sending(x);
+            } else {
+                // A full queue is waited out without counting a try
+                if (send_offer(x) == 0) {
+                    x->tries++;
+                    x->offered = 1;
+                }
+                x->deadline = now_ms + XFER_RETRY_MS;
+            }
+        }
+    }
+    if (x->sending && now_ms >= x->progress_ms) {
+        double secs = (now_ms - x->started_ms) / 1000.0;
+        uint64_t bytes = (uint64_t) x->acked * x->chunk;
+        if (bytes > x->size) { bytes = x->size; }
+        // Acknowledgments come once per window, so what is queued is shown too
+        uint32_t queued = x->acked + x->round_chunks;
+        notef(x, "Sending %s: %u%% queued, %u%% acknowledged, %.0f B/s goodput, %.0f%% of the "
+              "%.0f B/s link", x->name, (unsigned) (100ULL * queued / x->count),
+              (unsigned) (100 * bytes / x->size), bytes / secs,
+              x->link_rate > 0 ? 100 * bytes / secs / x->link_rate : 0, x->link_rate);
+        x->progress_ms = now_ms + XFER_PROGRESS_MS;
+    }
+    if (x->sending) {
+        wait = earliest(x->deadline - now_ms, x->progress_ms - now_ms);
+        if (wait < 0) { wait = 0; }
+    }
+    if (x->receiving && x->unreported > 0) {
+        // Chunks stopped coming, the last of the window was lost
+        long due = x->last_chunk_ms + XFER_IDLE_MS - now_ms;
+        if (due <= 0) {
+            report(x);
+            due = x->unreported > 0 ? 0 : -1;
+        }
+        wait = earliest(wait, due);
+    }
+    return wait;
+}
+
+void xfer_free(xfer* x) {
+    stop_sending(x);
+    stop_receiving(x);
+}
@@ -0,0 +1,33 @@
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal checks shared by the test_* programs. A failed CHECK prints where
+// it failed and the test goes on, so one run reports every broken case.
+// Each program ends with check_exit, whose status make test looks at.
+
+static int check_passed;
+static int check_failed;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (cond) {                                                              \
+            check_passed++;                                                      \
+        } else {                                                                 \
+            check_failed++;                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                        \
+    } while (0)
+
+// Prints the outcome of a test program.
+//
+// @param name Name of the program.
+// @return The exit status, EXIT_FAILURE if any check failed.
+static int check_exit(const char* name) {
+    printf("%-12s %d passed, %d failed\n", name, check_passed, check_failed);
+    return check_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif  // CHECK_H_
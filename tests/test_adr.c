@@ -0,0 +1,174 @@
+// Tests of the adaptive data rate: two controllers exchanging control
+// frames agree on a rate and switch together, settle on the slower of their
+// views of the link, undo a switch the peer did not follow and return to
+// the configured rate when the link goes silent.
+#include <string.h>
+
+#include "adr.h"
+#include "check.h"
+
+#define HOME_SF 12
+#define HOME_BW 125
+#define MARGIN_DB 5
+#define QUEUE 8
+
+typedef struct {
+    adr ctl;
+    unsigned sf;            // Rate the radio was switched to
+    unsigned bw;
+    int switches;
+    unsigned char out[QUEUE][ADR_FRAME];
+    int out_count;
+} endpoint;
+
+static int send_frame(const unsigned char* frame, size_t len, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    if (e->out_count == QUEUE) { return -1; }
+    memcpy(e->out[e->out_count++], frame, len);
+    return 0;
+}
+
+static void apply(unsigned sf, unsigned bw, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    e->sf = sf;
+    e->bw = bw;
+    e->switches++;
+}
+
+static void setup(endpoint* e) {
+    memset(e, 0, sizeof(*e));
+    e->sf = HOME_SF;
+    e->bw = HOME_BW;
+    adr_init(&e->ctl, HOME_SF, HOME_BW, 8, 1, MARGIN_DB, send_frame, apply, e);
+}
+
+static void sample(endpoint* e, int snr, long now) {
+    for (int i = 0; i < ADR_MIN_SAMPLES; ++i) { adr_sample(&e->ctl, snr, now); }
+}
+
+// Sends the frames queued by one end, the other hearing them if delivered
+static void air(endpoint* from, endpoint* to, int delivered, long now) {
+    int count = from->out_count;
+    unsigned char frames[QUEUE][ADR_FRAME];
+    memcpy(frames, from->out, sizeof(frames));
+    from->out_count = 0;
+    for (int i = 0; i < count; ++i) {
+        adr_sent(&from->ctl, 0, now);
+        if (delivered) { adr_recv(&to->ctl, frames[i], ADR_FRAME, now); }
+    }
+}
+
+static void test_agree(void) {
+    endpoint a, b;
+    setup(&a);
+    setup(&b);
+    // Too few readings to decide
+    adr_sample(&a.ctl, 10, 0);
+    adr_poll(&a.ctl, 0);
+    CHECK(a.out_count == 0);
+
+    sample(&a, 10, 0);
+    sample(&b, 10, 0);
+    adr_poll(&a.ctl, 0);
+    CHECK(a.out_count == 1 && a.out[0][0] == ADR_PROPOSE);
+    air(&a, &b, 1, 10);
+    CHECK(b.out_count == 1 && b.out[0][0] == ADR_ACCEPT);
+    CHECK(b.switches == 0);     // Not before the ACCEPT left the air
+    air(&b, &a, 1, 20);
+    CHECK(b.switches == 1);
+    CHECK(a.switches == 1);
+    CHECK(a.sf == b.sf && a.bw == b.bw);
+    CHECK(a.sf < HOME_SF);
+
+    // The proposer probes, both confirm once they hear each other
+    CHECK(a.out_count == 1 && a.out[0][0] == ADR_PROBE);
+    air(&a, &b, 1, 30);
+    adr_sample(&b.ctl, 10, 30);
+    air(&b, &a, 1, 40);
+    adr_sample(&a.ctl, 10, 40);
+    CHECK(a.ctl.changes == 1 && b.ctl.changes == 1);
+    CHECK(a.ctl.reverts == 0 && b.ctl.reverts == 0);
+
+    // No new proposal before the hold time is over
+    sample(&a, 10, 50);
+    adr_poll(&a.ctl, 50);
+    CHECK(a.out_count == 0);
+}
+
+// The peer hears the link worse, its slower rate is the one agreed on
+static void test_slower_wins(void) {
+    endpoint a, b;
+    setup(&a);
+    setup(&b);
+    sample(&a, 10, 0);
+    sample(&b, -5, 0);
+    adr_poll(&a.ctl, 0);
+    int proposed = a.out[0][2];
+    air(&a, &b, 1, 10);
+    CHECK(b.out_count == 1 && b.out[0][2] > proposed);
+    air(&b, &a, 1, 20);
+    CHECK(a.sf == b.sf && a.bw == b.bw);
+    CHECK(a.switches == 1 && b.switches == 1);
+}
+
+// The ACCEPT is lost: the proposer never switches and gives up, the peer
+// hears nothing at the new rate and goes back
+static void test_revert(void) {
+    endpoint a, b;
+    setup(&a);
+    setup(&b);
+    sample(&a, 10, 0);
+    sample(&b, 10, 0);
+    adr_poll(&a.ctl, 0);
+    air(&a, &b, 1, 10);
+    air(&b, &a, 0, 20);
+    CHECK(b.switches == 1);
+    CHECK(a.switches == 0);
+
+    // An ACCEPT of an earlier proposal does not switch the proposer
+    unsigned char stale[ADR_FRAME] = { ADR_ACCEPT, (unsigned char) (a.ctl.token - 1), 0 };
+    adr_recv(&a.ctl, stale, sizeof(stale), 20);
+    CHECK(a.switches == 0);
+
+    long wait = adr_poll(&b.ctl, 20);
+    CHECK(wait > 0);
+    adr_poll(&b.ctl, 20 + wait);
+    CHECK(b.ctl.reverts == 1);
+    CHECK(b.sf == HOME_SF && b.bw == HOME_BW);
+    CHECK(b.ctl.hold_ms == 2 * ADR_HOLD_MS);
+
+    // The proposer gives up without having switched
+    wait = adr_poll(&a.ctl, 20);
+    CHECK(wait > 0);
+    adr_poll(&a.ctl, 20 + wait);
+    CHECK(a.switches == 0);
+    CHECK(adr_poll(&a.ctl, 20 + wait) == -1);
+}
+
+// A switched link that goes silent returns to the configured rate
+static void test_fallback(void) {
+    endpoint a, b;
+    setup(&a);
+    setup(&b);
+    sample(&a, 10, 0);
+    sample(&b, 10, 0);
+    adr_poll(&a.ctl, 0);
+    air(&a, &b, 1, 10);
+    air(&b, &a, 1, 20);
+    adr_sample(&a.ctl, 10, 30);
+    CHECK(a.ctl.changes == 1);
+    CHECK(a.sf != HOME_SF);
+    long wait = adr_poll(&a.ctl, 40);
+    CHECK(wait > 0 && wait <= ADR_HOME_MS);
+    adr_poll(&a.ctl, 30 + ADR_HOME_MS);
+    CHECK(a.ctl.fallbacks == 1);
+    CHECK(a.sf == HOME_SF && a.bw == HOME_BW);
+}
+
+int main(void) {
+    test_agree();
+    test_slower_wins();
+    test_revert();
+    test_fallback();
+    return check_exit("adr");
+}
@@ -0,0 +1,231 @@
+// Tests of the selective repeat ARQ: two links exchanging frames over a
+// simulated channel that loses chosen or random frames, checking that every
+// payload arrives once and in order, and that only the frames missing from
+// an ACK's bitmap are sent again.
+#include <stdint.h>
+#include <string.h>
+
+#include "arq.h"
+#include "check.h"
+
+#define MTU 64
+#define STEP_MS 10          // Simulated time per round
+#define RTO_MS 200
+
+typedef struct endpoint endpoint;
+
+// Decides whether a frame is lost on its way to the peer
+typedef int (*lose_fn)(endpoint* from, const unsigned char* frame, size_t len);
+
+struct endpoint {
+    arq link;
+    endpoint* peer;
+    lose_fn lose;
+    // Frames handed to the radio, put on the air by the next round
+    unsigned char out[ARQ_ONAIR][ARQ_MAX_FRAME];
+    size_t out_len[ARQ_ONAIR];
+    int out_count;
+    // Messages pulled by the link, numbered from 0
+    int to_send;
+    int sent;
+    // Messages delivered, and those out of order or damaged
+    int received;
+    int wrong;
+    // Chosen data frames lost the first time they are sent
+    uint32_t drop_once;
+    double loss;            // Share of frames lost at random otherwise
+};
+
+static size_t source(unsigned char* buf, size_t len, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    if (e->sent == e->to_send) { return 0; }
+    // The message number, then bytes derived from it
+    size_t n = 4 + e->sent % (len - 4);
+    memcpy(buf, &e->sent, 4);
+    for (size_t i = 4; i < n; ++i) { buf[i] = (unsigned char) (e->sent * 31 + i); }
+    e->sent++;
+    return n;
+}
+
+static int emit(const unsigned char* frame, size_t len, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    if (e->out_count == ARQ_ONAIR) { return -1; }
+    memcpy(e->out[e->out_count], frame, len);
+    e->out_len[e->out_count++] = len;
+    return 0;
+}
+
+static void deliver(const unsigned char* data, size_t len, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    int number;
+    memcpy(&number, data, 4);
+    int ok = number == e->received && len == 4 + number % (MTU - ARQ_HEADER - 4);
+    for (size_t i = 4; ok && i < len; ++i) { ok = data[i] == (unsigned char) (number * 31 + i); }
+    if (!ok) { e->wrong++; }
+    e->received++;
+}
+
+static int lose_none(endpoint* from, const unsigned char* frame, size_t len) {
+    return 0;
+}
+
+// Loses the data frames in drop_once on their first sending
+static int lose_chosen(endpoint* from, const unsigned char* frame, size_t len) {
+    if ((frame[0] & ARQ_TYPE_MASK) != ARQ_DATA || frame[1] >= 32) { return 0; }
+    uint32_t bit = 1u << frame[1];
+    if (!(from->drop_once & bit)) { return 0; }
+    from->drop_once &= ~bit;
+    return 1;
+}
+
+static int lose_random(endpoint* from, const unsigned char* frame, size_t len) {
+    return rand() < from->loss * RAND_MAX;
+}
+
+static void setup(endpoint* a, endpoint* b, unsigned window, lose_fn lose) {
+    memset(a, 0, sizeof(*a));
+    memset(b, 0, sizeof(*b));
+    arq_init(&a->link, 1, window, MTU, RTO_MS, source, emit, deliver, a);
+    arq_init(&b->link, 1, window, MTU, RTO_MS, source, emit, deliver, b);
+    a->peer = b;
+    b->peer = a;
+    a->lose = lose;
+    b->lose = lose;
+}
+
+// Puts the frames an endpoint handed to the radio on the air, in order
+static void air(endpoint* from, long now) {
+    int count = from->out_count;
+    unsigned char frames[ARQ_ONAIR][ARQ_MAX_FRAME];
+    size_t lens[ARQ_ONAIR];
+    memcpy(frames, from->out, sizeof(frames));
+    memcpy(lens, from->out_len, sizeof(lens));
+    from->out_count = 0;
+    for (int i = 0; i < count; ++i) {
+        arq_sent(&from->link, 0, now);
+        if (!from->lose(from, frames[i], lens[i])) {
+            arq_recv(&from->peer->link, frames[i], lens[i], now);
+        }
+    }
+}
+
+// Runs both links until a has sent everything and b received it, or the
+// time runs out
+static long run(endpoint* a, endpoint* b, long limit_ms) {
+    long now = 0;
+    for (; now < limit_ms; now += STEP_MS) {
+        arq_pump(&a->link);
+        arq_pump(&b->link);
+        air(a, now);
+        air(b, now);
+        arq_poll(&a->link, now);
+        arq_poll(&b->link, now);
+        if (b->received == a->to_send && a->link.base == a->link.next && !a->link.polling) {
+            break;
+        }
+    }
+    return now;
+}
+
+static void test_clean(void) {
+    endpoint a, b;
+    setup(&a, &b, 8, lose_none);
+    a.to_send = 100;
+    run(&a, &b, 60000);
+    CHECK(b.received == 100);
+    CHECK(b.wrong == 0);
+    CHECK(a.link.stats.acked == 100);
+    CHECK(a.link.stats.resent == 0);
+    CHECK(b.link.stats.duplicates == 0);
+}
+
+// A loss in the middle of a burst costs that frame only
+static void test_bitmap(void) {
+    endpoint a, b;
+    setup(&a, &b, 8, lose_chosen);
+    a.to_send = 8;
+    a.drop_once = 1u << 2 | 1u << 5;
+    run(&a, &b, 60000);
+    CHECK(b.received == 8);
+    CHECK(b.wrong == 0);
+    CHECK(a.link.stats.resent == 2);
+    CHECK(a.link.stats.failed == 0);
+    CHECK(b.link.stats.duplicates == 0);
+}
+
+// Losing the polling frame itself is recovered by asking for the ACK again
+static void test_lost_poll(void) {
+    endpoint a, b;
+    setup(&a, &b, 4, lose_chosen);
+    a.to_send = 4;
+    a.drop_once = 1u << 3;
+    run(&a, &b, 60000);
+    CHECK(b.received == 4);
+    CHECK(b.wrong == 0);
+    CHECK(a.link.stats.resent == 1);
+}
+
+static void test_random_loss(void) {
+    endpoint a, b;
+    srand(1);
+    setup(&a, &b, 8, lose_random);
+    a.to_send = 500;
+    a.loss = 0.2;
+    b.loss = 0.2;
+    run(&a, &b, 3600000);
+    CHECK(b.received == 500);
+    CHECK(b.wrong == 0);
+    CHECK(a.link.stats.failed == 0);
+    CHECK(a.link.stats.resent > 0);
+}
+
+// New frames keep going out while a poll waits for its ACK, and only the
+// ACK echoing the poll's id ends the wait
+static void test_poll_ids(void) {
+    endpoint a, b;
+    setup(&a, &b, 4, lose_none);
+    a.to_send = 8;
+    arq_pump(&a.link);
+    CHECK(a.out_count == 4);
+    CHECK(a.link.polling);
+    CHECK((a.out[3][0] & ARQ_POLL) != 0);
+    uint8_t id = a.link.poll_id;
+    for (int i = 0; i < 4; ++i) { arq_sent(&a.link, 0, 0); }
+    a.out_count = 0;
+
+    // The ACK of an earlier poll acknowledges frames but is not the answer
+    unsigned char stale[2] = { ARQ_ACK | ((id - 1) & 7) << ARQ_POLL_SHIFT, 2 };
+    arq_recv(&a.link, stale, sizeof(stale), 0);
+    CHECK(a.link.base == 2);
+    CHECK(a.link.polling);
+
+    // Room in the window is used at once, without asking for another ACK
+    arq_pump(&a.link);
+    CHECK(a.out_count == 2);
+    CHECK((a.out[0][0] & ARQ_POLL) == 0);
+    CHECK((a.out[1][0] & ARQ_POLL) == 0);
+    for (int i = 0; i < 2; ++i) { arq_sent(&a.link, 0, 0); }
+    a.out_count = 0;
+
+    // The answer to the poll ends the wait, frames 2 and 3 it covered but
+    // did not acknowledge are sent again, the later ones get a poll of their own
+    unsigned char ack[2] = { ARQ_ACK | id << ARQ_POLL_SHIFT, 2 };
+    arq_recv(&a.link, ack, sizeof(ack), 0);
+    CHECK(!a.link.polling);
+    CHECK(a.link.stats.resent == 2);
+    arq_pump(&a.link);
+    CHECK(a.out_count == 2);
+    CHECK(a.out[0][1] == 2 && a.out[1][1] == 3);
+    CHECK((a.out[1][0] & ARQ_POLL) != 0);
+    CHECK(a.link.polling);
+    CHECK(a.link.poll_id != id);
+}
+
+int main(void) {
+    test_clean();
+    test_bitmap();
+    test_lost_poll();
+    test_random_loss();
+    test_poll_ids();
+    return check_exit("arq");
+}
@@ -0,0 +1,232 @@
+// Tests of forward error correction: the Reed-Solomon code rebuilding data
+// symbols from any k symbols, and coded messages going through the
+// fragmenter and reassembler with fragments lost, reordered and repeated.
+#include <stdint.h>
+#include <string.h>
+
+#include "frag.h"
+#include "rs.h"
+#include "check.h"
+
+#define SYMBOL 37           // Odd length, the code must not care
+#define MAX_K 40
+#define MAX_PARITY 6
+#define MTU 200
+#define MSG_LEN 2000
+#define TIMEOUT_MS 5000
+
+static void fill(unsigned char* buf, size_t len, unsigned seed) {
+    for (size_t i = 0; i < len; ++i) { buf[i] = (unsigned char) (seed * 131 + i * 7 + (i >> 8)); }
+}
+
+// Loses the data symbols in lost and decodes with the given parity rows
+static int rebuild(unsigned k, const uint8_t* lost, const uint8_t* rows, unsigned count) {
+    static unsigned char data[MAX_K * SYMBOL];
+    static unsigned char work[MAX_K * SYMBOL];
+    static unsigned char parity[MAX_PARITY * SYMBOL];
+    uint8_t have[MAX_K];
+    fill(data, k * SYMBOL, k);
+    for (unsigned i = 0; i < count; ++i) {
+        rs_encode(data, k, SYMBOL, rows[i], parity + i * SYMBOL);
+    }
+    memcpy(work, data, k * SYMBOL);
+    for (unsigned i = 0; i < k; ++i) {
+        have[i] = !lost[i];
+        if (lost[i]) { memset(work + i * SYMBOL, 0xa5, SYMBOL); }
+    }
+    if (rs_decode(work, have, k, SYMBOL, parity, rows, count) != 0) { return -1; }
+    return memcmp(work, data, k * SYMBOL) == 0 ? 0 : -2;
+}
+
+// Every single and double erasure, rebuilt from the first or the last rows
+static void test_rs_pairs(void) {
+    const uint8_t first[2] = { 0, 1 };
+    const uint8_t last[2] = { 4, 5 };
+    for (unsigned k = 1; k <= 12; ++k) {
+        for (unsigned a = 0; a < k; ++a) {
+            for (unsigned b = a; b < k; ++b) {
+                uint8_t lost[MAX_K] = { 0 };
+                lost[a] = 1;
+                lost[b] = 1;
+                unsigned n = a == b ? 1 : 2;
+                CHECK(rebuild(k, lost, first, n) == 0);
+                CHECK(rebuild(k, lost, last, n) == 0);
+            }
+        }
+    }
+}
+
+// As many erasures as parity symbols, at random places of long blocks
+static void test_rs_random(void) {
+    const uint8_t rows[MAX_PARITY] = { 5, 0, 3, 1, 4, 2 };
+    srand(2);
+    for (int round = 0; round < 200; ++round) {
+        unsigned k = MAX_PARITY + rand() % (MAX_K - MAX_PARITY + 1);
+        uint8_t lost[MAX_K] = { 0 };
+        for (unsigned n = 0; n < MAX_PARITY;) {
+            unsigned i = rand() % k;
+            if (!lost[i]) {
+                lost[i] = 1;
+                n++;
+            }
+        }
+        CHECK(rebuild(k, lost, rows, MAX_PARITY) == 0);
+    }
+}
+
+// One symbol short of k cannot be rebuilt, nothing lost needs no parity
+static void test_rs_limits(void) {
+    const uint8_t rows[2] = { 0, 1 };
+    uint8_t lost[MAX_K] = { 1, 1, 1 };
+    CHECK(rebuild(10, lost, rows, 2) == -1);
+    uint8_t none[MAX_K] = { 0 };
+    CHECK(rebuild(10, none, rows, 0) == 0);
+}
+
+typedef struct {
+    unsigned char frames[FRAG_MAX_COUNT][MTU];
+    size_t lens[FRAG_MAX_COUNT];
+    unsigned count;
+    unsigned k;             // Data fragments, the rest is parity
+} coded_msg;
+
+typedef struct {
+    unsigned char msg[MSG_LEN];
+    int delivered;
+    int wrong;
+} sink;
+
+static void deliver(const unsigned char* msg, size_t len, void* arg) {
+    sink* s = (sink*) arg;
+    if (len != MSG_LEN || memcmp(msg, s->msg, MSG_LEN) != 0) { s->wrong++; }
+    s->delivered++;
+}
+
+// Fragments a message with parity percent, keeping every frame
+static void encode(coded_msg* m, sink* s, int percent) {
+    frag_tx tx;
+    frag_tx_init(&tx, MTU);
+    frag_tx_fec(&tx, percent);
+    fill(s->msg, MSG_LEN, 9);
+    frag_tx_push(&tx, s->msg, MSG_LEN, 0);
+    m->count = 0;
+    m->k = 0;
+    while ((m->lens[m->count] = frag_tx_next(&tx, m->frames[m->count], 0)) > 0) {
+        if (m->frames[m->count][3] < m->frames[m->count][4] + 1u) { m->k++; }
+        m->count++;
+    }
+    frag_tx_free(&tx);
+}
+
+// Pushes the frames not in lost, in order or backwards
+static void receive(frag_rx* rx, sink* s, const coded_msg* m, const uint8_t* lost,
+                    int backwards) {
+    frag_rx_init(rx, MTU, TIMEOUT_MS, deliver, s);
+    for (unsigned j = 0; j < m->count; ++j) {
+        unsigned i = backwards ? m->count - 1 - j : j;
+        if (!lost[i]) { frag_rx_push(rx, m->frames[i], m->lens[i], 0); }
+    }
+}
+
+static void test_frag_erasures(void) {
+    static coded_msg m;
+    sink s = { .delivered = 0 };
+    frag_rx rx;
+    encode(&m, &s, 50);
+    unsigned parity = m.count - m.k;
+    CHECK(m.k == (MSG_LEN + MTU - FRAG_CODED_HEADER - 1) / (MTU - FRAG_CODED_HEADER));
+    CHECK(parity == (m.k + 1) / 2);
+
+    // Nothing lost: delivered from the data alone
+    uint8_t lost[FRAG_MAX_COUNT] = { 0 };
+    receive(&rx, &s, &m, lost, 0);
+    CHECK(s.delivered == 1 && s.wrong == 0);
+    CHECK(rx.rebuilt == 0);
+    frag_rx_free(&rx);
+
+    // The first data fragments, and the short last one, rebuilt from parity
+    s.delivered = 0;
+    for (unsigned i = 0; i + 1 < parity; ++i) { lost[i] = 1; }
+    lost[m.k - 1] = 1;
+    receive(&rx, &s, &m, lost, 0);
+    CHECK(s.delivered == 1 && s.wrong == 0);
+    CHECK(rx.rebuilt == 1);
+    frag_rx_free(&rx);
+
+    // The same losses with the parity arriving first
+    s.delivered = 0;
+    receive(&rx, &s, &m, lost, 1);
+    CHECK(s.delivered == 1 && s.wrong == 0);
+    frag_rx_free(&rx);
+
+    // Lost parity costs nothing while the data arrives
+    memset(lost, 0, sizeof(lost));
+    for (unsigned i = m.k; i < m.count; ++i) { lost[i] = 1; }
+    s.delivered = 0;
+    receive(&rx, &s, &m, lost, 0);
+    CHECK(s.delivered == 1 && s.wrong == 0);
+    frag_rx_free(&rx);
+
+    // One loss too many: the message waits, then expires
+    memset(lost, 0, sizeof(lost));
+    for (unsigned i = 0; i <= parity; ++i) { lost[i * 2] = 1; }
+    s.delivered = 0;
+    receive(&rx, &s, &m, lost, 0);
+    CHECK(s.delivered == 0);
+    CHECK(frag_rx_expire(&rx, TIMEOUT_MS + 1) == 1);
+    CHECK(rx.expired == 1);
+    frag_rx_free(&rx);
+}
+
+// Fragments arriving after the message was rebuilt are not taken for a new one
+static void test_frag_late(void) {
+    static coded_msg m;
+    sink s = { .delivered = 0 };
+    frag_rx rx;
+    encode(&m, &s, 50);
+    uint8_t lost[FRAG_MAX_COUNT] = { 0 };
+    lost[0] = 1;
+    receive(&rx, &s, &m, lost, 0);
+    CHECK(s.delivered == 1);
+    CHECK(frag_rx_push(&rx, m.frames[0], m.lens[0], 0) == 0);
+    CHECK(frag_rx_push(&rx, m.frames[m.count - 1], m.lens[m.count - 1], 0) == 0);
+    CHECK(s.delivered == 1);
+    // A repeated fragment of a message still missing some counts once
+    frag_rx_free(&rx);
+    frag_rx_init(&rx, MTU, TIMEOUT_MS, deliver, &s);
+    s.delivered = 0;
+    for (unsigned i = 0; i < m.k; ++i) {
+        frag_rx_push(&rx, m.frames[0], m.lens[0], 0);
+    }
+    CHECK(s.delivered == 0);
+    frag_rx_free(&rx);
+}
+
+// The auto mode sends parity only once loss was measured
+static void test_frag_auto(void) {
+    frag_tx tx;
+    unsigned char msg[MSG_LEN];
+    unsigned char frame[MTU];
+    fill(msg, MSG_LEN, 3);
+    frag_tx_init(&tx, MTU);
+    frag_tx_fec(&tx, FRAG_FEC_AUTO);
+    frag_tx_push(&tx, msg, MSG_LEN, 0);
+    while (frag_tx_next(&tx, frame, 0) > 0) {}
+    CHECK(tx.coded == 0);
+    frag_tx_loss(&tx, 0.1);
+    frag_tx_push(&tx, msg, MSG_LEN, 0);
+    while (frag_tx_next(&tx, frame, 0) > 0) {}
+    CHECK(tx.coded == 1);
+    CHECK(tx.parity > 0);
+    frag_tx_free(&tx);
+}
+
+int main(void) {
+    test_rs_pairs();
+    test_rs_random();
+    test_rs_limits();
+    test_frag_erasures();
+    test_frag_late();
+    test_frag_auto();
+    return check_exit("fec");
+}
@@ -0,0 +1,170 @@
+// Tests of mesh routing: nodes placed on a simulated air where each hears
+// only its neighbors. Flooded frames are delivered once per node however
+// many copies arrive, repeats are cancelled once enough copies were heard,
+// the TTL bounds how far a frame travels, and learned routes carry frames
+// hop by hop instead of flooding them.
+#include <string.h>
+
+#include "mesh.h"
+#include "check.h"
+
+#define NODES 10
+#define MTU 200
+#define OUTBOX 32
+#define STEP_MS 10
+
+typedef struct {
+    mesh node;
+    unsigned char out[OUTBOX][MESH_MAX_FRAME];
+    size_t out_len[OUTBOX];
+    int out_count;
+    int delivered;              // Data delivered to this node
+    uint8_t last_src;
+} station;
+
+static station stations[NODES];
+static int hears[NODES][NODES];    // hears[i][j] if node i receives what j sends
+
+static int send_frame(const unsigned char* frame, size_t len, int local, void* arg) {
+    station* s = (station*) arg;
+    if (s->out_count == OUTBOX) { return -1; }
+    memcpy(s->out[s->out_count], frame, len);
+    s->out_len[s->out_count++] = len;
+    return 0;
+}
+
+static void deliver(uint8_t src, const unsigned char* data, size_t len, void* arg) {
+    station* s = (station*) arg;
+    s->delivered++;
+    s->last_src = src;
+}
+
+// Station i is node i + 1, every station starts out hearing nobody
+static void setup(int count) {
+    memset(stations, 0, sizeof(stations));
+    memset(hears, 0, sizeof(hears));
+    for (int i = 0; i < count; ++i) {
+        mesh_init(&stations[i].node, (uint8_t) (i + 1), MTU, 1000 + i, send_frame, deliver,
+                  &stations[i]);
+    }
+}
+
+static void chain(int count) {
+    setup(count);
+    for (int i = 0; i + 1 < count; ++i) {
+        hears[i][i + 1] = 1;
+        hears[i + 1][i] = 1;
+    }
+}
+
+static void full(int count) {
+    setup(count);
+    for (int i = 0; i < count; ++i) {
+        for (int j = 0; j < count; ++j) { hears[i][j] = i != j; }
+    }
+}
+
+// Puts every frame sent on the air, then runs the timers of every node
+static void run(int count, long from_ms, long to_ms) {
+    for (long now = from_ms; now < to_ms; now += STEP_MS) {
+        for (int j = 0; j < count; ++j) {
+            station* s = &stations[j];
+            int n = s->out_count;
+            s->out_count = 0;
+            for (int k = 0; k < n; ++k) {
+                for (int i = 0; i < count; ++i) {
+                    if (!hears[i][j]) { continue; }
+                    mesh_recv(&stations[i].node, s->out[k], s->out_len[k], now);
+                }
+            }
+        }
+        for (int i = 0; i < count; ++i) { mesh_poll(&stations[i].node, now); }
+    }
+}
+
+// The same frame heard twice is delivered once
+static void test_duplicates(void) {
+    chain(2);
+    unsigned char data[4] = "abc";
+    mesh_send(&stations[0].node, 2, data, sizeof(data), 0);
+    CHECK(stations[0].out_count == 1);
+    mesh_recv(&stations[1].node, stations[0].out[0], stations[0].out_len[0], 0);
+    mesh_recv(&stations[1].node, stations[0].out[0], stations[0].out_len[0], 5);
+    CHECK(stations[1].delivered == 1);
+    CHECK(stations[1].last_src == 1);
+    CHECK(stations[1].node.stats.duplicates == 1);
+
+    // Nodes drop copies of their own frames repeated back to them
+    stations[0].out_count = 0;
+    CHECK(mesh_send(&stations[0].node, MESH_BROADCAST, data, sizeof(data), 10) == 0);
+    unsigned char echo[MESH_MAX_FRAME];
+    memcpy(echo, stations[0].out[0], stations[0].out_len[0]);
+    echo[3] = 2;            // As repeated by node 2
+    mesh_recv(&stations[0].node, echo, stations[0].out_len[0], 20);
+    CHECK(stations[0].delivered == 0);
+    CHECK(stations[0].node.stats.duplicates == 1);
+}
+
+// Everybody hears everybody: one flooded frame reaches each node once, and
+// the nodes that heard enough copies while waiting stay quiet
+static void test_flood(void) {
+    full(6);
+    unsigned char data[8] = "flood";
+    mesh_send(&stations[0].node, MESH_BROADCAST, data, sizeof(data), 0);
+    run(6, 0, 2000);
+    unsigned long flooded = 0, suppressed = 0;
+    for (int i = 1; i < 6; ++i) {
+        CHECK(stations[i].delivered == 1);
+        flooded += stations[i].node.stats.flooded;
+        suppressed += stations[i].node.stats.suppressed;
+    }
+    CHECK(stations[0].delivered == 0);
+    CHECK(flooded + suppressed == 5);
+    CHECK(suppressed >= 1);
+    CHECK(flooded <= MESH_REDUNDANT + 1);
+}
+
+// A broadcast along a chain travels MESH_TTL hops and no further
+static void test_ttl(void) {
+    chain(NODES);
+    unsigned char data[8] = "far";
+    mesh_send(&stations[0].node, MESH_BROADCAST, data, sizeof(data), 0);
+    run(NODES, 0, NODES * (MESH_JITTER_MS + STEP_MS));
+    for (int i = 1; i < NODES; ++i) { CHECK(stations[i].delivered == (i <= MESH_TTL)); }
+    CHECK(stations[MESH_TTL].node.stats.dropped == 1);
+
+    // Frames claiming more hops than allowed, and truncated ones, are refused
+    unsigned char bad[MESH_HEADER + 1] = { MESH_DATA << 4 | (MESH_TTL + 1), 1, 3, 1, 0xff, 9, 9 };
+    CHECK(mesh_recv(&stations[1].node, bad, sizeof(bad), 0) == -1);
+    CHECK(mesh_recv(&stations[1].node, bad, MESH_HEADER - 1, 0) == -1);
+}
+
+// Once HELLO frames spread the routes, frames go hop by hop to their
+// destination, and copies meant for another next hop are left alone
+static void test_routes(void) {
+    chain(5);
+    long now = 3 * MESH_HELLO_MS;
+    run(5, 0, now);
+    CHECK(mesh_hops(&stations[0].node, 5, now) == 4);
+    CHECK(mesh_hops(&stations[4].node, 1, now) == 4);
+    unsigned char data[8] = "routed";
+    CHECK(mesh_send(&stations[0].node, 5, data, sizeof(data), now) == 0);
+    run(5, now, now + 1000);
+    CHECK(stations[4].delivered == 1);
+    CHECK(stations[4].last_src == 1);
+    for (int i = 1; i < 4; ++i) {
+        CHECK(stations[i].delivered == 0);
+        CHECK(stations[i].node.stats.forwarded == 1);
+        CHECK(stations[i].node.stats.flooded == 0);
+    }
+    // The node before each relay hears its copy too, and ignores it
+    CHECK(stations[1].node.stats.ignored >= 1);
+}
+
+int main(void) {
+    test_duplicates();
+    test_flood();
+    test_ttl();
+    test_routes();
+    return check_exit("mesh");
+}
@@ -0,0 +1,152 @@
+// Tests of the recovery of the message log on open: a torn last record is
+// dropped and its sequence number reused, a last segment that is not one is
+// kept aside and numbering goes on past it, and a segment that cannot be
+// read now fails the open. No record already logged is ever lost.
+#define _DEFAULT_SOURCE     // mkdtemp
+#define _GNU_SOURCE         // memmem
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "msglog.h"
+#include "check.h"
+
+#define MESSAGES 100
+
+static char dir[64], segment[128], bad[160];
+
+static int count(const msglog_entry* e, void* arg) {
+    ++*(long*) arg;
+    return 0;
+}
+
+// Messages in the log, all of them or from seq
+static long logged(uint64_t from) {
+    msglog_query q = { .peer = -1, .sent = -1, .seq_from = from };
+    long n = 0;
+    msglog_search(dir, &q, count, &n);
+    return n;
+}
+
+// Starts an empty log holding MESSAGES messages
+static void fill(void) {
+    DIR* d = opendir(dir);
+    struct dirent* e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        char path[400];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (e->d_name[0] != '.') { unlink(path); }
+    }
+    if (d != NULL) { closedir(d); }
+    msglog* log = msglog_open(dir);
+    CHECK(log != NULL);
+    if (log == NULL) { return; }
+    for (int i = 0; i < MESSAGES; ++i) {
+        char text[32];
+        int len = snprintf(text, sizeof(text), "message %03d", i + 1);
+        CHECK(msglog_append(log, i & 1, 2, text, len) == (uint64_t) i + 1);
+    }
+    msglog_close(log);
+}
+
+// Opens the log and appends one message
+static uint64_t append(void) {
+    msglog* log = msglog_open(dir);
+    if (log == NULL) { return 0; }
+    uint64_t seq = msglog_append(log, 1, 2, "after", 5);
+    msglog_close(log);
+    return seq;
+}
+
+static off_t file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void test_reopen(void) {
+    fill();
+    CHECK(append() == MESSAGES + 1);
+    CHECK(append() == MESSAGES + 2);
+    CHECK(logged(0) == MESSAGES + 2);
+}
+
+// A crash in the middle of the last record: it is gone, the others stay
+static void test_torn(void) {
+    fill();
+    int fd = open(segment, O_RDWR);
+    CHECK(fd >= 0);
+    off_t size = file_size(segment);
+    unsigned char* map = size > 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                  : MAP_FAILED;
+    CHECK(map != MAP_FAILED);
+    if (map != MAP_FAILED) {
+        unsigned char* last = memmem(map, size, "message 100", 11);
+        CHECK(last != NULL);
+        if (last != NULL) { last[10] = 'X'; }
+        munmap(map, size);
+    }
+    close(fd);
+    CHECK(append() == MESSAGES);
+    CHECK(logged(0) == MESSAGES);
+}
+
+// A segment of the wrong size is renamed, not replaced, and no sequence
+// number it may hold is used again
+static void test_wrong_size(void) {
+    fill();
+    off_t size = file_size(segment);
+    CHECK(truncate(segment, size + 4096) == 0);
+    uint64_t seq = append();
+    CHECK(seq > MESSAGES);
+    CHECK(file_size(bad) == size + 4096);
+    CHECK(logged(0) == 1);
+    CHECK(logged(seq) == 1);
+    // The log goes on from there
+    CHECK(append() == seq + 1);
+    CHECK(file_size(bad) == size + 4096);
+}
+
+// Out of file descriptors: the open fails and the log is left as it was
+static void test_transient(void) {
+    fill();
+    struct rlimit saved, few;
+    int lowest = dup(0);
+    close(lowest);
+    getrlimit(RLIMIT_NOFILE, &saved);
+    few = saved;
+    few.rlim_cur = lowest + 1;     // Enough for the lock file only
+    setrlimit(RLIMIT_NOFILE, &few);
+    msglog* log = msglog_open(dir);
+    int err = errno;
+    setrlimit(RLIMIT_NOFILE, &saved);
+    CHECK(log == NULL);
+    CHECK(err == EMFILE);
+    msglog_close(log);
+    CHECK(access(bad, F_OK) != 0);
+    CHECK(logged(0) == MESSAGES);
+    CHECK(append() == MESSAGES + 1);
+}
+
+int main(void) {
+    snprintf(dir, sizeof(dir), "/tmp/wio-test-msglog.XXXXXX");
+    if (mkdtemp(dir) == NULL) { return EXIT_FAILURE; }
+    // Segments are named by their first sequence number
+    snprintf(segment, sizeof(segment), "%s/%020d.wlog", dir, 1);
+    snprintf(bad, sizeof(bad), "%s.bad", segment);
+
+    test_reopen();
+    test_torn();
+    test_wrong_size();
+    test_transient();
+
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) { return EXIT_FAILURE; }
+    return check_exit("msglog");
+}
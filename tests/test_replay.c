@@ -0,0 +1,300 @@
+// Tests of replay protection: the sliding window at its edges, the history
+// of sessions no longer tracked and its file, and packets recorded from a
+// sender replayed at a device after the sender's session was evicted by
+// others, or after the device restarted. Also the sequence numbers seen as
+// lost when sends find the queue full.
+#define _DEFAULT_SOURCE     // cfmakeraw
+#define _XOPEN_SOURCE 600   // posix_openpt
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "replay.h"
+#include "wioe.h"
+#include "check.h"
+
+#define SENDERS (WIOE_PEERS + 1)  // One more than tracked by default
+#define RECORDED 12               // Packets recorded from the first sender
+
+static void test_window(void) {
+    replay_window w;
+    replay_init(&w);
+    CHECK(replay_check(&w, 0));
+    replay_update(&w, 0);
+    CHECK(!replay_check(&w, 0));
+    CHECK(w.lost == 0);
+
+    // Reordered within the window, then repeated
+    replay_update(&w, 5);
+    CHECK(w.lost == 4);
+    CHECK(replay_check(&w, 3));
+    replay_update(&w, 3);
+    CHECK(!replay_check(&w, 3));
+    CHECK(w.reordered == 1);
+    CHECK(w.lost == 3);
+
+    // The oldest sequence number still remembered, and the first forgotten
+    replay_update(&w, 100);
+    CHECK(replay_check(&w, 100 - (REPLAY_WINDOW - 1)));
+    CHECK(!replay_check(&w, 100 - REPLAY_WINDOW));
+    CHECK(!replay_check(&w, 5));
+
+    // A jump past the window forgets everything below it
+    replay_update(&w, 100 + REPLAY_WINDOW);
+    CHECK(!replay_check(&w, 100));
+    CHECK(replay_check(&w, 101));
+    CHECK(!replay_check(&w, 100 + REPLAY_WINDOW));
+
+    // The window works the same at the top of the sequence space
+    replay_init(&w);
+    replay_update(&w, UINT32_MAX - 1);
+    CHECK(replay_check(&w, UINT32_MAX));
+    replay_update(&w, UINT32_MAX);
+    CHECK(!replay_check(&w, UINT32_MAX));
+    CHECK(!replay_check(&w, UINT32_MAX - 1));
+    CHECK(replay_check(&w, UINT32_MAX - 2));
+    CHECK(w.lost == 0);
+}
+
+static void test_history(void) {
+    static replay_history h;
+    replay_window w;
+    unsigned char id[REPLAY_ID_BYTES] = { 1 };
+    replay_history_init(&h);
+
+    // A session never heard starts empty
+    replay_recall(&h, id, &w);
+    CHECK(!w.started);
+
+    // A retired one rejects all it accepted before, and what was skipped
+    replay_init(&w);
+    replay_update(&w, 10);
+    replay_update(&w, 20);
+    replay_retire(&h, id, &w);
+    replay_recall(&h, id, &w);
+    CHECK(!replay_check(&w, 20));
+    CHECK(!replay_check(&w, 15));
+    CHECK(replay_check(&w, 21));
+
+    // Retired again with an older window, the higher top is kept
+    replay_window older;
+    replay_init(&older);
+    replay_update(&older, 5);
+    replay_retire(&h, id, &older);
+    CHECK(h.count == 1);
+    replay_recall(&h, id, &w);
+    CHECK(!replay_check(&w, 20));
+
+    // Windows that never accepted a packet are not worth remembering
+    unsigned char quiet[REPLAY_ID_BYTES] = { 2 };
+    replay_init(&w);
+    replay_retire(&h, quiet, &w);
+    CHECK(h.count == 1);
+
+    // The oldest sessions are forgotten once the history is full
+    replay_init(&w);
+    replay_update(&w, 1);
+    for (int i = 0; i < REPLAY_HISTORY; ++i) {
+        unsigned char other[REPLAY_ID_BYTES] = { 3, (unsigned char) i, (unsigned char) (i >> 8) };
+        replay_retire(&h, other, &w);
+    }
+    CHECK(h.count == REPLAY_HISTORY);
+    replay_recall(&h, id, &w);
+    CHECK(!w.started);
+}
+
+static void test_history_file(void) {
+    static replay_history h, loaded;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/wio-test-replay.%d", (int) getpid());
+    replay_history_init(&h);
+    replay_window w;
+    replay_init(&w);
+    for (int i = 0; i < 3; ++i) {
+        unsigned char id[REPLAY_ID_BYTES] = { (unsigned char) (i + 1) };
+        replay_update(&w, 100 * (i + 1));
+        replay_retire(&h, id, &w);
+    }
+    CHECK(replay_history_save(&h, path) == 0);
+    CHECK(replay_history_load(&loaded, path) == 0);
+    CHECK(loaded.count == 3);
+    unsigned char id[REPLAY_ID_BYTES] = { 2 };
+    replay_recall(&loaded, id, &w);
+    CHECK(w.started && w.top == 200);
+
+    // A damaged file leaves the history empty
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    CHECK(fd >= 0 && write(fd, "wioreplay0", 10) == 10);
+    close(fd);
+    CHECK(replay_history_load(&loaded, path) != 0);
+    CHECK(loaded.count == 0);
+    unlink(path);
+    CHECK(replay_history_load(&loaded, path) != 0);
+}
+
+// Opens a device on a pseudo-terminal whose answers to the setup commands
+// are already waiting, no module needed
+static wioe* fake_device(void) {
+    wioe_params params = {
+        .frequency = 915, .spreading_factor = 7, .bandwidth = 500, .tx_preamble = 12,
+        .rx_preamble = 12, .power = 14, .crc = 1,
+    };
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) { return NULL; }
+    char* path = ptsname(master);
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    struct termios tty;
+    if (slave < 0 || tcgetattr(slave, &tty) != 0) { return NULL; }
+    cfmakeraw(&tty);
+    tcsetattr(slave, TCSANOW, &tty);
+    static const char answers[] = "+MODE: TEST\r\n+TEST: RFCFG F:915000000\r\n";
+    if (write(master, answers, sizeof(answers) - 1) < 0) { return NULL; }
+    wioe* device = wioe_init(&params, path);
+    close(slave);
+    // The master stays open for the commands the device writes
+    return wioe_is_valid(device) ? device : NULL;
+}
+
+typedef struct {
+    unsigned char data[WIOE_MAX_PAYLOAD];
+    ssize_t len;
+} packet;
+
+static ssize_t seal(wioe* device, packet* p, const unsigned char* key) {
+    static const char text[] = "hello over the air";
+    p->len = wioe_seal(device, p->data, sizeof(p->data), (const unsigned char*) text,
+                       sizeof(text), key);
+    return p->len;
+}
+
+static int open_packet(wioe* device, const packet* p, const unsigned char* key) {
+    unsigned char out[WIOE_MAX_PLAINTEXT];
+    return wioe_open(device, out, sizeof(out), p->data, p->len, key) >= 0;
+}
+
+static unsigned long replayed(wioe* device) {
+    wioe_link_stats stats;
+    wioe_get_link_stats(device, &stats);
+    return stats.replayed;
+}
+
+// The first sender's session is evicted by newer ones, its recorded packets
+// replayed then, and after the receiver saved and reloaded its sessions
+static void test_eviction(void) {
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    randombytes_buf(key, sizeof(key));
+    wioe* rx = fake_device();
+    wioe* tx[SENDERS];
+    for (int i = 0; i < SENDERS; ++i) { tx[i] = fake_device(); }
+    CHECK(rx != NULL);
+    for (int i = 0; i < SENDERS; ++i) { CHECK(tx[i] != NULL); }
+    if (rx == NULL) { return; }
+    for (int i = 0; i < SENDERS; ++i) {
+        if (tx[i] == NULL) { return; }
+    }
+
+    static packet recorded[RECORDED];
+    int accepted = 0;
+    for (int i = 0; i < RECORDED; ++i) {
+        seal(tx[0], &recorded[i], key);
+        accepted += open_packet(rx, &recorded[i], key);
+    }
+    CHECK(accepted == RECORDED);
+    CHECK(!open_packet(rx, &recorded[0], key));
+    CHECK(!open_packet(rx, &recorded[RECORDED - 1], key));
+
+    // The others push the first sender out of the tracked sessions
+    for (int i = 1; i < SENDERS; ++i) {
+        packet p;
+        seal(tx[i], &p, key);
+        CHECK(open_packet(rx, &p, key));
+    }
+    unsigned long before = replayed(rx);
+    for (int i = 0; i < RECORDED; ++i) { CHECK(!open_packet(rx, &recorded[i], key)); }
+    // Packets announcing the session are known to be replays
+    CHECK(replayed(rx) - before == WIOE_ANNOUNCE);
+
+    // The sender itself is heard again once it announces its session
+    packet p;
+    int heard = 0;
+    for (int i = RECORDED; i <= WIOE_ANNOUNCE_EVERY && !heard; ++i) {
+        seal(tx[0], &p, key);
+        heard = open_packet(rx, &p, key);
+    }
+    CHECK(heard);
+    CHECK(!open_packet(rx, &p, key));
+
+    // A restart keeps the sessions heard
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/wio-test-sessions.%d", (int) getpid());
+    CHECK(wioe_save_sessions(rx, path) == 0);
+    wioe* restarted = fake_device();
+    CHECK(restarted != NULL);
+    if (restarted != NULL) {
+        CHECK(wioe_load_sessions(restarted, path) == 0);
+        for (int i = 0; i < WIOE_ANNOUNCE; ++i) { CHECK(!open_packet(restarted, &recorded[i], key)); }
+        CHECK(replayed(restarted) == WIOE_ANNOUNCE);
+        wioe_destroy(restarted);
+    }
+    unlink(path);
+
+    // Tracking every sender, nobody is evicted and every packet announces
+    // its session, so the first sender is heard again at once
+    wioe* mesh = fake_device();
+    CHECK(mesh != NULL);
+    if (mesh != NULL) {
+        CHECK(wioe_set_peers(mesh, SENDERS, 1) == 0);
+        CHECK(wioe_set_peers(mesh, WIOE_MAX_PEERS + 1, 1) != 0);
+        CHECK(wioe_set_peers(tx[0], SENDERS, 1) == 0);
+        for (int i = 0; i < SENDERS; ++i) {
+            seal(tx[i], &p, key);
+            CHECK(open_packet(mesh, &p, key));
+        }
+        seal(tx[0], &p, key);
+        CHECK((p.data[0] & WIOE_FLAG_SESSION) != 0);
+        CHECK(open_packet(mesh, &p, key));
+        wioe_destroy(mesh);
+    }
+
+    wioe_destroy(rx);
+    for (int i = 0; i < SENDERS; ++i) { wioe_destroy(tx[i]); }
+}
+
+// Sends that find the queue full must not use up sequence numbers, or the
+// receiver counts the packets never sent as lost
+static void test_queue_full(void) {
+    unsigned char key[crypto_aead_chacha20poly1305_KEYBYTES];
+    randombytes_buf(key, sizeof(key));
+    wioe* rx = fake_device();
+    wioe* tx = fake_device();
+    CHECK(rx != NULL && tx != NULL);
+    if (rx == NULL || tx == NULL) { return; }
+    packet before, after;
+    seal(tx, &before, key);
+    int queued = 0;
+    for (int i = 0; i < TXQ_LEN + 8; ++i) {
+        queued += wioe_send_encrypted_async(tx, "queued", 6, key, NULL, NULL) == 0;
+    }
+    CHECK(queued == TXQ_LEN);
+    // The queue waits for the radio, the receiver misses what it holds only
+    seal(tx, &after, key);
+    CHECK(open_packet(rx, &before, key));
+    CHECK(open_packet(rx, &after, key));
+    wioe_link_stats stats;
+    wioe_get_link_stats(rx, &stats);
+    CHECK(stats.lost == TXQ_LEN);
+    wioe_destroy(rx);
+    wioe_destroy(tx);
+}
+
+int main(void) {
+    if (sodium_init() < 0) { return EXIT_FAILURE; }
+    test_window();
+    test_history();
+    test_history_file();
+    test_eviction();
+    test_queue_full();
+    return check_exit("replay");
+}
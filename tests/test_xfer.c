@@ -0,0 +1,230 @@
+// Tests of file transfers between two ends passing messages directly: an
+// interrupted transfer resumes with the chunks missing, and one whose part
+// file was removed, cut short or no longer matches its bitmap is received
+// again from the start instead of trusting what is on disk.
+#define _DEFAULT_SOURCE     // mkdtemp
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "xfer.h"
+#include "check.h"
+
+#define MAX_MSG 400         // Chunks of MAX_MSG - XFER_CHUNK_HEADER bytes, the file
+                            // spanning a few pages
+#define CHUNKS 28
+#define SIZE (CHUNKS * (MAX_MSG - XFER_CHUNK_HEADER) - 10)
+#define OUTBOX 64
+#define STEP_MS 10
+
+typedef struct {
+    xfer x;
+    unsigned char out[OUTBOX][MAX_MSG];
+    size_t out_len[OUTBOX];
+    int out_count;
+    int chunks;             // Chunks handed to the peer
+    int resumed;            // Notes of a resumed transfer
+    int restarted;          // Notes of a failed verification
+} endpoint;
+
+static char tx_dir[64], rx_dir[64], src[96], part[96], state[96], dst[96];
+static unsigned char content[SIZE];
+
+static int send_msg(const unsigned char* msg, size_t len, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    if (e->out_count == OUTBOX) { return -1; }
+    memcpy(e->out[e->out_count], msg, len);
+    e->out_len[e->out_count++] = len;
+    return 0;
+}
+
+static void note(const char* text, void* arg) {
+    endpoint* e = (endpoint*) arg;
+    if (strncmp(text, "Resuming", 8) == 0) { e->resumed++; }
+    if (strstr(text, "failed verification") != NULL) { e->restarted++; }
+}
+
+static void setup(endpoint* tx, endpoint* rx) {
+    memset(tx, 0, sizeof(*tx));
+    memset(rx, 0, sizeof(*rx));
+    xfer_init(&tx->x, MAX_MSG, NULL, send_msg, note, tx);
+    xfer_init(&rx->x, MAX_MSG, rx_dir, send_msg, note, rx);
+}
+
+// Hands the messages queued by one end to the other, but for the first
+// chunk if it is lost
+static void pass(endpoint* from, endpoint* to, int lose_first, long now) {
+    int count = from->out_count;
+    from->out_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (from->out[i][1] == XFER_CHUNK) {
+            uint32_t index = 0;
+            memcpy(&index, from->out[i] + 2 + XFER_TAG + 1 + XFER_MAC, 4);
+            if (lose_first && index == 0) { continue; }
+            from->chunks++;
+        }
+        xfer_recv(&to->x, from->out[i], from->out_len[i], now);
+    }
+}
+
+// Runs the transfer until the sender is done or the time runs out
+static long run(endpoint* tx, endpoint* rx, int lose_first, long from_ms, long to_ms) {
+    long now = from_ms;
+    for (; now < to_ms && tx->x.sending; now += STEP_MS) {
+        xfer_poll(&tx->x, now);
+        xfer_poll(&rx->x, now);
+        pass(tx, rx, lose_first, now);
+        pass(rx, tx, 0, now);
+    }
+    return now;
+}
+
+static int received_intact(void) {
+    static unsigned char got[SIZE + 1];
+    int fd = open(dst, O_RDONLY);
+    if (fd < 0) { return 0; }
+    ssize_t n = read(fd, got, sizeof(got));
+    close(fd);
+    return n == SIZE && memcmp(got, content, SIZE) == 0;
+}
+
+static void clear(void) {
+    unlink(part);
+    unlink(state);
+    unlink(dst);
+}
+
+// Sends all chunks but the first, then drops both ends as a restart would
+static void interrupt(endpoint* tx, endpoint* rx) {
+    clear();
+    setup(tx, rx);
+    xfer_start(&tx->x, src, 0);
+    run(tx, rx, 1, 0, 2000);
+    xfer_free(&tx->x);
+    xfer_free(&rx->x);
+}
+
+// Offers the file again to a fresh receiver and runs to the end
+static void resume(endpoint* tx, endpoint* rx) {
+    setup(tx, rx);
+    xfer_start(&tx->x, src, 0);
+    run(tx, rx, 0, 0, 60000);
+}
+
+static void test_resume(void) {
+    endpoint tx, rx;
+    interrupt(&tx, &rx);
+    CHECK(tx.chunks == CHUNKS - 1);
+    CHECK(access(dst, F_OK) != 0);
+    resume(&tx, &rx);
+    CHECK(rx.resumed == 1);
+    CHECK(tx.chunks == 1);
+    CHECK(rx.x.files_received == 1);
+    CHECK(tx.x.files_sent == 1);
+    CHECK(received_intact());
+    CHECK(access(part, F_OK) != 0 && access(state, F_OK) != 0);
+}
+
+// The bitmap says all chunks but the first are there, the part file says
+// otherwise
+static void test_missing_part(void) {
+    endpoint tx, rx;
+    interrupt(&tx, &rx);
+    unlink(part);
+    resume(&tx, &rx);
+    CHECK(rx.resumed == 0);
+    CHECK(tx.chunks == CHUNKS);
+    CHECK(received_intact());
+
+    interrupt(&tx, &rx);
+    CHECK(truncate(part, SIZE / 2) == 0);
+    resume(&tx, &rx);
+    CHECK(rx.resumed == 0);
+    CHECK(tx.chunks == CHUNKS);
+    CHECK(received_intact());
+
+    // A longer one is no better
+    interrupt(&tx, &rx);
+    CHECK(truncate(part, SIZE + 1) == 0);
+    resume(&tx, &rx);
+    CHECK(rx.resumed == 0);
+    CHECK(received_intact());
+}
+
+static void test_mismatched_state(void) {
+    endpoint tx, rx;
+    // State of another offer: nothing of it is kept
+    interrupt(&tx, &rx);
+    int fd = open(state, O_WRONLY);
+    CHECK(fd >= 0 && pwrite(fd, "\xff", 1, 8) == 1);
+    close(fd);
+    resume(&tx, &rx);
+    CHECK(rx.resumed == 0);
+    CHECK(tx.chunks == CHUNKS);
+    CHECK(received_intact());
+
+    // A bitmap claiming chunks the part file lacks fails the hash, and the
+    // file is received again
+    interrupt(&tx, &rx);
+    unsigned char all[(CHUNKS + 7) / 8];
+    memset(all, 0xff, sizeof(all));
+    fd = open(state, O_WRONLY);
+    CHECK(fd >= 0 && pwrite(fd, all, sizeof(all), 64) == sizeof(all));
+    close(fd);
+    resume(&tx, &rx);
+    CHECK(rx.restarted == 1);
+    CHECK(tx.chunks == CHUNKS);
+    CHECK(received_intact());
+}
+
+// No room for the part file: the offer is refused rather than received
+// into a file too short to map
+static void test_no_room(void) {
+    endpoint tx, rx;
+    struct rlimit saved, small = { .rlim_cur = SIZE / 2 };
+    clear();
+    getrlimit(RLIMIT_FSIZE, &saved);
+    small.rlim_max = saved.rlim_max;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &small);
+    setup(&tx, &rx);
+    xfer_start(&tx.x, src, 0);
+    run(&tx, &rx, 0, 0, 60000);
+    setrlimit(RLIMIT_FSIZE, &saved);
+    CHECK(!tx.x.sending);
+    CHECK(tx.chunks == 0);
+    CHECK(rx.x.files_received == 0);
+    CHECK(!rx.x.receiving);
+    xfer_free(&tx.x);
+    xfer_free(&rx.x);
+}
+
+int main(void) {
+    if (sodium_init() < 0) { return EXIT_FAILURE; }
+    snprintf(tx_dir, sizeof(tx_dir), "/tmp/wio-test-xfer.XXXXXX");
+    snprintf(rx_dir, sizeof(rx_dir), "/tmp/wio-test-xfer.XXXXXX");
+    if (mkdtemp(tx_dir) == NULL || mkdtemp(rx_dir) == NULL) { return EXIT_FAILURE; }
+    snprintf(src, sizeof(src), "%s/src", tx_dir);
+    snprintf(part, sizeof(part), "%s/src.part", rx_dir);
+    snprintf(state, sizeof(state), "%s/src.xfer", rx_dir);
+    snprintf(dst, sizeof(dst), "%s/src", rx_dir);
+    for (size_t i = 0; i < SIZE; ++i) { content[i] = (unsigned char) (i * 7 + (i >> 8)); }
+    int fd = open(src, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, content, SIZE) != SIZE) { return EXIT_FAILURE; }
+    close(fd);
+
+    test_resume();
+    test_missing_part();
+    test_mismatched_state();
+    test_no_room();
+
+    clear();
+    unlink(src);
+    rmdir(tx_dir);
+    rmdir(rx_dir);
+    return check_exit("xfer");
+}
@@ -0,0 +1,107 @@
+// Message log reader: prints the messages a client sent and received, as
+// kept by msglog.c, oldest first.
+//
+// usage: ./wiolog [-d log_dir] [-p peer] [-s seconds_ago] [-u seconds_ago]
+//                 [-f first_seq] [-t text] [-n count] [-i | -o]
+//
+// -n keeps the latest count messages, -i and -o only the received or sent
+// ones. The log can be read while a client is appending to it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msglog.h"
+
+#define MAX_SHOWN 100000    // Most messages -n holds
+
+typedef struct {
+    msglog_entry* entries;  // Copies, latest first
+    size_t count;
+} latest;
+
+static void print_entry(const msglog_entry* e) {
+    time_t secs = e->time_ms / 1000;
+    struct tm tm;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+    printf("%s.%03d #%llu %s %u: %.*s\n", when, (int) (e->time_ms % 1000),
+           (unsigned long long) e->seq, e->sent ? "to" : "from", e->peer,
+           (int) e->len, (const char*) e->data);
+}
+
+static int visit_print(const msglog_entry* e, void* arg) {
+    print_entry(e);
+    return 0;
+}
+
+static int visit_keep(const msglog_entry* e, void* arg) {
+    latest* l = (latest*) arg;
+    unsigned char* data = malloc(e->len + 1);
+    if (data == NULL) { return 1; }
+    memcpy(data, e->data, e->len);
+    l->entries[l->count] = *e;
+    l->entries[l->count++].data = data;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    static char dir[4096];
+    if (msglog_default_path(dir, sizeof(dir)) != 0) { dir[0] = '\0'; }
+    msglog_query q = { .peer = -1, .sent = -1 };
+    int64_t now = (int64_t) time(NULL) * 1000;
+    long count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:ion:p:s:t:u:")) != -1) {
+        if (opt == 'd') {
+            snprintf(dir, sizeof(dir), "%s", optarg);
+        } else if (opt == 'f') {
+            q.seq_from = strtoull(optarg, NULL, 10);
+        } else if (opt == 'i') {
+            q.sent = 0;
+        } else if (opt == 'o') {
+            q.sent = 1;
+        } else if (opt == 'n') {
+            count = atol(optarg);
+        } else if (opt == 'p') {
+            q.peer = atoi(optarg);
+        } else if (opt == 's') {
+            q.since_ms = now - (int64_t) (atof(optarg) * 1000);
+        } else if (opt == 't') {
+            q.text = optarg;
+        } else if (opt == 'u') {
+            q.until_ms = now - (int64_t) (atof(optarg) * 1000);
+        } else {
+            argc = 0;
+            break;
+        }
+    }
+    if (argc == 0 || optind != argc || dir[0] == '\0' || q.peer > 255
+        || count < 0 || count > MAX_SHOWN) {
+        puts("usage: ./wiolog [-d log_dir] [-p peer] [-s seconds_ago] [-u seconds_ago] [-f first_seq] [-t text] [-n count] [-i | -o]");
+        return EXIT_FAILURE;
+    }
+    long found;
+    if (count > 0) {
+        // The latest ones are found from the end, then printed in order
+        latest l = { .entries = calloc(count, sizeof(msglog_entry)) };
+        if (l.entries == NULL) { return EXIT_FAILURE; }
+        q.limit = count;
+        q.newest_first = 1;
+        found = msglog_search(dir, &q, visit_keep, &l);
+        while (l.count > 0) {
+            msglog_entry* e = &l.entries[--l.count];
+            print_entry(e);
+            free((void*) e->data);
+        }
+        free(l.entries);
+    } else {
+        found = msglog_search(dir, &q, visit_print, NULL);
+    }
+    if (found < 0) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,420 @@
+// Wio-E5 emulator: exposes a number of simulated modules as pseudo-terminals
+// that speak the AT test mode dialect used by wioe.c, linked through a shared
+// "air" that delivers packets after their LoRa time on air.
+//
+// usage: ./wiosim [-n radios] [-p link_prefix] [-l loss] [-r rssi] [-s snr]
+//                 [-j jitter] [-c] [-S seed] [-v]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+#include "airtime.h"
+
+#define MAX_RADIOS 16       // Maximum number of emulated modules
+#define MAX_INFLIGHT 64     // Maximum number of packets in the air at once
+#define LINE_LEN 640        // Longest accepted AT command line
+#define MAX_PAYLOAD 255     // Maximum LoRa payload in bytes
+
+// Radio configuration as set by AT+TEST=RFCFG (module defaults otherwise)
+typedef struct {
+    double frequency;
+    unsigned sf;
+    unsigned bw;
+    unsigned tx_preamble;
+    unsigned rx_preamble;
+    int power;
+    int crc;
+    int iq;
+    int net;
+} rfcfg;
+
+typedef struct {
+    int master_fd;
+    int slave_fd;           // Held open so the master never sees a hangup
+    char name[160];
+    char line[LINE_LEN];
+    size_t line_len;
+    int test_mode;
+    int rx_on;              // Listening after AT+TEST=RXLRPKT
+    int tx_busy;            // Transmitting, TX DONE pending
+    rfcfg cfg;
+    // Counters reported on exit
+    unsigned long tx, rx, lost, collided, deaf;
+} radio;
+
+typedef struct {
+    int used;
+    int src;
+    rfcfg cfg;
+    uint64_t start_us;
+    uint64_t end_us;
+    uint32_t listeners;     // Radios that were listening when the preamble started
+    int collided;
+    size_t len;
+    unsigned char payload[MAX_PAYLOAD];
+} packet;
+
+static radio radios[MAX_RADIOS];
+static packet air[MAX_INFLIGHT];
+static int nradios = 2;
+static double loss = 0.0;
+static int rssi = -40;
+static int snr = 10;
+static int jitter = 0;
+static int collisions = 1;
+static int verbose = 0;
+static volatile sig_atomic_t running = 1;
+
+// Demodulation floor for each spreading factor in dB (SX126x datasheet)
+static const double snr_floor[13] = {
+    [7] = -7.5, [8] = -10, [9] = -12.5, [10] = -15, [11] = -17.5, [12] = -20
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig) {
+    (void) sig;
+    running = 0;
+}
+
+static void reply(radio* r, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void reply(radio* r, const char* fmt, ...) {
+    char out[LINE_LEN + 64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out, sizeof(out) - 2, fmt, ap);
+    va_end(ap);
+    if (n < 0) { return; }
+    if ((size_t) n > sizeof(out) - 3) { n = sizeof(out) - 3; }
+    out[n++] = '\r';
+    out[n++] = '\n';
+    if (write(r->master_fd, out, n) < 0 && verbose) {
+        perror("write");
+    }
+    if (verbose) { fprintf(stderr, "[%s] < %.*s\n", r->name, n - 2, out); }
+}
+
+static void default_cfg(rfcfg* cfg) {
+    cfg->frequency = 868.0;
+    cfg->sf = 12;
+    cfg->bw = 125;
+    cfg->tx_preamble = 8;
+    cfg->rx_preamble = 8;
+    cfg->power = 14;
+    cfg->crc = 1;
+    cfg->iq = 0;
+    cfg->net = 0;
+}
+
+static int parse_onoff(const char* s, int* out) {
+    if (strcasecmp(s, "ON") == 0) { *out = 1; return 0; }
+    if (strcasecmp(s, "OFF") == 0) { *out = 0; return 0; }
+    return -1;
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+static int same_channel(const rfcfg* a, const rfcfg* b) {
+    return a->sf == b->sf && a->bw == b->bw && a->frequency > b->frequency - 0.01
+        && a->frequency < b->frequency + 0.01;
+}
+
+// AT+TEST=RFCFG,F:<MHz>,SF<n>,<bw>,<txpr>,<rxpr>,<pow>,<crc>,<iq>,<net>
+static void cmd_rfcfg(radio* r, char* args) {
+    rfcfg cfg;
+    char crc[8], iq[8], net[8];
+    if (sscanf(args, "F:%lf,SF%u,%u,%u,%u,%d,%7[^,],%7[^,],%7s",
+               &cfg.frequency, &cfg.sf, &cfg.bw, &cfg.tx_preamble, &cfg.rx_preamble,
+               &cfg.power, crc, iq, net) != 9
+        || parse_onoff(crc, &cfg.crc) || parse_onoff(iq, &cfg.iq) || parse_onoff(net, &cfg.net)
+        || cfg.sf < 7 || cfg.sf > 12 || (cfg.bw != 125 && cfg.bw != 250 && cfg.bw != 500)) {
+        reply(r, "+TEST: ERROR(-1)");
+        return;
+    }
+    r->cfg = cfg;
+    reply(r, "+TEST: RFCFG F:%.0f, SF%u, BW%uK, TXPR:%u, RXPR:%u, POW:%ddBm, CRC:%s, IQ:%s, NET:%s",
+          cfg.frequency * 1e6, cfg.sf, cfg.bw, cfg.tx_preamble, cfg.rx_preamble, cfg.power,
+          cfg.crc ? "ON" : "OFF", cfg.iq ? "ON" : "OFF", cfg.net ? "ON" : "OFF");
+}
+
+// AT+TEST=TXLRPKT,"<hex>"
+static void cmd_txlrpkt(radio* r, char* args) {
+    int idx = r - radios;
+    char* hex = args;
+    size_t hex_len = strlen(hex);
+    if (hex_len >= 2 && hex[0] == '"' && hex[hex_len - 1] == '"') {
+        hex[hex_len - 1] = '\0';
+        hex++;
+        hex_len -= 2;
+    }
+    if (hex_len == 0 || hex_len % 2 != 0 || hex_len / 2 > MAX_PAYLOAD || r->tx_busy) {
+        reply(r, "+TEST: ERROR(-1)");
+        return;
+    }
+    packet* p = NULL;
+    for (int i = 0; i < MAX_INFLIGHT && p == NULL; ++i) {
+        if (!air[i].used) { p = &air[i]; }
+    }
+    if (p == NULL) {
+        reply(r, "+TEST: ERROR(-1)");
+        return;
+    }
+    for (size_t i = 0; i < hex_len / 2; ++i) {
+        int hi = hexval(hex[2 * i]), lo = hexval(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            reply(r, "+TEST: ERROR(-1)");
+            return;
+        }
+        p->payload[i] = (unsigned char) (hi << 4 | lo);
+    }
+    reply(r, "+TEST: TXLRPKT \"%s\"", hex);
+    // Transmitting leaves receive mode
+    r->rx_on = 0;
+    r->tx_busy = 1;
+    r->tx++;
+    p->used = 1;
+    p->src = idx;
+    p->cfg = r->cfg;
+    p->len = hex_len / 2;
+    p->start_us = now_us();
+    p->end_us = p->start_us + airtime_us(r->cfg.sf, r->cfg.bw, r->cfg.tx_preamble, r->cfg.crc, p->len);
+    p->collided = 0;
+    p->listeners = 0;
+    for (int j = 0; j < nradios; ++j) {
+        if (j != idx && radios[j].rx_on && same_channel(&radios[j].cfg, &r->cfg)) {
+            p->listeners |= 1u << j;
+        }
+    }
+    // Any overlapping packet on the same channel is destroyed along with this one
+    for (int i = 0; i < MAX_INFLIGHT && collisions; ++i) {
+        if (air[i].used && &air[i] != p && same_channel(&air[i].cfg, &p->cfg)) {
+            air[i].collided = p->collided = 1;
+        }
+    }
+    // A radio that starts sending while hearing a packet misses it
+    for (int i = 0; i < MAX_INFLIGHT; ++i) {
+        if (air[i].used && &air[i] != p && (air[i].listeners & (1u << idx))) {
+            air[i].listeners &= ~(1u << idx);
+            r->deaf++;
+        }
+    }
+}
+
+static void handle_line(radio* r, char* line) {
+    if (verbose) { fprintf(stderr, "[%s] > %s\n", r->name, line); }
+    if (strcasecmp(line, "AT") == 0) {
+        reply(r, "+AT: OK");
+    } else if (strcasecmp(line, "AT+MODE=TEST") == 0) {
+        r->test_mode = 1;
+        reply(r, "+MODE: TEST");
+    } else if (strncasecmp(line, "AT+MODE", 7) == 0) {
+        r->test_mode = 0;
+        r->rx_on = 0;
+        reply(r, "+MODE: LWABP");
+    } else if (strncasecmp(line, "AT+TEST=", 8) == 0) {
+        char* cmd = line + 8;
+        char* args = strchr(cmd, ',');
+        if (args != NULL) { *args++ = '\0'; }
+        if (!r->test_mode) {
+            reply(r, "+TEST: ERROR(-12)");
+        } else if (strcasecmp(cmd, "RFCFG") == 0 && args != NULL) {
+            cmd_rfcfg(r, args);
+        } else if (strcasecmp(cmd, "TXLRPKT") == 0 && args != NULL) {
+            cmd_txlrpkt(r, args);
+        } else if (strcasecmp(cmd, "RXLRPKT") == 0) {
+            r->rx_on = 1;
+            reply(r, "+TEST: RXLRPKT");
+        } else if (strcasecmp(cmd, "STOP") == 0) {
+            r->rx_on = 0;
+            reply(r, "+TEST: STOP");
+        } else {
+            reply(r, "+TEST: ERROR(-1)");
+        }
+    } else {
+        reply(r, "ERROR(-10)");
+    }
+}
+
+static void handle_input(radio* r) {
+    char buf[256];
+    ssize_t n = read(r->master_fd, buf, sizeof(buf));
+    for (ssize_t i = 0; i < n; ++i) {
+        char c = buf[i];
+        if (c == '\0') { continue; }
+        if (c == '\r' || c == '\n') {
+            if (r->line_len > 0) {
+                r->line[r->line_len] = '\0';
+                handle_line(r, r->line);
+                r->line_len = 0;
+            }
+        } else if (r->line_len < LINE_LEN - 1) {
+            r->line[r->line_len++] = c;
+        }
+    }
+}
+
+static void deliver(packet* p) {
+    radio* src = &radios[p->src];
+    src->tx_busy = 0;
+    reply(src, "+TEST: TX DONE");
+    for (int j = 0; j < nradios; ++j) {
+        radio* dst = &radios[j];
+        if (j == p->src || !(p->listeners & (1u << j))) { continue; }
+        if (!dst->rx_on || !same_channel(&dst->cfg, &p->cfg) || dst->cfg.iq != p->cfg.iq) {
+            dst->deaf++;
+            continue;
+        }
+        if (p->collided) {
+            dst->collided++;
+            continue;
+        }
+        int pkt_rssi = rssi + (jitter ? (int) (random() % (2 * jitter + 1)) - jitter : 0);
+        int pkt_snr = snr + (jitter ? (int) (random() % (2 * jitter + 1)) - jitter : 0);
+        if ((double) random() / RAND_MAX < loss || pkt_snr < snr_floor[p->cfg.sf]) {
+            dst->lost++;
+            continue;
+        }
+        char hex[2 * MAX_PAYLOAD + 1];
+        for (size_t i = 0; i < p->len; ++i) {
+            snprintf(&hex[2 * i], 3, "%02X", p->payload[i]);
+        }
+        hex[2 * p->len] = '\0';
+        dst->rx++;
+        reply(dst, "+TEST: LEN:%zu, RSSI:%d, SNR:%d", p->len, pkt_rssi, pkt_snr);
+        reply(dst, "+TEST: RX \"%s\"", hex);
+    }
+    p->used = 0;
+}
+
+static int open_radio(radio* r, int idx, const char* prefix) {
+    r->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (r->master_fd < 0 || grantpt(r->master_fd) != 0 || unlockpt(r->master_fd) != 0) {
+        perror("Error creating pseudo-terminal");
+        return -1;
+    }
+    char* slave = ptsname(r->master_fd);
+    r->slave_fd = open(slave, O_RDWR | O_NOCTTY);
+    if (r->slave_fd < 0) {
+        perror("Error opening pseudo-terminal");
+        return -1;
+    }
+    // Behave like a freshly enumerated USB serial port, minus the echo
+    struct termios tty;
+    tcgetattr(r->slave_fd, &tty);
+    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL);
+    tcsetattr(r->slave_fd, TCSANOW, &tty);
+    fcntl(r->master_fd, F_SETFL, fcntl(r->master_fd, F_GETFL) | O_NONBLOCK);
+    snprintf(r->name, sizeof(r->name), "%s", slave);
+    if (prefix != NULL) {
+        char link[128];
+        snprintf(link, sizeof(link), "%s%d", prefix, idx);
+        unlink(link);
+        if (symlink(slave, link) != 0) {
+            perror("Error creating link");
+            return -1;
+        }
+        snprintf(r->name, sizeof(r->name), "%s", link);
+    }
+    default_cfg(&r->cfg);
+    printf("radio %d: %s\n", idx, r->name);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* prefix = NULL;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:l:r:s:j:cS:v")) != -1) {
+        switch (opt) {
+            case 'n': nradios = atoi(optarg); break;
+            case 'p': prefix = optarg; break;
+            case 'l': loss = atof(optarg); break;
+            case 'r': rssi = atoi(optarg); break;
+            case 's': snr = atoi(optarg); break;
+            case 'j': jitter = atoi(optarg); break;
+            case 'c': collisions = 0; break;
+            case 'S': seed = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-n radios] [-p link_prefix] [-l loss] [-r rssi] "
+                                "[-s snr] [-j jitter] [-c] [-S seed] [-v]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (nradios < 1 || nradios > MAX_RADIOS) {
+        fprintf(stderr, "radios must be between 1 and %d\n", MAX_RADIOS);
+        return EXIT_FAILURE;
+    }
+    srandom(seed);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    for (int i = 0; i < nradios; ++i) {
+        if (open_radio(&radios[i], i, prefix) != 0) { return EXIT_FAILURE; }
+    }
+    fflush(stdout);
+
+    struct pollfd fds[MAX_RADIOS];
+    while (running) {
+        // Sleep until input arrives or the next packet leaves the air
+        uint64_t now = now_us();
+        int timeout = -1;
+        for (int i = 0; i < MAX_INFLIGHT; ++i) {
+            if (!air[i].used) { continue; }
+            int ms = air[i].end_us > now ? (int) ((air[i].end_us - now + 999) / 1000) : 0;
+            if (timeout < 0 || ms < timeout) { timeout = ms; }
+        }
+        for (int i = 0; i < nradios; ++i) {
+            fds[i].fd = radios[i].master_fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, nradios, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < nradios; ++i) {
+            if (fds[i].revents & POLLIN) { handle_input(&radios[i]); }
+        }
+        // Deliver everything whose last symbol has been sent, oldest first
+        for (;;) {
+            packet* next = NULL;
+            now = now_us();
+            for (int i = 0; i < MAX_INFLIGHT; ++i) {
+                if (air[i].used && air[i].end_us <= now && (next == NULL || air[i].end_us < next->end_us)) {
+                    next = &air[i];
+                }
+            }
+            if (next == NULL) { break; }
+            deliver(next);
+        }
+    }
+
+    for (int i = 0; i < nradios; ++i) {
+        radio* r = &radios[i];
+        fprintf(stderr, "radio %d: tx %lu rx %lu lost %lu collided %lu missed %lu\n",
+                i, r->tx, r->rx, r->lost, r->collided, r->deaf);
+        if (prefix != NULL) { unlink(r->name); }
+        close(r->slave_fd);
+        close(r->master_fd);
+    }
+    return EXIT_SUCCESS;
+}